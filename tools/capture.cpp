@@ -5,6 +5,7 @@
 #include <inttypes.h>
 #include <string.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/time.h>
@@ -21,6 +22,9 @@
 #include "frame-writer.h"
 #include "rcwt.h"
 #include "v210burn.h"
+#include "v210unpack.h"
+#include "vanc-filter.h"
+#include "prbs15-check.h"
 
 #include "hires-av-debug.h"
 #include "kl-lineartrend.h"
@@ -44,10 +48,18 @@
 #include "DeckLinkAPI.h"
 #include "ts_packetizer.h"
 #include "histogram.h"
+#include "spsc-queue.h"
 #include "decklink_portability.h"
 
 /* Forward declarations */
-static void convert_colorspace_and_parse_vanc(unsigned char *buf, unsigned int uiWidth, unsigned int lineNr);
+static int convert_colorspace_and_parse_vanc(unsigned char *buf, unsigned int uiWidth, unsigned int lineNr);
+static void pipelineStatsPrint(int fd);
+static void vancLineMapStatsPrint(int fd);
+static void vancRepeatStatsPrint(int fd);
+static void prbsStatsPrint(int fd);
+struct vancDecodePool_s;
+static void vancDecodeLineAdd(struct vancDecodePool_s *pool, unsigned char *buf, unsigned int uiWidth, unsigned int lineNr);
+static void vancDecodeRun(struct vancDecodePool_s *pool);
 
 #define WIDE 80
 
@@ -118,9 +130,16 @@ static int vancOutputFile = -1;
 static int rcwtOutputFile = -1;
 static int g_showStartupMemory = 0;
 static int g_verbose = 0;
-static unsigned int g_linenr = 0;
+static struct vanc_filter_s g_vancFilter; /* -l */
+static int g_vancDecodeThreads = 0; /* -U, 0 = decode VANC on the calling thread */
+static struct vancDecodePool_s *g_vancDecodePool = NULL;
+static unsigned int g_vancLineMapWarmup = 0; /* -y, 0 = fetch and parse every VBI line of every frame */
+static unsigned int g_vancLineMapSweep = 300;
+static int g_vancRepeatDetect = 0; /* -d */
 static uint64_t lastGoodKLFrameCounter = 0;
 static uint64_t lastGoodKLOsdCounter = 0;
+static uint32_t prevKLOsdCounter = 0;
+static int g_klOsdCounterResync = 0; /* Frames were dropped by -w, don't compare the next OSD counter. */
 
 /* SMPTE 2038 */
 static int g_packetizeSMPTE2038 = 0;
@@ -147,8 +166,38 @@ static int g_muxedOutputExcludeVideo = 0;
 static int g_muxedOutputExcludeAudio = 0;
 static int g_muxedOutputExcludeData = 0;
 static const char *g_muxedInputFilename = NULL;
+static int g_muxedInputRange = 0;
+static int g_muxedInputRangeSeconds = 0; /* Range is in seconds from the start of the capture, else frame counters */
+static double g_muxedInputRangeStart = 0;
+static double g_muxedInputRangeEnd = -1; /* -1 = until the end of the file */
 static const char *g_rcwtOutputFilename = NULL;
 static struct fwr_session_s *muxedSession = NULL;
+static uint64_t g_muxedQueueMaxBytes = 0; /* 0 = unlimited */
+static uint32_t g_muxedQueueMaxFrames = 0; /* 0 = unlimited */
+static int g_muxedQueuePolicy = FWR_QUEUE_POLICY_DROP;
+static uint64_t g_muxedShedMaxBytes = 0; /* 0 = video is queued like everything else */
+static uint32_t g_muxedShedDecimation = 0;
+static int g_muxedPoolHugepages = 0;
+static int g_muxedDirectIO = 0;
+static int g_muxedGzipWorkers = 0; /* 0 = compress on the writer thread */
+static int g_muxedVideoCodecThreads = 0; /* 0 = store video uncompressed */
+static int g_muxedVancCompact = 0; /* FWR_VANC_COMPACT_..., 0 = every VANC line as captured */
+static const char *g_muxedStatsFilename = NULL; /* Writer statistics appended as JSON lines */
+static int g_muxedStatsFd = -1;
+static uint32_t g_segmentSeconds = 0; /* -x and -a output segmentation, 0 = single file */
+static uint64_t g_segmentMaxBytes = 0;
+static uint32_t g_segmentKeep = 0; /* 0 = keep every segment */
+static int g_flightRecorder = 0; /* -x keeps recent records in memory, dumped around events */
+static uint32_t g_flightRecorderPre = 0;
+static uint32_t g_flightRecorderPost = 0;
+static uint64_t g_flightRecorderBytes = 0; /* 0 = library default */
+static uint32_t g_muxedZeroCopyMax = 0; /* Max SDK buffers the muxed writer may retain, 0 = always copy */
+static uint32_t g_muxedZeroCopyRetained = 0; /* Atomic, SDK buffers currently referenced by the writer queue */
+static uint64_t g_muxedZeroCopyCount = 0;
+static uint64_t g_muxedZeroCopyFallbackCount = 0;
+#define MUXED_POOL_FRAMES 32      /* Video frames worth of preallocated buffers, when the queue is unbounded. */
+#define MUXED_POOL_AUDIO_SFC 2002 /* Largest audio sample frame count per video frame, 23.98 */
+#define MUXED_POOL_VBI_LINES 48   /* VBI lines per video frame with VANC, 1080i has 45 */
 static int g_maxFrames = -1;
 static int g_shutdown = 0;
 static int g_monitor_reset = 0;
@@ -169,6 +218,7 @@ static int g_1080i2997_cadence_check = 0;
 static int g_1080i2997_cadence_set[5]  = { 1602, 1601, 1602, 1601, 1602 }; /* 48KHz 2997 */
 static int g_1080i2997_cadence_match[5]= {    0,    0,    0,    0,    0 };
 static int g_1080i2997_cadence_hist[5] = {    0,    0,    0,    0,    0 };
+static int g_1080i2997_cadence_refill = 0; /* Samples to collect before comparing again, after a -w drop. */
 
 static int g_hires_av_debug = 0;
 static struct hires_av_ctx_s g_havctx;
@@ -184,9 +234,8 @@ static int g_bw_flash_initialized = 0;
 
 #if HAVE_LIBKLMONITORING_KLMONITORING_H
 static int g_monitor_prbs_audio_mode = 0;
-static struct prbs_context_s g_prbs;
-static int g_prbs_initialized = 0;
 #endif
+static struct prbs15_check_s *g_prbs = NULL;
 
 #if ENABLE_NIELSEN
 static int g_enable_nielsen = 0;
@@ -242,81 +291,214 @@ void genericDumpAudioPayload(IDeckLinkAudioInputPacket* audioFrame, int audioCha
 
 }
 
+/* Dump the flight recorder around an event of interest, see -F. */
+static void flightRecorderTrigger(const char *reason)
+{
+	if (g_flightRecorder && muxedSession)
+		fwr_session_trigger(muxedSession, reason);
+}
+
+/* Audio silence detection, see -Z. Every channel of the frame is scanned in a single
+ * pass, one sample frame (all channels) per vector, counting zero samples, tracking the
+ * length of zero runs that carry on across frames and the peak level. The scan is a
+ * template so each channel count and sample depth gets its own fixed width kernel.
+ */
+#define AUDIO_SILENCE_MAX_CHANNELS 16
+#define AUDIO_SILENCE_RUN_MAX      (1 << 30)
+
 struct audioSilenceContext_s
 {
 	time_t lastReport;
 	double sequentialAudioSilenceMs;
+	int silent; /* The previous frame tripped the limit. */
 
-	int sequentialAudioSilence;
-	int sequentialAudioSilenceLast;
+	uint32_t run; /* Zero samples at the end of the previous frame. */
 
-} g_asctx[16];
+} g_asctx[AUDIO_SILENCE_MAX_CHANNELS];
 
-void checkForSilence(IDeckLinkAudioInputPacket* audioFrame, int channelNr, int audioChannelCount, int audioSampleDepth)
+struct audioSilenceScan_s
 {
-	assert(audioChannelCount == 16);
-	assert(audioSampleDepth == 32);
+	uint32_t zeros[AUDIO_SILENCE_MAX_CHANNELS];      /* Zero samples in the frame. */
+	uint32_t longestRun[AUDIO_SILENCE_MAX_CHANNELS]; /* Longest zero run, including one carried in. */
+	uint32_t run[AUDIO_SILENCE_MAX_CHANNELS];        /* Zero run at the end of the frame. */
+	uint32_t peak[AUDIO_SILENCE_MAX_CHANNELS];       /* Largest absolute sample value. */
+};
 
-	if (!audioFrame)
-		return;
+/* One vector holds a whole sample frame, specialized for each supported layout. */
+template <typename T, int CHANNELS> struct audioSilenceVector_s;
+
+#define AUDIO_SILENCE_VECTOR(T, CHANNELS) \
+	template <> struct audioSilenceVector_s<T, CHANNELS> \
+	{ \
+		typedef T sample_v __attribute__((vector_size(CHANNELS * sizeof(T)))); \
+		typedef int32_t count_v __attribute__((vector_size(CHANNELS * sizeof(int32_t)))); \
+	};
+AUDIO_SILENCE_VECTOR(int16_t, 2)
+AUDIO_SILENCE_VECTOR(int16_t, 8)
+AUDIO_SILENCE_VECTOR(int16_t, 16)
+AUDIO_SILENCE_VECTOR(int32_t, 2)
+AUDIO_SILENCE_VECTOR(int32_t, 8)
+AUDIO_SILENCE_VECTOR(int32_t, 16)
+#undef AUDIO_SILENCE_VECTOR
+
+template <typename T, int CHANNELS>
+static void audioSilenceScan(const uint8_t *data, int frameCount, const uint32_t *runIn, struct audioSilenceScan_s *out)
+{
+	typedef typename audioSilenceVector_s<T, CHANNELS>::sample_v sample_v;
+	typedef typename audioSilenceVector_s<T, CHANNELS>::count_v count_v;
+
+	count_v zeros = { 0 };
+	count_v run;
+	for (int c = 0; c < CHANNELS; c++)
+		run[c] = runIn[c];
+	count_v longest = run;
+
+	sample_v hi = { 0 };
+	sample_v lo = { 0 };
+
+	for (int i = 0; i < frameCount; i++) {
+		sample_v v;
+		memcpy(&v, data + i * sizeof(sample_v), sizeof(v));
+
+		count_v z = __builtin_convertvector(v == 0, count_v); /* -1 where silent */
+		zeros -= z;
+		run = (run + 1) & z;
+		longest = longest > run ? longest : run;
+		hi = v > hi ? v : hi;
+		lo = v < lo ? v : lo;
+	}
+
+	for (int c = 0; c < CHANNELS; c++) {
+		int64_t neg = -(int64_t)lo[c];
+		out->zeros[c] = zeros[c];
+		out->longestRun[c] = longest[c];
+		out->run[c] = run[c] > AUDIO_SILENCE_RUN_MAX ? AUDIO_SILENCE_RUN_MAX : run[c];
+		out->peak[c] = neg > hi[c] ? neg : hi[c];
+	}
+}
 
-	struct audioSilenceContext_s *asctx = &g_asctx[channelNr];
+static int audioSilenceScanFrame(const uint8_t *data, int frameCount, int channelCount, int sampleDepth,
+	struct audioSilenceScan_s *out)
+{
+	uint32_t runIn[AUDIO_SILENCE_MAX_CHANNELS];
+	for (int c = 0; c < AUDIO_SILENCE_MAX_CHANNELS; c++)
+		runIn[c] = g_asctx[c].run;
+
+	if (sampleDepth == 16) {
+		switch (channelCount) {
+		case 2:  audioSilenceScan<int16_t, 2>(data, frameCount, runIn, out); break;
+		case 8:  audioSilenceScan<int16_t, 8>(data, frameCount, runIn, out); break;
+		case 16: audioSilenceScan<int16_t, 16>(data, frameCount, runIn, out); break;
+		default: return -1;
+		}
+	} else
+	if (sampleDepth == 32) {
+		switch (channelCount) {
+		case 2:  audioSilenceScan<int32_t, 2>(data, frameCount, runIn, out); break;
+		case 8:  audioSilenceScan<int32_t, 8>(data, frameCount, runIn, out); break;
+		case 16: audioSilenceScan<int32_t, 16>(data, frameCount, runIn, out); break;
+		default: return -1;
+		}
+	} else
+		return -1;
+
+	return 0;
+}
+
+enum audioSilenceEventType_e
+{
+	AUDIO_SILENCE_DETECTED,     /* A frame held at least the limit of silent samples on a channel. */
+	AUDIO_SILENCE_SUMMARY,      /* Silence accumulated on a channel since its last summary. */
+};
+
+struct audioSilenceEvent_s
+{
+	enum audioSilenceEventType_e type;
+	int channel;
+	time_t when;
+	int start;                  /* DETECTED, the channel's previous frame wasn't silent. */
+	uint32_t samples;           /* DETECTED, zero samples in the frame. */
+	uint32_t longestRun;        /* DETECTED, longest run of zero samples, including earlier frames. */
+	uint32_t peak;              /* DETECTED, largest absolute sample value in the frame. */
+	double ms;                  /* Silence in milliseconds, accumulated for SUMMARY. */
+};
 
-	time_t now;
-	time(&now);
-	if (now != asctx->lastReport && asctx->sequentialAudioSilenceMs > 0) {
-		printf("channel %d: %7.2fms of silent audio @ %s",
-			channelNr,
-			asctx->sequentialAudioSilenceMs,
-			ctime(&asctx->lastReport));
-		asctx->lastReport = now;
-		asctx->sequentialAudioSilenceMs = 0;
+static void audioSilenceEventReport(const struct audioSilenceEvent_s *ev)
+{
+	char t[64];
+	ctime_r(&ev->when, t);
+
+	switch (ev->type) {
+	case AUDIO_SILENCE_SUMMARY:
+		printf("channel %d: %7.2fms of silent audio @ %s", ev->channel, ev->ms, t);
+		break;
+	case AUDIO_SILENCE_DETECTED:
+		printf("\tSilence detected on channel %d, lost %5.02fms (or #%5d samples), longest run #%5u, peak %u @ %s",
+			ev->channel, ev->ms, ev->samples, ev->longestRun, ev->peak, t);
+		fflush(stdout); /* When console is redirected to logs, we want output in logs immediately. */
+		if (ev->start)
+			flightRecorderTrigger("Audio silence");
+		break;
 	}
+}
+
+/* Check every channel of the enabled pairs, channelMask has a bit per channel. */
+static void checkForSilence(IDeckLinkAudioInputPacket *audioFrame, uint32_t channelMask, int audioChannelCount, int audioSampleDepth)
+{
+	if (!audioFrame)
+		return;
 
 	uint8_t *data = NULL;
 	audioFrame->GetBytes((void **)&data);
+	int frameCount = audioFrame->GetSampleFrameCount();
 
-	uint32_t *p = (uint32_t *)data;
-	p += channelNr; /* Adjust the offset to the start of the channel we are inspecting */
-	int silence = 0;
-	// int lastSilenceIdx = -1;
+	struct audioSilenceScan_s scan;
+	if (audioSilenceScanFrame(data, frameCount, audioChannelCount, audioSampleDepth, &scan) < 0)
+		return;
 
 	/* 720p59.94 default to 24, 1080i default to 48 */
-	int limit = 24;
-	if (audioFrame->GetSampleFrameCount() > 800)
+	uint32_t limit = 24;
+	if (frameCount > 800)
 		limit = 48;
 
 	/* Operator can override the upper limit */
 	if (g_silencemax != -1)
 		limit = g_silencemax;
 
-	for (int s = 0; s < audioFrame->GetSampleFrameCount(); s++) {
-		uint32_t dw = *p;
-		if (dw == 0) {
-			//printf("silence at %d last %d\n", s, lastSilenceIdx);
-			silence++;
-			asctx->sequentialAudioSilence++;
-		} else {
-			asctx->sequentialAudioSilence = 0;
-		}
-		//printf("%08x\n", dw);
+	time_t now = time(NULL);
 
-		p += audioChannelCount;
-	}
+	for (int c = 0; c < audioChannelCount; c++) {
+		struct audioSilenceContext_s *asctx = &g_asctx[c];
+		asctx->run = scan.run[c];
+		if (!(channelMask & (1 << c)))
+			continue;
 
-	if (silence >= limit) {
-		time_t now;
-		time(&now);
-		double lostMS = (double)silence / 48.0;
-		asctx->sequentialAudioSilenceMs += lostMS;
-		printf("\tSilence detected on channel %d, lost %5.02fms (or #%5d samples) @ %s",
-			channelNr,
-			lostMS,
-			silence, ctime(&now));
-		fflush(stdout); /* When console is redirected to logs, we want output in logs immediately. */
-		if (channelNr == 0) {
-			//genericDumpAudioPayload(audioFrame, audioChannelCount, audioSampleDepth);
+		struct audioSilenceEvent_s ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.channel = c;
+
+		if (now != asctx->lastReport && asctx->sequentialAudioSilenceMs > 0) {
+			ev.type = AUDIO_SILENCE_SUMMARY;
+			ev.when = asctx->lastReport;
+			ev.ms = asctx->sequentialAudioSilenceMs;
+			audioSilenceEventReport(&ev);
+			asctx->lastReport = now;
+			asctx->sequentialAudioSilenceMs = 0;
 		}
+
+		int silent = scan.zeros[c] >= limit;
+		if (silent) {
+			ev.type = AUDIO_SILENCE_DETECTED;
+			ev.when = now;
+			ev.start = !asctx->silent;
+			ev.samples = scan.zeros[c];
+			ev.longestRun = scan.longestRun[c];
+			ev.peak = scan.peak[c];
+			ev.ms = (double)scan.zeros[c] / 48.0;
+			asctx->sequentialAudioSilenceMs += ev.ms;
+			audioSilenceEventReport(&ev);
+		}
+		asctx->silent = silent;
 	}
 }
 
@@ -638,25 +820,63 @@ static void *thread_func_draw(void *p)
 }
 #endif /* HAVE_CURSES_H */
 
-static void signal_handler(int signum)
+/* Set by the signal handler, serviced by the main thread, see statsRequestService(). */
+static volatile sig_atomic_t g_statsPrintRequest = 0;
+static volatile sig_atomic_t g_statsResetRequest = 0;
+
+static void statsPrint()
 {
-	if (signum == SIGUSR1) {
-		ltn_histogram_interval_print(STDOUT_FILENO, hist_arrival_interval, 0);
-		ltn_histogram_interval_print(STDOUT_FILENO, hist_arrival_interval_video, 0);
-		ltn_histogram_interval_print(STDOUT_FILENO, hist_arrival_interval_audio, 0);
-		ltn_histogram_interval_print(STDOUT_FILENO, hist_audio_sfc, 0);
-		ltn_histogram_interval_print(STDOUT_FILENO, hist_format_change, 0);
+	ltn_histogram_interval_print(STDOUT_FILENO, hist_arrival_interval, 0);
+	ltn_histogram_interval_print(STDOUT_FILENO, hist_arrival_interval_video, 0);
+	ltn_histogram_interval_print(STDOUT_FILENO, hist_arrival_interval_audio, 0);
+	ltn_histogram_interval_print(STDOUT_FILENO, hist_audio_sfc, 0);
+	ltn_histogram_interval_print(STDOUT_FILENO, hist_format_change, 0);
+
+	hires_av_summary(&g_havctx, 0); /* Write stats to console */
+	pipelineStatsPrint(STDOUT_FILENO);
+	vancLineMapStatsPrint(STDOUT_FILENO);
+	vancRepeatStatsPrint(STDOUT_FILENO);
+	prbsStatsPrint(STDOUT_FILENO);
 
-		hires_av_summary(&g_havctx, 0); /* Write stats to console */
+	if (muxedSession) {
+		fwr_session_queue_stats_print(STDOUT_FILENO, muxedSession, g_muxedOutputFilename);
+		if (g_muxedStatsFd >= 0)
+			fwr_session_queue_stats_print_json(g_muxedStatsFd, muxedSession, g_muxedOutputFilename);
+		if (g_muxedZeroCopyMax) {
+			printf("Zero-copy: %u SDK buffers retained (max %u), %" PRIu64 " referenced, %" PRIu64 " copied\n",
+				__sync_fetch_and_add(&g_muxedZeroCopyRetained, 0), g_muxedZeroCopyMax,
+				g_muxedZeroCopyCount, g_muxedZeroCopyFallbackCount);
+		}
+	}
+}
 
-	} else
-	if (signum == SIGUSR2) {
+/* Main thread only. The stats take locks the writer and capture threads hold, so they
+ * can't be printed from the signal handler itself.
+ */
+static void statsRequestService()
+{
+	if (g_statsPrintRequest) {
+		g_statsPrintRequest = 0;
+		statsPrint();
+	}
+	if (g_statsResetRequest) {
+		g_statsResetRequest = 0;
 		printf("Stats manually reset via SIGUSR2\n");
 		ltn_histogram_reset(hist_arrival_interval);
 		ltn_histogram_reset(hist_arrival_interval_video);
 		ltn_histogram_reset(hist_arrival_interval_audio);
 		ltn_histogram_reset(hist_audio_sfc);
 		ltn_histogram_reset(hist_format_change);
+	}
+}
+
+static void signal_handler(int signum)
+{
+	if (signum == SIGUSR1) {
+		g_statsPrintRequest = 1;
+	} else
+	if (signum == SIGUSR2) {
+		g_statsResetRequest = 1;
 	} else {
 		g_shutdown = 1;
 		pthread_cond_signal(&sleepCond);
@@ -713,6 +933,32 @@ static void *smpte337_callback(void *user_context, struct smpte337_detector_s *c
 	return 0;
 }
 
+/* <start>[-<end>], frame counters, or seconds from the start of the capture when suffixed with 's'. */
+static int parseMuxedInputRange(const char *str)
+{
+	char *p;
+
+	g_muxedInputRangeStart = strtod(str, &p);
+	if (p == str || g_muxedInputRangeStart < 0)
+		return -1;
+	if (*p == 's') {
+		g_muxedInputRangeSeconds = 1;
+		p++;
+	}
+	if (*p == '-') {
+		str = p + 1;
+		g_muxedInputRangeEnd = strtod(str, &p);
+		if (p == str || g_muxedInputRangeEnd < g_muxedInputRangeStart)
+			return -1;
+		if (*p == 's') {
+			g_muxedInputRangeSeconds = 1;
+			p++;
+		}
+	}
+
+	return *p ? -1 : 0;
+}
+
 static int AnalyzeMuxed(const char *fn)
 {
 	struct fwr_session_s *session;
@@ -720,12 +966,46 @@ static int AnalyzeMuxed(const char *fn)
 		fprintf(stderr, "Error opening %s\n", fn);
 		return -1;
 	}
+	/* Decompress .gz captures on another thread, while we parse. */
+	fwr_session_read_ahead_set(session, 0);
 
 	struct fwr_header_audio_s *fa;
 	struct fwr_header_video_s *fv;
 	struct fwr_header_timing_s ft;
 	struct fwr_header_vanc_s *fd;
 	uint32_t header;
+	struct fwr_header_timing_s ftstart;
+	int haveStart = 0;
+	int inRange = !g_muxedInputRange;
+
+	if (g_muxedInputRange) {
+		int ret;
+		if (g_muxedInputRangeSeconds) {
+			/* Second ranges are relative to the first frame, note it before we jump. */
+			if (fwr_session_frame_gettype(session, &header) == 0 && header == timing_v1_header &&
+				fwr_timing_frame_read(session, &ftstart) == 0) {
+				haveStart = 1;
+			}
+
+			struct timeval elapsed;
+			elapsed.tv_sec = (time_t)g_muxedInputRangeStart;
+			elapsed.tv_usec = (g_muxedInputRangeStart - elapsed.tv_sec) * 1000000;
+			ret = fwr_session_seek_time(session, &elapsed);
+		} else {
+			ret = fwr_session_seek_frame(session, (uint64_t)g_muxedInputRangeStart);
+		}
+
+		if (ret < 0) {
+			/* No index, or it doesn't cover the range. Scan from the top. */
+			fprintf(stderr, "No usable index for %s, scanning from the start\n", fn);
+			fwr_session_file_close(session);
+			if (fwr_session_file_open(fn, 0, &session) < 0) {
+				fprintf(stderr, "Error opening %s\n", fn);
+				return -1;
+			}
+			fwr_session_read_ahead_set(session, 0);
+		}
+	}
 
 	while (1) {
 		fa = 0, fv = 0;
@@ -742,6 +1022,24 @@ static int AnalyzeMuxed(const char *fn)
 			struct timeval diff;
 			fwr_timeval_subtract(&diff, &ft.ts1, &ftlast.ts1);
 
+			if (g_muxedInputRange) {
+				double pos = ft.counter;
+				if (!haveStart) {
+					ftstart = ft;
+					haveStart = 1;
+				}
+				if (g_muxedInputRangeSeconds) {
+					struct timeval elapsed;
+					fwr_timeval_subtract(&elapsed, &ft.ts1, &ftstart.ts1);
+					pos = elapsed.tv_sec + (elapsed.tv_usec / 1000000.0);
+				}
+				if (g_muxedInputRangeEnd >= 0 && pos > g_muxedInputRangeEnd)
+					break;
+				inRange = pos >= g_muxedInputRangeStart;
+			}
+			if (!inRange)
+				continue;
+
 			printf("timing: counter %" PRIu64 "  mode:%s  ts:%ld.%06ld  timestamp_interval:%ld.%06ld\n",
 				ft.counter,
 				display_mode_to_string(ft.decklinkCaptureMode),
@@ -750,19 +1048,22 @@ static int AnalyzeMuxed(const char *fn)
 				diff.tv_sec,
 				diff.tv_usec);
 		} else
-		if (header == video_v1_header) {
+		if (header == video_v1_header || header == video_v2_header) {
 			if (fwr_video_frame_read(session, &fv) < 0) {
 				fprintf(stderr, "No more video?\n");
 				break;
 			}
-			printf("\tvideo: %d x %d  strideBytes: %d  bufferLengthBytes: %d\n",
+			if (inRange)
+				printf("\tvideo: %d x %d  strideBytes: %d  bufferLengthBytes: %d\n",
 				fv->width, fv->height, fv->strideBytes, fv->bufferLengthBytes);
 		} else
-		if (header == VANC_SOL_INDICATOR) {
+		if (header == VANC_SOL_INDICATOR || header == vanc_line_v2_header || header == vanc_packets_v2_header) {
 			if (fwr_vanc_frame_read(session, &fd) < 0) {
 				fprintf(stderr, "No more vanc?\n");
 				break;
 			}
+			if (!inRange)
+				continue;
 			printf("\t\tvanc: line: %4d -- ", fd->line);
 			for (int i = 0; i < 32; i++)
 				printf("%02x ", *(fd->ptr + i));
@@ -777,11 +1078,30 @@ static int AnalyzeMuxed(const char *fn)
 			if (fwr_pcm_frame_read(session, &fa) < 0) {
 				break;
 			}
-			printf("\taudio: channels: %d  depth: %d  frameCount: %d  bufferLengthBytes: %d\n",
+			if (inRange)
+				printf("\taudio: channels: %d  depth: %d  frameCount: %d  bufferLengthBytes: %d\n",
 				fa->channelCount,
 				fa->sampleDepth,
 				fa->frameCount,
 				fa->bufferLengthBytes);
+		} else
+		if (header == gap_v1_header) {
+			static const char *types[] = { "unknown", "timing", "video", "audio", "vanc" };
+			struct fwr_header_gap_s gap;
+			if (fwr_gap_frame_read(session, &gap) < 0) {
+				break;
+			}
+			if (inRange)
+				printf("\tgap: %u %s records (%" PRIu64 " bytes) dropped by the writer over %ld.%06ld - %ld.%06ld\n",
+				gap.count,
+				types[gap.type < sizeof(types) / sizeof(types[0]) ? gap.type : 0],
+				(uint64_t)gap.bytes,
+				(long)gap.first.tv_sec, (long)gap.first.tv_usec,
+				(long)gap.last.tv_sec, (long)gap.last.tv_usec);
+		} else {
+			/* Record sizes are only known to the readers, we can't skip over it. */
+			fprintf(stderr, "Unsupported record type 0x%08x, stopping\n", header);
+			break;
 		}
 
 		if (fa) {
@@ -883,40 +1203,166 @@ static int AnalyzeAudio(const char *fn)
 	return 0;
 }
 
-static void convert_colorspace_and_parse_vanc(unsigned char *buf, unsigned int uiWidth, unsigned int lineNr)
+/* Repeated VANC line detection, see -d. AFD, static HDR metadata and the like arrive
+ * bit for bit identical every frame. Each parsed line keeps a hash of its v210 words
+ * and the DID/SDID of the packets found on it, when the next frame's line hashes the
+ * same it isn't converted or parsed again, the packet cache counters the monitor
+ * shows are bumped instead. Packet callbacks don't run for repeated lines.
+ */
+#define VANC_REPEAT_LINES   2048 /* Lines tracked, as the klvanc packet cache. */
+#define VANC_REPEAT_PACKETS 16
+
+struct vancRepeatLine_s
+{
+	uint64_t hash;
+	unsigned int width;
+	int valid;                  /* hash and packets describe the last parse of this line. */
+	int packetCount;            /* -1 once the line held more than VANC_REPEAT_PACKETS. */
+	struct {
+		uint8_t did;
+		uint8_t sdid;
+	} packets[VANC_REPEAT_PACKETS];
+};
+
+struct vancRepeat_s
+{
+	/* Each entry is only touched by whoever parses that line, for the decode pool
+	 * that's one worker per line per frame.
+	 */
+	struct vancRepeatLine_s *lines;
+
+	/* Stats */
+	uint64_t parsed;
+	uint64_t repeated;
+};
+
+static struct vancRepeat_s g_vancRepeat;
+
+/* From the packet callbacks, note a packet found on the line being parsed. */
+static void vancRepeatPacket(struct klvanc_packet_header_s *pkt)
+{
+	if (!g_vancRepeat.lines || pkt->lineNr >= VANC_REPEAT_LINES)
+		return;
+
+	struct vancRepeatLine_s *rl = &g_vancRepeat.lines[pkt->lineNr];
+	if (rl->packetCount < 0)
+		return;
+	if (rl->packetCount == VANC_REPEAT_PACKETS) {
+		rl->packetCount = -1;
+		return;
+	}
+
+	rl->packets[rl->packetCount].did = pkt->did;
+	rl->packets[rl->packetCount].sdid = pkt->dbnOrSdid;
+	rl->packetCount++;
+}
+
+/* Account for the packets of a repeated line as if it had been parsed. */
+static void vancRepeatCount(struct klvanc_context_s *ctx, const struct vancRepeatLine_s *rl, unsigned int lineNr)
+{
+	for (int i = 0; i < rl->packetCount; i++) {
+		struct klvanc_cache_s *e = klvanc_cache_lookup(ctx, rl->packets[i].did, rl->packets[i].sdid);
+		if (!e)
+			continue;
+
+		struct klvanc_cache_line_s *line = &e->lines[lineNr];
+		pthread_mutex_lock(&line->mutex);
+		line->count++;
+		pthread_mutex_unlock(&line->mutex);
+	}
+}
+
+static void vancRepeatStatsPrint(int fd)
+{
+	if (!g_vancRepeat.lines)
+		return;
+
+	uint64_t parsed = __sync_fetch_and_add(&g_vancRepeat.parsed, 0);
+	uint64_t repeated = __sync_fetch_and_add(&g_vancRepeat.repeated, 0);
+	uint64_t total = parsed + repeated;
+
+	dprintf(fd, "VANC repeat detection: %" PRIu64 " lines parsed, %" PRIu64 " repeats skipped (%.1f%%)\n",
+		parsed, repeated, total ? (double)repeated * 100.0 / total : 0.0);
+}
+
+/* Returns 1 when the line held an ancillary data flag and was parsed, otherwise 0. */
+static int convert_colorspace_and_parse_vanc_ctx(struct klvanc_context_s *ctx, unsigned char *buf, unsigned int uiWidth, unsigned int lineNr)
 {
 	/* Convert the vanc line from V210 to CrCB422, then vanc parse it */
 
-	/* We need two kinds of type pointers into the source vbi buffer */
-	/* TODO: What the hell is this, two ptrs? */
+	/* Don't attempt to parse vanc if we're capturing it and the monitor isn't running. */
+	if (!g_monitor_mode && vancOutputFile >= 0)
+		return 0;
+
+	if (!vanc_filter_line(&g_vancFilter, lineNr))
+		return 0;
+
 	const uint32_t *src = (const uint32_t *)buf;
 
-	/* Convert Blackmagic pixel format to nv20.
-	 * src pointer gets mangled during conversion, hence we need its own
-	 * ptr instead of passing vbiBufferPtr */
+	/* Standard definition video will have VANC spanning both Luma and Chroma
+	 * channels, HD is converted to separate planes in whole groups of 6 pixels.
+	 */
+	unsigned int width = uiWidth == 720 ? uiWidth : (uiWidth / 6) * 6;
+
+	/* Most VBI lines carry nothing, don't convert and parse them unless the
+	 * ancillary data flag could be present.
+	 */
+	if (!v210unpack_line_may_have_adf(src, width))
+		return 0;
+
+	struct vancRepeatLine_s *rl = NULL;
+	if (g_vancRepeat.lines && lineNr < VANC_REPEAT_LINES) {
+		rl = &g_vancRepeat.lines[lineNr];
+
+		uint64_t hash = v210unpack_line_hash(src, width);
+		if (rl->valid && rl->hash == hash && rl->width == width) {
+			vancRepeatCount(ctx, rl, lineNr);
+			__sync_fetch_and_add(&g_vancRepeat.repeated, 1);
+			return 1;
+		}
+
+		/* Packets are collected by vancRepeatPacket() during the parse. */
+		rl->valid = 0;
+		rl->hash = hash;
+		rl->width = width;
+		rl->packetCount = 0;
+	}
+
+	/* Convert Blackmagic pixel format to nv20. Only the converted samples are
+	 * parsed, so the buffer doesn't need clearing first.
+	 */
 	uint16_t decoded_words[16384];
-	memset(&decoded_words[0], 0, sizeof(decoded_words));
-	uint16_t *p_anc = decoded_words;
+	unsigned int decoded_count;
 
 	if (uiWidth == 720) {
-		/* Standard definition video will have VANC spanning both
-		   Luma and Chroma channels */
-		klvanc_v210_line_to_uyvy_c(src, p_anc, uiWidth);
+		v210unpack_line_to_uyvy(src, decoded_words, width);
+		decoded_count = (width * 2 / 3) * 3;
 	} else {
-		if (klvanc_v210_line_to_nv20_c(src, p_anc,
-					       sizeof(decoded_words),
-					       (uiWidth / 6) * 6) < 0)
-			return;
+		if (v210unpack_line_to_nv20(src, decoded_words, sizeof(decoded_words), width) < 0)
+			return 0;
+		decoded_count = width * 2;
 	}
 
-	/* Don't attempt to parse vanc if we're capturing it and the monitor isn't running. */
-	if (!g_monitor_mode && vancOutputFile >= 0)
-		return;
+	/* Nothing on the line that -l wants, don't parse it. */
+	if (!vanc_filter_words(&g_vancFilter, decoded_words, decoded_count))
+		return 0;
 
-	int ret = klvanc_packet_parse(vanchdl, lineNr, decoded_words, sizeof(decoded_words) / (sizeof(unsigned short)));
+	int ret = klvanc_packet_parse(ctx, lineNr, decoded_words, decoded_count);
 	if (ret < 0) {
 		/* No VANC on this line */
 	}
+
+	if (rl) {
+		rl->valid = rl->packetCount >= 0;
+		__sync_fetch_and_add(&g_vancRepeat.parsed, 1);
+	}
+
+	return 1;
+}
+
+static int convert_colorspace_and_parse_vanc(unsigned char *buf, unsigned int uiWidth, unsigned int lineNr)
+{
+	return convert_colorspace_and_parse_vanc_ctx(vanchdl, buf, uiWidth, lineNr);
 }
 
 #define TS_OUTPUT_NAME "/tmp/smpte2038-sample.ts"
@@ -954,7 +1400,7 @@ static int AnalyzeVANC(const char *fn)
 		assert(uiStride < maxbuflen);
 		fread(&uiEOL, sizeof(unsigned int), 1, fh);
 
-		if (g_linenr && g_linenr != uiLine)
+		if (!vanc_filter_line(&g_vancFilter, uiLine))
 			continue;
 
 		fprintf(stdout, "Line: %04d SOL: %x EOL: %x ", uiLine, uiSOL, uiEOL);
@@ -1010,6 +1456,121 @@ static uint8_t *cdstbuf = 0;
 static int ddstlen = 16384;
 static uint8_t *ddstbuf = 0;
 #endif
+/* Queue every VBI line to the muxed output, on the callback so they follow the
+ * timing and video records of their frame.
+ */
+static void muxedEnqueueVANC(IDeckLinkVideoInputFrame *frame)
+{
+	IDeckLinkVideoFrameAncillary *vanc;
+	if (frame->GetAncillaryData(&vanc) != S_OK)
+		return;
+
+	unsigned int uiStride = frame->GetRowBytes();
+	unsigned int uiWidth = frame->GetWidth();
+	unsigned int uiHeight = frame->GetHeight();
+	for (unsigned int i = 0; i < uiHeight; i++) {
+		uint8_t *buf;
+		if (vanc->GetBufferForVerticalBlankingLine(i, (void **)&buf) != S_OK || !buf)
+			continue;
+
+		struct fwr_header_vanc_s *f = 0;
+		if (fwr_vanc_frame_create(muxedSession, i, uiWidth, uiHeight, uiStride, buf, &f) == 0) {
+			fwr_writer_enqueue(muxedSession, f, FWR_FRAME_VANC);
+		}
+	}
+
+	vanc->Release();
+}
+
+/* Learned VANC line map, see -y. ANC normally sits on a handful of lines that don't
+ * change, so once every line has been looked at for the warm-up period only the lines
+ * that held an ancillary data flag are fetched from the SDK and parsed. Every sweep
+ * interval frames all lines are looked at again, adding any new ones. Lines are never
+ * forgotten, the map starts over when the display mode or height changes.
+ */
+struct vancLineMap_s
+{
+	BMDDisplayMode displayMode;
+	unsigned int height;
+	uint8_t *known;             /* Per line, ANC has been seen on it. Written by the decode pool too. */
+	unsigned int knownCount;
+	uint64_t frame;             /* Frames since the map was reset. */
+
+	/* Stats */
+	uint64_t frames;
+	uint64_t sweeps;
+	uint64_t linesVisited;
+	uint64_t linesSkipped;
+};
+
+static struct vancLineMap_s g_vancLineMap;
+
+/* Returns 1 if every line of this frame should be looked at. */
+static int vancLineMapFrameBegin(struct vancLineMap_s *map, BMDDisplayMode dm, unsigned int height)
+{
+	if (map->height != height || map->displayMode != dm) {
+		uint8_t *known = (uint8_t *)realloc(map->known, height);
+		if (!known)
+			return 1;
+		memset(known, 0, height);
+		map->known = known;
+		map->height = height;
+		map->displayMode = dm;
+		map->frame = 0;
+	}
+
+	int sweep = map->frame < g_vancLineMapWarmup ||
+		(map->frame - g_vancLineMapWarmup) % g_vancLineMapSweep == 0;
+
+	map->frame++;
+	map->frames++;
+	if (sweep)
+		map->sweeps++;
+
+	return sweep;
+}
+
+static void vancLineMapSeen(struct vancLineMap_s *map, unsigned int lineNr)
+{
+	if (lineNr < map->height)
+		map->known[lineNr] = 1;
+}
+
+/* After vancDecodeRun(), once nothing else touches the map for this frame. */
+static void vancLineMapFrameEnd(struct vancLineMap_s *map, unsigned int visited)
+{
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < map->height; i++)
+		count += map->known[i];
+
+	map->knownCount = count;
+	map->linesVisited += visited;
+	if (visited < map->height)
+		map->linesSkipped += map->height - visited;
+}
+
+static void vancLineMapStatsPrint(int fd)
+{
+	struct vancLineMap_s *map = &g_vancLineMap;
+	if (!g_vancLineMapWarmup || !map->frames)
+		return;
+
+	char lines[256];
+	int len = 0;
+	lines[0] = 0;
+	for (unsigned int i = 0; i < map->height && len < (int)sizeof(lines) - 8; i++) {
+		if (map->known[i])
+			len += snprintf(lines + len, sizeof(lines) - len, "%s%u", len ? " " : "", i);
+	}
+
+	uint64_t total = map->linesVisited + map->linesSkipped;
+	dprintf(fd, "VANC line map: %u of %u lines learned [%s], %" PRIu64 " frames, %" PRIu64 " sweeps"
+		", lines per frame visited %.1f skipped %.1f (%.1f%%)\n",
+		map->knownCount, map->height, lines, map->frames, map->sweeps,
+		(double)map->linesVisited / map->frames, (double)map->linesSkipped / map->frames,
+		total ? (double)map->linesSkipped * 100.0 / total : 0.0);
+}
+
 static void ProcessVANC(IDeckLinkVideoInputFrame * frame)
 {
 	IDeckLinkVideoFrameAncillary *vanc;
@@ -1029,7 +1590,23 @@ static void ProcessVANC(IDeckLinkVideoInputFrame * frame)
 	unsigned int uiSOL = VANC_SOL_INDICATOR;
 	unsigned int uiEOL = VANC_EOL_INDICATOR;
 	int written = 0;
+
+	/* Capturing VANC to file needs every line. */
+	struct vancLineMap_s *map = NULL;
+	int sweep = 1;
+	unsigned int visited = 0;
+	if (g_vancLineMapWarmup && vancOutputFile < 0) {
+		map = &g_vancLineMap;
+		sweep = vancLineMapFrameBegin(map, dm, uiHeight);
+	}
+
 	for (unsigned int i = 0; i < uiHeight; i++) {
+		if (vancOutputFile < 0 && !vanc_filter_line(&g_vancFilter, i))
+			continue;
+		if (!sweep && !map->known[i])
+			continue;
+		visited++;
+
 		uint8_t *buf;
 		int ret = vanc->GetBufferForVerticalBlankingLine(i, (void **)&buf);
 		if (ret != S_OK)
@@ -1040,14 +1617,10 @@ static void ProcessVANC(IDeckLinkVideoInputFrame * frame)
 		/* Process the line colorspace, hand-off to the vanc library for parsing
 		 * and prepare to receive callbacks.
 		 */
-		convert_colorspace_and_parse_vanc(buf, uiWidth, uiLine);
-
-		if (muxedSession && g_muxedOutputExcludeData == 0 && buf) {
-			struct fwr_header_vanc_s *frame = 0;
-			if (fwr_vanc_frame_create(muxedSession, uiLine, uiWidth, uiHeight, uiStride, (uint8_t *)buf, &frame) == 0) {
-				fwr_writer_enqueue(muxedSession, frame, FWR_FRAME_VANC);
-			}
-		}
+		if (g_vancDecodePool)
+			vancDecodeLineAdd(g_vancDecodePool, buf, uiWidth, uiLine);
+		else if (convert_colorspace_and_parse_vanc(buf, uiWidth, uiLine) && map)
+			vancLineMapSeen(map, uiLine);
 
 		if (vancOutputFile >= 0) {
 			/* Warning: Balance these writes with the file reads in AnalyzeVANC */
@@ -1127,6 +1700,12 @@ static void ProcessVANC(IDeckLinkVideoInputFrame * frame)
 
 	}
 
+	if (g_vancDecodePool)
+		vancDecodeRun(g_vancDecodePool);
+
+	if (map)
+		vancLineMapFrameEnd(map, visited);
+
 	if (g_packetizeSMPTE2038) {
 		BMDTimeValue stream_time;
 		BMDTimeValue frame_duration;
@@ -1198,6 +1777,82 @@ ULONG DeckLinkCaptureDelegate::Release(void)
 	return (ULONG) m_refCount;
 }
 
+/* Zero-copy muxed capture. The writer queue holds an SDK reference to the
+ * video frame or audio packet and serializes straight from the SDK buffer.
+ * The SDK only has a handful of capture buffers, so once we're holding
+ * g_muxedZeroCopyMax of them, go back to copying until the writer catches up.
+ */
+static void muxedZeroCopyRelease(void *opaque)
+{
+	((IUnknown *)opaque)->Release();
+	__sync_fetch_and_sub(&g_muxedZeroCopyRetained, 1);
+}
+
+static int muxedZeroCopyAvailable()
+{
+	if (g_muxedZeroCopyMax == 0)
+		return 0;
+
+	if (__sync_fetch_and_add(&g_muxedZeroCopyRetained, 0) >= g_muxedZeroCopyMax) {
+		g_muxedZeroCopyFallbackCount++;
+		return 0;
+	}
+
+	g_muxedZeroCopyCount++;
+	return 1;
+}
+
+static void muxedZeroCopyRetain(IUnknown *obj)
+{
+	obj->AddRef();
+	__sync_fetch_and_add(&g_muxedZeroCopyRetained, 1);
+}
+
+/* Bytes per line the SDK hands us for a pixel format, see the SDK's RowBytesForPixelFormat(). */
+static uint32_t muxedRowBytes(BMDPixelFormat fmt, uint32_t width)
+{
+	switch (fmt) {
+	case bmdFormat8BitYUV:   return width * 2;
+	case bmdFormat10BitYUV:  return ((width + 47) / 48) * 128;
+	case bmdFormat10BitRGB:  return ((width + 63) / 64) * 256;
+	default:                 return width * 4;
+	}
+}
+
+/* Size the muxed writer buffer pools for a display mode. Called from _main before the
+ * streams start, and again while they're paused when the input format changes, never
+ * from the capture callback since populating the pools takes a while.
+ */
+static void muxedSessionPoolsAlloc(uint32_t width, uint32_t height)
+{
+	if (!muxedSession || width == 0 || height == 0)
+		return;
+
+	int flags = g_muxedPoolHugepages ? FWR_POOL_HUGEPAGES : 0;
+	uint32_t stride = muxedRowBytes(g_pixelFormat, width);
+	uint32_t frameBytes = stride * height;
+
+	/* Pool enough frames to cover the queue limits, there's no point holding more. */
+	uint32_t count = MUXED_POOL_FRAMES;
+	if (g_muxedQueueMaxBytes)
+		count = (g_muxedQueueMaxBytes / frameBytes) + 2;
+	if (g_muxedQueueMaxFrames && g_muxedQueueMaxFrames < count)
+		count = g_muxedQueueMaxFrames;
+
+	/* Each video frame produces one VANC record per VBI line. The SDK only says how many
+	 * lines there are once a frame arrives, so assume the most any mode has, lines beyond
+	 * the pool fall back to the heap.
+	 */
+	fwr_session_pool_alloc(muxedSession, FWR_FRAME_TIMING, 0, count, 0);
+	if (g_muxedOutputExcludeVideo == 0)
+		fwr_session_pool_alloc(muxedSession, FWR_FRAME_VIDEO, frameBytes, count, flags);
+	if (g_muxedOutputExcludeAudio == 0)
+		fwr_session_pool_alloc(muxedSession, FWR_FRAME_AUDIO,
+			MUXED_POOL_AUDIO_SFC * g_audioChannels * (g_audioSampleDepth / 8), count, flags);
+	if (g_muxedOutputExcludeData == 0)
+		fwr_session_pool_alloc(muxedSession, FWR_FRAME_VANC, stride, count * MUXED_POOL_VBI_LINES, flags);
+}
+
 static void monitorSignal(IDeckLinkVideoInputFrame *videoFrame, IDeckLinkAudioInputPacket *audioFrame)
 {
 	ltn_histogram_interval_update(hist_arrival_interval);
@@ -1220,6 +1875,573 @@ static void monitorSignal(IDeckLinkVideoInputFrame *videoFrame, IDeckLinkAudioIn
 	ltn_histogram_interval_print(STDOUT_FILENO, hist_format_change, g_hist_print_interval);
 }
 
+/* Frames were dropped by the pipeline, the history no longer runs on from the next sample. */
+static void analyzeCadenceResync()
+{
+	memset(&g_1080i2997_cadence_hist[0], 0, sizeof(g_1080i2997_cadence_hist));
+	g_1080i2997_cadence_refill = sizeof(g_1080i2997_cadence_hist) / sizeof(g_1080i2997_cadence_hist[0]) - 1;
+}
+
+/* Optionally check the audio sample cadence as per SMPTE299-1:1997 table 5 page 12 */
+static void analyzeCadence(IDeckLinkVideoInputFrame *videoFrame, IDeckLinkAudioInputPacket *audioFrame)
+{
+	if (!audioFrame || g_detected_mode_id != bmdModeHD1080i5994)
+		return;
+
+	int depth = audioFrame->GetSampleFrameCount();
+	int setlen = 5;
+
+	/* Setup our matching table if needed, usually a one time cost */
+	if (g_1080i2997_cadence_match[0] == 0) {
+		memcpy(&g_1080i2997_cadence_match[0], &g_1080i2997_cadence_set[0], sizeof(g_1080i2997_cadence_set));
+	}
+
+	/* Rotate the history and the match sequence sets, then add the new cadance sample to history. */
+	int m = g_1080i2997_cadence_match[0];
+	for (int i = 1; i < setlen; i++) {
+		g_1080i2997_cadence_hist[i - 1] = g_1080i2997_cadence_hist[i];
+		g_1080i2997_cadence_match[i - 1] = g_1080i2997_cadence_match[i];
+	}
+	g_1080i2997_cadence_hist[setlen - 1] = depth;
+	g_1080i2997_cadence_match[setlen - 1] = m;
+
+	if (g_1080i2997_cadence_refill) {
+		g_1080i2997_cadence_refill--;
+		return;
+	}
+
+#if 0
+	static int vvv = 0;
+	if (vvv++ == 100) {
+		/* Damage the history just after startup to induce a control test */
+		g_1080i2997_cadence_hist[2] = 1234;
+	}
+#endif
+
+	/* See if we match the history and match set, meaning our history is syncronized and cadence is perfect */
+	if (memcmp(&g_1080i2997_cadence_match[0], &g_1080i2997_cadence_hist[0], sizeof(g_1080i2997_cadence_hist)) == 0) {
+		/* Cadence match */
+	} else {
+
+		/* Try to match the history across all five match positions, and align the match set with the measured history.
+		 * The goal here is to accept that we might have valid candence in history and we need to align out match
+		 * set to the candence to syncronize our candence.
+		 */
+		int j;
+		for (j = 1; j <= setlen; j++) {
+			m = g_1080i2997_cadence_match[0];
+			for (int i = 1; i <= (setlen - 1); i++) {
+				g_1080i2997_cadence_match[i - 1] = g_1080i2997_cadence_match[i];
+			}
+			g_1080i2997_cadence_match[setlen - 1] = m;
+			if (memcmp(&g_1080i2997_cadence_match[0], &g_1080i2997_cadence_hist[0], sizeof(g_1080i2997_cadence_hist)) == 0) {
+				printf("1080i29.97 audio cadence matched, after adjusting set\n");
+				break;
+			}
+		}
+		if (j > setlen) {
+			time_t now = time(NULL);
+			printf("1080i29.97 audio cadence not matched, after adjusting set:  ");
+			for (int i = 0; i < setlen; i++) {
+				printf("%d ", g_1080i2997_cadence_match[i]);
+			}
+			printf(", recd: ");
+			for (int i = 0; i < setlen; i++) {
+				printf("%d ", g_1080i2997_cadence_hist[i]);
+			}
+			printf(" @ %s", ctime(&now));
+		}
+	}
+}
+
+/* Measure any a/v offsets specific to a black/white flash pattern, if enabled. */
+static void analyzeBWFlash(IDeckLinkVideoInputFrame *videoFrame, IDeckLinkAudioInputPacket *audioFrame)
+{
+	if (videoFrame && audioFrame && g_bw_flash_measurements && g_bw_flash_initialized == 0) {
+
+		int ret = bw_flash_avoffset_initialize(&g_bw_flash_ctx,
+			videoFrame->GetRowBytes(),
+			videoFrame->GetWidth(),
+			videoFrame->GetHeight(),
+			0, 				/* videoInterlaced */
+			g_audioChannels,
+			g_audioChannels * sizeof(uint32_t),
+			0x3				/* Active Channel Bitmask, assume Stereo */ );
+
+		if (ret == 0) {
+			g_bw_flash_initialized = 1;
+			printf("Initialized and counting A/V Flash pattern.\n");
+		}
+
+	}
+	if (videoFrame && g_bw_flash_measurements && g_bw_flash_initialized) {
+		void *frame;
+		videoFrame->GetBytes(&frame);
+		bw_flash_avoffset_write_video_V210(&g_bw_flash_ctx, (const unsigned char *)frame);
+	}
+	if (audioFrame && g_bw_flash_measurements && g_bw_flash_initialized) {
+		void *frame;
+		audioFrame->GetBytes(&frame);
+
+		int complete = 0;
+		bw_flash_avoffset_write_audio_s32(&g_bw_flash_ctx, (const unsigned char *)frame, audioFrame->GetSampleFrameCount(), &complete);
+		if (complete) {
+			bw_flash_avoffset_query_report_to_fd(&g_bw_flash_ctx, STDOUT_FILENO);
+		}
+	}
+}
+
+static void analyzeSilence(IDeckLinkVideoInputFrame *videoFrame, IDeckLinkAudioInputPacket *audioFrame)
+{
+	/* Both channels of each -Z pair. */
+	uint32_t channelMask = 0;
+	for (int i = 0; i < 8; i++) {
+		if (g_analyzeBitmask & (1 << i))
+			channelMask |= 3 << (2 * i);
+	}
+
+	checkForSilence(audioFrame, channelMask, g_audioChannels, g_audioSampleDepth);
+}
+
+/* -f, only frames with an input signal. */
+static void writeRawVideo(IDeckLinkVideoInputFrame *videoFrame, IDeckLinkAudioInputPacket *audioFrame)
+{
+	if (videoFrame->GetFlags() & bmdFrameHasNoInputSource)
+		return;
+
+	IDeckLinkVideoFrame *rightEyeFrame = NULL;
+	IDeckLinkVideoFrame3DExtensions *threeDExtensions = NULL;
+	void *frameBytes;
+
+	if ((videoFrame->QueryInterface(IID_IDeckLinkVideoFrame3DExtensions, (void **)&threeDExtensions) != S_OK)
+	    || (threeDExtensions->GetFrameForRightEye(&rightEyeFrame) != S_OK)) {
+		rightEyeFrame = NULL;
+	}
+
+	if (threeDExtensions)
+		threeDExtensions->Release();
+
+	videoFrame->GetBytes(&frameBytes);
+	write(videoOutputFile, frameBytes,
+	      videoFrame->GetRowBytes() *
+	      videoFrame->GetHeight());
+
+	if (rightEyeFrame) {
+		rightEyeFrame->GetBytes(&frameBytes);
+		write(videoOutputFile, frameBytes,
+		      videoFrame->GetRowBytes() *
+		      videoFrame->GetHeight());
+		rightEyeFrame->Release();
+	}
+}
+
+/* Frames were dropped by the pipeline, neither KL counter follows on from the last one seen. */
+static void analyzeVANCResync()
+{
+	lastGoodKLFrameCounter = 0;
+	g_klOsdCounterResync = 1;
+}
+
+/* VANC parsing and -V, then the KL OSD counter which is compared against the VANC one. */
+static void analyzeVANC(IDeckLinkVideoInputFrame *videoFrame, IDeckLinkAudioInputPacket *audioFrame)
+{
+	ProcessVANC(videoFrame);
+
+	if (g_kl_osd_vanc_compare) {
+		unsigned int stride = videoFrame->GetRowBytes();
+		unsigned char *pixelData;
+		videoFrame->GetBytes((void **)&pixelData);
+
+		lastGoodKLOsdCounter = V210_read_32bit_value(pixelData, stride, 10, 1);
+		if (g_klOsdCounterResync) {
+			g_klOsdCounterResync = 0;
+		} else if (prevKLOsdCounter + 1 != lastGoodKLOsdCounter) {
+			char t[160];
+			time_t now = time(0);
+			sprintf(t, "%s", ctime(&now));
+			t[strlen(t) - 1] = 0;
+			if (!g_monitor_mode)
+				fprintf(stderr, "%s: KL OSD counter discontinuity, expected %08" PRIx32 " got %08" PRIx32 "\n", t, prevKLOsdCounter + 1, lastGoodKLOsdCounter);
+			flightRecorderTrigger("KL OSD counter discontinuity");
+		}
+		if (!g_monitor_mode)
+			fprintf(stderr, "video counter=%d vanc counter=%d delta=%d\n", lastGoodKLOsdCounter,
+				lastGoodKLFrameCounter, lastGoodKLOsdCounter - lastGoodKLFrameCounter);
+		prevKLOsdCounter = lastGoodKLOsdCounter;
+	}
+}
+
+static void analyzeNielsen(IDeckLinkVideoInputFrame *videoFrame, IDeckLinkAudioInputPacket *audioFrame)
+{
+#if ENABLE_NIELSEN
+	/* We only support 32bit samples, which happens to be the klvanc_capture tool default. */
+	if (g_audioSampleDepth == 32) {
+		void *audioFrameBytes;
+		audioFrame->GetBytes(&audioFrameBytes);
+		uint32_t *p = (uint32_t *)audioFrameBytes;
+		/* This is a little messy, calling the API hundreds of times per buffer. Good enough for now. */
+		for (int i = 0; i < audioFrame->GetSampleFrameCount(); i++) {
+			for (unsigned int j = 0; j < g_audioChannels / 2; j++) {
+				p++; /* Right */
+
+				/* Left channel on Pair X */
+				uint8_t *x = (uint8_t *)p;
+				//fprintf(stdout, "%02x %02x %02x %02x\n", *(x + 0), *(x + 1), *(x + 2), *(x + 3));
+				pNielsenAPI[j]->InputAudioData((uint8_t *)x, 4);
+
+				p++;
+			}
+		}
+	}
+#endif
+}
+
+/* This is crying out for some refactoring and being pushed directly
+ * into libklmonitoring, but in the meantime, here's what its supposed to
+ * accomplish.
+ * a) An upstream SDI device puts PRBS15 15bit values into all of its PCM
+ *    channels. IN the buffer if uint16_t words, the buffer is prepared
+ *    as follows
+ *     for word in buffer[0 ... size]
+ *       word = next prbs15_value;
+ * b) So the entire PRBS set is stripped across all PCM channels.
+ * c) ON the receive side, we "unstripe" accross all channels, and validate
+ *    our syncronized value matches the predicted upstream value.
+ *
+ * In order for the downstream device to syncronize with upstream, it samples the
+ * last word in an initial buffer, then prepares to predict the next words for each and
+ * every subsequent buffer. The prediction comes from a table of the whole sequence, see
+ * prbs15-check.h, so each buffer is compared in bulk. Every mismatch is counted, in words
+ * and bits, and the first few are reported by position. Only when the last word of the
+ * buffer is wrong too has the stream slipped, and we re-syncronize from it.
+ */
+#if HAVE_LIBKLMONITORING_KLMONITORING_H
+static uint16_t prbsNext(uint16_t value)
+{
+	struct prbs_context_s ctx;
+	prbs15_init_with_seed(&ctx, value);
+	return prbs15_generate(&ctx);
+}
+#endif
+
+static void prbsStatsPrint(int fd)
+{
+	if (!g_prbs)
+		return;
+
+	uint64_t words, wordErrors, bitErrors, syncs;
+	prbs15_check_stats(g_prbs, &words, &wordErrors, &bitErrors, &syncs);
+
+	dprintf(fd, "PRBS15 audio: %" PRIu64 " words checked, %" PRIu64 " word errors, %" PRIu64 " bit errors, %" PRIu64 " syncs\n",
+		words, wordErrors, bitErrors, syncs);
+}
+
+/* Audio went missing ahead of the next buffer, sync on it rather than report a discontinuity. */
+static void analyzePRBSResync()
+{
+	if (g_prbs)
+		prbs15_check_reset(g_prbs);
+}
+
+static void analyzePRBS(IDeckLinkVideoInputFrame *videoFrame, IDeckLinkAudioInputPacket *audioFrame)
+{
+#if HAVE_LIBKLMONITORING_KLMONITORING_H
+	if (!g_prbs)
+		return;
+
+	void *audioFrameBytes;
+	audioFrame->GetBytes(&audioFrameBytes);
+	uint32_t count = audioFrame->GetSampleFrameCount() * g_audioChannels;
+
+	struct prbs15_check_result_s r;
+	if (prbs15_check_samples(g_prbs, audioFrameBytes, count, g_audioSampleDepth, &r) < 0) {
+		fprintf(stderr, "KL PRSB15 Audio unable to syncronize, the sequence isn't periodic from 0x%04x\n", r.seed);
+		return;
+	}
+
+	if (r.synced)
+		printf("Seeding audio PRBS sequence with upstream value 0x%04x\n", r.seed);
+
+	if (!r.wordErrors)
+		return;
+
+	char t[160];
+	time_t now = time(0);
+	sprintf(t, "%s", ctime(&now));
+	t[strlen(t) - 1] = 0;
+	fprintf(stderr, "%s: KL PRSB15 Audio frame discontinuity, expected %04" PRIx16 " got %04" PRIx16
+		" (pos %d ch %d), %u of %u words wrong, %u bit errors%s\n", t,
+		r.errors[0].expected, r.errors[0].got,
+		r.errors[0].index / g_audioChannels, r.errors[0].index % g_audioChannels,
+		r.wordErrors, r.words, r.bitErrors,
+		r.resynced ? ", re-syncronized" : "");
+	if (g_verbose) {
+		for (uint32_t i = 0; i < r.errorCount; i++) {
+			printf("y.is:%04x pred:%04x (pos %d ch %d)\n", r.errors[i].got, r.errors[i].expected,
+				r.errors[i].index / g_audioChannels, r.errors[i].index % g_audioChannels);
+		}
+		dumpAudio((uint16_t *)audioFrameBytes, audioFrame->GetSampleFrameCount(), g_audioChannels);
+	}
+	flightRecorderTrigger("PRBS15 audio discontinuity");
+#endif
+}
+
+/* Analysis pipeline, see -w. Each analysis above is a stage. With -w the capture
+ * callback hands every enabled stage its own SDK reference to the frame through a
+ * lock-free queue, and the stage runs on a thread of its own. A slow analysis then
+ * only drops its own frames, counted in the SIGUSR1 stats, rather than holding up
+ * the callback until the hardware drops capture frames. Stages that write files
+ * are lossless, the callback waits for room in their queue instead. The stages that
+ * check a sequence across frames, the audio cadence, the KL counters and PRBS, are
+ * told when frames were dropped ahead of the next one, so the gap isn't reported as
+ * an error in the signal. Without -w the stages run on the callback, as they always
+ * have, other than those with a default depth.
+ */
+enum {
+	PIPELINE_CADENCE = 0,
+	PIPELINE_BWFLASH,
+	PIPELINE_SILENCE,
+	PIPELINE_VIDEO,
+	PIPELINE_VANC,
+	PIPELINE_NIELSEN,
+	PIPELINE_PRBS,
+	PIPELINE_STAGE_MAX
+};
+
+struct pipelineItem_s
+{
+	IDeckLinkVideoInputFrame *videoFrame;
+	IDeckLinkAudioInputPacket *audioFrame;
+	uint64_t queuedUs;
+	int resync;                 /* Frames were dropped ahead of this one. */
+};
+
+struct pipelineStage_s
+{
+	const char *name;
+	void (*process)(IDeckLinkVideoInputFrame *videoFrame, IDeckLinkAudioInputPacket *audioFrame);
+	void (*resync)();           /* Optional, forget any state carried from frame to frame. */
+
+	uint32_t defaultDepth;      /* Frames queued without -w, 0 = run on the callback */
+	int lossless;               /* Writes a file, wait for the stage when its queue is full rather than drop. */
+	struct spsc_queue_s *queue; /* NULL = run on the callback */
+	sem_t sem;                  /* Posted once per item queued, and once to terminate. */
+	sem_t space;                /* Free queue slots, posted once per item popped. */
+	pthread_t threadId;
+	int terminate;
+
+	/* Updated by the callback. */
+	uint64_t queued;
+	uint64_t dropped;           /* Queue was full. */
+	uint64_t stalled;           /* Queue was full, and the callback waited. */
+	int resyncPending;          /* Dropped since the last frame queued. */
+	uint32_t depthHWM;
+
+	/* Updated by the stage thread. */
+	uint64_t processed;
+	uint64_t waitSumUs;         /* Queued, until the stage got to it. */
+	uint64_t waitMaxUs;
+	uint64_t runSumUs;
+	uint64_t runMaxUs;
+};
+
+static uint32_t g_pipelineDepth = 0; /* Frames queued per stage, 0 = analyze on the callback */
+static struct pipelineStage_s g_pipeline[PIPELINE_STAGE_MAX] = {
+	/* In PIPELINE_... order */
+	{ "cadence", analyzeCadence, analyzeCadenceResync, },
+	{ "bwflash", analyzeBWFlash, },
+	{ "silence", analyzeSilence, },
+	{ "video",   writeRawVideo, },
+	{ "vanc",    analyzeVANC, analyzeVANCResync, },
+	{ "nielsen", analyzeNielsen, },
+	{ "prbs",    analyzePRBS, analyzePRBSResync, 16 }, /* Always on a thread of its own. */
+};
+
+static uint64_t pipelineNowUs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static void pipelineItemRelease(struct pipelineItem_s *item)
+{
+	if (item->videoFrame)
+		item->videoFrame->Release();
+	if (item->audioFrame)
+		item->audioFrame->Release();
+}
+
+static void *pipelineThread(void *p)
+{
+	struct pipelineStage_s *stage = (struct pipelineStage_s *)p;
+	struct pipelineItem_s item;
+
+	while (1) {
+		sem_wait(&stage->sem);
+		if (spsc_queue_pop(stage->queue, &item) < 0) {
+			/* Everything queued ahead of the terminate post has been processed. */
+			if (stage->terminate)
+				break;
+			continue;
+		}
+
+		sem_post(&stage->space);
+
+		uint64_t start = pipelineNowUs();
+		if (item.resync && stage->resync)
+			stage->resync();
+		stage->process(item.videoFrame, item.audioFrame);
+		uint64_t end = pipelineNowUs();
+		pipelineItemRelease(&item);
+
+		uint64_t wait = start - item.queuedUs;
+		uint64_t run = end - start;
+		stage->processed++;
+		stage->waitSumUs += wait;
+		stage->runSumUs += run;
+		if (wait > stage->waitMaxUs)
+			stage->waitMaxUs = wait;
+		if (run > stage->runMaxUs)
+			stage->runMaxUs = run;
+	}
+
+	return 0;
+}
+
+/* Run a stage on this frame, or queue it to the stage's thread. */
+static void pipelineRun(int nr, IDeckLinkVideoInputFrame *videoFrame, IDeckLinkAudioInputPacket *audioFrame)
+{
+	struct pipelineStage_s *stage = &g_pipeline[nr];
+	if (!stage->queue) {
+		stage->process(videoFrame, audioFrame);
+		return;
+	}
+
+	struct pipelineItem_s item = { videoFrame, audioFrame, pipelineNowUs(), 0 };
+	if (videoFrame)
+		videoFrame->AddRef();
+	if (audioFrame)
+		audioFrame->AddRef();
+
+	if (sem_trywait(&stage->space) < 0) {
+		if (!stage->lossless) {
+			pipelineItemRelease(&item);
+			stage->dropped++;
+			stage->resyncPending = 1;
+			return;
+		}
+		stage->stalled++;
+		while (sem_wait(&stage->space) < 0)
+			;
+	}
+	item.resync = stage->resyncPending;
+	stage->resyncPending = 0;
+	spsc_queue_push(stage->queue, &item);
+	stage->queued++;
+
+	uint32_t depth = spsc_queue_depth(stage->queue);
+	if (depth > stage->depthHWM)
+		stage->depthHWM = depth;
+
+	sem_post(&stage->sem);
+}
+
+/* Start a thread for each analysis the command line enabled. */
+static int pipelineStart()
+{
+	int enabled[PIPELINE_STAGE_MAX] = { 0 };
+	enabled[PIPELINE_CADENCE] = g_1080i2997_cadence_check;
+	enabled[PIPELINE_BWFLASH] = g_bw_flash_measurements;
+	enabled[PIPELINE_SILENCE] = g_analyzeBitmask != 0;
+	enabled[PIPELINE_VIDEO] = videoOutputFile != -1;
+	enabled[PIPELINE_VANC] = 1;
+#if ENABLE_NIELSEN
+	enabled[PIPELINE_NIELSEN] = g_enable_nielsen;
+#endif
+#if HAVE_LIBKLMONITORING_KLMONITORING_H
+	enabled[PIPELINE_PRBS] = g_monitor_prbs_audio_mode;
+#endif
+
+	for (int i = 0; i < PIPELINE_STAGE_MAX; i++) {
+		struct pipelineStage_s *stage = &g_pipeline[i];
+		uint32_t depth = g_pipelineDepth ? g_pipelineDepth : stage->defaultDepth;
+		if (!enabled[i] || !depth)
+			continue;
+
+		/* -f, and the VANC outputs written while it is parsed, -V, RCWT captions, -T and -P. */
+		stage->lossless = i == PIPELINE_VIDEO ||
+			(i == PIPELINE_VANC && (vancOutputFile >= 0 || rcwtOutputFile >= 0 ||
+				g_vancOutputDir || g_packetizeSMPTE2038));
+
+		if (spsc_queue_alloc(&stage->queue, depth, sizeof(struct pipelineItem_s)) < 0)
+			return -1;
+
+		sem_init(&stage->sem, 0, 0);
+		sem_init(&stage->space, 0, stage->queue->mask + 1);
+		if (pthread_create(&stage->threadId, 0, pipelineThread, stage) != 0) {
+			sem_destroy(&stage->sem);
+			sem_destroy(&stage->space);
+			spsc_queue_free(stage->queue);
+			stage->queue = NULL;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void pipelineStatsPrint(int fd)
+{
+	for (int i = 0; i < PIPELINE_STAGE_MAX; i++) {
+		struct pipelineStage_s *stage = &g_pipeline[i];
+		if (!stage->queue)
+			continue;
+
+		uint64_t processed = stage->processed ? stage->processed : 1;
+		dprintf(fd, "Pipeline stage '%s': depth %u (hwm %u / %u), queued %" PRIu64 " processed %" PRIu64 " %s %" PRIu64
+			", wait mean %" PRIu64 " us max %" PRIu64 " us, run mean %" PRIu64 " us max %" PRIu64 " us\n",
+			stage->name,
+			spsc_queue_depth(stage->queue), stage->depthHWM, stage->queue->mask + 1,
+			stage->queued, stage->processed,
+			stage->lossless ? "stalled" : "dropped", stage->lossless ? stage->stalled : stage->dropped,
+			stage->waitSumUs / processed, stage->waitMaxUs,
+			stage->runSumUs / processed, stage->runMaxUs);
+	}
+}
+
+/* Once the callbacks have stopped, let each stage finish what it has queued. */
+static void pipelineStop()
+{
+	int running = 0;
+	for (int i = 0; i < PIPELINE_STAGE_MAX; i++) {
+		struct pipelineStage_s *stage = &g_pipeline[i];
+		if (!stage->queue)
+			continue;
+
+		stage->terminate = 1;
+		sem_post(&stage->sem);
+		pthread_join(stage->threadId, NULL);
+		running++;
+	}
+	if (!running)
+		return;
+
+	pipelineStatsPrint(STDOUT_FILENO);
+
+	for (int i = 0; i < PIPELINE_STAGE_MAX; i++) {
+		struct pipelineStage_s *stage = &g_pipeline[i];
+		if (!stage->queue)
+			continue;
+
+		sem_destroy(&stage->sem);
+		sem_destroy(&stage->space);
+		spsc_queue_free(stage->queue);
+		stage->queue = NULL;
+	}
+}
+
 HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(IDeckLinkVideoInputFrame *videoFrame, IDeckLinkAudioInputPacket *audioFrame)
 {
 	if (g_shutdown == 1) {
@@ -1275,116 +2497,20 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(IDeckLinkVideoInputFrame
 		for (int i = 0; i < 4; i++) {
 			struct txtable_s *e = &tctable[i];
 			if (e->valid) {
-				e->ref->Release();
-			}
-		}
-		return S_OK;
-	}
-
-	/* Optionally check the audio sample cadence as per SMPTE299-1:1997 table 5 page 12 */
-	if (audioFrame && g_1080i2997_cadence_check && g_detected_mode_id == bmdModeHD1080i5994) {
-		int depth = audioFrame->GetSampleFrameCount();
-		int setlen = 5;
-
-		/* Setup our matching table if needed, usually a one time cost */
-		if (g_1080i2997_cadence_match[0] == 0) {
-			memcpy(&g_1080i2997_cadence_match[0], &g_1080i2997_cadence_set[0], sizeof(g_1080i2997_cadence_set));
-		}
-
-		/* Rotate the history and the match sequence sets, then add the new cadance sample to history. */
-		int m = g_1080i2997_cadence_match[0];
-		for (int i = 1; i < setlen; i++) {
-			g_1080i2997_cadence_hist[i - 1] = g_1080i2997_cadence_hist[i];
-			g_1080i2997_cadence_match[i - 1] = g_1080i2997_cadence_match[i];
-		}
-		g_1080i2997_cadence_hist[setlen - 1] = depth;
-		g_1080i2997_cadence_match[setlen - 1] = m;
-
-#if 0
-		static int vvv = 0;
-		if (vvv++ == 100) {
-			/* Damage the history just after startup to induce a control test */
-			g_1080i2997_cadence_hist[2] = 1234;
-		}
-#endif
-
-		/* See if we match the history and match set, meaning our history is syncronized and cadence is perfect */
-		if (memcmp(&g_1080i2997_cadence_match[0], &g_1080i2997_cadence_hist[0], sizeof(g_1080i2997_cadence_hist)) == 0) {
-			/* Cadence match */
-		} else {
-
-			/* Try to match the history across all five match positions, and align the match set with the measured history.
-			 * The goal here is to accept that we might have valid candence in history and we need to align out match
-			 * set to the candence to syncronize our candence.
-			 */
-			int j;
-			for (j = 1; j <= setlen; j++) {
-				m = g_1080i2997_cadence_match[0];
-				for (int i = 1; i <= (setlen - 1); i++) {
-					g_1080i2997_cadence_match[i - 1] = g_1080i2997_cadence_match[i];
-				}
-				g_1080i2997_cadence_match[setlen - 1] = m;
-				if (memcmp(&g_1080i2997_cadence_match[0], &g_1080i2997_cadence_hist[0], sizeof(g_1080i2997_cadence_hist)) == 0) {
-					printf("1080i29.97 audio cadence matched, after adjusting set\n");
-					break;
-				}
-			}
-			if (j > setlen) {
-				time_t now = time(NULL);
-				printf("1080i29.97 audio cadence not matched, after adjusting set:  ");
-				for (int i = 0; i < setlen; i++) {
-					printf("%d ", g_1080i2997_cadence_match[i]);
-				}
-				printf(", recd: ");
-				for (int i = 0; i < setlen; i++) {
-					printf("%d ", g_1080i2997_cadence_hist[i]);
-				}
-				printf(" @ %s", ctime(&now));
+				e->ref->Release();
 			}
 		}
+		return S_OK;
 	}
 
-	/* Measure any a/v offsets specific to a black/white flash pattern, if enabled. */
-	if (videoFrame && audioFrame && g_bw_flash_measurements && g_bw_flash_initialized == 0) {
-
-		int ret = bw_flash_avoffset_initialize(&g_bw_flash_ctx,
-			videoFrame->GetRowBytes(),
-			videoFrame->GetWidth(),
-			videoFrame->GetHeight(),
-			0, 				/* videoInterlaced */
-			g_audioChannels,
-			g_audioChannels * sizeof(uint32_t),
-			0x3				/* Active Channel Bitmask, assume Stereo */ );
-
-		if (ret == 0) {
-			g_bw_flash_initialized = 1;
-			printf("Initialized and counting A/V Flash pattern.\n");
-		}
-
-	}
-	if (videoFrame && g_bw_flash_measurements && g_bw_flash_initialized) {
-		void *frame;
-		videoFrame->GetBytes(&frame);
-		bw_flash_avoffset_write_video_V210(&g_bw_flash_ctx, (const unsigned char *)frame);
-	}
-	if (audioFrame && g_bw_flash_measurements && g_bw_flash_initialized) {
-		void *frame;
-		audioFrame->GetBytes(&frame);
+	if (audioFrame && g_1080i2997_cadence_check)
+		pipelineRun(PIPELINE_CADENCE, NULL, audioFrame);
 
-		int complete = 0;
-		bw_flash_avoffset_write_audio_s32(&g_bw_flash_ctx, (const unsigned char *)frame, audioFrame->GetSampleFrameCount(), &complete);
-		if (complete) {
-			bw_flash_avoffset_query_report_to_fd(&g_bw_flash_ctx, STDOUT_FILENO);
-		}
-	}
-	/* End: Measure any a/v offsets specific to a black/white flash pattern, if enabled. */
+	if (g_bw_flash_measurements)
+		pipelineRun(PIPELINE_BWFLASH, videoFrame, audioFrame);
 
-	for (int i = 0; i < 8; i++) {
-		if (g_analyzeBitmask & (1 << i)) {
-			checkForSilence(audioFrame, (2 * i), g_audioChannels, g_audioSampleDepth);
-			checkForSilence(audioFrame, (2 * i) + 1, g_audioChannels, g_audioSampleDepth);
-		}
-	}
+	if (audioFrame && g_analyzeBitmask)
+		pipelineRun(PIPELINE_SILENCE, NULL, audioFrame);
 
 	if (g_monitorSignalStability) {
 		monitorSignal(videoFrame, audioFrame);
@@ -1392,9 +2518,8 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(IDeckLinkVideoInputFrame
 	}
 	if (writeSession) {
 		struct fwr_header_timing_s *timing;
-		fwr_timing_frame_create(writeSession, (uint32_t)g_detected_mode_id, &timing);
-		fwr_timing_frame_write(writeSession, timing);
-		fwr_timing_frame_free(writeSession, timing);
+		if (fwr_timing_frame_create(writeSession, (uint32_t)g_detected_mode_id, &timing) == 0)
+			fwr_writer_enqueue(writeSession, timing, FWR_FRAME_TIMING);
 	}
 	if (muxedSession) {
 		struct fwr_header_timing_s *timing;
@@ -1417,6 +2542,12 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(IDeckLinkVideoInputFrame
 		struct fwr_header_video_s *frame;
 		videoFrame->GetBytes(&frameBytes);
 
+		if (muxedZeroCopyAvailable()) {
+			muxedZeroCopyRetain(videoFrame);
+			fwr_writer_enqueue_video_ref(muxedSession,
+				videoFrame->GetWidth(), videoFrame->GetHeight(), videoFrame->GetRowBytes(),
+				(uint8_t *)frameBytes, muxedZeroCopyRelease, videoFrame);
+		} else
 		if (fwr_video_frame_create(muxedSession,
 			videoFrame->GetWidth(), videoFrame->GetHeight(), videoFrame->GetRowBytes(),
 			(uint8_t *)frameBytes, &frame) == 0)
@@ -1600,19 +2731,8 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(IDeckLinkVideoInputFrame
 			if (timecodeString)
 				free(timecodeString);
 
-			if (videoOutputFile != -1) {
-				videoFrame->GetBytes(&frameBytes);
-				write(videoOutputFile, frameBytes,
-				      videoFrame->GetRowBytes() *
-				      videoFrame->GetHeight());
-
-				if (rightEyeFrame) {
-					rightEyeFrame->GetBytes(&frameBytes);
-					write(videoOutputFile, frameBytes,
-					      videoFrame->GetRowBytes() *
-					      videoFrame->GetHeight());
-				}
-			}
+			if (videoOutputFile != -1)
+				pipelineRun(PIPELINE_VIDEO, videoFrame, NULL);
 		}
 
 		if (rightEyeFrame)
@@ -1628,33 +2748,10 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(IDeckLinkVideoInputFrame
 	}
 
 	/* Video Ancillary data */
+	if (videoFrame && muxedSession && g_muxedOutputExcludeData == 0)
+		muxedEnqueueVANC(videoFrame);
 	if (videoFrame)
-		ProcessVANC(videoFrame);
-
-	if (videoFrame) {
-		unsigned int stride = videoFrame->GetRowBytes();
-		unsigned char *pixelData;
-		videoFrame->GetBytes((void **)&pixelData);
-
-		if (g_kl_osd_vanc_compare) {
-			static uint32_t xxx = 0;
-			lastGoodKLOsdCounter = V210_read_32bit_value(pixelData, stride, 10, 1);
-			if (xxx + 1 != lastGoodKLOsdCounter) {
-				char t[160];
-				time_t now = time(0);
-				sprintf(t, "%s", ctime(&now));
-				t[strlen(t) - 1] = 0;
-				if (!g_monitor_mode)
-					fprintf(stderr, "%s: KL OSD counter discontinuity, expected %08" PRIx32 " got %08" PRIx32 "\n", t, xxx + 1, lastGoodKLOsdCounter);
-			}
-			if (!g_monitor_mode)
-				fprintf(stderr, "video counter=%d vanc counter=%d delta=%d\n", lastGoodKLOsdCounter,
-					lastGoodKLFrameCounter, lastGoodKLOsdCounter - lastGoodKLFrameCounter);
-			xxx = lastGoodKLOsdCounter;
-		}
-	}
-
-
+		pipelineRun(PIPELINE_VANC, videoFrame, NULL);
 
 	// Handle Audio Frame
 	if (audioFrame) {
@@ -1690,40 +2787,40 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(IDeckLinkVideoInputFrame
 		}
 
 #if ENABLE_NIELSEN
-		if (g_enable_nielsen && audioFrame) {
-			/* We only support 32bit samples, which happens to be the klvanc_capture tool default. */
-			if (g_audioSampleDepth == 32) {
-				audioFrame->GetBytes(&audioFrameBytes);
-				uint32_t *p = (uint32_t *)audioFrameBytes;
-				/* This is a little messy, calling the API hundreds of times per buffer. Good enough for now. */
-				for (int i = 0; i < audioFrame->GetSampleFrameCount(); i++) {
-					for (unsigned int j = 0; j < g_audioChannels / 2; j++) {
-						p++; /* Right */
-
-						/* Left channel on Pair X */
-						uint8_t *x = (uint8_t *)p;
-						//fprintf(stdout, "%02x %02x %02x %02x\n", *(x + 0), *(x + 1), *(x + 2), *(x + 3));
-						pNielsenAPI[j]->InputAudioData((uint8_t *)x, 4);
-
-						p++;
-					}
-				}
-			}
-		}
+		if (g_enable_nielsen)
+			pipelineRun(PIPELINE_NIELSEN, NULL, audioFrame);
 #endif
 
 		if (writeSession) {
+			/* Both sessions write the same packet, share a single copy (or the SDK buffer)
+			 * which the last of them to finish releases. Written on the session threads,
+			 * segment rollover never stalls the callback.
+			 */
 			audioFrame->GetBytes(&audioFrameBytes);
-			struct fwr_header_audio_s *frame = 0;
-			if (fwr_pcm_frame_create(writeSession, audioFrame->GetSampleFrameCount(), g_audioSampleDepth, g_audioChannels, (const uint8_t *)audioFrameBytes, &frame) == 0) {
-				fwr_pcm_frame_write(writeSession, frame);
-				fwr_pcm_frame_free(writeSession, frame);
+			uint32_t sfc = audioFrame->GetSampleFrameCount();
+			size_t len = (size_t)sfc * g_audioChannels * (g_audioSampleDepth / 8);
+			struct fwr_buffer_s *buf = NULL;
+			if (muxedZeroCopyAvailable()) {
+				muxedZeroCopyRetain(audioFrame);
+				fwr_buffer_wrap((const uint8_t *)audioFrameBytes, len, muxedZeroCopyRelease, audioFrame, &buf);
+			} else {
+				fwr_buffer_alloc((const uint8_t *)audioFrameBytes, len, &buf);
 			}
-		}
-
+			if (buf) {
+				fwr_writer_enqueue_pcm_buffer(writeSession, sfc, g_audioSampleDepth, g_audioChannels, buf);
+				if (muxedSession && g_muxedOutputExcludeAudio == 0)
+					fwr_writer_enqueue_pcm_buffer(muxedSession, sfc, g_audioSampleDepth, g_audioChannels, buf);
+				fwr_buffer_unref(buf);
+			}
+		} else
 		if (muxedSession && g_muxedOutputExcludeAudio == 0) {
 			audioFrame->GetBytes(&audioFrameBytes);
 			struct fwr_header_audio_s *frame = 0;
+			if (muxedZeroCopyAvailable()) {
+				muxedZeroCopyRetain(audioFrame);
+				fwr_writer_enqueue_pcm_ref(muxedSession, audioFrame->GetSampleFrameCount(), g_audioSampleDepth, g_audioChannels,
+					(const uint8_t *)audioFrameBytes, muxedZeroCopyRelease, audioFrame);
+			} else
 			if (fwr_pcm_frame_create(muxedSession, audioFrame->GetSampleFrameCount(), g_audioSampleDepth, g_audioChannels, (const uint8_t *)audioFrameBytes, &frame) == 0) {
 				fwr_writer_enqueue(muxedSession, frame, FWR_FRAME_AUDIO);
 			}
@@ -1733,117 +2830,8 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(IDeckLinkVideoInputFrame
 		frameTime->lastTime = t;
 
 #if HAVE_LIBKLMONITORING_KLMONITORING_H
-		/* This is crying out for some refactoring and being pushed directly
-		 * into libklmonitoring, but in the meantime, here's what its supposed to
-		 * accomplish.
-		 * a) An upstream SDI device puts PRBS15 15bit values into all of its PCM
-		 *    channels. IN the buffer if uint16_t words, the buffer is prepared
-		 *    as follows
-		 *     for word in buffer[0 ... size]
-		 *       word = next prbs15_value;
-		 * b) So the entire PRBS set is stripped across all PCM channels.
-		 * c) ON the receive side, we "unstripe" accross all channels, and validate
-		 *    our syncronized value matches the predicted upstream value.
-		 *
-		 * In order for the downstream device to syncronize with upstream, it samples the
-		 * last word in an initial buffer, then prepares to predict the next words for each and
-		 * every subsequent buffer. If the prediction value doesn't match the actual value obtained
-		 * from upstream, declare a data integrity error and re-syncronize / repeat the syncronization
-		 * process.
-		 */
-		if (g_monitor_prbs_audio_mode) {
-			audioFrame->GetBytes(&audioFrameBytes);
-			if (g_prbs_initialized == 0) {
-				if (g_audioSampleDepth == 16) {
-					uint16_t *p = (uint16_t *)audioFrameBytes;
-					for (int i = 0; i < audioFrame->GetSampleFrameCount(); i++) {
-						for (int j = 0; j < g_audioChannels; j++) {
-							if (i == (audioFrame->GetSampleFrameCount() - 1)) {
-								if (j == (g_audioChannels - 1)) {
-									printf("Seeding audio PRBS sequence with upstream value 0x%04x\n", *p);
-									prbs15_init_with_seed(&g_prbs, *p);
-								}
-							}
-							p++;
-						}
-					}
-					g_prbs_initialized = 1;
-				} else
-				if (g_audioSampleDepth == 32) {
-					uint32_t *p = (uint32_t *)audioFrameBytes;
-					for (int i = 0; i < audioFrame->GetSampleFrameCount(); i++) {
-						for (int j = 0; j < g_audioChannels; j++) {
-							if (i == (audioFrame->GetSampleFrameCount() - 1)) {
-								if (j == (g_audioChannels - 1)) {
-									printf("Seeding audio PRBS sequence with upstream value 0x%08x\n", *p >> 16);
-									prbs15_init_with_seed(&g_prbs, *p >> 16);
-								}
-							}
-							p++;
-						}
-					}
-					g_prbs_initialized = 1;
-				} else
-					assert(0);
-			} else {
-				if (g_audioSampleDepth == 16) {
-					uint16_t *p = (uint16_t *)audioFrameBytes;
-					for (int i = 0; i < audioFrame->GetSampleFrameCount(); i++) {
-						for (int j = 0; j < g_audioChannels; j++) {
-							uint16_t a = *p++;
-							uint16_t b = prbs15_generate(&g_prbs);
-							if (a != b) {
-								if (g_verbose) {
-									printf("%04x %04x %04x %04x -- ", *(p + 0), *(p + 1), *(p + 2), *(p + 3));
-									printf("y.is:%04x pred:%04x (pos %d)\n", a, b, i);
-									dumpAudio(p, audioFrame->GetSampleFrameCount(), g_audioChannels);
-								}
-								char t[160];
-								time_t now = time(0);
-								sprintf(t, "%s", ctime(&now));
-								t[strlen(t) - 1] = 0;
-						                fprintf(stderr, "%s: KL PRSB15 Audio frame discontinuity, expected %04" PRIx16
-									" got %04" PRIx16 "\n", t, b, a);
-
-								g_prbs_initialized = 0;
-
-								// Break the sample frame loop i
-								i = audioFrame->GetSampleFrameCount();
-								break;
-							}
-						}
-					}
-				} else
-				if (g_audioSampleDepth == 32) {
-					uint32_t *p = (uint32_t *)audioFrameBytes;
-					for (int i = 0; i < audioFrame->GetSampleFrameCount(); i++) {
-						for (int j = 0; j < g_audioChannels; j++) {
-							uint32_t a = *p++ >> 16;
-							uint32_t b = prbs15_generate(&g_prbs);
-							if (a != b) {
-								if (g_verbose) {
-									printf("%08x %08x %08x %08x -- ", *(p + 0), *(p + 1), *(p + 2), *(p + 3));
-									printf("y.is:%04x pred:%04x (pos %d)\n", a, b, i);
-									dumpAudio((uint16_t *)p, audioFrame->GetSampleFrameCount(), g_audioChannels);
-								}
-								char t[160];
-								time_t now = time(0);
-								sprintf(t, "%s", ctime(&now));
-								t[strlen(t) - 1] = 0;
-						                fprintf(stderr, "%s: KL PRSB15 Audio frame discontinuity, expected %08" PRIx32
-									" got %08" PRIx32 "\n", t, b, a);
-
-								g_prbs_initialized = 0;
-
-								// Break the sample frame loop i
-								i = audioFrame->GetSampleFrameCount();
-								break;
-							}
-						}
-					}
-				}
-			}
-		}
+		if (g_monitor_prbs_audio_mode)
+			pipelineRun(PIPELINE_PRBS, NULL, audioFrame);
 #endif
 	}
 	return S_OK;
@@ -1854,6 +2842,8 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFormatChanged(BMDVideoInputFormatChan
 	HRESULT result;
 	ltn_histogram_update_with_timevalue(hist_format_change, 1);
 
+	flightRecorderTrigger("Input format change");
+
 	if (events & bmdVideoInputDisplayModeChanged) {
 		g_detected_mode_id = mode->GetDisplayMode();
 		if (g_requested_mode_id == 0) {
@@ -1864,6 +2854,7 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFormatChanged(BMDVideoInputFormatChan
 				fprintf(stderr, "Failed to enable video input. Is another application using the card? (Result=0x%x\n", result);
 			}
 			deckLinkInput->FlushStreams();
+			muxedSessionPoolsAlloc(mode->GetWidth(), mode->GetHeight());
 			deckLinkInput->StartStreams();
 		}
 	}
@@ -1871,8 +2862,19 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFormatChanged(BMDVideoInputFormatChan
 }
 
 /* CALLBACKS for message notification */
+
+/* Packets the -l filter doesn't want are parsed alongside wanted ones on the same line. */
+static int vancFilterPacket(struct klvanc_packet_header_s *hdr)
+{
+	return vanc_filter_line(&g_vancFilter, hdr->lineNr) &&
+		vanc_filter_packet(&g_vancFilter, hdr->did, hdr->dbnOrSdid);
+}
+
 static int cb_AFD(void *callback_context, struct klvanc_context_s *ctx, struct klvanc_packet_afd_s *pkt)
 {
+	if (!vancFilterPacket(&pkt->hdr))
+		return 0;
+
 	/* Have the library display some debug */
 	if (!g_monitor_mode && g_verbose)
 		klvanc_dump_AFD(ctx, pkt);
@@ -1884,6 +2886,9 @@ static int cb_EIA_708B(void *callback_context, struct klvanc_context_s *ctx, str
 {
 	uint8_t caption_data[128];
 
+	if (!vancFilterPacket(&pkt->hdr))
+		return 0;
+
 	/* Have the library display some debug */
 	if (!g_monitor_mode && g_verbose)
 		klvanc_dump_EIA_708B(ctx, pkt);
@@ -1912,6 +2917,9 @@ static int cb_EIA_708B(void *callback_context, struct klvanc_context_s *ctx, str
 
 static int cb_EIA_608(void *callback_context, struct klvanc_context_s *ctx, struct klvanc_packet_eia_608_s *pkt)
 {
+	if (!vancFilterPacket(&pkt->hdr))
+		return 0;
+
 	/* Have the library display some debug */
 	if (!g_monitor_mode && g_verbose)
 		klvanc_dump_EIA_608(ctx, pkt);
@@ -1923,18 +2931,25 @@ static int cb_SCTE_104(void *callback_context, struct klvanc_context_s *ctx, str
 {
 	int ret;
 
+	if (!vancFilterPacket(&pkt->hdr))
+		return 0;
+
 	/* Have the library display some debug */
 	if (!g_monitor_mode && g_verbose) {
 		ret = klvanc_dump_SCTE_104(ctx, pkt);
 		if (ret != 0)
 			fprintf(stderr, "Error dumping SCTE 104 packet!\n");
 	}
+	flightRecorderTrigger("SCTE-104");
 
 	return 0;
 }
 
 static int cb_SDP(void *callback_context, struct klvanc_context_s *ctx, struct klvanc_packet_sdp_s *pkt)
 {
+	if (!vancFilterPacket(&pkt->hdr))
+		return 0;
+
 	/* Have the library display some debug */
 	if (!g_monitor_mode && g_verbose)
 		klvanc_dump_SDP(ctx, pkt);
@@ -1944,6 +2959,9 @@ static int cb_SDP(void *callback_context, struct klvanc_context_s *ctx, struct k
 
 static int cb_SMPTE_12_2(void *callback_context, struct klvanc_context_s *ctx, struct klvanc_packet_smpte_12_2_s *pkt)
 {
+	if (!vancFilterPacket(&pkt->hdr))
+		return 0;
+
 	/* Have the library display some debug */
 	if (!g_monitor_mode && g_verbose)
 		klvanc_dump_SMPTE_12_2(ctx, pkt);
@@ -1953,6 +2971,9 @@ static int cb_SMPTE_12_2(void *callback_context, struct klvanc_context_s *ctx, s
 
 static int cb_SMPTE_2108_1(void *callback_context, struct klvanc_context_s *ctx, struct klvanc_packet_smpte_2108_1_s *pkt)
 {
+	if (!vancFilterPacket(&pkt->hdr))
+		return 0;
+
 	/* Have the library display some debug */
 	if (!g_monitor_mode && g_verbose)
 		klvanc_dump_SMPTE_2108_1(ctx, pkt);
@@ -1962,15 +2983,17 @@ static int cb_SMPTE_2108_1(void *callback_context, struct klvanc_context_s *ctx,
 
 static int cb_all(void *callback_context, struct klvanc_context_s *ctx, struct klvanc_packet_header_s *pkt)
 {
+	/* The packet cache counts every packet parsed, filtered or not. */
+	vancRepeatPacket(pkt);
+
+	if (!vancFilterPacket(pkt))
+		return 0;
+
 	/* Save the packet to disk, if reqd. */
 	if (g_vancOutputDir) {
-		int requestedLine = g_linenr;
-		if (requestedLine == 0)
-			requestedLine = -1; /* All lines */
-
 		klvanc_packet_save(g_vancOutputDir,
 			(const struct klvanc_packet_header_s *)pkt,
-			requestedLine,
+			-1, /* All lines, -l has already been applied */
 			-1 /* did */);
 	}
 
@@ -1990,6 +3013,9 @@ static int cb_all(void *callback_context, struct klvanc_context_s *ctx, struct k
 
 static int cb_VANC_TYPE_KL_UINT64_COUNTER(void *callback_context, struct klvanc_context_s *ctx, struct klvanc_packet_kl_u64le_counter_s *pkt)
 {
+	if (!vancFilterPacket(&pkt->hdr))
+		return 0;
+
 	/* Have the library display some debug */
 	if (!g_monitor_mode && g_verbose)
 		klvanc_dump_KL_U64LE_COUNTER(ctx, pkt);
@@ -2003,6 +3029,7 @@ static int cb_VANC_TYPE_KL_UINT64_COUNTER(void *callback_context, struct klvanc_
 		fprintf(stderr, "%s: KL VANC frame counter discontinuity was %" PRIu64 " now %" PRIu64 "\n",
 			t,
 			lastGoodKLFrameCounter, pkt->counter);
+		flightRecorderTrigger("KL VANC frame counter discontinuity");
 	}
 	lastGoodKLFrameCounter = pkt->counter;
 
@@ -2022,6 +3049,268 @@ static struct klvanc_callbacks_s callbacks =
 	.smpte_2108_1           = cb_SMPTE_2108_1,
 };
 
+/* Parallel VANC decode, see -U. The VBI lines of each frame are converted and parsed
+ * in batches on a pool of threads, each with a klvanc context of its own, while the
+ * frame's caller works through batches too. Packet callbacks are held back until
+ * every earlier line of the frame has finished, so the SMPTE 2038 packetizer, RCWT
+ * and the KL counter checks still see the packets in line order.
+ */
+#define VANC_DECODE_BATCH 4 /* Lines pulled from the frame at a time. */
+
+struct vancDecodeLine_s
+{
+	unsigned char *buf;
+	unsigned int width;
+	unsigned int lineNr;
+};
+
+struct vancDecodeWorker_s
+{
+	struct vancDecodePool_s *pool;
+	struct klvanc_context_s *ctx;
+	uint32_t current;           /* Index of the line being parsed. */
+	pthread_t threadId;
+};
+
+struct vancDecodePool_s
+{
+	int threadCount;            /* Including the caller, worker 0. */
+	struct vancDecodeWorker_s *workers;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;        /* Lines are available, or terminate. */
+	pthread_cond_t doneCond;    /* The last line of the frame finished. */
+	pthread_cond_t turnCond;    /* nextOrdered moved on. */
+	int terminate;
+
+	/* Current frame, protected by mutex. */
+	struct vancDecodeLine_s *lines;
+	uint8_t *done;
+	uint32_t lineAlloc;
+	uint32_t lineCount;
+	uint32_t nextLine;
+	uint32_t doneLines;
+	uint32_t nextOrdered;       /* Every line before this has finished, its callbacks can run. */
+	int running;
+};
+
+/* Called from a worker's packet callbacks, wait for every earlier line of the frame. */
+static void vancDecodeTurnWait(struct vancDecodeWorker_s *w)
+{
+	struct vancDecodePool_s *pool = w->pool;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->nextOrdered < w->current)
+		pthread_cond_wait(&pool->turnCond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+#define VANC_DECODE_ORDERED_CB(name, type) \
+static int cbo_##name(void *callback_context, struct klvanc_context_s *ctx, type *pkt) \
+{ \
+	vancDecodeTurnWait((struct vancDecodeWorker_s *)callback_context); \
+	return cb_##name(NULL, ctx, pkt); \
+}
+
+VANC_DECODE_ORDERED_CB(AFD, struct klvanc_packet_afd_s)
+VANC_DECODE_ORDERED_CB(EIA_708B, struct klvanc_packet_eia_708b_s)
+VANC_DECODE_ORDERED_CB(EIA_608, struct klvanc_packet_eia_608_s)
+VANC_DECODE_ORDERED_CB(SCTE_104, struct klvanc_packet_scte_104_s)
+VANC_DECODE_ORDERED_CB(all, struct klvanc_packet_header_s)
+VANC_DECODE_ORDERED_CB(VANC_TYPE_KL_UINT64_COUNTER, struct klvanc_packet_kl_u64le_counter_s)
+VANC_DECODE_ORDERED_CB(SDP, struct klvanc_packet_sdp_s)
+VANC_DECODE_ORDERED_CB(SMPTE_12_2, struct klvanc_packet_smpte_12_2_s)
+VANC_DECODE_ORDERED_CB(SMPTE_2108_1, struct klvanc_packet_smpte_2108_1_s)
+
+static struct klvanc_callbacks_s orderedCallbacks =
+{
+	.afd                    = cbo_AFD,
+	.eia_708b               = cbo_EIA_708B,
+	.eia_608                = cbo_EIA_608,
+	.scte_104               = cbo_SCTE_104,
+	.all                    = cbo_all,
+	.kl_i64le_counter       = cbo_VANC_TYPE_KL_UINT64_COUNTER,
+	.sdp                    = cbo_SDP,
+	.smpte_12_2             = cbo_SMPTE_12_2,
+	.smpte_2108_1           = cbo_SMPTE_2108_1,
+};
+
+/* The caller and every worker pull batches of lines until the frame is exhausted. */
+static void vancDecodeNext(struct vancDecodePool_s *pool, struct vancDecodeWorker_s *w)
+{
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->nextLine < pool->lineCount) {
+		uint32_t first = pool->nextLine;
+		uint32_t last = first + VANC_DECODE_BATCH;
+		if (last > pool->lineCount)
+			last = pool->lineCount;
+		pool->nextLine = last;
+		pthread_mutex_unlock(&pool->mutex);
+
+		for (uint32_t i = first; i < last; i++) {
+			struct vancDecodeLine_s *l = &pool->lines[i];
+			w->current = i;
+			if (convert_colorspace_and_parse_vanc_ctx(w->ctx, l->buf, l->width, l->lineNr) && g_vancLineMapWarmup)
+				vancLineMapSeen(&g_vancLineMap, l->lineNr);
+
+			pthread_mutex_lock(&pool->mutex);
+			pool->done[i] = 1;
+			if (i == pool->nextOrdered) {
+				while (pool->nextOrdered < pool->lineCount && pool->done[pool->nextOrdered])
+					pool->nextOrdered++;
+				pthread_cond_broadcast(&pool->turnCond);
+			}
+			if (++pool->doneLines == pool->lineCount)
+				pthread_cond_broadcast(&pool->doneCond);
+			pthread_mutex_unlock(&pool->mutex);
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void *vancDecodeThread(void *p)
+{
+	struct vancDecodeWorker_s *w = (struct vancDecodeWorker_s *)p;
+	struct vancDecodePool_s *pool = w->pool;
+
+	while (1) {
+		pthread_mutex_lock(&pool->mutex);
+		while (!pool->terminate && (!pool->running || pool->nextLine >= pool->lineCount))
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		int terminate = pool->terminate;
+		pthread_mutex_unlock(&pool->mutex);
+		if (terminate)
+			break;
+
+		vancDecodeNext(pool, w);
+	}
+
+	return 0;
+}
+
+/* Queue a VBI line of the current frame, decoded by vancDecodeRun(). */
+static void vancDecodeLineAdd(struct vancDecodePool_s *pool, unsigned char *buf, unsigned int uiWidth, unsigned int lineNr)
+{
+	if (pool->lineCount == pool->lineAlloc) {
+		uint32_t count = pool->lineAlloc ? pool->lineAlloc * 2 : 64;
+		struct vancDecodeLine_s *lines = (struct vancDecodeLine_s *)realloc(pool->lines, count * sizeof(*lines));
+		if (!lines)
+			return;
+		pool->lines = lines;
+
+		uint8_t *done = (uint8_t *)realloc(pool->done, count);
+		if (!done)
+			return;
+		pool->done = done;
+		pool->lineAlloc = count;
+	}
+
+	struct vancDecodeLine_s *l = &pool->lines[pool->lineCount++];
+	l->buf = buf;
+	l->width = uiWidth;
+	l->lineNr = lineNr;
+}
+
+/* Decode every line queued for the frame, returns once all of their callbacks have run. */
+static void vancDecodeRun(struct vancDecodePool_s *pool)
+{
+	if (pool->lineCount == 0)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	memset(pool->done, 0, pool->lineCount);
+	pool->nextLine = 0;
+	pool->doneLines = 0;
+	pool->nextOrdered = 0;
+	pool->running = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	vancDecodeNext(pool, &pool->workers[0]);
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->doneLines < pool->lineCount)
+		pthread_cond_wait(&pool->doneCond, &pool->mutex);
+	pool->running = 0;
+	pool->lineCount = 0;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void vancDecodeFree(struct vancDecodePool_s *pool)
+{
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->terminate = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (int i = 0; i < pool->threadCount; i++) {
+		struct vancDecodeWorker_s *w = &pool->workers[i];
+		if (i > 0 && w->threadId)
+			pthread_join(w->threadId, NULL);
+		if (w->ctx)
+			klvanc_context_destroy(w->ctx);
+	}
+
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->cond);
+	pthread_cond_destroy(&pool->doneCond);
+	pthread_cond_destroy(&pool->turnCond);
+	free(pool->workers);
+	free(pool->lines);
+	free(pool->done);
+	free(pool);
+}
+
+static int vancDecodeAlloc(struct vancDecodePool_s **handle, int threads)
+{
+	struct vancDecodePool_s *pool = (struct vancDecodePool_s *)calloc(1, sizeof(*pool));
+	if (!pool)
+		return -1;
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pthread_cond_init(&pool->doneCond, NULL);
+	pthread_cond_init(&pool->turnCond, NULL);
+
+	pool->workers = (struct vancDecodeWorker_s *)calloc(threads, sizeof(struct vancDecodeWorker_s));
+	if (!pool->workers) {
+		vancDecodeFree(pool);
+		return -1;
+	}
+	pool->threadCount = threads;
+
+	for (int i = 0; i < threads; i++) {
+		struct vancDecodeWorker_s *w = &pool->workers[i];
+		w->pool = pool;
+		if (klvanc_context_create(&w->ctx) < 0) {
+			w->ctx = NULL;
+			vancDecodeFree(pool);
+			return -1;
+		}
+
+		/* Same settings as vanchdl. */
+		w->ctx->allow_bad_checksums = 1;
+		w->ctx->warn_on_decode_failure = 1;
+		w->ctx->verbose = g_verbose;
+		w->ctx->callbacks = &orderedCallbacks;
+		w->ctx->callback_context = w;
+
+		if (i > 0 && pthread_create(&w->threadId, 0, vancDecodeThread, w) != 0) {
+			w->threadId = 0;
+			vancDecodeFree(pool);
+			return -1;
+		}
+	}
+
+	*handle = pool;
+	return 0;
+}
+
 /* END - CALLBACKS for message notification */
 
 static void listDisplayModes()
@@ -2082,7 +3371,14 @@ static int usage(const char *progname, int status)
 		"    -I <filename>   Interpret and display input VANC filename (See -V)\n"
 		"    -R <filename>   RCWT caption output filename\n"
 		"    -k              Enable analysis of KL frame counters in video and VANC\n"
-		"    -l <linenr>     During -I parse, process a specific line# (def: 0 all)\n"
+		"    -l <filter>     Only convert and parse the given VBI lines and report the given packets, live and\n"
+		"                    with -I / -X. Comma separated terms, can be repeated:\n"
+		"                      9 or 9-20   accept these lines, otherwise all\n"
+		"                      0           accept all lines, Eg. to override an earlier -l\n"
+		"                      41/07       accept packets with this DID/SDID (hex), or 41/xx for any SDID,\n"
+		"                                  otherwise all. Also by name: afd scte104 hdr sdp atc eia708 eia608\n"
+		"                      !61/02      reject packets, Eg. '!eia608'\n"
+		"                    Eg. -l 9-13,scte104 (def: everything)\n"
 		"    -L              List available display modes\n"
 		"    -m <mode>       Force to capture in specified mode\n"
 		"                    Eg. Hi59 (1080i59), hp60 (1280x720p60) Hp60 (1080p60) (def: ntsc):\n"
@@ -2107,18 +3403,69 @@ static int usage(const char *progname, int status)
 #endif
 #if HAVE_LIBKLMONITORING_KLMONITORING_H
 		"    -S              Validate PRBS15 sequences are correct on all audio channels (def: disabled).\n"
+		"                    Runs on its own thread, counts word and bit errors, summary on SIGUSR1.\n"
 #endif
 		"    -x <filename>   Create a muxed audio+video+vanc output file.\n"
 		"    -ev             Exclude video from muxed output file.\n"
 		"    -ea             Exclude audio from muxed output file.\n"
 		"    -ed             Exclude data (vanc) from muxed output file.\n"
-		"    -X <filename>   Analyze a muxed audio+video+vanc input file.\n"
+		"    -q <MB>         Limit the muxed output writer queue to MB megabytes of memory (def: unlimited)\n"
+		"    -Q <frames>     Limit the muxed output writer queue to a number of queued frames (def: unlimited)\n"
+		"    -b              When the muxed output writer queue is full, stall capture until space is available\n"
+		"                    (def: drop the frame and report it in the SIGUSR1 stats)\n"
+		"    -r <MB>[,<N>]   Give muxed output video its own MB megabyte queue budget and drop video first when the\n"
+		"                    writer falls behind, keeping audio, vanc and timing. Past half the budget keep only\n"
+		"                    every Nth video frame. Drops are marked with gap records in the file.\n"
+		"                    Audio, vanc and timing are then never dropped, -q and -Q only stall them with -b.\n"
+		"    -G              Back the muxed output frame buffer pools with hugepages.\n"
+		"    -D              Write an uncompressed muxed output file with O_DIRECT, bypassing the page cache.\n"
+		"    -j <threads>    Compress a .gz muxed output file on this many threads (def: 0, single threaded)\n"
+		"    -W <threads>    Losslessly compress muxed output video on this many threads (def: 0, uncompressed)\n"
+		"                    The file is marked, older builds of this tool fail to read it rather than misparse it.\n"
+		"    -u <filename>   Append muxed output writer statistics (queue, latency and rate histograms) to\n"
+		"                    filename as a line of JSON, on SIGUSR1 and when capture stops.\n"
+		"    -E <mode>       Compact muxed output VANC, only keeping lines that carry ANC packets.\n"
+		"                    1 = whole lines, 2 = just the packets (def: 0, every line as captured)\n"
+		"                    The file is marked, older builds of this tool fail to read it rather than misparse it.\n"
+		"    -z <buffers>    Write muxed video and audio straight from the capture hardware buffers, holding\n"
+		"                    at most this many buffers. Copies when the limit is reached (def: 0, always copy)\n"
+		"                    With -a as well, both files write audio from the same buffer.\n"
+		"    -g <seconds>    Split -x and -a output files into segments of this duration, Eg. capture.000000.mx\n"
+		"    -o <MB>         Start a new -x and -a output segment once MB megabytes are written (before compression)\n"
+		"    -O <count>      Keep at most this many segments, deleting the oldest (def: 0, keep all)\n"
+		"    -F <pre>[,<post>]\n"
+		"                    Flight recorder, keep the last pre seconds of -x output in memory and only write\n"
+		"                    them, plus post seconds (def: pre), when an event occurs: SCTE-104, audio silence\n"
+		"                    (-Z), KL counter (-k) or PRBS15 (-S) discontinuities, or an input format change.\n"
+		"                    Each event is written to its own file, Eg. capture.000000.mx\n"
+		"    -J <MB>         Flight recorder memory (def: 1024)\n"
+		"    -X <filename>[@<start>[-<end>]]\n"
+		"                    Analyze a muxed audio+video+vanc input file, optionally only a range of frame\n"
+		"                    counters, or seconds from the start of the capture when suffixed with 's'.\n"
+		"                    Eg. capture.mx@2820s-2880s. Uses the capture.mx.idx index to seek when present.\n"
 		"    -Z <pair# 1-8>  Check for audio silence on the given audio pairs.\n"
 		"    -K <number>     audio samples ceiling before tripping silence alert (-Z). (def: 24)\n"
 		"    -T <dirname>    Save all vanc messages into dirname as a seperate unique file (16bit words).\n"
 		"    -Y <seconds>    Monitor SDK callback intervals and report to console periodically.\n"
 		"    -H              Monitor frame arrival intervals, attempt to measure SDI inputs that run less than realtime\n"
 		"                    Make sure you specify -m and force the video mode when using this feature\n"
+		"    -U <threads>    Convert and parse the VBI lines of each frame on this many threads, each with its own\n"
+		"                    klvanc context. Packets are still reported in line order. Not with -M. (def: 1)\n"
+		"    -y <frames>[,<interval>]\n"
+		"                    Learn which VBI lines carry ANC over the first <frames> frames, then only fetch and\n"
+		"                    parse those lines, with a full sweep of every line each <interval> frames to pick up\n"
+		"                    new ones. A packet on a line that has never carried ANC before can be missed until\n"
+		"                    the next sweep. Ignored while capturing VANC to file with -V. Stats on SIGUSR1.\n"
+		"                    (def: 0, every line of every frame, interval 300)\n"
+		"    -d              With -M, don't convert and parse a VBI line again while it's identical to the previous\n"
+		"                    frame, only count its packets again for the monitor. Packets on repeated lines aren't\n"
+		"                    reported or dumped again. Not with SMPTE 2038 packetization, -T or RCWT output.\n"
+		"    -w <frames>     Run each enabled analysis (-Z, -S, -N, -k, VANC parsing, -f, -V ..) on its own thread,\n"
+		"                    queueing up to this many frames to each. A stage that falls behind drops its own frames\n"
+		"                    rather than stalling capture, except -f and the VANC outputs (-V, RCWT captions, -T, -P),\n"
+		"                    which never drop, capture waits for them.\n"
+		"                    Each queued frame holds a capture hardware buffer, so keep it small, Eg. 4.\n"
+		"                    Per stage stats on SIGUSR1. (def: 0, analyze on the capture callback)\n"
 		"\n"
 		"Capture raw video and audio to file then playback. 1920x1080p30, 50 complete frames, PCM audio, 8bit mode:\n"
 		"    %s -mHp30 -n 50 -f video.raw -a audio.raw -p0\n"
@@ -2206,8 +3553,10 @@ static int _main(int argc, char *argv[])
 	ltn_histogram_alloc_video_defaults(&hist_format_change, "video format change");
 	memset(&g_asctx, 0, sizeof(g_asctx));
 
+	vanc_filter_init(&g_vancFilter);
+
 	int v;
-	while ((ch = getopt(argc, argv, "?h39c:Cs:f:a:A:Bm:n:p:t:vV:HI:i:K:l:LP:MNSx:X:R:e:T:Y:Z:k")) != -1) {
+	while ((ch = getopt(argc, argv, "?h39bc:Cds:f:a:A:BDF:g:GJ:j:m:n:o:O:p:q:Q:r:t:vV:HI:i:K:l:LP:MNSU:w:x:X:R:e:E:T:u:W:y:Y:Z:kz:")) != -1) {
 		switch (ch) {
 		case '9':
 			g_1080i2997_cadence_check = 1;
@@ -2215,7 +3564,6 @@ static int _main(int argc, char *argv[])
 #if HAVE_LIBKLMONITORING_KLMONITORING_H
 		case 'S':
 			g_monitor_prbs_audio_mode = 1;
-			g_prbs_initialized = 0;
 			break;
 #endif
 		case 'K':
@@ -2234,6 +3582,93 @@ static int _main(int argc, char *argv[])
 			break;
 		case 'X':
 			g_muxedInputFilename = optarg;
+			if (access(optarg, F_OK) != 0 && strrchr(optarg, '@')) {
+				char *range = strrchr(optarg, '@');
+				*range++ = 0;
+				if (parseMuxedInputRange(range) < 0) {
+					fprintf(stderr, "Invalid -X range '%s'\n", range);
+					exit(1);
+				}
+				g_muxedInputRange = 1;
+			}
+			break;
+		case 'q':
+			g_muxedQueueMaxBytes = (uint64_t)atoi(optarg) * 1048576;
+			break;
+		case 'Q':
+			g_muxedQueueMaxFrames = atoi(optarg);
+			break;
+		case 'r':
+			{
+				unsigned int mb = 0, n = 0;
+				if (sscanf(optarg, "%u,%u", &mb, &n) < 1 || mb == 0) {
+					fprintf(stderr, "Invalid -r budget '%s'\n", optarg);
+					exit(1);
+				}
+				g_muxedShedMaxBytes = (uint64_t)mb * 1048576;
+				g_muxedShedDecimation = n;
+			}
+			break;
+		case 'b':
+			g_muxedQueuePolicy = FWR_QUEUE_POLICY_BLOCK;
+			break;
+		case 'G':
+			g_muxedPoolHugepages = 1;
+			break;
+		case 'D':
+			g_muxedDirectIO = 1;
+			break;
+		case 'j':
+			g_muxedGzipWorkers = atoi(optarg);
+			break;
+		case 'W':
+			g_muxedVideoCodecThreads = atoi(optarg);
+			break;
+		case 'E':
+			g_muxedVancCompact = atoi(optarg);
+			break;
+		case 'u':
+			g_muxedStatsFilename = optarg;
+			break;
+		case 'z':
+			g_muxedZeroCopyMax = atoi(optarg);
+			break;
+		case 'w':
+			g_pipelineDepth = atoi(optarg);
+			break;
+		case 'U':
+			g_vancDecodeThreads = atoi(optarg);
+			break;
+		case 'd':
+			g_vancRepeatDetect = 1;
+			break;
+		case 'y':
+			{
+				unsigned int warmup = 0, sweep = g_vancLineMapSweep;
+				if (sscanf(optarg, "%u,%u", &warmup, &sweep) < 1 || warmup == 0 || sweep == 0) {
+					fprintf(stderr, "Invalid -y line map '%s'\n", optarg);
+					exit(1);
+				}
+				g_vancLineMapWarmup = warmup;
+				g_vancLineMapSweep = sweep;
+			}
+			break;
+		case 'g':
+			g_segmentSeconds = atoi(optarg);
+			break;
+		case 'F':
+			g_flightRecorder = 1;
+			g_flightRecorderPre = atoi(optarg);
+			g_flightRecorderPost = strchr(optarg, ',') ? atoi(strchr(optarg, ',') + 1) : g_flightRecorderPre;
+			break;
+		case 'J':
+			g_flightRecorderBytes = (uint64_t)atoi(optarg) * 1048576;
+			break;
+		case 'o':
+			g_segmentMaxBytes = (uint64_t)atoi(optarg) * 1048576;
+			break;
+		case 'O':
+			g_segmentKeep = atoi(optarg);
 			break;
 		case 'e':
 			switch (optarg[0]) {
@@ -2292,7 +3727,10 @@ static int _main(int argc, char *argv[])
 			portnr = atoi(optarg);
 			break;
 		case 'l':
-			g_linenr = atoi(optarg);
+			if (vanc_filter_add(&g_vancFilter, optarg) < 0) {
+				fprintf(stderr, "Invalid -l filter '%s'\n", optarg);
+				exit(1);
+			}
 			break;
 		case 'L':
 			wantDisplayModes = true;
@@ -2388,6 +3826,13 @@ static int _main(int argc, char *argv[])
 		goto bail;
 	}
 
+	vanc_filter_compile(&g_vancFilter);
+	if (g_vancFilter.lineTerms || g_vancFilter.packetFiltered) {
+		char desc[256];
+		vanc_filter_describe(&g_vancFilter, desc, sizeof(desc));
+		printf("VANC filter: %s\n", desc);
+	}
+
 #if ENABLE_NIELSEN
 	if (g_enable_nielsen) {
 		for (unsigned int i = 0; i < g_audioChannels / 2; i++) {
@@ -2503,6 +3948,46 @@ static int _main(int argc, char *argv[])
 			fprintf(stderr, "Could not open muxed output file \"%s\"\n", g_muxedOutputFilename);
 			goto bail;
 		}
+		fwr_session_queue_limits_set(muxedSession, g_muxedQueueMaxBytes, g_muxedQueueMaxFrames, g_muxedQueuePolicy);
+		if (g_muxedShedMaxBytes)
+			fwr_session_shed_set(muxedSession, g_muxedShedMaxBytes, g_muxedShedDecimation);
+		if (g_muxedDirectIO && fwr_session_direct_io_set(muxedSession, 0) < 0) {
+			fprintf(stderr, "Warning: O_DIRECT not available for \"%s\", using buffered writes\n", g_muxedOutputFilename);
+		}
+		if (g_muxedGzipWorkers > 0 && fwr_session_gzip_workers_set(muxedSession, g_muxedGzipWorkers) < 0) {
+			fprintf(stderr, "Warning: parallel compression not available for \"%s\", compressing on a single thread\n", g_muxedOutputFilename);
+		}
+		if (g_muxedVideoCodecThreads > 0 && fwr_session_video_codec_set(muxedSession, g_muxedVideoCodecThreads) < 0) {
+			fprintf(stderr, "Warning: lossless video compression not available for \"%s\"\n", g_muxedOutputFilename);
+		}
+		if (g_muxedVancCompact && fwr_session_vanc_compact_set(muxedSession, g_muxedVancCompact) < 0) {
+			fprintf(stderr, "Invalid -E VANC mode %d, expected 1 or 2\n", g_muxedVancCompact);
+			goto bail;
+		}
+		if (g_muxedStatsFilename) {
+			g_muxedStatsFd = open(g_muxedStatsFilename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+			if (g_muxedStatsFd < 0) {
+				fprintf(stderr, "Could not open writer statistics file \"%s\"\n", g_muxedStatsFilename);
+				goto bail;
+			}
+		}
+
+		if (g_flightRecorder && fwr_session_flight_recorder_set(muxedSession, g_flightRecorderPre, g_flightRecorderPost, g_flightRecorderBytes) < 0) {
+			fprintf(stderr, "Could not start a flight recorder for \"%s\", needs an uncompressed file without -D\n", g_muxedOutputFilename);
+			goto bail;
+		}
+
+		/* Flight recorder dumps aren't indexed, or segmented. */
+		char indexFilename[PATH_MAX];
+		snprintf(indexFilename, sizeof(indexFilename), "%s.idx", g_muxedOutputFilename);
+		if (!g_flightRecorder && fwr_session_index_set(muxedSession, indexFilename) < 0) {
+			fprintf(stderr, "Warning: unable to index \"%s\"\n", g_muxedOutputFilename);
+		}
+		if (!g_flightRecorder && (g_segmentSeconds || g_segmentMaxBytes) &&
+			fwr_session_segment_set(muxedSession, g_segmentSeconds, g_segmentMaxBytes, g_segmentKeep) < 0) {
+			fprintf(stderr, "Could not segment muxed output file \"%s\"\n", g_muxedOutputFilename);
+			goto bail;
+		}
 	}
 
 	if (g_audioOutputFilename != NULL) {
@@ -2510,6 +3995,11 @@ static int _main(int argc, char *argv[])
 			fprintf(stderr, "Could not open audio output file \"%s\"\n", g_audioOutputFilename);
 			goto bail;
 		}
+		if ((g_segmentSeconds || g_segmentMaxBytes) &&
+			fwr_session_segment_set(writeSession, g_segmentSeconds, g_segmentMaxBytes, g_segmentKeep) < 0) {
+			fprintf(stderr, "Could not segment audio output file \"%s\"\n", g_audioOutputFilename);
+			goto bail;
+		}
 	}
 
 	if (g_vancOutputFilename != NULL) {
@@ -2540,6 +4030,47 @@ static int _main(int argc, char *argv[])
 		goto bail;
 	}
 
+	/* Resized from VideoInputFormatChanged() if the input turns out to be something else. */
+	if (muxedSession) {
+		const struct blackmagic_format_s *fmt = blackmagic_getFormatByMode(selectedDisplayMode);
+		if (fmt)
+			muxedSessionPoolsAlloc(fmt->callback_width, fmt->callback_height);
+	}
+
+	/* The curses monitor reads the vanchdl packet cache, so it needs every line parsed there. */
+	if (g_vancDecodeThreads > 1 && g_monitor_mode) {
+		fprintf(stderr, "Warning: -U isn't supported with -M, decoding VANC on a single thread\n");
+	} else
+	if (g_vancDecodeThreads > 1 && vancDecodeAlloc(&g_vancDecodePool, g_vancDecodeThreads) < 0) {
+		fprintf(stderr, "Warning: unable to start %d VANC decode threads, decoding on a single thread\n", g_vancDecodeThreads);
+	}
+
+	/* Repeats are only accounted for in the packet cache, which only the monitor keeps. */
+	if (g_vancRepeatDetect && !g_monitor_mode) {
+		fprintf(stderr, "Warning: -d needs the -M monitor, parsing every line\n");
+	} else
+	/* Those outputs need every packet of every frame. */
+	if (g_vancRepeatDetect && (g_packetizeSMPTE2038 || g_vancOutputDir || g_rcwtOutputFilename)) {
+		fprintf(stderr, "Warning: -d isn't supported with SMPTE 2038 packetization, -T or RCWT output, parsing every line\n");
+	} else
+	if (g_vancRepeatDetect) {
+		g_vancRepeat.lines = (struct vancRepeatLine_s *)calloc(VANC_REPEAT_LINES, sizeof(struct vancRepeatLine_s));
+		if (!g_vancRepeat.lines)
+			fprintf(stderr, "Warning: unable to allocate VANC repeat detection, parsing every line\n");
+	}
+
+#if HAVE_LIBKLMONITORING_KLMONITORING_H
+	if (g_monitor_prbs_audio_mode && prbs15_check_alloc(&g_prbs, prbsNext) < 0) {
+		fprintf(stderr, "Unable to allocate the PRBS15 validator\n");
+		goto bail;
+	}
+#endif
+
+	if (pipelineStart() < 0) {
+		fprintf(stderr, "Could not start the analysis pipeline\n");
+		goto bail;
+	}
+
 	result = deckLinkInput->StartStreams();
 	if (result != S_OK) {
 		fprintf(stderr, "Failed to start stream. Is another application using the card?\n");
@@ -2561,20 +4092,46 @@ static int _main(int argc, char *argv[])
 	/* All Okay. */
 	exitStatus = 0;
 
-	/* Block main thread until signal occurs */
+	/* Block main thread until signal occurs, waking to print stats when asked. */
 	pthread_mutex_lock(&sleepMutex);
-	while (g_shutdown == 0)
-		pthread_cond_wait(&sleepCond, &sleepMutex);
+	while (g_shutdown == 0) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100 * 1000 * 1000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&sleepCond, &sleepMutex, &ts);
+
+		pthread_mutex_unlock(&sleepMutex);
+		statsRequestService();
+		pthread_mutex_lock(&sleepMutex);
+	}
 	pthread_mutex_unlock(&sleepMutex);
 
-	while (g_shutdown != 2)
+	while (g_shutdown != 2) {
+		statsRequestService();
 		usleep(50 * 1000);
+	}
 
 	fprintf(stdout, "Stopping Capture\n");
 	result = deckLinkInput->StopStreams();
 	if (result != S_OK) {
 		fprintf(stderr, "Failed to start stream. Is another application using the card?\n");
 	}
+	pipelineStop();
+	vancDecodeFree(g_vancDecodePool);
+	g_vancDecodePool = NULL;
+	vancLineMapStatsPrint(STDOUT_FILENO);
+	vancRepeatStatsPrint(STDOUT_FILENO);
+	prbsStatsPrint(STDOUT_FILENO);
+
+	if (muxedSession) {
+		fwr_session_queue_stats_print(STDOUT_FILENO, muxedSession, g_muxedOutputFilename);
+		if (g_muxedStatsFd >= 0)
+			fwr_session_queue_stats_print_json(g_muxedStatsFd, muxedSession, g_muxedOutputFilename);
+	}
 
 #if HAVE_CURSES_H
 	vanc_monitor_stats_dump();
@@ -2596,6 +4153,13 @@ static int _main(int argc, char *argv[])
 #endif
 
 bail:
+	pipelineStop();
+	vancDecodeFree(g_vancDecodePool);
+	g_vancDecodePool = NULL;
+	free(g_vancRepeat.lines);
+	g_vancRepeat.lines = NULL;
+	prbs15_check_free(g_prbs);
+	g_prbs = NULL;
 
 	if (videoOutputFile)
 		close(videoOutputFile);
@@ -2605,6 +4169,8 @@ bail:
 		fwr_session_file_close(writeSession);
 	if (muxedSession)
 		fwr_session_file_close(muxedSession);
+	if (g_muxedStatsFd >= 0)
+		close(g_muxedStatsFd);
 	if (vancOutputFile)
 		close(vancOutputFile);
 	if (rcwtOutputFile)
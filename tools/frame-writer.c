@@ -19,8 +19,13 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* O_DIRECT */
+#endif
+
 #include <libklvanc/vanc.h>
 #include "frame-writer.h"
+#include "v210codec.h"
 
 //#include "core-private.h"
 
@@ -28,526 +33,4335 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
 #define LOCAL_DEBUG 0
 
-extern int usleep(uint32_t usecs);
+/* Record output staging.
+ * Uncompressed files: small record fields (type codes, headers, footers) are copied
+ * into a stage buffer, payloads are referenced in place, and the whole lot goes to
+ * disk with a single writev() per flush.
+ * Compressed files: records are gathered into one large contiguous buffer so zlib
+ * sees a few big gzfwrite() calls instead of four tiny ones per record.
+ */
+#define FWR_IOV_MAX          1024
+#define FWR_STAGE_INLINE_MAX 256                 /* Fields up to this size are copied, not referenced. */
+#define FWR_STAGE_RAW_BYTES  (64 * 1024)
+#define FWR_STAGE_GZ_BYTES   (1024 * 1024)
+#define FWR_FLUSH_BYTES      (4 * 1024 * 1024)   /* Writer thread flushes once this much is pending. */
 
-static int fwr_writer_dequeue(struct fwr_session_s *session, void **ptr, int *type);
+/* O_DIRECT output.
+ * Records are copied into one of two aligned buffers. Once a buffer fills it is handed
+ * to a dedicated I/O thread, and the writer thread carries on filling the other one.
+ * The file only ever sees whole, aligned buffers; the tail is padded on close and the
+ * file truncated back to its logical length.
+ */
+#define FWR_DIRECT_ALIGN        4096
+#define FWR_DIRECT_BUFFER_BYTES (8 * 1024 * 1024)
 
-static void *fwr_writer_threadfunc(void *p)
+static void *fwr_direct_threadfunc(void *p)
 {
 	struct fwr_session_s *s = (struct fwr_session_s *)p;
 
-	s->thread_terminate = 0;
-	s->thread_running = 1;
-	while (!s->thread_terminate) {
+	pthread_mutex_lock(&s->directMutex);
+	while (1) {
+		while (!s->directPending && !s->directTerminate)
+			pthread_cond_wait(&s->directCond, &s->directMutex);
+		if (!s->directPending)
+			break;
 
-		usleep(100 * 1000);
+		uint8_t *buf = s->directPending;
+		size_t len = s->directPendingLen;
+		pthread_mutex_unlock(&s->directMutex);
 
-		while (1 && !s->thread_terminate) {
-			/* Wait on a timeout condition. */
-			/* Write frames to disk. */
-			/* Release frames. */
-			void *frame;
-			int type;
-			if (fwr_writer_dequeue(s, &frame, &type) < 0)
+		int err = 0;
+		while (len) {
+			ssize_t r = write(s->fd, buf, len);
+			if (r < 0) {
+				if (errno == EINTR)
+					continue;
+				err = 1;
 				break;
+			}
+			buf += r;
+			len -= r;
+			if (len) {
+				/* A short write leaves us misaligned, finish the file through the page cache. */
+				fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) & ~O_DIRECT);
+			}
+		}
 
-			/* Do something with the data then clean up. */
+		pthread_mutex_lock(&s->directMutex);
+		if (err)
+			s->directError = 1;
+		s->directPending = NULL;
+		pthread_cond_broadcast(&s->directCond);
+	}
+	pthread_mutex_unlock(&s->directMutex);
 
-			switch (type) {
-			case FWR_FRAME_TIMING: /* timing */
-				fwr_timing_frame_write(s, (struct fwr_header_timing_s *)frame);
-				fwr_timing_frame_free(s, (struct fwr_header_timing_s *)frame);
-				break;
-			case FWR_FRAME_VIDEO:
-				fwr_video_frame_write(s, (struct fwr_header_video_s *)frame);
-				fwr_video_frame_free(s, (struct fwr_header_video_s *)frame);
+	return NULL;
+}
+
+/* Hand the current fill buffer to the I/O thread and swap to the other one.
+ * Waits if the I/O thread is still busy with the previous buffer.
+ */
+static void fwr_direct_submit(struct fwr_session_s *s, size_t len)
+{
+	pthread_mutex_lock(&s->directMutex);
+	if (s->directPending)
+		s->directStalls++;
+	while (s->directPending)
+		pthread_cond_wait(&s->directCond, &s->directMutex);
+	s->directPending = s->directBuffer[s->directFill];
+	s->directPendingLen = len;
+	pthread_cond_broadcast(&s->directCond);
+	pthread_mutex_unlock(&s->directMutex);
+
+	s->directFill ^= 1;
+	s->directUsed = 0;
+}
+
+static void fwr_direct_stage(struct fwr_session_s *s, const void *buf, size_t len)
+{
+	const uint8_t *src = buf;
+
+	while (len) {
+		size_t n = s->directBufferSize - s->directUsed;
+		if (n > len)
+			n = len;
+		memcpy(s->directBuffer[s->directFill] + s->directUsed, src, n);
+		s->directUsed += n;
+		s->directBytes += n;
+		src += n;
+		len -= n;
+
+		if (s->directUsed == s->directBufferSize)
+			fwr_direct_submit(s, s->directBufferSize);
+	}
+}
+
+/* Write out the partial buffer, wait for the I/O thread to go idle and trim the
+ * file back to its logical length. The I/O thread stays up for the next file.
+ */
+static int fwr_direct_finish(struct fwr_session_s *s)
+{
+	int ret = 0;
+
+	if (s->directUsed) {
+		size_t len = (s->directUsed + s->directAlign - 1) & ~(s->directAlign - 1);
+		memset(s->directBuffer[s->directFill] + s->directUsed, 0, len - s->directUsed);
+		fwr_direct_submit(s, len);
+	}
+
+	pthread_mutex_lock(&s->directMutex);
+	while (s->directPending)
+		pthread_cond_wait(&s->directCond, &s->directMutex);
+	if (s->directError)
+		ret = -1;
+	pthread_mutex_unlock(&s->directMutex);
+
+	/* Drop the tail padding. */
+	if (ftruncate(s->fd, s->directBytes) < 0)
+		ret = -1;
+
+	return ret;
+}
+
+static int fwr_direct_close(struct fwr_session_s *s)
+{
+	int ret = fwr_direct_finish(s);
+
+	pthread_mutex_lock(&s->directMutex);
+	s->directTerminate = 1;
+	pthread_cond_broadcast(&s->directCond);
+	pthread_mutex_unlock(&s->directMutex);
+	pthread_join(s->directThreadId, NULL);
+
+	pthread_cond_destroy(&s->directCond);
+	pthread_mutex_destroy(&s->directMutex);
+	free(s->directBuffer[0]);
+	free(s->directBuffer[1]);
+	s->direct = 0;
+
+	return ret;
+}
+
+#if HAVE_ZLIB
+/* Block parallel gzip.
+ * The record stream is cut into fixed size blocks, each compressed by a worker thread
+ * into an independent gzip member. A single output thread writes the members in order.
+ * Concatenated members are a valid gzip stream, gzread() walks straight through them.
+ */
+#define FWR_GZ_BLOCK_BYTES (1024 * 1024)
+#define FWR_GZ_LEVEL       1 /* Matches the single threaded "wb1" mode. */
+
+struct fwr_gz_block_s
+{
+	struct xorg_list list;
+	uint64_t seq;
+	uint8_t *in;
+	size_t inLen;
+	uint8_t *out;
+	size_t outSize;
+	size_t outLen;
+	int error;
+};
+
+struct fwr_gzpool_s
+{
+	int fd;
+	int workerCount;
+	pthread_t *workers;
+	pthread_t outputThreadId;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;        /* Broadcast on every state change, there are only a handful of threads. */
+	struct xorg_list freeBlocks;
+	struct xorg_list todo;      /* Filled, waiting for a worker. */
+	struct xorg_list done;      /* Compressed, waiting for the output thread. Unordered. */
+	uint32_t blockCount;
+	uint32_t blockMax;
+	uint64_t nextSeq;
+	uint64_t nextWrite;
+	int terminate;
+	int error;
+
+	struct fwr_gz_block_s *fill; /* Owned by the writer thread. */
+
+	/* Protected by mutex */
+	uint64_t *memberOffsets;     /* File offset of each blocks gzip member, indexed by seq. */
+	uint64_t memberAlloc;
+	uint64_t fileBytes;          /* Written to the current fd, see fwr_gzpool_switch(). */
+	uint64_t blocks;
+	uint64_t bytesIn;
+	uint64_t bytesOut;
+	uint64_t stalls;             /* Times the writer thread waited for a free block. */
+};
+
+static void *fwr_gzpool_workerfunc(void *p)
+{
+	struct fwr_gzpool_s *gp = (struct fwr_gzpool_s *)p;
+	z_stream z;
+	int zok;
+
+	memset(&z, 0, sizeof(z));
+	zok = deflateInit2(&z, FWR_GZ_LEVEL, Z_DEFLATED, 15 + 16 /* gzip wrapper */, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+
+	pthread_mutex_lock(&gp->mutex);
+	while (1) {
+		while (xorg_list_is_empty(&gp->todo) && !gp->terminate)
+			pthread_cond_wait(&gp->cond, &gp->mutex);
+		if (xorg_list_is_empty(&gp->todo))
+			break;
+
+		struct fwr_gz_block_s *b = xorg_list_first_entry(&gp->todo, struct fwr_gz_block_s, list);
+		xorg_list_del(&b->list);
+		pthread_mutex_unlock(&gp->mutex);
+
+		b->error = 1;
+		if (zok && deflateReset(&z) == Z_OK) {
+			z.next_in = b->in;
+			z.avail_in = b->inLen;
+			z.next_out = b->out;
+			z.avail_out = b->outSize;
+			if (deflate(&z, Z_FINISH) == Z_STREAM_END) {
+				b->outLen = b->outSize - z.avail_out;
+				b->error = 0;
+			}
+		}
+
+		pthread_mutex_lock(&gp->mutex);
+		xorg_list_append(&b->list, &gp->done);
+		pthread_cond_broadcast(&gp->cond);
+	}
+	pthread_mutex_unlock(&gp->mutex);
+
+	if (zok)
+		deflateEnd(&z);
+
+	return NULL;
+}
+
+static void *fwr_gzpool_outputfunc(void *p)
+{
+	struct fwr_gzpool_s *gp = (struct fwr_gzpool_s *)p;
+
+	pthread_mutex_lock(&gp->mutex);
+	while (1) {
+		struct fwr_gz_block_s *b = NULL, *e;
+		xorg_list_for_each_entry(e, &gp->done, list) {
+			if (e->seq == gp->nextWrite) {
+				b = e;
 				break;
-			case FWR_FRAME_AUDIO:
-				fwr_pcm_frame_write(s, (struct fwr_header_audio_s *)frame);
-				fwr_pcm_frame_free(s, (struct fwr_header_audio_s *)frame);
+			}
+		}
+		if (!b) {
+			if (gp->terminate && gp->nextWrite == gp->nextSeq)
 				break;
-			case FWR_FRAME_VANC:
-				fwr_vanc_frame_write(s, (struct fwr_header_vanc_s *)frame);
-				fwr_vanc_frame_free(s, (struct fwr_header_vanc_s *)frame);
+			pthread_cond_wait(&gp->cond, &gp->mutex);
+			continue;
+		}
+		xorg_list_del(&b->list);
+		pthread_mutex_unlock(&gp->mutex);
+
+		int err = b->error;
+		uint8_t *buf = b->out;
+		size_t len = err ? 0 : b->outLen;
+		while (len) {
+			ssize_t r = write(gp->fd, buf, len);
+			if (r < 0) {
+				if (errno == EINTR)
+					continue;
+				err = 1;
 				break;
 			}
+			buf += r;
+			len -= r;
+		}
 
+		pthread_mutex_lock(&gp->mutex);
+		if (err)
+			gp->error = 1;
+		if (b->seq >= gp->memberAlloc) {
+			uint64_t n = gp->memberAlloc ? gp->memberAlloc * 2 : 4096;
+			uint64_t *o = realloc(gp->memberOffsets, n * sizeof(uint64_t));
+			if (o) {
+				gp->memberOffsets = o;
+				gp->memberAlloc = n;
+			}
 		}
+		if (b->seq < gp->memberAlloc)
+			gp->memberOffsets[b->seq] = gp->fileBytes;
+		gp->blocks++;
+		gp->bytesIn += b->inLen;
+		gp->bytesOut += b->outLen;
+		gp->fileBytes += b->outLen;
+		gp->nextWrite++;
+		xorg_list_append(&b->list, &gp->freeBlocks);
+		pthread_cond_broadcast(&gp->cond);
 	}
-	s->thread_complete = 1;
-	s->thread_running = 0;
-	pthread_exit(0);
+	pthread_mutex_unlock(&gp->mutex);
+
+	return NULL;
 }
 
-int fwr_session_file_open(const char *filename, int writeMode, struct fwr_session_s **session)
+static void fwr_gzpool_block_free(struct fwr_gz_block_s *b)
 {
-	struct fwr_session_s *s = calloc(1, sizeof(*s));
-	if (!s)
-		return -1;
+	free(b->in);
+	free(b->out);
+	free(b);
+}
 
-	if (writeMode) {
-		/* If file ends in .gz, create compressed file with "Best Performance",
-		   otherwise open in transparent mode where gzwrite() is a passthrough */
+static struct fwr_gz_block_s *fwr_gzpool_block_alloc(void)
+{
+	struct fwr_gz_block_s *b = calloc(1, sizeof(*b));
+	if (!b)
+		return NULL;
 
-		if (strlen(filename) > 3 && strcmp(&filename[strlen(filename) - 3] , ".gz") == 0) {
-#if !HAVE_ZLIB
-			fprintf(stderr, "Error: Cannot create gzip files because not compiled with zlib\n");
+	/* Worst case deflate expansion, plus the gzip header and trailer. */
+	b->outSize = compressBound(FWR_GZ_BLOCK_BYTES) + 64;
+	b->in = malloc(FWR_GZ_BLOCK_BYTES);
+	b->out = malloc(b->outSize);
+	if (!b->in || !b->out) {
+		fwr_gzpool_block_free(b);
+		return NULL;
+	}
+
+	return b;
+}
+
+/* Writer thread, obtain an empty block to fill. Blocks are allocated on demand up to
+ * blockMax, after which we wait for the output thread to recycle one.
+ */
+static struct fwr_gz_block_s *fwr_gzpool_block_get(struct fwr_gzpool_s *gp)
+{
+	struct fwr_gz_block_s *b = NULL;
+
+	pthread_mutex_lock(&gp->mutex);
+	if (xorg_list_is_empty(&gp->freeBlocks) && gp->blockCount >= gp->blockMax)
+		gp->stalls++;
+	while (xorg_list_is_empty(&gp->freeBlocks) && gp->blockCount >= gp->blockMax)
+		pthread_cond_wait(&gp->cond, &gp->mutex);
+	if (!xorg_list_is_empty(&gp->freeBlocks)) {
+		b = xorg_list_first_entry(&gp->freeBlocks, struct fwr_gz_block_s, list);
+		xorg_list_del(&b->list);
+	} else if ((b = fwr_gzpool_block_alloc())) {
+		gp->blockCount++;
+	}
+	pthread_mutex_unlock(&gp->mutex);
+
+	if (b)
+		b->inLen = 0;
+
+	return b;
+}
+
+static void fwr_gzpool_submit(struct fwr_gzpool_s *gp)
+{
+	struct fwr_gz_block_s *b = gp->fill;
+	gp->fill = NULL;
+
+	pthread_mutex_lock(&gp->mutex);
+	b->seq = gp->nextSeq++;
+	xorg_list_append(&b->list, &gp->todo);
+	pthread_cond_broadcast(&gp->cond);
+	pthread_mutex_unlock(&gp->mutex);
+}
+
+static int fwr_gzpool_stage(struct fwr_gzpool_s *gp, const void *buf, size_t len)
+{
+	const uint8_t *src = buf;
+
+	while (len) {
+		if (!gp->fill && !(gp->fill = fwr_gzpool_block_get(gp)))
 			return -1;
-#else
-			s->fh = gzopen(filename, "wb1");
-#endif
-		} else {
-			s->fh = gzopen(filename, "wbT");
-		}
+
+		size_t n = FWR_GZ_BLOCK_BYTES - gp->fill->inLen;
+		if (n > len)
+			n = len;
+		memcpy(gp->fill->in + gp->fill->inLen, src, n);
+		gp->fill->inLen += n;
+		src += n;
+		len -= n;
+
+		if (gp->fill->inLen == FWR_GZ_BLOCK_BYTES)
+			fwr_gzpool_submit(gp);
+	}
+
+	return 0;
+}
+
+/* Compress any partial block and wait for everything to reach the disk, then close the
+ * file and carry on with the next one on fd. Block numbering restarts with the file,
+ * ownership of the member offset table passes to the caller, if requested.
+ */
+static int fwr_gzpool_switch(struct fwr_gzpool_s *gp, int fd, uint64_t **memberOffsets, uint64_t *memberCount)
+{
+	int ret;
+
+	if (gp->fill && gp->fill->inLen)
+		fwr_gzpool_submit(gp);
+
+	pthread_mutex_lock(&gp->mutex);
+	while (gp->nextWrite != gp->nextSeq)
+		pthread_cond_wait(&gp->cond, &gp->mutex);
+	ret = gp->error ? -1 : 0;
+
+	if (close(gp->fd) < 0)
+		ret = -1;
+	gp->fd = fd;
+
+	if (memberOffsets) {
+		*memberOffsets = gp->memberOffsets;
+		*memberCount = gp->memberAlloc < gp->nextWrite ? gp->memberAlloc : gp->nextWrite;
 	} else {
-#if !HAVE_ZLIB
-		if (strlen(filename) > 3 && strcmp(&filename[strlen(filename) - 3] , ".gz") == 0) {
-			fprintf(stderr, "Error: Cannot read gzip files because not compiled with zlib\n");
-			return -1;
-		}
-#endif
-		s->fh = gzopen(filename, "rb");
+		free(gp->memberOffsets);
 	}
+	gp->memberOffsets = NULL;
+	gp->memberAlloc = 0;
+	gp->nextSeq = 0;
+	gp->nextWrite = 0;
+	gp->fileBytes = 0;
+	pthread_mutex_unlock(&gp->mutex);
 
-	if (!s->fh) {
-		free(s);
-		return -1;
+	return ret;
+}
+
+/* Compress any partial block, wait for everything to reach the disk and tear down.
+ * Ownership of the member offset table passes to the caller, if requested.
+ */
+static int fwr_gzpool_close(struct fwr_gzpool_s *gp, uint64_t **memberOffsets, uint64_t *memberCount)
+{
+	int ret;
+
+	if (gp->fill && gp->fill->inLen)
+		fwr_gzpool_submit(gp);
+
+	pthread_mutex_lock(&gp->mutex);
+	gp->terminate = 1;
+	pthread_cond_broadcast(&gp->cond);
+	pthread_mutex_unlock(&gp->mutex);
+
+	for (int i = 0; i < gp->workerCount; i++)
+		pthread_join(gp->workers[i], NULL);
+	pthread_join(gp->outputThreadId, NULL);
+
+	ret = gp->error ? -1 : 0;
+
+	if (gp->fill)
+		fwr_gzpool_block_free(gp->fill);
+	while (!xorg_list_is_empty(&gp->freeBlocks)) {
+		struct fwr_gz_block_s *b = xorg_list_first_entry(&gp->freeBlocks, struct fwr_gz_block_s, list);
+		xorg_list_del(&b->list);
+		fwr_gzpool_block_free(b);
+	}
+	if (close(gp->fd) < 0)
+		ret = -1;
+	if (memberOffsets) {
+		*memberOffsets = gp->memberOffsets;
+		*memberCount = gp->memberAlloc < gp->nextWrite ? gp->memberAlloc : gp->nextWrite;
+	} else {
+		free(gp->memberOffsets);
 	}
+	pthread_cond_destroy(&gp->cond);
+	pthread_mutex_destroy(&gp->mutex);
+	free(gp->workers);
+	free(gp);
 
-	s->writeMode = writeMode;
-	if (writeMode) {
-		xorg_list_init(&s->list);
-		pthread_mutex_init(&s->listMutex, NULL);
-		pthread_condattr_init(&s->condAttr);
-		pthread_cond_init(&s->cond, &s->condAttr);
+	return ret;
+}
+#endif /* HAVE_ZLIB */
 
-		pthread_create(&s->writerThreadId, 0, fwr_writer_threadfunc, s);
+/* Compressed output, the gzFile is attached to the descriptor on first use so that
+ * fwr_session_gzip_workers_set() can still take the file over.
+ */
+static gzFile fwr_session_gzfile(struct fwr_session_s *s)
+{
+	if (!s->fh && s->gzfd >= 0) {
+		s->fh = gzdopen(s->gzfd, "wb1");
+		if (s->fh) {
+			s->gzfd = -1;
+			gzbuffer(s->fh, FWR_STAGE_GZ_BYTES);
+		}
 	}
 
-	*session = s;
+	return s->fh;
+}
+
+static int fwr_session_flush(struct fwr_session_s *s)
+{
+	int ret = 0;
+
+	if (s->direct) {
+		/* Records are copied and written in whole buffers, there is nothing to flush here. */
+		pthread_mutex_lock(&s->directMutex);
+		ret = s->directError ? -1 : 0;
+		pthread_mutex_unlock(&s->directMutex);
+	} else if (s->fd >= 0) {
+		struct iovec *iov = s->iov;
+		int cnt = s->iovcnt;
+		while (cnt > 0) {
+			ssize_t r = writev(s->fd, iov, cnt);
+			if (r < 0) {
+				if (errno == EINTR)
+					continue;
+				ret = -1;
+				break;
+			}
+			/* Step over whatever the kernel took, deal with partial writes. */
+			while (cnt && (size_t)r >= iov->iov_len) {
+				r -= iov->iov_len;
+				iov++;
+				cnt--;
+			}
+			if (cnt) {
+				iov->iov_base = (uint8_t *)iov->iov_base + r;
+				iov->iov_len -= r;
+			}
+		}
+		s->iovcnt = 0;
+#if HAVE_ZLIB
+	} else if (s->gzpool) {
+		/* Blocks are queued to the compressors as they fill. */
+		pthread_mutex_lock(&s->gzpool->mutex);
+		ret = s->gzpool->error ? -1 : 0;
+		pthread_mutex_unlock(&s->gzpool->mutex);
+#endif
+	} else if (s->stageUsed) {
+		gzFile fh = fwr_session_gzfile(s);
+		if (!fh || gzfwrite(s->stage, 1, s->stageUsed, fh) != s->stageUsed)
+			ret = -1;
+	}
+
+	s->stageUsed = 0;
+	s->pendingBytes = 0;
+
+	return ret;
+}
+
+/* Does the writer thread need to flush before staging any more records? */
+static int fwr_session_stage_full(struct fwr_session_s *s)
+{
+	if (s->pendingBytes >= FWR_FLUSH_BYTES)
+		return 1;
+	if (s->fd >= 0 && s->iovcnt > FWR_IOV_MAX - 8)
+		return 1;
+	if (s->stageUsed + (4 * FWR_STAGE_INLINE_MAX) > s->stageSize)
+		return 1;
+
 	return 0;
 }
 
-int fwr_pcm_frame_read(struct fwr_session_s *session, struct fwr_header_audio_s **frame)
+static int fwr_session_stage_raw(struct fwr_session_s *s, const void *buf, size_t len)
 {
-	struct fwr_header_audio_s *f = malloc(sizeof(*f));
-	if (!f)
-		return -1;
+	if (len <= FWR_STAGE_INLINE_MAX) {
+		if (s->stageUsed + len > s->stageSize || s->iovcnt == FWR_IOV_MAX) {
+			if (fwr_session_flush(s) < 0)
+				return -1;
+		}
 
-	if (gzfread(f, 1, fwr_header_audio_size_pre, session->fh) != fwr_header_audio_size_pre) {
-		free(f);
-		return -1;
+		uint8_t *dst = s->stage + s->stageUsed;
+		memcpy(dst, buf, len);
+		s->stageUsed += len;
+
+		/* Consecutive small fields, Eg. a footer followed by the next records header,
+		 * share a single iovec.
+		 */
+		if (s->iovcnt && (uint8_t *)s->iov[s->iovcnt - 1].iov_base + s->iov[s->iovcnt - 1].iov_len == dst) {
+			s->iov[s->iovcnt - 1].iov_len += len;
+			return 0;
+		}
+		buf = dst;
+	} else if (s->iovcnt == FWR_IOV_MAX) {
+		if (fwr_session_flush(s) < 0)
+			return -1;
 	}
 
-	f->ptr = malloc(f->bufferLengthBytes);
-	if (!f->ptr) {
-		free(f);
-		return -1;
+	s->iov[s->iovcnt].iov_base = (void *)buf;
+	s->iov[s->iovcnt].iov_len = len;
+	s->iovcnt++;
+
+	return 0;
+}
+
+static int fwr_session_stage_gz(struct fwr_session_s *s, const void *buf, size_t len)
+{
+	if (s->stageUsed + len > s->stageSize) {
+		if (fwr_session_flush(s) < 0)
+			return -1;
 	}
 
-	if (gzfread(f->ptr, 1, f->bufferLengthBytes, session->fh) != f->bufferLengthBytes) {
-		free(f->ptr);
-		free(f);
-		return -1;
+	/* Payloads bigger than the stage itself go straight to zlib. */
+	if (len > s->stageSize) {
+		gzFile fh = fwr_session_gzfile(s);
+		return fh && gzfwrite(buf, 1, len, fh) == len ? 0 : -1;
 	}
 
-	if (gzfread(&f->footer, 1, fwr_header_audio_size_post, session->fh) != fwr_header_audio_size_post) {
-		free(f->ptr);
-		free(f);
-		return -1;
+	memcpy(s->stage + s->stageUsed, buf, len);
+	s->stageUsed += len;
+
+	return 0;
+}
+
+static int fwr_file_marker_write(int fd)
+{
+	return write(fd, FWR_FILE_MARKER, FWR_FILE_MARKER_BYTES) == FWR_FILE_MARKER_BYTES ? 0 : -1;
+}
+
+/* Start the output file with the marker, see FWR_FILE_MARKER. Nothing else has been
+ * written to it yet, neither the gzFile nor the gzip pool have any output pending.
+ */
+static int fwr_session_marker_write(struct fwr_session_s *s)
+{
+	/* Each dump is marked as it's opened. */
+	if (s->recorder)
+		return 0;
+
+	/* Aligned output, the marker leads the first buffer. */
+	if (s->direct) {
+		fwr_direct_stage(s, FWR_FILE_MARKER, FWR_FILE_MARKER_BYTES);
+		return 0;
 	}
 
-	if (f->footer != audio_v1_footer) {
+	int fd = s->fd >= 0 ? s->fd : s->gzfd;
+#if HAVE_ZLIB
+	if (s->gzpool) {
+		pthread_mutex_lock(&s->gzpool->mutex);
+		fd = s->gzpool->fd;
+		s->gzpool->fileBytes = FWR_FILE_MARKER_BYTES;
+		pthread_mutex_unlock(&s->gzpool->mutex);
+	}
+#endif
+
+	return fwr_file_marker_write(fd);
+}
+
+/* Split a filename ahead of its extension, which starts at the first dot of the last
+ * path component, skipping any leading dot of a hidden file.
+ */
+static int fwr_filename_split(const char *filename, char **prefix, char **suffix)
+{
+	const char *base = strrchr(filename, '/');
+	base = base ? base + 1 : filename;
+	const char *ext = strchr(base + 1, '.');
+	if (*base == 0 || !ext)
+		ext = base + strlen(base);
+
+	*prefix = strndup(filename, ext - filename);
+	*suffix = strdup(ext);
+	if (!*prefix || !*suffix) {
+		free(*prefix);
+		free(*suffix);
 		return -1;
 	}
 
-	*frame = f;
 	return 0;
 }
 
-void fwr_pcm_frame_free(struct fwr_session_s *session, struct fwr_header_audio_s *frame)
+/* <prefix>.<nr><suffix><ext>, Eg. capture.000001.mx.gz */
+static char *fwr_filename_numbered(const char *prefix, const char *suffix, uint32_t nr, const char *ext)
 {
-	free(frame->ptr);
-	free(frame);
+	char *name;
+	if (asprintf(&name, "%s.%06u%s%s", prefix, nr, suffix, ext) < 0)
+		return NULL;
+
+	return name;
 }
 
-void fwr_session_file_close(struct fwr_session_s *session)
+/* Flight recorder, see fwr_session_flight_recorder_set().
+ * Records are serialized exactly as they would be on disk, into a byte ring allocated
+ * up front. The ring only ever holds whole frames, each starting with its timing
+ * record, so a dump is a valid capture file. Frames are evicted from the oldest end,
+ * once they're older than the window or their space is needed.
+ * Triggers are timestamped, once the writer reaches the frame captured at that time it
+ * opens a new file and starts draining the ring into it from the oldest frame, until the
+ * window after the last trigger has passed. A backlog in the writer queue therefore
+ * doesn't shift the dump away from the event.
+ * Live records keep going into the ring during a dump, and each frame drains what it
+ * added plus a fixed amount of the backlog, so the writer never stalls on the whole ring.
+ * Frames not yet in the dump file aren't evicted by age, only when their space or slot
+ * is needed, and then they're written out first.
+ */
+#define FWR_RECORDER_BYTES      (1024 * 1024 * 1024)
+#define FWR_RECORDER_FRAME_RATE 120 /* Upper bound, sizes the frame table. */
+#define FWR_RECORDER_DRAIN      (16 * 1024 * 1024) /* Backlog written per frame during a dump. */
+
+struct fwr_recorder_frame_s
 {
-	if (session->writeMode && session->thread_running) {
-		session->thread_terminate = 1;
-		while (!session->thread_complete)
-			usleep(50 * 1000);
+	uint64_t offset;            /* Of the timing record, in ring stream bytes. */
+	struct timeval ts;
+};
+
+struct fwr_recorder_s
+{
+	uint8_t *ring;
+	uint64_t ringSize;
+	uint64_t head;              /* Stream offsets, the ring position is offset % ringSize. */
+	uint64_t tail;
+
+	struct fwr_recorder_frame_s *frames; /* Circular, oldest first. */
+	uint32_t frameMax;
+	uint32_t frameFirst;
+	uint32_t frameCount;
+	int skipping;               /* Discard records until the next timing record. */
+
+	uint32_t preSeconds;
+	uint32_t postSeconds;
+	char *prefix;
+	char *suffix;
+
+	/* Raised by fwr_session_trigger(), protected by the session listMutex. */
+	int triggerPending;
+	struct timeval triggerFirst;
+	struct timeval triggerLast;
+	const char *reason;
+
+	int dumping;                /* A dump file is open. */
+	int dumpFd;
+	uint64_t dumpOff;           /* Stream offset of the next ring byte to write to it. */
+	struct timeval dumpEnd;
+	int stopping;               /* Past dumpEnd, draining up to dumpStop then closing. */
+	uint64_t dumpStop;
+	uint64_t frameHead;         /* head when the current frame started. */
+
+	uint32_t events;
+	uint64_t dumpedBytes;
+	uint64_t errors;
+};
+
+static uint64_t fwr_recorder_dump_limit(struct fwr_recorder_s *rec)
+{
+	return rec->stopping ? rec->dumpStop : rec->head;
+}
+
+static void fwr_recorder_write(struct fwr_recorder_s *rec, const uint8_t *buf, size_t len)
+{
+	while (len) {
+		ssize_t r = write(rec->dumpFd, buf, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			rec->errors++;
+			return;
+		}
+		buf += r;
+		len -= r;
+		rec->dumpedBytes += r;
 	}
+}
 
-	if (session->fh) {
-		gzclose(session->fh);
-		session->fh = NULL;
+/* Write the ring to the dump file up to stream offset upto, which it must hold. */
+static void fwr_recorder_drain(struct fwr_recorder_s *rec, uint64_t upto)
+{
+	if (upto > fwr_recorder_dump_limit(rec))
+		upto = fwr_recorder_dump_limit(rec);
+
+	/* The ring holds whole records, in at most two pieces. */
+	while (rec->dumpOff < upto) {
+		size_t pos = rec->dumpOff % rec->ringSize;
+		size_t len = rec->ringSize - pos;
+		if (len > upto - rec->dumpOff)
+			len = upto - rec->dumpOff;
+		fwr_recorder_write(rec, rec->ring + pos, len);
+		rec->dumpOff += len;
 	}
-	free(session);
 }
 
-int  fwr_pcm_frame_create(struct fwr_session_s *session,
-        uint32_t frameCount, uint32_t sampleDepth, uint32_t channelCount,
-        const uint8_t *buffer,
-        struct fwr_header_audio_s **frame)
+static void fwr_recorder_dump_end(struct fwr_recorder_s *rec)
 {
-	if (!buffer)
-		return -1;
+	fwr_recorder_drain(rec, fwr_recorder_dump_limit(rec));
+	if (close(rec->dumpFd) < 0)
+		rec->errors++;
+	rec->dumpFd = -1;
+	rec->dumping = 0;
+	rec->stopping = 0;
+	rec->events++;
+}
 
-	struct fwr_header_audio_s *f = malloc(sizeof(*f));
-	if (!f)
-		return -1;
+/* The oldest frame has to go, to the dump file first if it hasn't been written yet. */
+static void fwr_recorder_evict(struct fwr_recorder_s *rec)
+{
+	if (rec->dumping) {
+		uint64_t end = rec->frameCount > 1 ? rec->frames[(rec->frameFirst + 1) % rec->frameMax].offset : rec->head;
+		fwr_recorder_drain(rec, end);
+		if (rec->stopping && rec->dumpOff >= rec->dumpStop)
+			fwr_recorder_dump_end(rec);
+	}
 
-	f->channelCount = channelCount;
-	f->frameCount = frameCount;
-	f->sampleDepth = sampleDepth;
-	f->bufferLengthBytes = f->frameCount * f->channelCount * (f->sampleDepth / 4);
-	f->ptr = malloc(f->bufferLengthBytes);
-	if (!f->ptr) {
-		free(f);
+	rec->frameFirst = (rec->frameFirst + 1) % rec->frameMax;
+	rec->frameCount--;
+	rec->tail = rec->frameCount ? rec->frames[rec->frameFirst].offset : rec->head;
+}
+
+static void fwr_recorder_reset(struct fwr_recorder_s *rec)
+{
+	if (rec->dumping) {
+		fwr_recorder_drain(rec, rec->head);
+		/* What follows dumpStop is gone, the dump can't be carried on past it. */
+		if (rec->stopping)
+			fwr_recorder_dump_end(rec);
+	}
+	rec->frameCount = 0;
+	rec->tail = rec->head;
+}
+
+/* A timing record is about to be written, it starts a new frame in the ring. */
+static void fwr_recorder_frame_start(struct fwr_recorder_s *rec, const struct timeval *ts)
+{
+	if (rec->frameCount == rec->frameMax)
+		fwr_recorder_evict(rec);
+
+	struct fwr_recorder_frame_s *f = &rec->frames[(rec->frameFirst + rec->frameCount) % rec->frameMax];
+	f->offset = rec->head;
+	f->ts = *ts;
+	rec->frameCount++;
+	if (rec->frameCount == 1)
+		rec->tail = rec->head;
+	rec->skipping = 0;
+
+	while (rec->frameCount > 1) {
+		/* Aged out, but not written yet. */
+		if (rec->dumping && rec->frames[(rec->frameFirst + 1) % rec->frameMax].offset > rec->dumpOff)
+			break;
+
+		const struct timeval *oldest = &rec->frames[rec->frameFirst].ts;
+		int64_t age = ((int64_t)(ts->tv_sec - oldest->tv_sec) * 1000000) + (ts->tv_usec - oldest->tv_usec);
+		if (age <= (int64_t)rec->preSeconds * 1000000)
+			break;
+		fwr_recorder_evict(rec);
+	}
+}
+
+static int fwr_recorder_record(struct fwr_recorder_s *rec, const struct iovec *seg, int segcnt)
+{
+	size_t len = 0;
+
+	/* What's left of a frame too big for the ring still belongs in a dump. */
+	if (rec->skipping && rec->dumping && !rec->stopping) {
+		for (int i = 0; i < segcnt; i++)
+			fwr_recorder_write(rec, seg[i].iov_base, seg[i].iov_len);
+		return 0;
+	}
+
+	/* Nothing ahead of the first timing record, or what's left of a frame that didn't fit. */
+	if (rec->skipping || rec->frameCount == 0)
+		return 0;
+
+	for (int i = 0; i < segcnt; i++)
+		len += seg[i].iov_len;
+
+	while (rec->head + len - rec->tail > rec->ringSize) {
+		if (rec->frameCount == 1) {
+			/* The frame in progress doesn't fit by itself. */
+			fwr_recorder_reset(rec);
+			rec->skipping = 1;
+			return fwr_recorder_record(rec, seg, segcnt);
+		}
+		fwr_recorder_evict(rec);
+	}
+
+	for (int i = 0; i < segcnt; i++) {
+		const uint8_t *src = seg[i].iov_base;
+		size_t n = seg[i].iov_len;
+		while (n) {
+			size_t pos = rec->head % rec->ringSize;
+			size_t cnt = rec->ringSize - pos;
+			if (cnt > n)
+				cnt = n;
+			memcpy(rec->ring + pos, src, cnt);
+			rec->head += cnt;
+			src += cnt;
+			n -= cnt;
+		}
+	}
+
+	return 0;
+}
+
+static void fwr_recorder_dump_begin(struct fwr_session_s *s, const struct timeval *ts, const char *reason)
+{
+	struct fwr_recorder_s *rec = s->recorder;
+
+	char *name = fwr_filename_numbered(rec->prefix, rec->suffix, rec->events, "");
+	int fd = name ? open(name, O_WRONLY | O_CREAT | O_TRUNC, 0664) : -1;
+	if (fd < 0) {
+		fprintf(stderr, "Error: Flight recorder unable to create %s\n", name ? name : rec->prefix);
+		rec->errors++;
+		free(name);
+		return;
+	}
+
+	double buffered = 0;
+	if (rec->frameCount) {
+		const struct timeval *oldest = &rec->frames[rec->frameFirst].ts;
+		buffered = (ts->tv_sec - oldest->tv_sec) + ((ts->tv_usec - oldest->tv_usec) / 1000000.0);
+	}
+	fprintf(stderr, "Flight recorder: %s, writing %.1f seconds ahead of it and %u after to %s\n",
+		reason ? reason : "triggered", buffered, rec->postSeconds, name);
+	free(name);
+
+	if (s->fileMarker && fwr_file_marker_write(fd) < 0)
+		rec->errors++;
+
+	/* Written out a frame at a time from here on, see fwr_recorder_timing(). */
+	rec->dumpFd = fd;
+	rec->dumpOff = rec->tail;
+	rec->dumping = 1;
+	rec->stopping = 0;
+}
+
+/* Called for every timing record, before it's serialized. */
+static void fwr_recorder_timing(struct fwr_session_s *s, const struct timeval *ts)
+{
+	struct fwr_recorder_s *rec = s->recorder;
+
+	struct timeval end;
+	const char *reason = NULL;
+
+	pthread_mutex_lock(&s->listMutex);
+	int triggered = rec->triggerPending && !timercmp(ts, &rec->triggerFirst, <);
+	if (triggered) {
+		end = rec->triggerLast;
+		end.tv_sec += rec->postSeconds;
+		reason = rec->reason;
+		rec->triggerPending = 0;
+	}
+	pthread_mutex_unlock(&s->listMutex);
+
+	if (triggered) {
+		if (!rec->dumping) {
+			fwr_recorder_dump_begin(s, ts, reason);
+			rec->dumpEnd = end;
+		} else if (rec->stopping || timercmp(&end, &rec->dumpEnd, >)) {
+			/* Nothing past dumpStop has been evicted yet, the dump carries on unbroken. */
+			rec->dumpEnd = end;
+			rec->stopping = 0;
+		}
+	} else if (rec->dumping && !rec->stopping && !timercmp(ts, &rec->dumpEnd, <)) {
+		/* Frames from this one on aren't part of the dump. */
+		rec->stopping = 1;
+		rec->dumpStop = rec->head;
+	}
+
+	if (rec->dumping) {
+		fwr_recorder_drain(rec, rec->dumpOff + (rec->head - rec->frameHead) + FWR_RECORDER_DRAIN);
+		if (rec->stopping && rec->dumpOff >= rec->dumpStop)
+			fwr_recorder_dump_end(rec);
+	}
+	rec->frameHead = rec->head;
+
+	fwr_recorder_frame_start(rec, ts);
+	/* Any frame can end up first in a dump, so each one describes its own VANC. */
+	s->vancStreamValid = 0;
+}
+
+static void fwr_recorder_free(struct fwr_recorder_s *rec)
+{
+	if (rec->dumping)
+		fwr_recorder_dump_end(rec);
+	if (rec->ring)
+		munmap(rec->ring, rec->ringSize);
+	free(rec->frames);
+	free(rec->prefix);
+	free(rec->suffix);
+	free(rec);
+}
+
+/* Serialize a single record, described by its segments, to the output. Referenced
+ * payloads must remain valid until the next flush, which happens before this returns
+ * unless the writer thread is batching.
+ */
+static int fwr_session_record_write(struct fwr_session_s *s, const struct iovec *seg, int segcnt)
+{
+	if (s->recorder)
+		return fwr_recorder_record(s->recorder, seg, segcnt);
+
+	for (int i = 0; i < segcnt; i++) {
+		int ret = 0;
+		if (s->direct)
+			fwr_direct_stage(s, seg[i].iov_base, seg[i].iov_len);
+#if HAVE_ZLIB
+		else if (s->gzpool)
+			ret = fwr_gzpool_stage(s->gzpool, seg[i].iov_base, seg[i].iov_len);
+#endif
+		else if (s->fd >= 0)
+			ret = fwr_session_stage_raw(s, seg[i].iov_base, seg[i].iov_len);
+		else
+			ret = fwr_session_stage_gz(s, seg[i].iov_base, seg[i].iov_len);
+		if (ret < 0)
+			return -1;
+
+		s->pendingBytes += seg[i].iov_len;
+		s->streamOffset += seg[i].iov_len;
+	}
+
+	if (!s->batching)
+		return fwr_session_flush(s);
+
+	return 0;
+}
+
+/* A slab of identically sized slots, carved out of a single up-front allocation.
+ * Frame headers live at the start of each slot, the payload follows on the next
+ * cache line. Slots are handed out by the capture thread and returned by the
+ * writer thread, so the free stack is protected by a mutex.
+ */
+#define FWR_POOL_ALIGN 64
+#define FWR_POOL_HDR_BYTES(n) (((n) + (FWR_POOL_ALIGN - 1)) & ~((size_t)FWR_POOL_ALIGN - 1))
+#define FWR_POOL_HUGEPAGE_SIZE (2 * 1048576)
+
+struct fwr_pool_s
+{
+	pthread_mutex_t mutex;
+
+	uint8_t *base;
+	size_t   baseBytes;
+	size_t   slotBytes;
+	uint32_t slotCount;
+	int      isHugepages; /* The slab came from MAP_HUGETLB. */
+	int      flags;
+	struct fwr_pool_s *next; /* See poolsRetired */
+
+	void   **freeSlots;   /* Stack of available slots. */
+	uint32_t freeCount;
+	uint32_t freeCountLWM; /* Low water mark */
+
+	uint64_t misses;      /* Allocations that fell back to malloc. */
+};
+
+static const char *fwr_frame_type_name(int type)
+{
+	switch (type) {
+	case FWR_FRAME_TIMING: return "timing";
+	case FWR_FRAME_VIDEO:  return "video";
+	case FWR_FRAME_AUDIO:  return "audio";
+	case FWR_FRAME_VANC:   return "vanc";
+	case FWR_FRAME_GAP:    return "gap";
+	}
+
+	return "unknown";
+}
+
+static uint64_t fwr_monotonic_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/* Histogram bucket for a value, floor(log2), clamped to the last bucket. */
+static int fwr_stats_bucket(uint64_t val, int buckets)
+{
+	int n = val ? 63 - __builtin_clzll(val) : 0;
+	return n < buckets ? n : buckets - 1;
+}
+
+/* Called with listMutex held. Once a second has passed, fold the bytes written during
+ * it into the rate histograms. Seconds without any writes at all, Eg. while the writer
+ * thread is stuck on the disk, count as zero.
+ */
+static void fwr_stats_rate_update(struct fwr_session_s *s, uint64_t now)
+{
+	uint64_t second = now / 1000000;
+	if (second == s->rateSecond)
+		return;
+
+	uint64_t idle = second - s->rateSecond - 1;
+	for (int i = 1; i <= FWR_FRAME_TYPE_MAX; i++) {
+		struct fwr_session_type_stats_s *t = &s->stats.type[i];
+		if (!t->writtenFrames)
+			continue; /* Not part of this capture. */
+
+		t->rateSeconds[fwr_stats_bucket(s->rateBytes[i], FWR_STATS_RATE_BUCKETS)]++;
+		t->rateSeconds[0] += idle;
+		if (s->rateBytes[i] > t->peakRate)
+			t->peakRate = s->rateBytes[i];
+		s->rateBytes[i] = 0;
+	}
+	s->rateSecond = second;
+}
+
+static void fwr_pool_free(struct fwr_pool_s *p)
+{
+	if (p->base)
+		munmap(p->base, p->baseBytes);
+	free(p->freeSlots);
+	pthread_mutex_destroy(&p->mutex);
+	free(p);
+}
+
+static struct fwr_pool_s *fwr_pool_alloc(size_t slotBytes, uint32_t slotCount, int flags)
+{
+	struct fwr_pool_s *p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+
+	pthread_mutex_init(&p->mutex, NULL);
+	p->flags = flags;
+	p->slotBytes = FWR_POOL_HDR_BYTES(slotBytes);
+	p->slotCount = slotCount;
+	p->baseBytes = p->slotBytes * slotCount;
+
+	int mflags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(MAP_POPULATE)
+	/* Fault everything in now, rather than on the capture thread later. */
+	mflags |= MAP_POPULATE;
+#endif
+
+	p->base = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+	if (flags & FWR_POOL_HUGEPAGES) {
+		size_t len = (p->baseBytes + FWR_POOL_HUGEPAGE_SIZE - 1) & ~((size_t)FWR_POOL_HUGEPAGE_SIZE - 1);
+		p->base = mmap(NULL, len, PROT_READ | PROT_WRITE, mflags | MAP_HUGETLB, -1, 0);
+		if (p->base != MAP_FAILED) {
+			p->baseBytes = len;
+			p->isHugepages = 1;
+		}
+	}
+#endif
+	if (p->base == MAP_FAILED) {
+		p->base = mmap(NULL, p->baseBytes, PROT_READ | PROT_WRITE, mflags, -1, 0);
+		if (p->base == MAP_FAILED) {
+			p->base = NULL;
+			fwr_pool_free(p);
+			return NULL;
+		}
+#if defined(MADV_HUGEPAGE)
+		/* No reserved hugepages, ask for transparent hugepages instead. */
+		if (flags & FWR_POOL_HUGEPAGES)
+			madvise(p->base, p->baseBytes, MADV_HUGEPAGE);
+#endif
+	}
+
+	p->freeSlots = malloc(slotCount * sizeof(void *));
+	if (!p->freeSlots) {
+		fwr_pool_free(p);
+		return NULL;
+	}
+	for (uint32_t i = 0; i < slotCount; i++)
+		p->freeSlots[i] = p->base + ((slotCount - 1 - i) * p->slotBytes);
+	p->freeCount = slotCount;
+	p->freeCountLWM = slotCount;
+
+	return p;
+}
+
+static void *fwr_pool_get(struct fwr_pool_s *p, size_t bytes)
+{
+	void *slot = NULL;
+
+	pthread_mutex_lock(&p->mutex);
+	if (bytes <= p->slotBytes && p->freeCount) {
+		slot = p->freeSlots[--p->freeCount];
+		if (p->freeCount < p->freeCountLWM)
+			p->freeCountLWM = p->freeCount;
+	} else {
+		p->misses++;
+	}
+	pthread_mutex_unlock(&p->mutex);
+
+	return slot;
+}
+
+/* Return 0 if the slot belonged to the pool and was recycled. */
+static int fwr_pool_put(struct fwr_pool_s *p, void *slot)
+{
+	if ((uint8_t *)slot < p->base || (uint8_t *)slot >= p->base + (p->slotBytes * p->slotCount))
+		return -1;
+
+	pthread_mutex_lock(&p->mutex);
+	p->freeSlots[p->freeCount++] = slot;
+	pthread_mutex_unlock(&p->mutex);
+
+	return 0;
+}
+
+/* Allocate a frame header of hdrBytes, plus a payload buffer of payloadBytes.
+ * Take both from the session pool when one is configured for this type,
+ * otherwise (or when the pool is exhausted) fall back to the heap.
+ */
+static void *fwr_frame_alloc(struct fwr_session_s *s, int type, size_t hdrBytes, size_t payloadBytes, uint8_t **payload)
+{
+	/* Headers for frames queued by reference are tiny, don't waste a full pool slot on them. */
+	if (s->writeMode && (payload || type == FWR_FRAME_TIMING)) {
+		uint8_t *slot = NULL;
+		pthread_mutex_lock(&s->poolMutex);
+		if (s->pools[type])
+			slot = fwr_pool_get(s->pools[type], FWR_POOL_HDR_BYTES(hdrBytes) + payloadBytes);
+		pthread_mutex_unlock(&s->poolMutex);
+		if (slot) {
+			if (payload)
+				*payload = slot + FWR_POOL_HDR_BYTES(hdrBytes);
+			return slot;
+		}
+	}
+
+	void *hdr = malloc(hdrBytes);
+	if (!hdr)
+		return NULL;
+
+	if (payload) {
+		*payload = malloc(payloadBytes);
+		if (!*payload) {
+			free(hdr);
+			return NULL;
+		}
+	}
+
+	return hdr;
+}
+
+/* READ sessions on uncompressed files map the whole file, read-only. Records are parsed
+ * in place and payloads point straight into the mapping, so reading costs no malloc or copy.
+ * Pages well behind the cursor are dropped, they fault back in from the page cache if a
+ * caller still holds a frame that points at them.
+ */
+#define FWR_MAP_READAHEAD (64 * 1024 * 1024)
+
+static int fwr_session_mapped(struct fwr_session_s *s, const uint8_t *ptr)
+{
+	return s->map && ptr >= s->map && ptr < s->map + s->mapSize;
+}
+
+/* Bytes of the mapping left to read, up to where the file was last seen to end. */
+static size_t fwr_session_map_remain(struct fwr_session_s *s)
+{
+	return s->mapEnd > s->mapPos ? s->mapEnd - s->mapPos : 0;
+}
+
+/* Keep the kernel reading well ahead of the parser, and drop what it left well behind. */
+static void fwr_session_readahead(struct fwr_session_s *s)
+{
+	if (s->mapPos + (FWR_MAP_READAHEAD / 2) < s->mapAdvised)
+		return;
+
+	/* Once per window, catch a truncation before the parser walks into it. */
+	struct stat st;
+	if (fstat(s->mapFd, &st) == 0 && (uint64_t)st.st_size < s->mapEnd)
+		s->mapEnd = st.st_size;
+
+	size_t pagemask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+	size_t start = s->mapPos & ~pagemask;
+	if (start > FWR_MAP_READAHEAD) {
+		size_t release = (start - FWR_MAP_READAHEAD) & ~pagemask;
+		if (release > s->mapReleased) {
+			madvise(s->map + s->mapReleased, release - s->mapReleased, MADV_DONTNEED);
+			s->mapReleased = release;
+		}
+	}
+
+	if (start >= s->mapEnd)
+		return;
+	size_t len = s->mapEnd - start < FWR_MAP_READAHEAD ? s->mapEnd - start : FWR_MAP_READAHEAD;
+
+	madvise(s->map + start, len, MADV_WILLNEED);
+	s->mapAdvised = start + len;
+}
+
+static int fwr_session_map(struct fwr_session_s *s, const char *filename)
+{
+	struct stat st;
+	uint8_t magic[2];
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	/* gzip files go through zlib. */
+	if (fstat(fd, &st) < 0 || st.st_size < s->fileStart + 2 || (size_t)st.st_size != (uint64_t)st.st_size ||
+		pread(fd, magic, 2, s->fileStart) != 2 || (magic[0] == 0x1f && magic[1] == 0x8b))
+	{
+		close(fd);
+		return -1;
+	}
+
+	/* Read-only, so pages stay shared with the page cache and can be dropped and refaulted. */
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	s->map = map;
+	s->mapFd = fd;
+	s->mapSize = st.st_size;
+	s->mapEnd = st.st_size;
+	s->mapPos = s->fileStart;
+	s->mapAdvised = 0;
+	s->mapReleased = 0;
+	fwr_session_readahead(s);
+
+	return 0;
+}
+
+/* Read-ahead pipeline for compressed READ sessions, see fwr_session_read_ahead_set().
+ * A thread inflates the file and splits it into whole records, queued in file order.
+ * The caller consumes them through fwr_session_fread() and fwr_session_payload() as
+ * if reading the file, payloads are handed over without a further copy.
+ */
+#define FWR_READAHEAD_BYTES   (64 * 1024 * 1024)
+#define FWR_READAHEAD_RECORDS 4096
+#define FWR_RECORD_PRE_MAX    64 /* Largest type code plus fixed header. */
+
+struct fwr_read_record_s
+{
+	struct xorg_list list;
+	uint8_t hdr[FWR_RECORD_PRE_MAX];  /* Type code and fixed header. */
+	size_t hdrLen;
+	uint8_t *payload;                 /* NULL once handed to a frame. */
+	size_t payloadLen;
+	uint8_t post[4];
+	size_t postLen;
+	size_t pos;                       /* Consumer position, across hdr, payload and post. */
+};
+
+struct fwr_readahead_s
+{
+	pthread_t threadId;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;              /* Broadcast whenever the queue changes. */
+	struct xorg_list queue;
+	uint32_t count;
+	size_t bytes;
+	size_t maxBytes;
+	int terminate;
+	int eof;
+
+	struct fwr_read_record_s *cur;    /* Owned by the consumer. */
+};
+
+static void fwr_read_record_free(struct fwr_read_record_s *r)
+{
+	free(r->payload);
+	free(r);
+}
+
+/* Inflate and frame a single record. Returns 1 for a record type we don't know the
+ * layout of, the consumer sees its type code and nothing after it.
+ */
+static int fwr_readahead_record(gzFile fh, struct fwr_read_record_s *r)
+{
+	uint32_t header;
+	size_t pre = 0;
+	uint32_t len = 0;
+
+	if (gzfread(&header, 1, sizeof(header), fh) != sizeof(header))
+		return -1;
+	memcpy(r->hdr, &header, sizeof(header));
+	r->hdrLen = sizeof(header);
+
+	switch (header) {
+	case timing_v1_header:
+		pre = sizeof(struct fwr_header_timing_s);
+		break;
+	case gap_v1_header:
+		pre = sizeof(struct fwr_header_gap_s);
+		break;
+	case audio_v1_header:
+		pre = fwr_header_audio_size_pre;
+		r->postLen = fwr_header_audio_size_post;
+		break;
+	case video_v1_header:
+	case video_v2_header:
+		pre = fwr_header_video_size_pre;
+		r->postLen = fwr_header_video_size_post;
+		break;
+	case VANC_SOL_INDICATOR:
+		pre = fwr_header_vanc_size_pre;
+		r->postLen = fwr_header_vanc_size_post;
+		break;
+	case vanc_stream_v2_header:
+		pre = sizeof(struct fwr_header_vanc_stream_s);
+		break;
+	case vanc_line_v2_header:
+	case vanc_packets_v2_header:
+		pre = sizeof(struct fwr_header_vanc_v2_s);
+		r->postLen = sizeof(uint32_t);
+		break;
+	default:
+		return 1;
+	}
+
+	if (gzfread(r->hdr + r->hdrLen, 1, pre, fh) != pre)
+		return -1;
+
+	/* The payload length sits in a different place in each header. */
+	switch (header) {
+	case audio_v1_header: {
+		struct fwr_header_audio_s a;
+		memcpy(&a, r->hdr + r->hdrLen, pre);
+		len = a.bufferLengthBytes;
+		break;
+	}
+	case video_v1_header:
+	case video_v2_header: {
+		struct fwr_header_video_s v;
+		memcpy(&v, r->hdr + r->hdrLen, pre);
+		len = v.bufferLengthBytes;
+		break;
+	}
+	case VANC_SOL_INDICATOR: {
+		struct fwr_header_vanc_s d;
+		memcpy(&d, r->hdr + r->hdrLen, pre);
+		len = d.bufferLengthBytes;
+		break;
+	}
+	case vanc_line_v2_header:
+	case vanc_packets_v2_header: {
+		struct fwr_header_vanc_v2_s d;
+		memcpy(&d, r->hdr + r->hdrLen, pre);
+		len = d.bufferLengthBytes;
+		break;
+	}
+	}
+	r->hdrLen += pre;
+
+	if (len) {
+		r->payload = malloc(len);
+		if (!r->payload || gzfread(r->payload, 1, len, fh) != len)
+			return -1;
+		r->payloadLen = len;
+	}
+	if (r->postLen && gzfread(r->post, 1, r->postLen, fh) != r->postLen)
+		return -1;
+
+	return 0;
+}
+
+static void *fwr_readahead_threadfunc(void *p)
+{
+	struct fwr_session_s *s = (struct fwr_session_s *)p;
+	struct fwr_readahead_s *ra = s->readahead;
+
+	while (1) {
+		pthread_mutex_lock(&ra->mutex);
+		while (!ra->terminate && ra->count &&
+			(ra->count >= FWR_READAHEAD_RECORDS || ra->bytes >= ra->maxBytes))
+		{
+			pthread_cond_wait(&ra->cond, &ra->mutex);
+		}
+		int terminate = ra->terminate;
+		pthread_mutex_unlock(&ra->mutex);
+		if (terminate)
+			break;
+
+		struct fwr_read_record_s *r = calloc(1, sizeof(*r));
+		int ret = r ? fwr_readahead_record(s->fh, r) : -1;
+
+		pthread_mutex_lock(&ra->mutex);
+		if (ret < 0) {
+			/* Truncated or corrupt, the consumer sees end of file. */
+			if (r)
+				fwr_read_record_free(r);
+		} else {
+			xorg_list_append(&r->list, &ra->queue);
+			ra->count++;
+			ra->bytes += r->hdrLen + r->payloadLen + r->postLen;
+		}
+		if (ret != 0)
+			ra->eof = 1;
+		pthread_cond_broadcast(&ra->cond);
+		pthread_mutex_unlock(&ra->mutex);
+		if (ret != 0)
+			break;
+	}
+
+	return NULL;
+}
+
+static int fwr_readahead_start(struct fwr_session_s *s)
+{
+	struct fwr_readahead_s *ra = s->readahead;
+
+	ra->terminate = 0;
+	ra->eof = 0;
+	if (pthread_create(&ra->threadId, 0, fwr_readahead_threadfunc, s) != 0)
+		return -1;
+
+	return 0;
+}
+
+/* Stop the thread and discard anything queued, Eg. before repositioning the file. */
+static void fwr_readahead_stop(struct fwr_session_s *s)
+{
+	struct fwr_readahead_s *ra = s->readahead;
+
+	pthread_mutex_lock(&ra->mutex);
+	ra->terminate = 1;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->mutex);
+	pthread_join(ra->threadId, NULL);
+
+	while (!xorg_list_is_empty(&ra->queue)) {
+		struct fwr_read_record_s *r = xorg_list_first_entry(&ra->queue, struct fwr_read_record_s, list);
+		xorg_list_del(&r->list);
+		fwr_read_record_free(r);
+	}
+	ra->count = 0;
+	ra->bytes = 0;
+	if (ra->cur) {
+		fwr_read_record_free(ra->cur);
+		ra->cur = NULL;
+	}
+}
+
+/* The record the consumer is positioned in, moving on to the next once the current
+ * one is exhausted. NULL at end of file.
+ */
+static struct fwr_read_record_s *fwr_readahead_current(struct fwr_readahead_s *ra)
+{
+	struct fwr_read_record_s *r = ra->cur;
+	if (r && r->pos < r->hdrLen + r->payloadLen + r->postLen)
+		return r;
+
+	if (r)
+		fwr_read_record_free(r);
+	ra->cur = NULL;
+
+	pthread_mutex_lock(&ra->mutex);
+	while (xorg_list_is_empty(&ra->queue) && !ra->eof)
+		pthread_cond_wait(&ra->cond, &ra->mutex);
+	if (!xorg_list_is_empty(&ra->queue)) {
+		r = xorg_list_first_entry(&ra->queue, struct fwr_read_record_s, list);
+		xorg_list_del(&r->list);
+		ra->count--;
+		ra->bytes -= r->hdrLen + r->payloadLen + r->postLen;
+		ra->cur = r;
+		pthread_cond_broadcast(&ra->cond);
+	}
+	pthread_mutex_unlock(&ra->mutex);
+
+	return ra->cur;
+}
+
+/* Reads never span records, a record is always consumed from its type code onwards. */
+static size_t fwr_readahead_fread(struct fwr_readahead_s *ra, void *dst, size_t len)
+{
+	struct fwr_read_record_s *r = fwr_readahead_current(ra);
+	uint8_t *out = dst;
+	size_t done = 0;
+
+	while (r && done < len) {
+		const uint8_t *src;
+		size_t avail;
+
+		if (r->pos < r->hdrLen) {
+			src = r->hdr + r->pos;
+			avail = r->hdrLen - r->pos;
+		} else if (r->pos < r->hdrLen + r->payloadLen) {
+			if (!r->payload)
+				break;
+			src = r->payload + (r->pos - r->hdrLen);
+			avail = r->hdrLen + r->payloadLen - r->pos;
+		} else if (r->pos < r->hdrLen + r->payloadLen + r->postLen) {
+			src = r->post + (r->pos - r->hdrLen - r->payloadLen);
+			avail = r->hdrLen + r->payloadLen + r->postLen - r->pos;
+		} else {
+			break;
+		}
+
+		if (avail > len - done)
+			avail = len - done;
+		memcpy(out + done, src, avail);
+		done += avail;
+		r->pos += avail;
+	}
+
+	return done;
+}
+
+static int fwr_readahead_payload(struct fwr_readahead_s *ra, size_t len, uint8_t **ptr)
+{
+	struct fwr_read_record_s *r = ra->cur;
+
+	/* The whole payload, hand the buffer over. */
+	if (r && r->payload && r->pos == r->hdrLen && len == r->payloadLen) {
+		*ptr = r->payload;
+		r->payload = NULL;
+		r->pos += len;
+		return 0;
+	}
+
+	uint8_t *p = malloc(len);
+	if (!p)
+		return -1;
+	if (fwr_readahead_fread(ra, p, len) != len) {
+		free(p);
+		return -1;
+	}
+
+	*ptr = p;
+	return 0;
+}
+
+/* Copy the next len bytes of the record stream, returns the number of bytes copied. */
+static size_t fwr_session_fread(struct fwr_session_s *s, void *dst, size_t len)
+{
+	if (s->readahead)
+		return fwr_readahead_fread(s->readahead, dst, len);
+	if (!s->map)
+		return gzfread(dst, 1, len, s->fh);
+
+	if (len > fwr_session_map_remain(s))
+		len = fwr_session_map_remain(s);
+	memcpy(dst, s->map + s->mapPos, len);
+	s->mapPos += len;
+	fwr_session_readahead(s);
+
+	return len;
+}
+
+/* Obtain the next len bytes of the record stream as a payload. A pointer into the
+ * mapping if there is one, else a heap copy. Release with fwr_session_payload_free().
+ */
+static int fwr_session_payload(struct fwr_session_s *s, size_t len, uint8_t **ptr)
+{
+	if (s->readahead)
+		return fwr_readahead_payload(s->readahead, len, ptr);
+
+	if (s->map) {
+		if (len > fwr_session_map_remain(s))
+			return -1;
+		*ptr = s->map + s->mapPos;
+		s->mapPos += len;
+		fwr_session_readahead(s);
+		return 0;
+	}
+
+	uint8_t *p = malloc(len);
+	if (!p)
+		return -1;
+	if (gzfread(p, 1, len, s->fh) != len) {
+		free(p);
+		return -1;
+	}
+
+	*ptr = p;
+	return 0;
+}
+
+static void fwr_session_payload_free(struct fwr_session_s *s, uint8_t *ptr)
+{
+	if (!fwr_session_mapped(s, ptr))
+		free(ptr);
+}
+
+/* Return 0 if the slot belonged to the current or a retired pool. */
+static int fwr_session_pool_put(struct fwr_session_s *s, int type, void *slot)
+{
+	struct fwr_pool_s *done = NULL;
+	int ret = -1;
+
+	pthread_mutex_lock(&s->poolMutex);
+	if (s->pools[type] && fwr_pool_put(s->pools[type], slot) == 0) {
+		ret = 0;
+	} else {
+		for (struct fwr_pool_s **pp = &s->poolsRetired; *pp; pp = &(*pp)->next) {
+			struct fwr_pool_s *p = *pp;
+			if (fwr_pool_put(p, slot) < 0)
+				continue;
+			ret = 0;
+			if (p->freeCount == p->slotCount) {
+				/* That was the last frame out, nothing refers to the pool now. */
+				*pp = p->next;
+				done = p;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&s->poolMutex);
+
+	if (done)
+		fwr_pool_free(done);
+
+	return ret;
+}
+
+static void fwr_frame_release(struct fwr_session_s *s, int type, void *hdr, uint8_t *payload)
+{
+	if (s->writeMode && fwr_session_pool_put(s, type, hdr) == 0)
+		return;
+
+	fwr_session_payload_free(s, payload);
+	free(hdr);
+}
+
+static void fwr_writer_frame_free(struct fwr_session_s *s, void *frame, int type)
+{
+	switch (type) {
+	case FWR_FRAME_TIMING:
+		fwr_timing_frame_free(s, (struct fwr_header_timing_s *)frame);
+		break;
+	case FWR_FRAME_VIDEO:
+		fwr_video_frame_free(s, (struct fwr_header_video_s *)frame);
+		break;
+	case FWR_FRAME_AUDIO:
+		fwr_pcm_frame_free(s, (struct fwr_header_audio_s *)frame);
+		break;
+	case FWR_FRAME_VANC:
+		fwr_vanc_frame_free(s, (struct fwr_header_vanc_s *)frame);
+		break;
+	case FWR_FRAME_GAP:
+		fwr_frame_release(s, FWR_FRAME_GAP, frame, NULL);
+		break;
+	}
+}
+
+/* Frames queued by reference only own their header, the payload belongs to the caller. */
+static void fwr_writer_node_release(struct fwr_session_s *s, void *frame, int type, fwr_release_callback release, void *opaque)
+{
+	if (release) {
+		fwr_frame_release(s, type, frame, NULL);
+		release(opaque);
+	} else {
+		fwr_writer_frame_free(s, frame, type);
+	}
+}
+
+static int fwr_gap_frame_write(struct fwr_session_s *session, struct fwr_header_gap_s *frame)
+{
+	uint32_t frame_type = gap_v1_header;
+	struct iovec seg[] = {
+		{ &frame_type, sizeof(frame_type) },
+		{ frame,       sizeof(*frame) },
+	};
+
+	return fwr_session_record_write(session, seg, 2);
+}
+
+static int fwr_writer_frame_write(struct fwr_session_s *s, void *frame, int type)
+{
+	switch (type) {
+	case FWR_FRAME_TIMING:
+		return fwr_timing_frame_write(s, (struct fwr_header_timing_s *)frame);
+	case FWR_FRAME_VIDEO:
+		return fwr_video_frame_write(s, (struct fwr_header_video_s *)frame);
+	case FWR_FRAME_AUDIO:
+		return fwr_pcm_frame_write(s, (struct fwr_header_audio_s *)frame);
+	case FWR_FRAME_VANC:
+		return fwr_vanc_frame_write(s, (struct fwr_header_vanc_s *)frame);
+	case FWR_FRAME_GAP:
+		return fwr_gap_frame_write(s, (struct fwr_header_gap_s *)frame);
+	}
+
+	return -1;
+}
+
+/* Number of bytes the frame will occupy on disk, including the type code. */
+static size_t fwr_writer_frame_size(void *frame, int type)
+{
+	switch (type) {
+	case FWR_FRAME_TIMING:
+		return sizeof(uint32_t) + sizeof(struct fwr_header_timing_s);
+	case FWR_FRAME_VIDEO:
+		return sizeof(uint32_t) + fwr_header_video_size_pre + fwr_header_video_size_post +
+			((struct fwr_header_video_s *)frame)->bufferLengthBytes;
+	case FWR_FRAME_AUDIO:
+		return sizeof(uint32_t) + fwr_header_audio_size_pre + fwr_header_audio_size_post +
+			((struct fwr_header_audio_s *)frame)->bufferLengthBytes;
+	case FWR_FRAME_VANC:
+		return sizeof(uint32_t) + fwr_header_vanc_size_pre + fwr_header_vanc_size_post +
+			((struct fwr_header_vanc_s *)frame)->bufferLengthBytes;
+	case FWR_FRAME_GAP:
+		return sizeof(uint32_t) + sizeof(struct fwr_header_gap_s);
+	}
+
+	return 0;
+}
+
+/* Release a list of frames that have been flushed to disk, recycle their nodes and
+ * hand the queue space back to any blocked producer.
+ */
+static void fwr_writer_complete(struct fwr_session_s *s, struct xorg_list *written, int err)
+{
+	struct fwr_writer_node_s *n;
+	uint64_t bytes = 0;
+	uint32_t count = 0;
+	uint64_t now = fwr_monotonic_us();
+
+	xorg_list_for_each_entry(n, written, list) {
+		fwr_writer_node_release(s, n->ptr, n->type, n->release, n->opaque);
+		bytes += n->bytes;
+		count++;
+	}
+
+	pthread_mutex_lock(&s->listMutex);
+	s->stats.queueBytes -= bytes;
+	s->stats.queueFrames -= count;
+	xorg_list_for_each_entry(n, written, list) {
+		s->stats.type[n->type].queueBytes -= n->bytes;
+		s->stats.type[n->type].queueFrames--;
+	}
+	if (err) {
+		s->stats.writeErrors += count;
+	} else {
+		s->stats.writtenFrames += count;
+		s->stats.writtenBytes += bytes;
+
+		fwr_stats_rate_update(s, now);
+		xorg_list_for_each_entry(n, written, list) {
+			uint64_t us = now > n->enqueuedUs ? now - n->enqueuedUs : 0;
+			s->stats.latency[fwr_stats_bucket(us, FWR_STATS_LATENCY_BUCKETS)]++;
+			s->stats.latencySumUs += us;
+			if (us > s->stats.latencyMaxUs)
+				s->stats.latencyMaxUs = us;
+
+			s->stats.type[n->type].writtenFrames++;
+			s->stats.type[n->type].writtenBytes += n->bytes;
+			s->rateBytes[n->type] += n->bytes;
+		}
+	}
+	while (!xorg_list_is_empty(written)) {
+		n = xorg_list_first_entry(written, struct fwr_writer_node_s, list);
+		xorg_list_del(&n->list);
+		xorg_list_append(&n->list, &s->freeList);
+	}
+	pthread_cond_broadcast(&s->spaceCond);
+	pthread_mutex_unlock(&s->listMutex);
+}
+
+static void *fwr_writer_threadfunc(void *p)
+{
+	struct fwr_session_s *s = (struct fwr_session_s *)p;
+	struct xorg_list batch, written;
+
+	pthread_mutex_lock(&s->listMutex);
+	s->thread_running = 1;
+	while (1) {
+		/* Sleep until fwr_writer_enqueue() has something for us, or we're asked to terminate. */
+		while (xorg_list_is_empty(&s->list) && !s->thread_terminate)
+			pthread_cond_wait(&s->cond, &s->listMutex);
+
+		/* Always drain whatever is queued before honoring a termination request. */
+		if (xorg_list_is_empty(&s->list))
+			break;
+
+		/* Take the entire backlog in one go, so producers don't contend with us
+		 * while we're blocked in I/O.
+		 */
+		xorg_list_init(&batch);
+		while (!xorg_list_is_empty(&s->list)) {
+			struct fwr_writer_node_s *n = xorg_list_first_entry(&s->list, struct fwr_writer_node_s, list);
+			xorg_list_del(&n->list);
+			xorg_list_append(&n->list, &batch);
+		}
+		s->stats.batches++;
+		pthread_mutex_unlock(&s->listMutex);
+
+		/* Stage records, and flush them to disk in large vectored writes. Frames
+		 * can only be released once the flush covering them has completed.
+		 */
+		xorg_list_init(&written);
+		int err = 0;
+		s->batching = 1;
+		while (!xorg_list_is_empty(&batch)) {
+			struct fwr_writer_node_s *n = xorg_list_first_entry(&batch, struct fwr_writer_node_s, list);
+			xorg_list_del(&n->list);
+
+			if (fwr_writer_frame_write(s, n->ptr, n->type) < 0)
+				err = 1;
+			xorg_list_append(&n->list, &written);
+
+			/* Release queue space as data hits the disk, not once per batch,
+			 * so a blocked producer can make progress as early as possible.
+			 */
+			if (fwr_session_stage_full(s)) {
+				if (fwr_session_flush(s) < 0)
+					err = 1;
+				fwr_writer_complete(s, &written, err);
+				err = 0;
+			}
+		}
+		if (fwr_session_flush(s) < 0)
+			err = 1;
+		fwr_writer_complete(s, &written, err);
+		s->batching = 0;
+
+		pthread_mutex_lock(&s->listMutex);
+	}
+	s->thread_complete = 1;
+	s->thread_running = 0;
+	pthread_mutex_unlock(&s->listMutex);
+
+	pthread_exit(0);
+}
+
+/* Frame index, see fwr_session_index_set().
+ * While writing, entries are appended to the sidecar every FWR_INDEX_FLUSH_ENTRIES and
+ * only the ones not yet written are held in memory. Each flush rewrites what follows
+ * the entries and the header, so the sidecar is always complete up to the last flush.
+ */
+#define FWR_INDEX_RESTART_BYTES (32 * 1024 * 1024) /* Single threaded gzip, distance between restart points. */
+#define FWR_INDEX_FLUSH_ENTRIES 512                /* About 8 seconds of 1080p59.94 */
+
+struct fwr_index_s
+{
+	char *filename;
+	int fd;                     /* Write sessions, the sidecar, -1 until the first flush. */
+
+	/* Read sessions hold every entry, write sessions only those not yet on disk. */
+	struct fwr_index_entry_s *entries;
+	uint32_t count;
+	uint32_t alloc;
+	uint32_t written;           /* Write sessions, entries already on disk. */
+
+	/* Block parallel gzip, the blocks that entries start in. Their member offsets
+	 * are only known once the output thread has written them.
+	 */
+	uint64_t *blocks;
+	uint32_t blockCount;
+	uint32_t blockAlloc;
+
+	struct fwr_index_restart_s *restarts;
+	uint32_t restartCount;
+	uint32_t restartAlloc;
+	uint64_t lastRestart;
+
+	struct fwr_header_vanc_stream_s vancStream; /* First compact VANC descriptor in the file. */
+	int vancStreamValid;
+};
+
+static void fwr_index_free(struct fwr_index_s *idx)
+{
+	if (idx->fd >= 0)
+		close(idx->fd);
+	free(idx->filename);
+	free(idx->entries);
+	free(idx->blocks);
+	free(idx->restarts);
+	free(idx);
+}
+
+static int fwr_index_flush(struct fwr_index_s *idx);
+
+#if HAVE_ZLIB
+static void fwr_index_restart_add(struct fwr_index_s *idx, uint64_t offset, uint64_t fileOffset)
+{
+	if (idx->restartCount == idx->restartAlloc) {
+		uint32_t n = idx->restartAlloc ? idx->restartAlloc * 2 : 256;
+		struct fwr_index_restart_s *r = realloc(idx->restarts, n * sizeof(*r));
+		if (!r)
+			return;
+		idx->restarts = r;
+		idx->restartAlloc = n;
+	}
+	idx->restarts[idx->restartCount].offset = offset;
+	idx->restarts[idx->restartCount].fileOffset = fileOffset;
+	idx->restartCount++;
+}
+#endif
+
+/* Called by the writer for every timing record, before it's serialized. */
+static void fwr_index_add(struct fwr_session_s *s, struct fwr_header_timing_s *frame)
+{
+	struct fwr_index_s *idx = s->index;
+	struct timeval ts;
+
+#if HAVE_ZLIB
+	if (s->fd < 0 && !s->gzpool && s->streamOffset - idx->lastRestart >= FWR_INDEX_RESTART_BYTES) {
+		/* End the current gzip member, the next write starts a new one that
+		 * decompression can begin from.
+		 */
+		if (fwr_session_flush(s) == 0 && s->fh && gzflush(s->fh, Z_FINISH) == Z_OK)
+			fwr_index_restart_add(idx, s->streamOffset, gzoffset(s->fh));
+		idx->lastRestart = s->streamOffset;
+	}
+
+	if (s->gzpool) {
+		uint64_t blk = s->streamOffset / FWR_GZ_BLOCK_BYTES;
+		if (idx->blockCount == 0 || idx->blocks[idx->blockCount - 1] != blk) {
+			if (idx->blockCount == idx->blockAlloc) {
+				uint32_t n = idx->blockAlloc ? idx->blockAlloc * 2 : 256;
+				uint64_t *b = realloc(idx->blocks, n * sizeof(*b));
+				if (!b)
+					return;
+				idx->blocks = b;
+				idx->blockAlloc = n;
+			}
+			idx->blocks[idx->blockCount++] = blk;
+		}
+	}
+#endif
+
+	if (idx->count == idx->alloc) {
+		uint32_t n = FWR_INDEX_FLUSH_ENTRIES;
+		struct fwr_index_entry_s *e = realloc(idx->entries, n * sizeof(*e));
+		if (!e)
+			return;
+		idx->entries = e;
+		idx->alloc = n;
+	}
+
+	memcpy(&ts, &frame->ts1, sizeof(ts));
+	struct fwr_index_entry_s *e = &idx->entries[idx->count++];
+	e->counter = frame->counter;
+	e->tv_sec = ts.tv_sec;
+	e->tv_usec = ts.tv_usec;
+	e->offset = s->streamOffset;
+
+	/* Pending entries only ever fill the first allocation. If they can't be written,
+	 * Eg. the disk is full, give up on the index rather than hold or lose them quietly,
+	 * the sidecar stays valid up to the last flush.
+	 */
+	if (idx->count == FWR_INDEX_FLUSH_ENTRIES && fwr_index_flush(idx) < 0) {
+		fprintf(stderr, "Error: Unable to write index %s, no longer indexing\n", idx->filename);
+		fwr_index_free(idx);
+		s->index = NULL;
+	}
+}
+
+#if HAVE_ZLIB
+/* Every block parallel gzip member is a restart point, keep those the entries need. */
+static void fwr_index_restarts_from_members(struct fwr_index_s *idx, const uint64_t *memberOffsets, uint64_t memberCount,
+	uint64_t blockBytes)
+{
+	for (uint32_t i = 0; i < idx->blockCount; i++) {
+		uint64_t blk = idx->blocks[i];
+		if (blk < memberCount)
+			fwr_index_restart_add(idx, blk * blockBytes, memberOffsets[blk]);
+	}
+	idx->blockCount = 0;
+}
+#endif
+
+static int fwr_index_pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	while (len) {
+		ssize_t n = pwrite(fd, p, len, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+/* Append the pending entries to the sidecar, then rewrite the restarts, descriptor and
+ * header after them. The header goes last, a reader never sees counts the file can't back.
+ */
+static int fwr_index_flush(struct fwr_index_s *idx)
+{
+	if (idx->fd < 0) {
+		idx->fd = open(idx->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (idx->fd < 0)
+			return -1;
+	}
+
+	/* The restarts are about to be overwritten, until the new header lands the file only
+	 * claims the entries already there.
+	 */
+	struct fwr_index_file_header_s hdr = { FWR_INDEX_MAGIC, FWR_INDEX_VERSION, idx->written, 0 };
+	if (fwr_index_pwrite(idx->fd, &hdr, sizeof(hdr), 0) < 0)
+		return -1;
+	hdr.restartCount = idx->restartCount;
+
+	off_t pos = sizeof(hdr) + (off_t)idx->written * sizeof(*idx->entries);
+
+	int ret = 0;
+	if (fwr_index_pwrite(idx->fd, idx->entries, idx->count * sizeof(*idx->entries), pos) < 0)
+		ret = -1;
+	pos += idx->count * sizeof(*idx->entries);
+	if (ret == 0) {
+		idx->written += idx->count;
+		idx->count = 0;
+	}
+
+	if (fwr_index_pwrite(idx->fd, idx->restarts, idx->restartCount * sizeof(*idx->restarts), pos) < 0)
+		ret = -1;
+	pos += idx->restartCount * sizeof(*idx->restarts);
+
+	if (idx->vancStreamValid) {
+		uint32_t magic = FWR_INDEX_VANC_MAGIC;
+		if (fwr_index_pwrite(idx->fd, &magic, sizeof(magic), pos) < 0 ||
+			fwr_index_pwrite(idx->fd, &idx->vancStream, sizeof(idx->vancStream), pos + sizeof(magic)) < 0)
+		{
+			ret = -1;
+		}
+		pos += sizeof(magic) + sizeof(idx->vancStream);
+	}
+
+	if (ret == 0) {
+		hdr.entryCount = idx->written;
+		if (fwr_index_pwrite(idx->fd, &hdr, sizeof(hdr), 0) < 0 || ftruncate(idx->fd, pos) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/* Final flush, the index is left ready for the next segment. */
+static int fwr_index_close(struct fwr_index_s *idx)
+{
+	int ret = fwr_index_flush(idx);
+	if (idx->fd >= 0 && close(idx->fd) < 0)
+		ret = -1;
+	idx->fd = -1;
+	idx->count = 0;
+	idx->written = 0;
+	idx->blockCount = 0;
+	idx->restartCount = 0;
+	idx->lastRestart = 0;
+	idx->vancStreamValid = 0;
+
+	return ret;
+}
+
+static struct fwr_index_s *fwr_index_load(const char *filename)
+{
+	struct fwr_index_file_header_s hdr;
+	struct fwr_index_s *idx = NULL;
+
+	FILE *fh = fopen(filename, "rb");
+	if (!fh)
+		return NULL;
+
+	if (fread(&hdr, sizeof(hdr), 1, fh) != 1 || hdr.magic != FWR_INDEX_MAGIC || hdr.version != FWR_INDEX_VERSION)
+		goto err;
+
+	idx = calloc(1, sizeof(*idx));
+	if (!idx)
+		goto err;
+	idx->fd = -1;
+	idx->count = idx->alloc = hdr.entryCount;
+	idx->restartCount = idx->restartAlloc = hdr.restartCount;
+	idx->entries = malloc((hdr.entryCount + 1) * sizeof(*idx->entries));
+	idx->restarts = malloc((hdr.restartCount + 1) * sizeof(*idx->restarts));
+	if (!idx->entries || !idx->restarts ||
+		fread(idx->entries, sizeof(*idx->entries), idx->count, fh) != idx->count ||
+		fread(idx->restarts, sizeof(*idx->restarts), idx->restartCount, fh) != idx->restartCount)
+	{
+		goto err;
+	}
+
+	/* Seeks past the first VANC descriptor in the file need it, older indexes end here. */
+	uint32_t magic;
+	if (fread(&magic, sizeof(magic), 1, fh) == 1 && magic == FWR_INDEX_VANC_MAGIC &&
+		fread(&idx->vancStream, sizeof(idx->vancStream), 1, fh) == 1 &&
+		idx->vancStream.footer == vanc_stream_v2_footer)
+	{
+		idx->vancStreamValid = 1;
+	}
+
+	fclose(fh);
+	return idx;
+
+err:
+	if (idx)
+		fwr_index_free(idx);
+	fclose(fh);
+	return NULL;
+}
+
+/* Segmented output, see fwr_session_segment_set().
+ * Segments are named after the session file with a sequence number ahead of the
+ * extension, Eg. capture.mx.gz -> capture.000000.mx.gz, capture.000001.mx.gz ...
+ * The writer switches files just before a timing record, so each segment starts on a
+ * frame boundary. The next file is opened and preallocated as soon as the previous
+ * switch completes, the switch itself only finishes the old file.
+ */
+struct fwr_segment_s
+{
+	char *prefix;               /* Session filename up to the extension. */
+	char *suffix;               /* Extension, Eg. ".mx.gz", may be empty. */
+	uint32_t seconds;
+	uint64_t maxBytes;
+	uint32_t keepCount;
+
+	uint32_t current;           /* Sequence number of the segment being written. */
+	int nextFd;                 /* Segment current + 1, opened ahead of time, else -1. */
+	uint64_t preallocBytes;
+	struct timeval start;       /* Capture time of the first timing record in the segment. */
+	int started;
+	int failing;                /* The last switch failed, we're still on the old file. */
+
+	uint64_t rotations;
+	uint64_t deleted;
+	uint64_t errors;
+};
+
+static char *fwr_segment_name(struct fwr_segment_s *sg, uint32_t nr, const char *ext)
+{
+	return fwr_filename_numbered(sg->prefix, sg->suffix, nr, ext);
+}
+
+static int fwr_segment_open(struct fwr_segment_s *sg, uint32_t nr)
+{
+	char *name = fwr_segment_name(sg, nr, "");
+	if (!name)
+		return -1;
+
+	int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+	if (fd >= 0 && sg->preallocBytes) {
+		/* Best effort, the file size is left alone and the excess trimmed once the
+		 * segment is complete.
+		 */
+		fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, sg->preallocBytes);
+	}
+	free(name);
+
+	return fd;
+}
+
+/* Release any preallocated blocks past the end of a finished segment. Returns its size. */
+static uint64_t fwr_segment_trim(struct fwr_segment_s *sg, uint32_t nr)
+{
+	struct stat st;
+	uint64_t size = 0;
+
+	char *name = fwr_segment_name(sg, nr, "");
+	if (!name)
+		return 0;
+	if (stat(name, &st) == 0) {
+		size = st.st_size;
+		if (truncate(name, st.st_size) < 0)
+			size = 0;
+	}
+	free(name);
+
+	return size;
+}
+
+static void fwr_segment_unlink(struct fwr_segment_s *sg, uint32_t nr, const char *ext)
+{
+	char *name = fwr_segment_name(sg, nr, ext);
+	if (name) {
+		unlink(name);
+		free(name);
+	}
+}
+
+/* Called for every timing record, is it time to start a new segment? */
+static int fwr_segment_due(struct fwr_session_s *s, const struct timeval *ts)
+{
+	struct fwr_segment_s *sg = s->segment;
+
+	if (!sg->started) {
+		sg->start = *ts;
+		sg->started = 1;
+		return 0;
+	}
+	if (s->streamOffset == 0)
+		return 0;
+
+	if (sg->maxBytes && s->streamOffset >= sg->maxBytes)
+		return 1;
+	if (sg->seconds) {
+		int64_t elapsed = ((int64_t)(ts->tv_sec - sg->start.tv_sec) * 1000000) + (ts->tv_usec - sg->start.tv_usec);
+		if (elapsed >= (int64_t)sg->seconds * 1000000)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Finish the current segment and carry on writing into the next one. */
+static int fwr_segment_rotate(struct fwr_session_s *s, const struct timeval *ts)
+{
+	struct fwr_segment_s *sg = s->segment;
+	int ret;
+
+	int fd = sg->nextFd;
+	sg->nextFd = -1;
+	if (fd < 0)
+		fd = fwr_segment_open(sg, sg->current + 1);
+	if (fd < 0) {
+		/* Stay on the current file and try again next period. */
+		if (!sg->failing)
+			fprintf(stderr, "Error: Unable to create segment %u of %s%s\n", sg->current + 1, sg->prefix, sg->suffix);
+		sg->failing = 1;
+		sg->errors++;
+		sg->start = *ts;
+		return -1;
+	}
+	sg->failing = 0;
+
+	ret = fwr_session_flush(s);
+	if (s->direct && fwr_direct_finish(s) < 0)
+		ret = -1;
+
+#if HAVE_ZLIB
+	if (s->gzpool) {
+		uint64_t *memberOffsets = NULL, memberCount = 0;
+		if (fwr_gzpool_switch(s->gzpool, fd, s->index ? &memberOffsets : NULL, &memberCount) < 0)
+			ret = -1;
+		if (s->index && memberOffsets)
+			fwr_index_restarts_from_members(s->index, memberOffsets, memberCount, FWR_GZ_BLOCK_BYTES);
+		free(memberOffsets);
+	} else
+#endif
+	if (s->fd >= 0) {
+		if (close(s->fd) < 0)
+			ret = -1;
+		s->fd = fd;
+		if (s->direct) {
+			/* Without O_DIRECT the aligned buffers simply go through the page cache. */
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT);
+			s->directBytes = 0;
+		}
+	} else {
+		/* Single threaded gzip, the gzFile is attached to the new descriptor on first use. */
+		if (s->fh && gzclose(s->fh) != 0)
+			ret = -1;
+		s->fh = NULL;
+		if (s->gzfd >= 0)
+			close(s->gzfd);
+		s->gzfd = fd;
+	}
+
+	if (s->index) {
+		struct fwr_index_s *idx = s->index;
+		if (fwr_index_close(idx) < 0)
+			fprintf(stderr, "Error: Unable to write index %s\n", idx->filename);
+		char *name = fwr_segment_name(sg, sg->current + 1, ".idx");
+		if (name) {
+			free(idx->filename);
+			idx->filename = name;
+		}
+	}
+	s->vancStreamValid = 0;
+	s->vancStreamFirstValid = 0;
+	s->streamOffset = 0;
+	if (s->fileMarker && fwr_session_marker_write(s) < 0)
+		ret = -1;
+
+	/* Time based segments are preallocated at the size of the last one. */
+	uint64_t size = fwr_segment_trim(sg, sg->current);
+	if (!sg->maxBytes)
+		sg->preallocBytes = size;
+
+	sg->current++;
+	sg->start = *ts;
+	sg->rotations++;
+
+	if (sg->keepCount && sg->current >= sg->keepCount) {
+		uint32_t nr = sg->current - sg->keepCount;
+		fwr_segment_unlink(sg, nr, "");
+		if (s->index)
+			fwr_segment_unlink(sg, nr, ".idx");
+		sg->deleted++;
+	}
+
+	sg->nextFd = fwr_segment_open(sg, sg->current + 1);
+
+	if (ret < 0)
+		sg->errors++;
+
+	return ret;
+}
+
+/* Session close, everything has been written and closed by now. */
+static void fwr_segment_free(struct fwr_session_s *s)
+{
+	struct fwr_segment_s *sg = s->segment;
+
+	fwr_segment_trim(sg, sg->current);
+	if (sg->nextFd >= 0) {
+		close(sg->nextFd);
+		fwr_segment_unlink(sg, sg->current + 1, "");
+	}
+	free(sg->prefix);
+	free(sg->suffix);
+	free(sg);
+	s->segment = NULL;
+}
+
+/* Open for read, past the marker of files that carry one, see FWR_FILE_MARKER. */
+static gzFile fwr_session_open_read(struct fwr_session_s *s, const char *filename)
+{
+	uint8_t marker[FWR_FILE_MARKER_BYTES];
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (read(fd, marker, sizeof(marker)) == sizeof(marker) && memcmp(marker, FWR_FILE_MARKER, sizeof(marker)) == 0) {
+		s->fileStart = sizeof(marker);
+	} else if (lseek(fd, 0, SEEK_SET) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	gzFile fh = gzdopen(fd, "rb");
+	if (!fh)
+		close(fd);
+
+	return fh;
+}
+
+int fwr_session_file_open(const char *filename, int writeMode, struct fwr_session_s **session)
+{
+	struct fwr_session_s *s = calloc(1, sizeof(*s));
+	if (!s)
+		return -1;
+
+	s->fd = -1;
+	s->gzfd = -1;
+	if (writeMode) {
+		/* If file ends in .gz, create compressed file with "Best Performance",
+		   otherwise bypass zlib and write the file directly with writev(). */
+
+		if (strlen(filename) > 3 && strcmp(&filename[strlen(filename) - 3] , ".gz") == 0) {
+#if !HAVE_ZLIB
+			fprintf(stderr, "Error: Cannot create gzip files because not compiled with zlib\n");
+			free(s);
+			return -1;
+#else
+			s->gzfd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+			s->stageSize = FWR_STAGE_GZ_BYTES;
+#endif
+		} else {
+			s->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+			s->stageSize = FWR_STAGE_RAW_BYTES;
+			s->iov = malloc(FWR_IOV_MAX * sizeof(struct iovec));
+		}
+		s->stage = malloc(s->stageSize);
+		s->filename = strdup(filename);
+
+		if ((s->gzfd < 0 && s->fd < 0) || !s->stage || (s->fd >= 0 && !s->iov) || !s->filename) {
+			if (s->gzfd >= 0)
+				close(s->gzfd);
+			if (s->fd >= 0)
+				close(s->fd);
+			free(s->stage);
+			free(s->iov);
+			free(s->filename);
+			free(s);
+			return -1;
+		}
+	} else {
+#if !HAVE_ZLIB
+		if (strlen(filename) > 3 && strcmp(&filename[strlen(filename) - 3] , ".gz") == 0) {
+			fprintf(stderr, "Error: Cannot read gzip files because not compiled with zlib\n");
+			return -1;
+		}
+#endif
+		s->fh = fwr_session_open_read(s, filename);
+		s->filename = strdup(filename);
+		if (s->fh)
+			fwr_session_map(s, filename);
+	}
+
+	if (!writeMode && (!s->fh || !s->filename)) {
+		if (s->fh)
+			gzclose(s->fh);
+		free(s->filename);
+		free(s);
+		return -1;
+	}
+
+	s->writeMode = writeMode;
+	if (writeMode) {
+		xorg_list_init(&s->list);
+		xorg_list_init(&s->freeList);
+		pthread_mutex_init(&s->listMutex, NULL);
+		pthread_mutex_init(&s->poolMutex, NULL);
+		pthread_condattr_init(&s->condAttr);
+		pthread_cond_init(&s->cond, &s->condAttr);
+		pthread_cond_init(&s->spaceCond, &s->condAttr);
+		s->queuePolicy = FWR_QUEUE_POLICY_DROP;
+		s->createdUs = fwr_monotonic_us();
+		s->rateSecond = s->createdUs / 1000000;
+
+		if (pthread_create(&s->writerThreadId, 0, fwr_writer_threadfunc, s) != 0) {
+			if (s->gzfd >= 0)
+				close(s->gzfd);
+			if (s->fd >= 0)
+				close(s->fd);
+			free(s->stage);
+			free(s->iov);
+			free(s->filename);
+			free(s);
+			return -1;
+		}
+	}
+
+	*session = s;
+	return 0;
+}
+
+int fwr_pcm_frame_read(struct fwr_session_s *session, struct fwr_header_audio_s **frame)
+{
+	struct fwr_header_audio_s *f = malloc(sizeof(*f));
+	if (!f)
+		return -1;
+
+	if (fwr_session_fread(session, f, fwr_header_audio_size_pre) != fwr_header_audio_size_pre) {
+		free(f);
+		return -1;
+	}
+
+	uint8_t *ptr;
+	if (fwr_session_payload(session, f->bufferLengthBytes, &ptr) < 0) {
+		free(f);
+		return -1;
+	}
+	f->ptr = ptr;
+
+	if (fwr_session_fread(session, &f->footer, fwr_header_audio_size_post) != fwr_header_audio_size_post) {
+		fwr_session_payload_free(session, f->ptr);
+		free(f);
+		return -1;
+	}
+
+	if (f->footer != audio_v1_footer) {
+		return -1;
+	}
+
+	*frame = f;
+	return 0;
+}
+
+void fwr_pcm_frame_free(struct fwr_session_s *session, struct fwr_header_audio_s *frame)
+{
+	fwr_frame_release(session, FWR_FRAME_AUDIO, frame, frame->ptr);
+}
+
+static void fwr_writer_gaps_append(struct fwr_session_s *s, uint64_t now);
+
+void fwr_session_file_close(struct fwr_session_s *session)
+{
+	if (session->writeMode) {
+		/* The writer flushes anything still queued before it exits. */
+		pthread_mutex_lock(&session->listMutex);
+		fwr_writer_gaps_append(session, fwr_monotonic_us());
+		session->thread_terminate = 1;
+		pthread_cond_broadcast(&session->cond);
+		pthread_cond_broadcast(&session->spaceCond);
+		pthread_mutex_unlock(&session->listMutex);
+		pthread_join(session->writerThreadId, NULL);
+
+		while (!xorg_list_is_empty(&session->freeList)) {
+			struct fwr_writer_node_s *n = xorg_list_first_entry(&session->freeList, struct fwr_writer_node_s, list);
+			xorg_list_del(&n->list);
+			free(n);
+		}
+		pthread_cond_destroy(&session->cond);
+		pthread_cond_destroy(&session->spaceCond);
+		pthread_condattr_destroy(&session->condAttr);
+		pthread_mutex_destroy(&session->listMutex);
+	}
+
+	if (session->writeMode)
+		fwr_session_flush(session);
+	if (session->readahead) {
+		fwr_readahead_stop(session);
+		pthread_cond_destroy(&session->readahead->cond);
+		pthread_mutex_destroy(&session->readahead->mutex);
+		free(session->readahead);
+		session->readahead = NULL;
+	}
+	if (session->direct)
+		fwr_direct_close(session);
+#if HAVE_ZLIB
+	if (session->gzpool) {
+		uint64_t *memberOffsets = NULL, memberCount = 0;
+		fwr_gzpool_close(session->gzpool, session->index ? &memberOffsets : NULL, &memberCount);
+		session->gzpool = NULL;
+		if (session->index && memberOffsets)
+			fwr_index_restarts_from_members(session->index, memberOffsets, memberCount, FWR_GZ_BLOCK_BYTES);
+		free(memberOffsets);
+	}
+#endif
+
+	if (session->fh) {
+		gzclose(session->fh);
+		session->fh = NULL;
+	}
+	if (session->gzfd >= 0) {
+		close(session->gzfd);
+		session->gzfd = -1;
+	}
+	if (session->fd >= 0) {
+		close(session->fd);
+		session->fd = -1;
+	}
+	free(session->stage);
+	free(session->iov);
+	free(session->vancSamples);
+	free(session->vancPackets);
+	if (session->videoCodec)
+		v210codec_free(session->videoCodec);
+	if (session->index) {
+		/* Written last, every offset is final by now. */
+		if (session->writeMode && fwr_index_close(session->index) < 0)
+			fprintf(stderr, "Error: Unable to write index %s\n", session->index->filename);
+		fwr_index_free(session->index);
+	}
+	if (session->segment)
+		fwr_segment_free(session);
+	if (session->recorder)
+		fwr_recorder_free(session->recorder);
+	free(session->filename);
+	if (session->map) {
+		munmap(session->map, session->mapSize);
+		close(session->mapFd);
+	}
+
+	/* The writer thread has returned every frame by now. */
+	for (int i = 0; i <= FWR_FRAME_TYPE_MAX; i++) {
+		if (session->pools[i])
+			fwr_pool_free(session->pools[i]);
+	}
+	while (session->poolsRetired) {
+		struct fwr_pool_s *p = session->poolsRetired;
+		session->poolsRetired = p->next;
+		fwr_pool_free(p);
+	}
+	if (session->writeMode)
+		pthread_mutex_destroy(&session->poolMutex);
+	free(session);
+}
+
+int  fwr_pcm_frame_create(struct fwr_session_s *session,
+        uint32_t frameCount, uint32_t sampleDepth, uint32_t channelCount,
+        const uint8_t *buffer,
+        struct fwr_header_audio_s **frame)
+{
+	if (!buffer)
+		return -1;
+
+	uint8_t *ptr;
+	uint32_t bufferLengthBytes = frameCount * channelCount * (sampleDepth / 8);
+	struct fwr_header_audio_s *f = fwr_frame_alloc(session, FWR_FRAME_AUDIO, sizeof(*f), bufferLengthBytes, &ptr);
+	if (!f)
+		return -1;
+
+	f->channelCount = channelCount;
+	f->frameCount = frameCount;
+	f->sampleDepth = sampleDepth;
+	f->bufferLengthBytes = bufferLengthBytes;
+	f->ptr = ptr;
+
+	memcpy(f->ptr, buffer, f->bufferLengthBytes);
+        f->footer = audio_v1_footer;
+
+	*frame = f;
+	return 0;
+}
+
+int fwr_pcm_frame_write(struct fwr_session_s *session, struct fwr_header_audio_s *frame)
+{
+	uint32_t frame_type = audio_v1_header;
+	struct iovec seg[] = {
+		{ &frame_type,    sizeof(frame_type) },
+		{ frame,          fwr_header_audio_size_pre },
+		{ frame->ptr,     frame->bufferLengthBytes },
+		{ &frame->footer, fwr_header_audio_size_post },
+	};
+
+	return fwr_session_record_write(session, seg, 4);
+}
+
+/* -- */
+int fwr_timing_frame_create(struct fwr_session_s *session,
+        uint32_t decklinkCaptureMode,
+        struct fwr_header_timing_s **frame)
+{
+	struct fwr_header_timing_s *f = fwr_frame_alloc(session, FWR_FRAME_TIMING, sizeof(*f), 0, NULL);
+	if (!f)
+		return -1;
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+
+	f->counter = session->counter++;
+	f->ts1 = now; /* Implicit struct copy, ts1 is packed. */
+	f->decklinkCaptureMode = decklinkCaptureMode;
+	f->eof = timing_v1_footer;
+
+	*frame = f;
+	return 0;
+}
+
+int fwr_timing_frame_write(struct fwr_session_s *session, struct fwr_header_timing_s *frame)
+{
+	if (session->segment && session->writeMode) {
+		struct timeval ts;
+		memcpy(&ts, &frame->ts1, sizeof(ts));
+		if (fwr_segment_due(session, &ts))
+			fwr_segment_rotate(session, &ts);
+	}
+	if (session->recorder && session->writeMode) {
+		struct timeval ts;
+		memcpy(&ts, &frame->ts1, sizeof(ts));
+		fwr_recorder_timing(session, &ts);
+	}
+
+	/* After a geometry change every frame describes its own VANC, an index seek can
+	 * land on any of them and only knows the first descriptor in the file.
+	 */
+	if (session->vancStreamValid && session->vancStreamFirstValid &&
+		memcmp(&session->vancStream, &session->vancStreamFirst, sizeof(session->vancStream)) != 0)
+	{
+		session->vancStreamValid = 0;
+	}
+
+	if (session->index && session->writeMode)
+		fwr_index_add(session, frame);
+
+	uint32_t frame_type = timing_v1_header;
+	struct iovec seg[] = {
+		{ &frame_type, sizeof(frame_type) },
+		{ frame,       sizeof(*frame) },
+	};
+
+	return fwr_session_record_write(session, seg, 2);
+}
+
+int fwr_timing_frame_read(struct fwr_session_s *session, struct fwr_header_timing_s *frame)
+{
+	if (fwr_session_fread(session, frame, sizeof(*frame)) != sizeof(*frame)) {
+		return -1;
+	}
+
+	if (frame->eof != timing_v1_footer)
+		return -1;
+
+	return 0;
+}
+
+void fwr_timing_frame_free(struct fwr_session_s *session, struct fwr_header_timing_s *frame)
+{
+	fwr_frame_release(session, FWR_FRAME_TIMING, frame, NULL);
+}
+
+int fwr_gap_frame_read(struct fwr_session_s *session, struct fwr_header_gap_s *frame)
+{
+	if (fwr_session_fread(session, frame, sizeof(*frame)) != sizeof(*frame))
+		return -1;
+
+	if (frame->footer != gap_v1_footer)
+		return -1;
+
+	return 0;
+}
+
+/* -- */
+int fwr_video_frame_read(struct fwr_session_s *session, struct fwr_header_video_s **frame)
+{
+	struct fwr_header_video_s *f = malloc(sizeof(*f));
+	if (!f)
+		return -1;
+
+#if LOCAL_DEBUG
+	printf("%s() reading %d bytes of header\n", __func__, fwr_header_video_size_pre);
+#endif
+	if (fwr_session_fread(session, f, fwr_header_video_size_pre) != fwr_header_video_size_pre) {
+		free(f);
+		return -1;
+	}
+
+	int compressed = session->lastHeader == video_v2_header;
+	if (compressed && !session->videoCodec) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (v210codec_alloc(&session->videoCodec, cpus > 8 ? 8 : cpus) < 0) {
+			free(f);
+			return -1;
+		}
+	}
+
+#if LOCAL_DEBUG
+	printf("%s() reading %d bytes of data\n", __func__, f->bufferLengthBytes);
+#endif
+	uint8_t *ptr;
+	if (fwr_session_payload(session, f->bufferLengthBytes, &ptr) < 0) {
+		free(f);
+		return -1;
+	}
+	f->ptr = ptr;
+
+#if LOCAL_DEBUG
+	printf("%s() reading %d bytes of footer\n", __func__, fwr_header_video_size_post);
+#endif
+	if (fwr_session_fread(session, &f->eof, fwr_header_video_size_post) != fwr_header_video_size_post) {
+		fwr_session_payload_free(session, f->ptr);
+		free(f);
+		return -1;
+	}
+
+	if (compressed) {
+		uint8_t *decoded = NULL;
+		uint32_t len = f->height * f->strideBytes;
+		if (f->eof != video_v2_footer || !(decoded = malloc(len)) ||
+			v210codec_decode(session->videoCodec, ptr, f->bufferLengthBytes, f->height, f->strideBytes, decoded) < 0)
+		{
+			free(decoded);
+			fwr_session_payload_free(session, ptr);
+			free(f);
+			return -1;
+		}
+		fwr_session_payload_free(session, ptr);
+		f->ptr = decoded;
+		f->bufferLengthBytes = len;
+		f->eof = video_v1_footer;
+	}
+
+	if (f->eof != video_v1_footer) {
+#if LOCAL_DEBUG
+		printf("%s() f->eof = 0x%x\n", __func__, f->eof);
+#endif
+		return -1;
+	}
+
+	*frame = f;
+	return 0;
+}
+
+void fwr_video_frame_free(struct fwr_session_s *session, struct fwr_header_video_s *frame)
+{
+	fwr_frame_release(session, FWR_FRAME_VIDEO, frame, frame->ptr);
+}
+
+int  fwr_video_frame_create(struct fwr_session_s *session,
+        uint32_t width, uint32_t height, uint32_t strideBytes,
+        const uint8_t *buffer,
+        struct fwr_header_video_s **frame)
+{
+	if (!buffer)
+		return -1;
+
+	uint8_t *ptr;
+	struct fwr_header_video_s *f = fwr_frame_alloc(session, FWR_FRAME_VIDEO, sizeof(*f), height * strideBytes, &ptr);
+	if (!f)
+		return -1;
+
+	f->width = width;
+	f->height = height;
+	f->strideBytes = strideBytes;
+	f->bufferLengthBytes = height * strideBytes;
+	f->ptr = ptr;
+
+	memcpy(f->ptr, buffer, f->bufferLengthBytes);
+        f->eof = video_v1_footer;
+
+	*frame = f;
+	return 0;
+}
+
+static int fwr_video_frame_write_compressed(struct fwr_session_s *session, struct fwr_header_video_s *frame)
+{
+	const uint8_t *buf;
+	uint32_t len;
+
+	if (frame->bufferLengthBytes != frame->height * frame->strideBytes ||
+		v210codec_encode(session->videoCodec, frame->ptr, frame->height, frame->strideBytes, &buf, &len) < 0)
+	{
+		return 1; /* Not for us, write it uncompressed. */
+	}
+
+	uint32_t frame_type = video_v2_header;
+	struct fwr_header_video_s hdr = *frame;
+	hdr.bufferLengthBytes = len;
+	hdr.eof = video_v2_footer;
+	struct iovec seg[] = {
+		{ &frame_type, sizeof(frame_type) },
+		{ &hdr,        fwr_header_video_size_pre },
+		{ (void *)buf, len },
+		{ &hdr.eof,    fwr_header_video_size_post },
+	};
+
+	/* The codec reuses its output buffer for the next frame, so it can't sit in a batch. */
+	if (fwr_session_record_write(session, seg, 4) < 0)
+		return -1;
+	if (session->batching)
+		return fwr_session_flush(session);
+
+	return 0;
+}
+
+int fwr_video_frame_write(struct fwr_session_s *session, struct fwr_header_video_s *frame)
+{
+	if (session->videoCodec) {
+		int ret = fwr_video_frame_write_compressed(session, frame);
+		if (ret <= 0)
+			return ret;
+	}
+
+	uint32_t frame_type = video_v1_header;
+	struct iovec seg[] = {
+		{ &frame_type, sizeof(frame_type) },
+		{ frame,       fwr_header_video_size_pre },
+		{ frame->ptr,  frame->bufferLengthBytes },
+		{ &frame->eof, fwr_header_video_size_post },
+	};
+
+	return fwr_session_record_write(session, seg, 4);
+}
+
+/* -- */
+/* Compact VANC, see fwr_session_vanc_compact_set(). */
+#define FWR_VANC_SAMPLES_MAX 16384 /* Cb Y Cr Y ... samples in a line, 8192 pixels. */
+
+static int fwr_vanc_scratch_alloc(struct fwr_session_s *s)
+{
+	if (!s->vancSamples)
+		s->vancSamples = malloc((FWR_VANC_SAMPLES_MAX + 2) * sizeof(*s->vancSamples));
+	if (s->writeMode && !s->vancPackets)
+		s->vancPackets = malloc(FWR_VANC_SAMPLES_MAX * sizeof(uint16_t));
+
+	return s->vancSamples && (s->vancPackets || !s->writeMode) ? 0 : -1;
+}
+
+/* v210 packs three 10 bit samples into each little endian 32 bit word. Both directions
+ * work in whole words, dst (unpack) and src (pack) have room for two samples extra.
+ */
+static void fwr_vanc_unpack(const uint8_t *src, uint32_t samples, uint16_t *dst)
+{
+	for (uint32_t i = 0; i < samples; i += 3) {
+		uint32_t w;
+		memcpy(&w, src + (i / 3) * 4, sizeof(w));
+		dst[i + 0] = w & 0x3ff;
+		dst[i + 1] = (w >> 10) & 0x3ff;
+		dst[i + 2] = (w >> 20) & 0x3ff;
+	}
+}
+
+static void fwr_vanc_pack(const uint16_t *src, uint32_t samples, uint8_t *dst)
+{
+	for (uint32_t i = 0; i < samples; i += 3) {
+		uint32_t w = src[i + 0] | (src[i + 1] << 10) | ((uint32_t)src[i + 2] << 20);
+		memcpy(dst + (i / 3) * 4, &w, sizeof(w));
+	}
+}
+
+/* Is the line long enough to hold width pixels, and narrow enough to scan? */
+static uint32_t fwr_vanc_samples(uint32_t width, uint32_t bufferLengthBytes)
+{
+	uint32_t samples = width * 2;
+	if (samples == 0 || samples > FWR_VANC_SAMPLES_MAX || (samples + 2) / 3 * 4 > bufferLengthBytes)
+		return 0;
+
+	return samples;
+}
+
+/* Find the ANC packets in a line, ADF 000 3FF 3FF then DID, SDID, DC, DC user data
+ * words and a checksum. SD packets run through all the samples, HD ones through either
+ * the luma or the chroma samples. Serializes them to out as packet records expect,
+ * returns the number of bytes written, at most 2 per sample.
+ */
+static size_t fwr_vanc_packets_find(const uint16_t *w, uint32_t samples, int sd, uint8_t *out)
+{
+	uint32_t step = sd ? 1 : 2;
+	size_t len = 0;
+
+	for (uint32_t first = 0; first < step; first++) {
+		for (uint32_t i = first; i + 5 * step < samples; i += step) {
+			if (w[i] != 0x000 || w[i + step] != 0x3ff || w[i + 2 * step] != 0x3ff)
+				continue;
+
+			uint32_t count = 3 + (w[i + 5 * step] & 0xff) + 1;
+			if (i + (2 + count) * step >= samples)
+				break; /* Cut short by the end of the line. */
+
+			struct fwr_vanc_packet_s pkt = { i, step, count };
+			memcpy(out + len, &pkt, sizeof(pkt));
+			len += sizeof(pkt);
+			for (uint32_t k = 0; k < count; k++) {
+				uint16_t v = w[i + (3 + k) * step];
+				memcpy(out + len, &v, sizeof(v));
+				len += sizeof(v);
+			}
+			i += (2 + count) * step;
+		}
+	}
+
+	return len;
+}
+
+/* Blank the line, then put the packets back where they were found. */
+static int fwr_vanc_packets_place(const uint8_t *buf, uint32_t len, uint32_t samples, uint16_t *w)
+{
+	for (uint32_t i = 0; i < samples; i++)
+		w[i] = i & 1 ? 0x040 : 0x200;
+	w[samples] = w[samples + 1] = 0;
+
+	uint32_t pos = 0;
+	while (pos < len) {
+		struct fwr_vanc_packet_s pkt;
+		if (len - pos < sizeof(pkt))
+			return -1;
+		memcpy(&pkt, buf + pos, sizeof(pkt));
+		pos += sizeof(pkt);
+
+		uint32_t offset = pkt.offset, step = pkt.step, count = pkt.wordCount;
+		if (step == 0 || len - pos < count * sizeof(uint16_t) || offset + (2 + count) * step >= samples)
+			return -1;
+
+		w[offset] = 0x000;
+		w[offset + step] = 0x3ff;
+		w[offset + 2 * step] = 0x3ff;
+		for (uint32_t k = 0; k < count; k++) {
+			uint16_t v;
+			memcpy(&v, buf + pos, sizeof(v));
+			pos += sizeof(v);
+			w[offset + (3 + k) * step] = v & 0x3ff;
+		}
+	}
+
+	return 0;
+}
+
+static int fwr_vanc_frame_read_compact(struct fwr_session_s *s, struct fwr_header_vanc_s **frame)
+{
+	struct fwr_header_vanc_v2_s hdr;
+	uint32_t eol;
+	uint8_t *ptr;
+
+	/* Nothing has said what the lines look like, Eg. after a seek without a usable index. */
+	if (!s->vancStreamValid)
+		return -1;
+
+	if (fwr_session_fread(s, &hdr, sizeof(hdr)) != sizeof(hdr))
+		return -1;
+	if (fwr_session_payload(s, hdr.bufferLengthBytes, &ptr) < 0)
+		return -1;
+	if (fwr_session_fread(s, &eol, sizeof(eol)) != sizeof(eol) || eol != VANC_EOL_INDICATOR) {
+		fwr_session_payload_free(s, ptr);
+		return -1;
+	}
+
+	struct fwr_header_vanc_s *f = malloc(sizeof(*f));
+	if (!f) {
+		fwr_session_payload_free(s, ptr);
+		return -1;
+	}
+	f->line = hdr.line;
+	f->width = s->vancStream.width;
+	f->height = s->vancStream.height;
+	f->strideBytes = s->vancStream.strideBytes;
+	f->eol = VANC_EOL_INDICATOR;
+
+	if (s->lastHeader == vanc_line_v2_header) {
+		f->bufferLengthBytes = hdr.bufferLengthBytes;
+		f->ptr = ptr;
+		*frame = f;
+		return 0;
+	}
+
+	uint32_t samples = fwr_vanc_samples(f->width, f->strideBytes);
+	uint8_t *line = samples ? calloc(1, f->strideBytes) : NULL;
+	if (!line || fwr_vanc_scratch_alloc(s) < 0 ||
+		fwr_vanc_packets_place(ptr, hdr.bufferLengthBytes, samples, s->vancSamples) < 0)
+	{
+		free(line);
+		fwr_session_payload_free(s, ptr);
+		free(f);
+		return -1;
+	}
+	fwr_vanc_pack(s->vancSamples, samples, line);
+	fwr_session_payload_free(s, ptr);
+
+	f->bufferLengthBytes = f->strideBytes;
+	f->ptr = line;
+
+	*frame = f;
+	return 0;
+}
+
+/* Declare the line geometry, unless the last descriptor in this file already did. */
+static int fwr_vanc_stream_write(struct fwr_session_s *s, const struct fwr_header_vanc_s *frame)
+{
+	struct fwr_header_vanc_stream_s d = {
+		frame->width, frame->height, frame->strideBytes, s->vancCompact, vanc_stream_v2_footer
+	};
+	if (s->vancStreamValid && memcmp(&d, &s->vancStream, sizeof(d)) == 0)
+		return 0;
+
+	uint32_t frame_type = vanc_stream_v2_header;
+	struct iovec seg[] = {
+		{ &frame_type, sizeof(frame_type) },
+		{ &d,          sizeof(d) },
+	};
+	if (fwr_session_record_write(s, seg, 2) < 0)
+		return -1;
+
+	s->vancStream = d;
+	s->vancStreamValid = 1;
+	if (!s->vancStreamFirstValid) {
+		s->vancStreamFirst = d;
+		s->vancStreamFirstValid = 1;
+		if (s->index) {
+			s->index->vancStream = d;
+			s->index->vancStreamValid = 1;
+		}
+	}
+
+	return 0;
+}
+
+static int fwr_vanc_frame_write_compact(struct fwr_session_s *s, struct fwr_header_vanc_s *frame)
+{
+	uint32_t samples = fwr_vanc_samples(frame->width, frame->bufferLengthBytes);
+	if (!samples || frame->bufferLengthBytes != frame->strideBytes)
+		return 1; /* Not for us, write a v1 record. */
+
+	fwr_vanc_unpack(frame->ptr, samples, s->vancSamples);
+	size_t len = fwr_vanc_packets_find(s->vancSamples, samples, frame->width <= 720, s->vancPackets);
+	if (len == 0)
+		return 0; /* No ANC, nothing worth keeping. */
+
+	if (fwr_vanc_stream_write(s, frame) < 0)
+		return -1;
+
+	uint32_t frame_type = vanc_line_v2_header;
+	struct fwr_header_vanc_v2_s hdr = { frame->line, frame->bufferLengthBytes };
+	const uint8_t *payload = frame->ptr;
+	if (s->vancCompact == FWR_VANC_COMPACT_PACKETS) {
+		frame_type = vanc_packets_v2_header;
+		hdr.bufferLengthBytes = len;
+		payload = s->vancPackets;
+	}
+	uint32_t eol = VANC_EOL_INDICATOR;
+	struct iovec seg[] = {
+		{ &frame_type,       sizeof(frame_type) },
+		{ &hdr,              sizeof(hdr) },
+		{ (void *)payload,   hdr.bufferLengthBytes },
+		{ &eol,              sizeof(eol) },
+	};
+
+	if (fwr_session_record_write(s, seg, 4) < 0)
+		return -1;
+
+	/* Packets are rebuilt in place for the next line, a large set can't sit in a batch. */
+	if (payload == s->vancPackets && len > FWR_STAGE_INLINE_MAX && s->batching)
+		return fwr_session_flush(s);
+
+	return 0;
+}
+
+int fwr_vanc_frame_read(struct fwr_session_s *session, struct fwr_header_vanc_s **frame)
+{
+	if (session->lastHeader == vanc_line_v2_header || session->lastHeader == vanc_packets_v2_header)
+		return fwr_vanc_frame_read_compact(session, frame);
+
+	struct fwr_header_vanc_s *f = malloc(sizeof(*f));
+	if (!f)
+		return -1;
+
+#if LOCAL_DEBUG
+	printf("%s() reading %d bytes of header\n", __func__, fwr_header_vanc_size_pre);
+#endif
+	if (fwr_session_fread(session, f, fwr_header_vanc_size_pre) != fwr_header_vanc_size_pre) {
+		free(f);
+		return -1;
+	}
+
+#if LOCAL_DEBUG
+	printf("%s() reading %d bytes of data\n", __func__, f->bufferLengthBytes);
+#endif
+	uint8_t *ptr;
+	if (fwr_session_payload(session, f->bufferLengthBytes, &ptr) < 0) {
+		free(f);
+		return -1;
+	}
+	f->ptr = ptr;
+
+#if LOCAL_DEBUG
+	printf("%s() reading %d bytes of footer\n", __func__, fwr_header_vanc_size_post);
+#endif
+	if (fwr_session_fread(session, &f->eol, fwr_header_vanc_size_post) != fwr_header_vanc_size_post) {
+		fwr_session_payload_free(session, f->ptr);
+		free(f);
+		return -1;
+	}
+
+	if (f->eol != VANC_EOL_INDICATOR) {
+#if LOCAL_DEBUG
+		printf("%s() f->eol = 0x%x\n", __func__, f->eol);
+#endif
+		return -1;
+	}
+
+	*frame = f;
+	return 0;
+}
+
+void fwr_vanc_frame_free(struct fwr_session_s *session, struct fwr_header_vanc_s *frame)
+{
+	fwr_frame_release(session, FWR_FRAME_VANC, frame, frame->ptr);
+}
+
+int  fwr_vanc_frame_create(struct fwr_session_s *session,
+	uint32_t line,
+        uint32_t width, uint32_t height, uint32_t strideBytes,
+        const uint8_t *buffer,
+        struct fwr_header_vanc_s **frame)
+{
+	if (!buffer)
+		return -1;
+
+	uint8_t *ptr;
+	struct fwr_header_vanc_s *f = fwr_frame_alloc(session, FWR_FRAME_VANC, sizeof(*f), strideBytes, &ptr);
+	if (!f)
+		return -1;
+
+	f->line = line;
+	f->width = width;
+	f->height = height;
+	f->strideBytes = strideBytes;
+	f->bufferLengthBytes = strideBytes;
+	f->ptr = ptr;
+
+	memcpy(f->ptr, buffer, f->bufferLengthBytes);
+        f->eol = VANC_EOL_INDICATOR;
+
+	*frame = f;
+	return 0;
+}
+
+int fwr_vanc_frame_write(struct fwr_session_s *session, struct fwr_header_vanc_s *frame)
+{
+	if (session->vancCompact) {
+		int ret = fwr_vanc_frame_write_compact(session, frame);
+		if (ret <= 0)
+			return ret;
+	}
+
+	uint32_t frame_type = VANC_SOL_INDICATOR;
+	struct iovec seg[] = {
+		{ &frame_type, sizeof(frame_type) },
+		{ frame,       fwr_header_vanc_size_pre },
+		{ frame->ptr,  frame->bufferLengthBytes },
+		{ &frame->eol, fwr_header_vanc_size_post },
+	};
+
+	return fwr_session_record_write(session, seg, 4);
+}
+
+int fwr_session_frame_gettype(struct fwr_session_s *session, uint32_t *header)
+{
+	while (1) {
+		size_t r = fwr_session_fread(session, header, sizeof(*header));
+		if (r != sizeof(*header))
+			return -1;
+		if (*header != vanc_stream_v2_header)
+			break;
+
+		/* Stream descriptors only describe the VANC records after them, callers never see one. */
+		struct fwr_header_vanc_stream_s *d = &session->vancStream;
+		if (fwr_session_fread(session, d, sizeof(*d)) != sizeof(*d) || d->footer != vanc_stream_v2_footer) {
+			session->vancStreamValid = 0;
+			return -1;
+		}
+		session->vancStreamValid = 1;
+	}
+
+	session->lastHeader = *header;
+
+	return 0;
+}
+
+/* Called with listMutex held. Account for a frame that won't be written, and extend the
+ * gap record that takes its place in the file.
+ */
+static void fwr_writer_drop(struct fwr_session_s *s, int type, size_t bytes)
+{
+	s->stats.droppedFrames++;
+	s->stats.droppedBytes += bytes;
+	s->stats.type[type].droppedFrames++;
+	s->stats.type[type].droppedBytes += bytes;
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+
+	struct fwr_header_gap_s *g = s->gapPending[type];
+	if (!g) {
+		g = calloc(1, sizeof(*g));
+		if (!g)
+			return; /* Still counted, just not marked in the file. */
+		g->type = type;
+		g->first = now;
+		g->footer = gap_v1_footer;
+		s->gapPending[type] = g;
+	}
+	g->count++;
+	g->bytes += bytes;
+	g->last = now;
+}
+
+/* Called with listMutex held. */
+static int fwr_writer_append(struct fwr_session_s *s, void *ptr, int type, size_t bytes, uint64_t now,
+	fwr_release_callback release, void *opaque)
+{
+	struct fwr_writer_node_s *n;
+
+	if (!xorg_list_is_empty(&s->freeList)) {
+		n = xorg_list_first_entry(&s->freeList, struct fwr_writer_node_s, list);
+		xorg_list_del(&n->list);
+	} else {
+		n = malloc(sizeof(*n));
+		if (!n)
+			return -1;
+	}
+
+	n->ptr = ptr;
+	n->type = type;
+	n->bytes = bytes;
+	n->enqueuedUs = now;
+	n->release = release;
+	n->opaque = opaque;
+	xorg_list_append(&n->list, &s->list);
+
+	s->stats.enqueuedFrames++;
+	s->stats.queueFrames++;
+	s->stats.queueBytes += bytes;
+	s->stats.type[type].queueFrames++;
+	s->stats.type[type].queueBytes += bytes;
+	if (s->stats.queueFrames > s->stats.queueFramesHWM)
+		s->stats.queueFramesHWM = s->stats.queueFrames;
+	if (s->stats.queueBytes > s->stats.queueBytesHWM)
+		s->stats.queueBytesHWM = s->stats.queueBytes;
+
+	return 0;
+}
+
+/* Called with listMutex held. Queue a gap record for each type with drops, ahead of
+ * the next record accepted.
+ */
+static void fwr_writer_gaps_append(struct fwr_session_s *s, uint64_t now)
+{
+	for (int i = 1; i <= FWR_FRAME_TYPE_MAX; i++) {
+		struct fwr_header_gap_s *g = s->gapPending[i];
+		if (!g)
+			continue;
+
+		s->gapPending[i] = NULL;
+		if (fwr_writer_append(s, g, FWR_FRAME_GAP, fwr_writer_frame_size(g, FWR_FRAME_GAP), now, NULL, NULL) < 0)
+			free(g);
+	}
+}
+
+/* Called with listMutex held. Would another frame exceed the queue limits? Shed video
+ * has a budget of its own, and doesn't count towards them.
+ */
+static int fwr_writer_queue_full(struct fwr_session_s *s, size_t bytes)
+{
+	uint64_t queueBytes = s->stats.queueBytes;
+	uint32_t queueFrames = s->stats.queueFrames;
+	if (s->shedMaxBytes) {
+		queueBytes -= s->stats.type[FWR_FRAME_VIDEO].queueBytes;
+		queueFrames -= s->stats.type[FWR_FRAME_VIDEO].queueFrames;
+	}
+
+	/* An empty queue always accepts a frame, otherwise a single frame larger
+	 * than the byte limit could never be written.
+	 */
+	if (queueFrames == 0)
+		return 0;
+
+	return (s->queueMaxBytes && queueBytes + bytes > s->queueMaxBytes) ||
+		(s->queueMaxFrames && queueFrames >= s->queueMaxFrames);
+}
+
+/* Called with listMutex held. Should a video frame be shed to stay within its budget? */
+static int fwr_writer_shed(struct fwr_session_s *s, size_t bytes)
+{
+	uint64_t queued = s->stats.type[FWR_FRAME_VIDEO].queueBytes;
+	if (queued == 0)
+		return 0;
+	if (queued + bytes > s->shedMaxBytes)
+		return 1;
+	if (s->shedDecimation > 1 && queued + bytes > s->shedMaxBytes / 2)
+		return s->shedSequence++ % s->shedDecimation != 0;
+
+	return 0;
+}
+
+static int fwr_writer_enqueue_internal(struct fwr_session_s *session, void *ptr, int type,
+	fwr_release_callback release, void *opaque)
+{
+	size_t bytes = fwr_writer_frame_size(ptr, type);
+	uint64_t now = fwr_monotonic_us();
+
+	pthread_mutex_lock(&session->listMutex);
+
+	if (type == FWR_FRAME_VIDEO && session->shedMaxBytes) {
+		if (fwr_writer_shed(session, bytes))
+			goto drop;
+	} else if (!session->shedMaxBytes || session->queuePolicy == FWR_QUEUE_POLICY_BLOCK) {
+		/* With video shed, the rest is never dropped, only held up under BLOCK. */
+		while (!session->thread_terminate && fwr_writer_queue_full(session, bytes)) {
+			if (session->queuePolicy != FWR_QUEUE_POLICY_BLOCK)
+				goto drop;
+
+			session->stats.blockedCount++;
+			pthread_cond_wait(&session->spaceCond, &session->listMutex);
+		}
+	}
+
+	fwr_writer_gaps_append(session, now);
+	if (fwr_writer_append(session, ptr, type, bytes, now, release, opaque) < 0)
+		goto drop;
+
+	pthread_cond_signal(&session->cond);
+	pthread_mutex_unlock(&session->listMutex);
+
+	return 0;
+
+drop:
+	fwr_writer_drop(session, type, bytes);
+	pthread_mutex_unlock(&session->listMutex);
+	fwr_writer_node_release(session, ptr, type, release, opaque);
+
+	return -1;
+}
+
+int fwr_writer_enqueue(struct fwr_session_s *session, void *ptr, int type)
+{
+	return fwr_writer_enqueue_internal(session, ptr, type, NULL, NULL);
+}
+
+int fwr_writer_enqueue_video_ref(struct fwr_session_s *session,
+	uint32_t width, uint32_t height, uint32_t strideBytes,
+	const uint8_t *buffer,
+	fwr_release_callback release, void *opaque)
+{
+	struct fwr_header_video_s *f = fwr_frame_alloc(session, FWR_FRAME_VIDEO, sizeof(*f), 0, NULL);
+	if (!f) {
+		release(opaque);
+		return -1;
+	}
+
+	f->width = width;
+	f->height = height;
+	f->strideBytes = strideBytes;
+	f->bufferLengthBytes = height * strideBytes;
+	f->ptr = (uint8_t *)buffer;
+	f->eof = video_v1_footer;
+
+	return fwr_writer_enqueue_internal(session, f, FWR_FRAME_VIDEO, release, opaque);
+}
+
+int fwr_writer_enqueue_pcm_ref(struct fwr_session_s *session,
+	uint32_t frameCount, uint32_t sampleDepth, uint32_t channelCount,
+	const uint8_t *buffer,
+	fwr_release_callback release, void *opaque)
+{
+	struct fwr_header_audio_s *f = fwr_frame_alloc(session, FWR_FRAME_AUDIO, sizeof(*f), 0, NULL);
+	if (!f) {
+		release(opaque);
+		return -1;
+	}
+
+	f->channelCount = channelCount;
+	f->frameCount = frameCount;
+	f->sampleDepth = sampleDepth;
+	f->bufferLengthBytes = frameCount * channelCount * (sampleDepth / 8);
+	f->ptr = (uint8_t *)buffer;
+	f->footer = audio_v1_footer;
+
+	return fwr_writer_enqueue_internal(session, f, FWR_FRAME_AUDIO, release, opaque);
+}
+
+int fwr_buffer_alloc(const uint8_t *src, size_t len, struct fwr_buffer_s **buf)
+{
+	/* Header and payload in a single allocation. */
+	struct fwr_buffer_s *b = malloc(sizeof(*b) + len);
+	if (!b)
+		return -1;
+
+	memcpy(b + 1, src, len);
+	b->ptr = (const uint8_t *)(b + 1);
+	b->len = len;
+	b->refCount = 1;
+	b->release = NULL;
+	b->opaque = NULL;
+
+	*buf = b;
+	return 0;
+}
+
+int fwr_buffer_wrap(const uint8_t *ptr, size_t len, fwr_release_callback release, void *opaque, struct fwr_buffer_s **buf)
+{
+	struct fwr_buffer_s *b = malloc(sizeof(*b));
+	if (!b) {
+		release(opaque);
+		return -1;
+	}
+
+	b->ptr = ptr;
+	b->len = len;
+	b->refCount = 1;
+	b->release = release;
+	b->opaque = opaque;
+
+	*buf = b;
+	return 0;
+}
+
+struct fwr_buffer_s *fwr_buffer_ref(struct fwr_buffer_s *buf)
+{
+	__sync_fetch_and_add(&buf->refCount, 1);
+	return buf;
+}
+
+void fwr_buffer_unref(struct fwr_buffer_s *buf)
+{
+	if (__sync_sub_and_fetch(&buf->refCount, 1) != 0)
+		return;
+
+	if (buf->release)
+		buf->release(buf->opaque);
+	free(buf);
+}
+
+/* fwr_release_callback for frames queued from a shared buffer. */
+static void fwr_buffer_release(void *opaque)
+{
+	fwr_buffer_unref((struct fwr_buffer_s *)opaque);
+}
+
+int fwr_writer_enqueue_video_buffer(struct fwr_session_s *session,
+	uint32_t width, uint32_t height, uint32_t strideBytes,
+	struct fwr_buffer_s *buf)
+{
+	if (buf->len < (size_t)height * strideBytes)
+		return -1;
+
+	return fwr_writer_enqueue_video_ref(session, width, height, strideBytes, buf->ptr,
+		fwr_buffer_release, fwr_buffer_ref(buf));
+}
+
+int fwr_writer_enqueue_pcm_buffer(struct fwr_session_s *session,
+	uint32_t frameCount, uint32_t sampleDepth, uint32_t channelCount,
+	struct fwr_buffer_s *buf)
+{
+	if (buf->len < (size_t)frameCount * channelCount * (sampleDepth / 8))
+		return -1;
+
+	return fwr_writer_enqueue_pcm_ref(session, frameCount, sampleDepth, channelCount, buf->ptr,
+		fwr_buffer_release, fwr_buffer_ref(buf));
+}
+
+int fwr_session_queue_limits_set(struct fwr_session_s *session, uint64_t maxBytes, uint32_t maxFrames, int policy)
+{
+	if (!session->writeMode)
+		return -1;
+	if (policy != FWR_QUEUE_POLICY_DROP && policy != FWR_QUEUE_POLICY_BLOCK)
+		return -1;
+
+	pthread_mutex_lock(&session->listMutex);
+	session->queueMaxBytes = maxBytes;
+	session->queueMaxFrames = maxFrames;
+	session->queuePolicy = policy;
+	pthread_cond_broadcast(&session->spaceCond);
+	pthread_mutex_unlock(&session->listMutex);
+
+	return 0;
+}
+
+int fwr_session_shed_set(struct fwr_session_s *session, uint64_t maxBytes, uint32_t decimation)
+{
+	if (!session->writeMode)
+		return -1;
+
+	pthread_mutex_lock(&session->listMutex);
+	session->shedMaxBytes = maxBytes;
+	session->shedDecimation = decimation;
+	session->shedSequence = 0;
+	pthread_cond_broadcast(&session->spaceCond);
+	pthread_mutex_unlock(&session->listMutex);
+
+	return 0;
+}
+
+int fwr_session_pool_alloc(struct fwr_session_s *session, int type, size_t bufferLengthBytes, uint32_t count, int flags)
+{
+	size_t hdrBytes;
+
+	switch (type) {
+	case FWR_FRAME_TIMING:
+		hdrBytes = sizeof(struct fwr_header_timing_s);
+		bufferLengthBytes = 0;
+		break;
+	case FWR_FRAME_VIDEO:
+		hdrBytes = sizeof(struct fwr_header_video_s);
+		break;
+	case FWR_FRAME_AUDIO:
+		hdrBytes = sizeof(struct fwr_header_audio_s);
+		break;
+	case FWR_FRAME_VANC:
+		hdrBytes = sizeof(struct fwr_header_vanc_s);
+		break;
+	default:
+		return -1;
+	}
+
+	if (!session->writeMode || count == 0)
+		return -1;
+
+	size_t slotBytes = FWR_POOL_HDR_BYTES(FWR_POOL_HDR_BYTES(hdrBytes) + bufferLengthBytes);
+
+	pthread_mutex_lock(&session->poolMutex);
+	struct fwr_pool_s *old = session->pools[type];
+	pthread_mutex_unlock(&session->poolMutex);
+	if (old && old->slotBytes == slotBytes && old->slotCount == count && old->flags == flags)
+		return 0; /* Nothing changed */
+
+	/* Populate the new pool before taking the lock, the capture thread may be waiting on it. */
+	struct fwr_pool_s *p = fwr_pool_alloc(FWR_POOL_HDR_BYTES(hdrBytes) + bufferLengthBytes, count, flags);
+	if (!p)
+		return -1;
+
+	pthread_mutex_lock(&session->poolMutex);
+	old = session->pools[type];
+	session->pools[type] = p;
+	if (old) {
+		pthread_mutex_lock(&old->mutex);
+		int idle = old->freeCount == old->slotCount;
+		pthread_mutex_unlock(&old->mutex);
+		if (idle) {
+			fwr_pool_free(old);
+		} else {
+			old->next = session->poolsRetired;
+			session->poolsRetired = old;
+		}
+	}
+	pthread_mutex_unlock(&session->poolMutex);
+
+	return 0;
+}
+
+int fwr_session_direct_io_set(struct fwr_session_s *session, size_t bufferBytes)
+{
+	struct stat st;
+
+	if (!session->writeMode || session->fd < 0 || session->direct)
+		return -1;
+
+	/* Only before anything has been queued, the file offset must stay aligned. A marker
+	 * already written is rewritten as the start of the first buffer.
+	 */
+	pthread_mutex_lock(&session->listMutex);
+	uint64_t enqueued = session->stats.enqueuedFrames;
+	pthread_mutex_unlock(&session->listMutex);
+	off_t written = session->fileMarker ? FWR_FILE_MARKER_BYTES : 0;
+	if (enqueued || lseek(session->fd, 0, SEEK_CUR) != written)
+		return -1;
+
+	size_t align = FWR_DIRECT_ALIGN;
+	if (fstat(session->fd, &st) == 0 && st.st_blksize > (blksize_t)align && st.st_blksize <= 65536 &&
+		(st.st_blksize & (st.st_blksize - 1)) == 0) {
+		align = st.st_blksize;
+	}
+
+	if (bufferBytes == 0)
+		bufferBytes = FWR_DIRECT_BUFFER_BYTES;
+	bufferBytes = (bufferBytes + align - 1) & ~(align - 1);
+
+	/* Not every filesystem supports O_DIRECT, Eg. tmpfs. */
+	int flags = fcntl(session->fd, F_GETFL);
+	if (flags < 0 || fcntl(session->fd, F_SETFL, flags | O_DIRECT) < 0)
+		return -1;
+
+	for (int i = 0; i < 2; i++) {
+		if (posix_memalign((void **)&session->directBuffer[i], align, bufferBytes) != 0) {
+			free(session->directBuffer[0]);
+			session->directBuffer[0] = NULL;
+			fcntl(session->fd, F_SETFL, flags);
+			return -1;
+		}
+	}
+
+	pthread_mutex_init(&session->directMutex, NULL);
+	pthread_cond_init(&session->directCond, NULL);
+	session->directAlign = align;
+	session->directBufferSize = bufferBytes;
+	session->directFill = 0;
+	session->directUsed = 0;
+	session->directBytes = 0;
+
+	if (pthread_create(&session->directThreadId, 0, fwr_direct_threadfunc, session) != 0) {
+		pthread_cond_destroy(&session->directCond);
+		pthread_mutex_destroy(&session->directMutex);
+		free(session->directBuffer[0]);
+		free(session->directBuffer[1]);
+		session->directBuffer[0] = session->directBuffer[1] = NULL;
+		fcntl(session->fd, F_SETFL, flags);
 		return -1;
 	}
 
-	memcpy(f->ptr, buffer, f->bufferLengthBytes);
-        f->footer = audio_v1_footer;
+	/* The writer thread only looks at this once frames are queued, which we've ruled out above. */
+	session->direct = 1;
+	if (written) {
+		lseek(session->fd, 0, SEEK_SET);
+		fwr_session_marker_write(session);
+	}
 
-	*frame = f;
 	return 0;
 }
 
-int fwr_pcm_frame_write(struct fwr_session_s *session, struct fwr_header_audio_s *frame)
+int fwr_session_index_set(struct fwr_session_s *session, const char *filename)
 {
-	uint32_t frame_type = audio_v1_header;
-	if (gzfwrite(&frame_type, 1, sizeof(frame_type), session->fh) != sizeof(frame_type)) {
-		return -1;
-	}
-	if (gzfwrite(frame, 1, fwr_header_audio_size_pre, session->fh) != fwr_header_audio_size_pre) {
+	/* Flight recorder dumps start wherever the ring happens to, there's nothing to index. */
+	if (!session->writeMode || session->index || session->recorder || !filename)
 		return -1;
-	}
-	if (gzfwrite(frame->ptr, 1, frame->bufferLengthBytes, session->fh) != frame->bufferLengthBytes) {
+
+	pthread_mutex_lock(&session->listMutex);
+	uint64_t enqueued = session->stats.enqueuedFrames;
+	pthread_mutex_unlock(&session->listMutex);
+	if (enqueued)
 		return -1;
-	}
 
-	if (gzfwrite(&frame->footer, 1, fwr_header_audio_size_post, session->fh) != fwr_header_audio_size_post) {
+	struct fwr_index_s *idx = calloc(1, sizeof(*idx));
+	if (!idx)
+		return -1;
+	idx->fd = -1;
+	/* Segmented sessions index each segment separately. */
+	if (session->segment)
+		idx->filename = fwr_segment_name(session->segment, session->segment->current, ".idx");
+	else
+		idx->filename = strdup(filename);
+	if (!idx->filename) {
+		free(idx);
 		return -1;
 	}
 
+	session->index = idx;
 	return 0;
 }
 
-/* -- */
-int fwr_timing_frame_create(struct fwr_session_s *session,
-        uint32_t decklinkCaptureMode,
-        struct fwr_header_timing_s **frame)
+int fwr_session_segment_set(struct fwr_session_s *session, uint32_t seconds, uint64_t maxBytes, uint32_t keepCount)
 {
-	struct fwr_header_timing_s *f = malloc(sizeof(*f));
-	if (!f)
+	if (!session->writeMode || session->segment || session->recorder || (seconds == 0 && maxBytes == 0))
 		return -1;
 
-	f->counter = session->counter++;
-	gettimeofday(&f->ts1, NULL);
-	f->decklinkCaptureMode = decklinkCaptureMode;
-	f->eof = timing_v1_footer;
-
-	*frame = f;
-	return 0;
-}
+	pthread_mutex_lock(&session->listMutex);
+	uint64_t enqueued = session->stats.enqueuedFrames;
+	pthread_mutex_unlock(&session->listMutex);
+	if (enqueued || session->streamOffset)
+		return -1;
 
-int fwr_timing_frame_write(struct fwr_session_s *session, struct fwr_header_timing_s *frame)
-{
-	uint32_t frame_type = timing_v1_header;
-	if (gzfwrite(&frame_type, 1, sizeof(frame_type), session->fh) != sizeof(frame_type)) {
+	struct fwr_segment_s *sg = calloc(1, sizeof(*sg));
+	if (!sg)
+		return -1;
+	if (fwr_filename_split(session->filename, &sg->prefix, &sg->suffix) < 0) {
+		free(sg);
 		return -1;
 	}
 
-	if (gzfwrite(frame, 1, sizeof(*frame), session->fh) != sizeof(*frame)) {
+	sg->seconds = seconds;
+	sg->maxBytes = maxBytes;
+	sg->keepCount = keepCount;
+	sg->preallocBytes = maxBytes;
+	sg->nextFd = -1;
+
+	/* The file opened with the session becomes the first segment. */
+	char *name = fwr_segment_name(sg, 0, "");
+	if (!name || rename(session->filename, name) < 0) {
+		free(name);
+		free(sg->prefix);
+		free(sg->suffix);
+		free(sg);
 		return -1;
 	}
+	free(name);
+
+	if (session->index) {
+		name = fwr_segment_name(sg, 0, ".idx");
+		if (name) {
+			free(session->index->filename);
+			session->index->filename = name;
+		}
+	}
+
+	session->segment = sg;
+	sg->nextFd = fwr_segment_open(sg, 1);
 
 	return 0;
 }
 
-int fwr_timing_frame_read(struct fwr_session_s *session, struct fwr_header_timing_s *frame)
+static int fwr_session_seek_entry_fh(struct fwr_session_s *s, const struct fwr_index_entry_s *e);
+
+/* Position the READ session at the timing record described by an index entry. */
+static int fwr_session_seek_entry(struct fwr_session_s *s, const struct fwr_index_entry_s *e)
 {
-	if (gzfread(frame, 1, sizeof(*frame), session->fh) != sizeof(*frame)) {
-		return -1;
-	}
+	/* Frames after a VANC geometry change carry their own descriptor, the rest use the first. */
+	s->vancStream = s->index->vancStream;
+	s->vancStreamValid = s->index->vancStreamValid;
 
-	if (frame->eof != timing_v1_footer)
+	if (!s->readahead)
+		return fwr_session_seek_entry_fh(s, e);
+
+	/* The pipeline owns the file handle while it runs, and has read past the target. */
+	fwr_readahead_stop(s);
+	int ret = fwr_session_seek_entry_fh(s, e);
+	if (fwr_readahead_start(s) < 0)
 		return -1;
 
-	return 0;
+	return ret;
 }
 
-void fwr_timing_frame_free(struct fwr_session_s *session, struct fwr_header_timing_s *frame)
+static int fwr_session_seek_entry_fh(struct fwr_session_s *s, const struct fwr_index_entry_s *e)
 {
-	free(frame);
-}
+	struct fwr_index_s *idx = s->index;
 
-/* -- */
-int fwr_video_frame_read(struct fwr_session_s *session, struct fwr_header_video_s **frame)
-{
-	struct fwr_header_video_s *f = malloc(sizeof(*f));
-	if (!f)
-		return -1;
+	if (s->map) {
+		if (s->fileStart + e->offset > s->mapEnd)
+			return -1;
+		s->mapPos = s->fileStart + e->offset;
+		s->mapAdvised = 0;
+		s->mapReleased = s->mapPos > FWR_MAP_READAHEAD ?
+			(s->mapPos - FWR_MAP_READAHEAD) & ~((size_t)sysconf(_SC_PAGESIZE) - 1) : 0;
+		fwr_session_readahead(s);
+		return 0;
+	}
 
-#if LOCAL_DEBUG
-	printf("%s() reading %d bytes of header\n", __func__, fwr_header_video_size_pre);
+	/* Uncompressed, or one long gzip stream without restart points. zlib seeks from
+	 * where the stream starts, past any marker, stdio from the start of the file.
+	 */
+	if (idx->restartCount == 0) {
+#if HAVE_ZLIB
+		return gzseek(s->fh, e->offset, SEEK_SET) < 0 ? -1 : 0;
+#else
+		return gzseek(s->fh, s->fileStart + e->offset, SEEK_SET) < 0 ? -1 : 0;
 #endif
-	if (gzfread(f, 1, fwr_header_video_size_pre, session->fh) != fwr_header_video_size_pre) {
-		free(f);
-		return -1;
 	}
 
-	f->ptr = malloc(f->bufferLengthBytes);
-	if (!f->ptr) {
-		free(f);
-		return -1;
+	/* Find the last restart point at or before the entry, the stream starts as one. */
+	struct fwr_index_restart_s r = { 0, s->fileStart };
+	uint32_t lo = 0, hi = idx->restartCount;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (idx->restarts[mid].offset <= e->offset)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	if (lo)
+		r = idx->restarts[lo - 1];
 
-#if LOCAL_DEBUG
-	printf("%s() reading %d bytes of data\n", __func__, f->bufferLengthBytes);
-#endif
-	if (gzfread(f->ptr, 1, f->bufferLengthBytes, session->fh) != f->bufferLengthBytes) {
-		free(f->ptr);
-		free(f);
+	/* Start decompressing at the gzip member that begins there. */
+	int fd = open(s->filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (lseek(fd, r.fileOffset, SEEK_SET) < 0) {
+		close(fd);
 		return -1;
 	}
-
-#if LOCAL_DEBUG
-	printf("%s() reading %d bytes of footer\n", __func__, fwr_header_video_size_post);
-#endif
-	if (gzfread(&f->eof, 1, fwr_header_video_size_post, session->fh) != fwr_header_video_size_post) {
-		free(f->ptr);
-		free(f);
+	gzFile fh = gzdopen(fd, "rb");
+	if (!fh) {
+		close(fd);
 		return -1;
 	}
-
-	if (f->eof != video_v1_footer) {
-#if LOCAL_DEBUG
-		printf("%s() f->eof = 0x%x\n", __func__, f->eof);
-#endif
+	if (e->offset > r.offset && gzseek(fh, e->offset - r.offset, SEEK_CUR) < 0) {
+		gzclose(fh);
 		return -1;
 	}
 
-	*frame = f;
+	gzclose(s->fh);
+	s->fh = fh;
 	return 0;
 }
 
-void fwr_video_frame_free(struct fwr_session_s *session, struct fwr_header_video_s *frame)
+static int fwr_session_index_ready(struct fwr_session_s *s)
 {
-	free(frame->ptr);
-	free(frame);
+	if (s->writeMode)
+		return -1;
+
+	if (!s->index) {
+		char fn[4096];
+		snprintf(fn, sizeof(fn), "%s.idx", s->filename);
+		s->index = fwr_index_load(fn);
+	}
+
+	return s->index && s->index->count ? 0 : -1;
 }
 
-int  fwr_video_frame_create(struct fwr_session_s *session,
-        uint32_t width, uint32_t height, uint32_t strideBytes,
-        const uint8_t *buffer,
-        struct fwr_header_video_s **frame)
+int fwr_session_seek_frame(struct fwr_session_s *session, uint64_t counter)
 {
-	if (!buffer)
+	if (fwr_session_index_ready(session) < 0)
 		return -1;
 
-	struct fwr_header_video_s *f = malloc(sizeof(*f));
-	if (!f)
+	struct fwr_index_s *idx = session->index;
+	uint32_t lo = 0, hi = idx->count;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (idx->entries[mid].counter < counter)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == idx->count)
 		return -1;
 
-	f->width = width;
-	f->height = height;
-	f->strideBytes = strideBytes;
-	f->bufferLengthBytes = height * strideBytes;
-	f->ptr = malloc(f->bufferLengthBytes);
-	if (!f->ptr) {
-		free(f);
+	return fwr_session_seek_entry(session, &idx->entries[lo]);
+}
+
+int fwr_session_seek_time(struct fwr_session_s *session, const struct timeval *elapsed)
+{
+	if (fwr_session_index_ready(session) < 0)
 		return -1;
-	}
 
-	memcpy(f->ptr, buffer, f->bufferLengthBytes);
-        f->eof = video_v1_footer;
+	struct fwr_index_s *idx = session->index;
+	int64_t target = (idx->entries[0].tv_sec * 1000000LL) + idx->entries[0].tv_usec +
+		(elapsed->tv_sec * 1000000LL) + elapsed->tv_usec;
 
-	*frame = f;
-	return 0;
+	uint32_t lo = 0, hi = idx->count;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if ((idx->entries[mid].tv_sec * 1000000LL) + idx->entries[mid].tv_usec < target)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == idx->count)
+		return -1;
+
+	return fwr_session_seek_entry(session, &idx->entries[lo]);
 }
 
-int fwr_video_frame_write(struct fwr_session_s *session, struct fwr_header_video_s *frame)
+int fwr_session_flight_recorder_set(struct fwr_session_s *session, uint32_t preSeconds, uint32_t postSeconds, uint64_t maxBytes)
 {
-	uint32_t frame_type = video_v1_header;;
-	if (gzfwrite(&frame_type, 1, sizeof(frame_type), session->fh) != sizeof(frame_type)) {
+	/* Uncompressed and buffered only, dumps are written straight from the ring. */
+	if (!session->writeMode || session->fd < 0 || session->direct || session->recorder ||
+		session->segment || session->index)
+	{
 		return -1;
 	}
-	if (gzfwrite(frame, 1, fwr_header_video_size_pre, session->fh) != fwr_header_video_size_pre) {
+
+	pthread_mutex_lock(&session->listMutex);
+	uint64_t enqueued = session->stats.enqueuedFrames;
+	pthread_mutex_unlock(&session->listMutex);
+	if (enqueued || session->streamOffset)
 		return -1;
-	}
 
-	if (gzfwrite(frame->ptr, 1, frame->bufferLengthBytes, session->fh) != frame->bufferLengthBytes) {
+	struct fwr_recorder_s *rec = calloc(1, sizeof(*rec));
+	if (!rec)
 		return -1;
-	}
 
-	if (gzfwrite(&frame->eof, 1, fwr_header_video_size_post, session->fh) != fwr_header_video_size_post) {
+	rec->ringSize = maxBytes ? maxBytes : FWR_RECORDER_BYTES;
+	rec->dumpFd = -1;
+	rec->preSeconds = preSeconds;
+	rec->postSeconds = postSeconds;
+	rec->frameMax = (preSeconds + 1) * FWR_RECORDER_FRAME_RATE;
+	rec->frames = malloc(rec->frameMax * sizeof(*rec->frames));
+
+	/* Fault the whole ring in now, rather than during capture. */
+	rec->ring = mmap(NULL, rec->ringSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (rec->ring == MAP_FAILED)
+		rec->ring = NULL;
+
+	if (!rec->frames || !rec->ring || fwr_filename_split(session->filename, &rec->prefix, &rec->suffix) < 0) {
+		fwr_recorder_free(rec);
 		return -1;
 	}
 
+	/* Nothing goes to the session file itself, each dump gets a file of its own. */
+	close(session->fd);
+	session->fd = -1;
+	unlink(session->filename);
+
+	session->recorder = rec;
 	return 0;
 }
 
-/* -- */
-int fwr_vanc_frame_read(struct fwr_session_s *session, struct fwr_header_vanc_s **frame)
+int fwr_session_trigger(struct fwr_session_s *session, const char *reason)
 {
-	struct fwr_header_vanc_s *f = malloc(sizeof(*f));
-	if (!f)
+	if (!session->recorder)
 		return -1;
 
-#if LOCAL_DEBUG
-	printf("%s() reading %d bytes of header\n", __func__, fwr_header_vanc_size_pre);
-#endif
-	if (gzfread(f, 1, fwr_header_vanc_size_pre, session->fh) != fwr_header_vanc_size_pre) {
-		free(f);
-		return -1;
-	}
+	struct fwr_recorder_s *rec = session->recorder;
+	struct timeval now;
+	gettimeofday(&now, NULL);
 
-#if LOCAL_DEBUG
-	printf("%s() reading %d bytes of data\n", __func__, f->bufferLengthBytes);
-#endif
-	f->ptr = malloc(f->bufferLengthBytes);
-	if (!f->ptr) {
-		free(f);
-		return -1;
+	pthread_mutex_lock(&session->listMutex);
+	if (!rec->triggerPending) {
+		rec->triggerFirst = now;
+		rec->reason = reason;
 	}
+	rec->triggerLast = now;
+	rec->triggerPending = 1;
+	pthread_mutex_unlock(&session->listMutex);
 
-#if LOCAL_DEBUG
-	printf("%s() read %d bytes of data\n", __func__, f->bufferLengthBytes);
-#endif
-	if (gzfread(f->ptr, 1, f->bufferLengthBytes, session->fh) != f->bufferLengthBytes) {
-		free(f->ptr);
-		free(f);
+	return 0;
+}
+
+int fwr_session_read_ahead_set(struct fwr_session_s *session, size_t maxBytes)
+{
+	/* Mapped files are already as cheap as it gets. */
+	if (session->writeMode || session->map || !session->fh || session->readahead)
 		return -1;
-	}
 
-#if LOCAL_DEBUG
-	printf("%s() reading %d bytes of footer\n", __func__, fwr_header_vanc_size_post);
-#endif
-	if (gzfread(&f->eol, 1, fwr_header_vanc_size_post, session->fh) != fwr_header_vanc_size_post) {
-		free(f->ptr);
-		free(f);
+	struct fwr_readahead_s *ra = calloc(1, sizeof(*ra));
+	if (!ra)
 		return -1;
-	}
+	ra->maxBytes = maxBytes ? maxBytes : FWR_READAHEAD_BYTES;
+	xorg_list_init(&ra->queue);
+	pthread_mutex_init(&ra->mutex, NULL);
+	pthread_cond_init(&ra->cond, NULL);
 
-	if (f->eol != VANC_EOL_INDICATOR) {
-#if LOCAL_DEBUG
-		printf("%s() f->eol = 0x%x\n", __func__, f->eol);
-#endif
+	session->readahead = ra;
+	if (fwr_readahead_start(session) < 0) {
+		pthread_cond_destroy(&ra->cond);
+		pthread_mutex_destroy(&ra->mutex);
+		free(ra);
+		session->readahead = NULL;
 		return -1;
 	}
 
-	*frame = f;
 	return 0;
 }
 
-void fwr_vanc_frame_free(struct fwr_session_s *session, struct fwr_header_vanc_s *frame)
+int fwr_session_video_codec_set(struct fwr_session_s *session, int threads)
 {
-	free(frame->ptr);
-	free(frame);
-}
+	if (!session->writeMode || session->videoCodec || threads < 1)
+		return -1;
 
-int  fwr_vanc_frame_create(struct fwr_session_s *session,
-	uint32_t line,
-        uint32_t width, uint32_t height, uint32_t strideBytes,
-        const uint8_t *buffer,
-        struct fwr_header_vanc_s **frame)
-{
-	if (!buffer)
+	pthread_mutex_lock(&session->listMutex);
+	uint64_t enqueued = session->stats.enqueuedFrames;
+	pthread_mutex_unlock(&session->listMutex);
+	if (enqueued)
 		return -1;
 
-	struct fwr_header_vanc_s *f = malloc(sizeof(*f));
-	if (!f)
+	if (!session->fileMarker && fwr_session_marker_write(session) < 0)
 		return -1;
+	session->fileMarker = 1;
 
-	f->line = line;
-	f->width = width;
-	f->height = height;
-	f->strideBytes = strideBytes;
-	f->bufferLengthBytes = strideBytes;
-	f->ptr = malloc(f->bufferLengthBytes);
-	if (!f->ptr) {
-		free(f);
+	return v210codec_alloc(&session->videoCodec, threads);
+}
+
+int fwr_session_vanc_compact_set(struct fwr_session_s *session, int mode)
+{
+	if (!session->writeMode || session->vancCompact ||
+		(mode != FWR_VANC_COMPACT_LINES && mode != FWR_VANC_COMPACT_PACKETS))
+	{
 		return -1;
 	}
 
-	memcpy(f->ptr, buffer, f->bufferLengthBytes);
-        f->eol = VANC_EOL_INDICATOR;
+	pthread_mutex_lock(&session->listMutex);
+	uint64_t enqueued = session->stats.enqueuedFrames;
+	pthread_mutex_unlock(&session->listMutex);
+	if (enqueued)
+		return -1;
+
+	if (fwr_vanc_scratch_alloc(session) < 0)
+		return -1;
+	if (!session->fileMarker && fwr_session_marker_write(session) < 0)
+		return -1;
+	session->fileMarker = 1;
+	session->vancCompact = mode;
 
-	*frame = f;
 	return 0;
 }
 
-int fwr_vanc_frame_write(struct fwr_session_s *session, struct fwr_header_vanc_s *frame)
+int fwr_session_gzip_workers_set(struct fwr_session_s *session, int workers)
 {
-	uint32_t frame_type = VANC_SOL_INDICATOR;
-	if (gzfwrite(&frame_type, 1, sizeof(frame_type), session->fh) != sizeof(frame_type)) {
+#if !HAVE_ZLIB
+	return -1;
+#else
+	/* Only before the gzFile has been attached, nothing can have been written yet. */
+	if (!session->writeMode || session->gzfd < 0 || session->gzpool || workers < 1)
 		return -1;
-	}
-	if (gzfwrite(frame, 1, fwr_header_vanc_size_pre, session->fh) != fwr_header_vanc_size_pre) {
+
+	pthread_mutex_lock(&session->listMutex);
+	uint64_t enqueued = session->stats.enqueuedFrames;
+	pthread_mutex_unlock(&session->listMutex);
+	if (enqueued)
 		return -1;
-	}
 
-	if (gzfwrite(frame->ptr, 1, frame->bufferLengthBytes, session->fh) != frame->bufferLengthBytes) {
+	struct fwr_gzpool_s *gp = calloc(1, sizeof(*gp));
+	if (!gp)
+		return -1;
+	gp->workers = calloc(workers, sizeof(pthread_t));
+	if (!gp->workers) {
+		free(gp);
 		return -1;
 	}
 
-	if (gzfwrite(&frame->eol, 1, fwr_header_vanc_size_post, session->fh) != fwr_header_vanc_size_post) {
+	gp->fd = session->gzfd;
+	gp->fileBytes = session->fileMarker ? FWR_FILE_MARKER_BYTES : 0;
+	gp->blockMax = (workers * 2) + 2; /* Keep every worker busy while the output thread writes. */
+	xorg_list_init(&gp->freeBlocks);
+	xorg_list_init(&gp->todo);
+	xorg_list_init(&gp->done);
+	pthread_mutex_init(&gp->mutex, NULL);
+	pthread_cond_init(&gp->cond, NULL);
+
+	if (pthread_create(&gp->outputThreadId, 0, fwr_gzpool_outputfunc, gp) != 0) {
+		pthread_cond_destroy(&gp->cond);
+		pthread_mutex_destroy(&gp->mutex);
+		free(gp->workers);
+		free(gp);
 		return -1;
 	}
+	for (int i = 0; i < workers; i++) {
+		if (pthread_create(&gp->workers[i], 0, fwr_gzpool_workerfunc, gp) != 0)
+			break;
+		gp->workerCount++;
+	}
+	if (gp->workerCount == 0) {
+		/* Nobody to compress, shut the output thread down and stay single threaded. */
+		gp->fd = dup(gp->fd);
+		fwr_gzpool_close(gp, NULL, NULL);
+		return -1;
+	}
+
+	/* The pool owns the descriptor from here on. */
+	session->gzfd = -1;
+	session->gzpool = gp;
 
 	return 0;
+#endif
 }
 
-int fwr_session_frame_gettype(struct fwr_session_s *session, uint32_t *header)
+void fwr_session_queue_stats_get(struct fwr_session_s *session, struct fwr_session_queue_stats_s *stats)
 {
-	size_t r = gzfread(header, 1, sizeof(*header), session->fh);
-	if (r != sizeof(*header))
-		return -1;
+	if (!session->writeMode) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
 
-	return 0;
+	pthread_mutex_lock(&session->listMutex);
+	*stats = session->stats; /* Implicit struct copy. */
+	pthread_mutex_unlock(&session->listMutex);
+	stats->elapsedUs = fwr_monotonic_us() - session->createdUs;
 }
 
-int fwr_writer_enqueue(struct fwr_session_s *session, void *ptr, int type)
+/* " <4.1ms 12 <8.2ms 30 ...", the buckets in use labelled by their upper bound. */
+static void fwr_stats_hist_format(char *buf, size_t len, const uint64_t *hist, int buckets, int isBytes)
 {
-	struct fwr_writer_node_s *n = malloc(sizeof(*n));
-	if (!n)
-		return -1;
-
-	n->ptr = ptr;
-	n->type = type;
+	static const char *units[] = { "", "K", "M", "G", "T" };
+	size_t used = 0;
+	buf[0] = 0;
 
-	pthread_mutex_lock(&session->listMutex);
-	xorg_list_append(&n->list, &session->list);
-	pthread_mutex_unlock(&session->listMutex);
+	for (int i = 0; i < buckets && used < len; i++) {
+		if (!hist[i])
+			continue;
 
-	pthread_cond_broadcast(&session->cond);
-	
-	return 0;
+		int last = i == buckets - 1;
+		uint64_t bound = last ? 1ULL << i : 1ULL << (i + 1);
+		char label[32];
+		if (isBytes) {
+			int u = 0;
+			while (bound >= 1024 && u < 4) {
+				bound /= 1024;
+				u++;
+			}
+			snprintf(label, sizeof(label), "%" PRIu64 "%s", bound, units[u]);
+		} else if (bound < 1000) {
+			snprintf(label, sizeof(label), "%" PRIu64 "us", bound);
+		} else if (bound < 1000000) {
+			snprintf(label, sizeof(label), "%.1fms", (double)bound / 1000);
+		} else {
+			snprintf(label, sizeof(label), "%.1fs", (double)bound / 1000000);
+		}
+		used += snprintf(buf + used, len - used, " %s%s %" PRIu64, last ? ">=" : "<", label, hist[i]);
+	}
 }
 
-static int fwr_writer_dequeue(struct fwr_session_s *session, void **ptr, int *type)
+void fwr_session_queue_stats_print(int fd, struct fwr_session_s *session, const char *name)
 {
-	int ret = -1;
+	struct fwr_session_queue_stats_s st;
+	fwr_session_queue_stats_get(session, &st);
 
-	struct fwr_writer_node_s *n = NULL;
-	pthread_mutex_lock(&session->listMutex);
-	if (!xorg_list_is_empty(&session->list)) {
-		n = xorg_list_first_entry(&session->list, struct fwr_writer_node_s, list);
+	dprintf(fd, "Writer queue '%s': depth %u frames / %" PRIu64 " bytes (hwm %u / %" PRIu64 "), limits %u frames / %" PRIu64 " bytes (%s)\n",
+		name,
+		st.queueFrames, st.queueBytes,
+		st.queueFramesHWM, st.queueBytesHWM,
+		session->queueMaxFrames, session->queueMaxBytes,
+		session->queuePolicy == FWR_QUEUE_POLICY_BLOCK ? "block" : "drop");
+	dprintf(fd, "Writer queue '%s': enqueued %" PRIu64 " written %" PRIu64 " (%" PRIu64 " bytes, %" PRIu64 " batches) "
+		"dropped %" PRIu64 " (%" PRIu64 " bytes) blocked %" PRIu64 " write errors %" PRIu64 "\n",
+		name,
+		st.enqueuedFrames, st.writtenFrames, st.writtenBytes, st.batches,
+		st.droppedFrames, st.droppedBytes, st.blockedCount, st.writeErrors);
 
-		*ptr = n->ptr;
-		*type = n->type;
-		xorg_list_del(&n->list);
-		ret = 0;
+	char hist[1024];
+	if (st.writtenFrames) {
+		fwr_stats_hist_format(hist, sizeof(hist), st.latency, FWR_STATS_LATENCY_BUCKETS, 0);
+		dprintf(fd, "Writer latency '%s': mean %" PRIu64 " us, max %" PRIu64 " us, frames by latency:%s\n",
+			name, st.latencySumUs / st.writtenFrames, st.latencyMaxUs, hist);
+	}
+	uint64_t elapsed = st.elapsedUs / 1000000 ? st.elapsedUs / 1000000 : 1;
+	for (int i = 1; i <= FWR_FRAME_TYPE_MAX; i++) {
+		struct fwr_session_type_stats_s *t = &st.type[i];
+		if (!t->writtenFrames)
+			continue;
 
+		fwr_stats_hist_format(hist, sizeof(hist), t->rateSeconds, FWR_STATS_RATE_BUCKETS, 1);
+		dprintf(fd, "Writer rate  '%s': %6s %" PRIu64 " frames, %" PRIu64 " bytes, mean %" PRIu64 " bytes/s, peak %" PRIu64 " bytes/s, seconds by bytes:%s\n",
+			name, fwr_frame_type_name(i), t->writtenFrames, t->writtenBytes,
+			t->writtenBytes / elapsed, t->peakRate, hist);
 	}
-	pthread_mutex_unlock(&session->listMutex);
+	if (session->shedMaxBytes) {
+		dprintf(fd, "Writer shed  '%s': video budget %" PRIu64 " bytes, decimation 1/%u above half\n",
+			name, session->shedMaxBytes, session->shedDecimation > 1 ? session->shedDecimation : 1);
+	}
+	for (int i = 1; i <= FWR_FRAME_TYPE_MAX; i++) {
+		struct fwr_session_type_stats_s *t = &st.type[i];
+		if (!t->droppedFrames)
+			continue;
 
-	return ret;
+		dprintf(fd, "Writer drops '%s': %6s %" PRIu64 " frames, %" PRIu64 " bytes\n",
+			name, fwr_frame_type_name(i), t->droppedFrames, t->droppedBytes);
+	}
+
+#if HAVE_ZLIB
+	if (session->gzpool) {
+		struct fwr_gzpool_s *gp = session->gzpool;
+		pthread_mutex_lock(&gp->mutex);
+		dprintf(fd, "Writer gzip  '%s': %d workers, %" PRIu64 " blocks, %" PRIu64 " -> %" PRIu64 " bytes, %u/%u blocks allocated, %" PRIu64 " stalls\n",
+			name, gp->workerCount, gp->blocks, gp->bytesIn, gp->bytesOut,
+			gp->blockCount, gp->blockMax, gp->stalls);
+		pthread_mutex_unlock(&gp->mutex);
+	}
+#endif
+	if (session->recorder) {
+		struct fwr_recorder_s *rec = session->recorder;
+		dprintf(fd, "Writer recorder '%s': %" PRIu64 "/%" PRIu64 " bytes, %u frames buffered, %s, %u events (%" PRIu64 " bytes from the ring), %" PRIu64 " errors\n",
+			name, rec->head - rec->tail, rec->ringSize, rec->frameCount,
+			rec->dumping ? "dumping" : "idle", rec->events, rec->dumpedBytes, rec->errors);
+	}
+	if (session->segment) {
+		struct fwr_segment_s *sg = session->segment;
+		dprintf(fd, "Writer segment '%s': writing segment %u, %" PRIu64 " rotations, %" PRIu64 " deleted, %" PRIu64 " errors\n",
+			name, sg->current, sg->rotations, sg->deleted, sg->errors);
+	}
+	if (session->direct) {
+		dprintf(fd, "Writer direct '%s': 2 x %zu byte buffers, %zu byte alignment, %" PRIu64 " bytes, %" PRIu64 " io stalls\n",
+			name, session->directBufferSize, session->directAlign,
+			session->directBytes, session->directStalls);
+	}
+
+	pthread_mutex_lock(&session->poolMutex);
+	for (int i = 0; i <= FWR_FRAME_TYPE_MAX; i++) {
+		struct fwr_pool_s *p = session->pools[i];
+		if (!p)
+			continue;
+
+		pthread_mutex_lock(&p->mutex);
+		dprintf(fd, "Writer pool  '%s': %6s %u x %zu bytes%s, %u free (lwm %u), %" PRIu64 " heap fallbacks\n",
+			name, fwr_frame_type_name(i),
+			p->slotCount, p->slotBytes, p->isHugepages ? " (hugepages)" : "",
+			p->freeCount, p->freeCountLWM, p->misses);
+		pthread_mutex_unlock(&p->mutex);
+	}
+	pthread_mutex_unlock(&session->poolMutex);
+}
+
+/* JSON string contents, quotes, backslashes and control characters escaped. */
+static void fwr_json_escape(char *buf, size_t len, const char *str)
+{
+	size_t used = 0;
+
+	for (; *str && used + 7 < len; str++) {
+		unsigned char c = *str;
+		if (c == '"' || c == '\\') {
+			buf[used++] = '\\';
+			buf[used++] = c;
+		} else if (c < 0x20) {
+			used += snprintf(buf + used, len - used, "\\u%04x", c);
+		} else {
+			buf[used++] = c;
+		}
+	}
+	buf[used] = 0;
+}
+
+/* [[lower bound, count], ...] for the buckets in use. */
+static void fwr_json_hist(int fd, const uint64_t *hist, int buckets)
+{
+	const char *sep = "";
+
+	dprintf(fd, "[");
+	for (int i = 0; i < buckets; i++) {
+		if (!hist[i])
+			continue;
+		dprintf(fd, "%s[%" PRIu64 ",%" PRIu64 "]", sep, i ? (uint64_t)1 << i : 0, hist[i]);
+		sep = ",";
+	}
+	dprintf(fd, "]");
 }
 
+void fwr_session_queue_stats_print_json(int fd, struct fwr_session_s *session, const char *name)
+{
+	struct fwr_session_queue_stats_s st;
+	fwr_session_queue_stats_get(session, &st);
+
+	char esc[4096 * 2];
+	fwr_json_escape(esc, sizeof(esc), name);
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+
+	dprintf(fd, "{\"name\":\"%s\",\"time\":%ld.%06ld,\"elapsed_us\":%" PRIu64 ","
+		"\"queue\":{\"frames\":%u,\"bytes\":%" PRIu64 ",\"frames_hwm\":%u,\"bytes_hwm\":%" PRIu64 ","
+		"\"max_frames\":%u,\"max_bytes\":%" PRIu64 ",\"policy\":\"%s\"},"
+		"\"enqueued\":%" PRIu64 ",\"written\":%" PRIu64 ",\"written_bytes\":%" PRIu64 ",\"batches\":%" PRIu64 ","
+		"\"dropped\":%" PRIu64 ",\"dropped_bytes\":%" PRIu64 ",\"blocked\":%" PRIu64 ",\"write_errors\":%" PRIu64 ","
+		"\"latency_us\":{\"mean\":%" PRIu64 ",\"max\":%" PRIu64 ",\"histogram\":",
+		esc, (long)now.tv_sec, (long)now.tv_usec, st.elapsedUs,
+		st.queueFrames, st.queueBytes, st.queueFramesHWM, st.queueBytesHWM,
+		session->queueMaxFrames, session->queueMaxBytes,
+		session->queuePolicy == FWR_QUEUE_POLICY_BLOCK ? "block" : "drop",
+		st.enqueuedFrames, st.writtenFrames, st.writtenBytes, st.batches,
+		st.droppedFrames, st.droppedBytes, st.blockedCount, st.writeErrors,
+		st.writtenFrames ? st.latencySumUs / st.writtenFrames : 0, st.latencyMaxUs);
+	fwr_json_hist(fd, st.latency, FWR_STATS_LATENCY_BUCKETS);
+	dprintf(fd, "},\"types\":{");
+
+	for (int i = 1; i <= FWR_FRAME_TYPE_MAX; i++) {
+		struct fwr_session_type_stats_s *t = &st.type[i];
+		dprintf(fd, "%s\"%s\":{\"frames\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"dropped\":%" PRIu64 ",\"dropped_bytes\":%" PRIu64 ","
+			"\"peak_bytes_per_sec\":%" PRIu64 ",\"rate_histogram\":",
+			i > 1 ? "," : "", fwr_frame_type_name(i), t->writtenFrames, t->writtenBytes,
+			t->droppedFrames, t->droppedBytes, t->peakRate);
+		fwr_json_hist(fd, t->rateSeconds, FWR_STATS_RATE_BUCKETS);
+		dprintf(fd, "}");
+	}
+	dprintf(fd, "}}\n");
+}
@@ -51,6 +51,9 @@
 #define gzfread fread
 #define gzfwrite fwrite
 #define gzclose fclose
+#define gzdopen fdopen
+#define gzseek fseeko
+#define gzbuffer(fh, size) ((void)0)
 #endif
 
 #ifdef __cplusplus
@@ -73,9 +76,185 @@ struct fwr_header_audio_s
 #define fwr_header_audio_size_pre  (sizeof(struct fwr_header_audio_s) - sizeof(uint32_t) - sizeof(uint8_t *))
 #define fwr_header_audio_size_post (sizeof(uint32_t))
 
+/* What fwr_writer_enqueue() does when the writer queue has reached its limits. */
+#define FWR_QUEUE_POLICY_DROP  0 /* Discard the new frame and account for it (default). */
+#define FWR_QUEUE_POLICY_BLOCK 1 /* Stall the caller until the writer thread frees space (backpressure). */
+
+#define FWR_FRAME_TIMING 1
+#define FWR_FRAME_VIDEO  2
+#define FWR_FRAME_AUDIO  3
+#define FWR_FRAME_VANC   4
+#define FWR_FRAME_GAP    5 /* Written by the session itself, see gap_v1_header. */
+#define FWR_FRAME_TYPE_MAX FWR_FRAME_GAP
+
+#define FWR_STATS_LATENCY_BUCKETS 24 /* log2 microseconds, the last one is open ended (8s and over). */
+#define FWR_STATS_RATE_BUCKETS    40 /* log2 bytes per second. */
+
+/* Per FWR_FRAME_... */
+struct fwr_session_type_stats_s
+{
+	uint64_t writtenFrames;
+	uint64_t writtenBytes;
+	uint64_t queueBytes;        /* Currently waiting for the writer thread. */
+	uint32_t queueFrames;
+	uint64_t droppedFrames;     /* Dropped or shed, and recorded in a gap record. */
+	uint64_t droppedBytes;
+	uint64_t peakRate;          /* Bytes written in the busiest second. */
+	uint64_t rateSeconds[FWR_STATS_RATE_BUCKETS]; /* Seconds by bytes written in them, n counts [2^n, 2^(n+1)). */
+};
+
+struct fwr_session_queue_stats_s
+{
+	uint64_t queueBytes;        /* Bytes currently waiting for the writer thread. */
+	uint32_t queueFrames;       /* Frames currently waiting for the writer thread. */
+	uint64_t queueBytesHWM;     /* High water marks, since the session was created. */
+	uint32_t queueFramesHWM;
+
+	uint64_t enqueuedFrames;
+	uint64_t writtenFrames;
+	uint64_t writtenBytes;
+	uint64_t writeErrors;
+	uint64_t droppedFrames;     /* Frames discarded because the queue was full, or shed. */
+	uint64_t droppedBytes;
+	uint64_t blockedCount;      /* Number of times an enqueue had to wait for space. */
+	uint64_t batches;           /* Number of times the writer thread woke and drained the queue. */
+
+	/* From fwr_writer_enqueue() until the writer thread has handed the frame to the OS.
+	 * That's the page cache unless O_DIRECT is in use, nothing here waits for the disk.
+	 * Bucket n counts frames written within [2^n, 2^(n+1)) us, bucket 0 anything under 2us.
+	 */
+	uint64_t latency[FWR_STATS_LATENCY_BUCKETS];
+	uint64_t latencySumUs;
+	uint64_t latencyMaxUs;
+
+	struct fwr_session_type_stats_s type[FWR_FRAME_TYPE_MAX + 1];
+	uint64_t elapsedUs;         /* Since the session was created, filled in by fwr_session_queue_stats_get(). */
+};
+
+/* Flags for fwr_session_pool_alloc() */
+#define FWR_POOL_HUGEPAGES (1 << 0) /* Back the pool with hugepages, transparent hugepages if none are reserved. */
+
+struct fwr_header_gap_s;
+struct fwr_pool_s;
+struct fwr_gzpool_s;
+struct v210codec_s;
+struct fwr_index_s;
+struct fwr_readahead_s;
+struct fwr_segment_s;
+struct fwr_recorder_s;
+
+/* Frame index sidecar, see fwr_session_index_set(). All fields native endian.
+ *   struct fwr_index_file_header_s
+ *   entryCount x struct fwr_index_entry_s, in file order
+ *   restartCount x struct fwr_index_restart_s, in file order
+ *   optionally FWR_INDEX_VANC_MAGIC and a struct fwr_header_vanc_stream_s, the first
+ *   compact VANC stream descriptor in the file
+ * Offsets are positions in the decompressed record stream. For gzip files, restart
+ * points are gzip member boundaries, where decompression can begin without reading
+ * anything before them. Uncompressed files have none.
+ */
+#define FWR_INDEX_MAGIC   0x58495746 /* "FWIX" */
+#define FWR_INDEX_VANC_MAGIC 0x53565746 /* "FWVS" */
+#define FWR_INDEX_VERSION 1
+
+struct fwr_index_file_header_s
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t entryCount;
+	uint32_t restartCount;
+};
+
+struct fwr_index_entry_s
+{
+	uint64_t counter;           /* fwr_header_timing_s.counter */
+	int64_t  tv_sec;            /* fwr_header_timing_s.ts1 */
+	int64_t  tv_usec;
+	uint64_t offset;            /* Of the timing record type code. */
+};
+
+struct fwr_index_restart_s
+{
+	uint64_t offset;            /* Decompressed stream position. */
+	uint64_t fileOffset;        /* Where the gzip member starting there begins on disk. */
+};
+
+/* Files holding records that older readers don't know, video_v2_header and the compact
+ * VANC records, start with this marker ahead of the record stream, as does every segment
+ * and flight recorder dump of the session. Readers that predate those records have no
+ * case for their codes and would step over them a word at a time, locking onto stray
+ * magic words in the payload. The marker reads as a gzip header with an unknown
+ * compression method instead, so zlib fails their first read. fwr_session_file_open()
+ * steps over it, stream offsets and the index start after it.
+ */
+#define FWR_FILE_MARKER       "\x1f\x8b\x00" "FWR2\n"
+#define FWR_FILE_MARKER_BYTES 8
+
+/* Compact VANC, see fwr_session_vanc_compact_set().
+ * A stream descriptor record declares the VANC line geometry once, ahead of the first
+ * line record that needs it and again whenever it changes. Line records only carry
+ * what changes from line to line:
+ *   vanc_stream_v2_header, struct fwr_header_vanc_stream_s
+ *   vanc_line_v2_header, struct fwr_header_vanc_v2_s, the whole v210 line, VANC_EOL_INDICATOR
+ *   vanc_packets_v2_header, struct fwr_header_vanc_v2_s, packets, VANC_EOL_INDICATOR
+ * Each packet is a struct fwr_vanc_packet_s followed by wordCount 10 bit words, DID
+ * through checksum, the ADF is implied. Lines without ANC aren't written at all.
+ * fwr_vanc_frame_read() returns either as a whole v210 line, the same as a v1 record.
+ * Files holding these records start with FWR_FILE_MARKER.
+ */
+#define FWR_VANC_COMPACT_LINES   1 /* Only the lines carrying ANC, stored whole. */
+#define FWR_VANC_COMPACT_PACKETS 2 /* Only the ANC packets, blanking is regenerated on read. */
+
+#define vanc_stream_v2_header  0xEFBEADE1
+#define vanc_stream_v2_footer  0xEDFEADE1
+#define vanc_line_v2_header    0xEFBEADDF
+#define vanc_packets_v2_header 0xEFBEADE0
+
+struct fwr_header_vanc_stream_s
+{
+	uint32_t width;
+	uint32_t height;
+	uint32_t strideBytes;
+	uint32_t mode;              /* FWR_VANC_COMPACT_... */
+	uint32_t footer;            /* vanc_stream_v2_footer */
+} __attribute__((packed));
+
+struct fwr_header_vanc_v2_s
+{
+	uint32_t line;
+	uint32_t bufferLengthBytes;
+} __attribute__((packed));
+
+struct fwr_vanc_packet_s
+{
+	uint16_t offset;            /* ADF position in the line's Cb Y Cr Y ... sample order. */
+	uint16_t step;              /* 1 for SD packets, 2 for HD packets in the luma or chroma samples. */
+	uint16_t wordCount;
+} __attribute__((packed));
+
+/* Called by the writer thread once a frame queued by reference has been written (or dropped). */
+typedef void (*fwr_release_callback)(void *opaque);
+
+/* Immutable reference counted payload, queued to any number of sessions and handed to
+ * any other consumer without copying, see fwr_buffer_alloc(). Whoever drops the last
+ * reference frees it.
+ */
+struct fwr_buffer_s
+{
+	const uint8_t *ptr;
+	size_t len;
+	uint32_t refCount;              /* Atomic */
+	fwr_release_callback release;   /* Wrapped buffers, see fwr_buffer_wrap(). */
+	void *opaque;
+};
+
+struct iovec;
+
 struct fwr_session_s
 {
 	gzFile fh;
+	int fd;     /* Uncompressed output is written directly to this descriptor, else -1. */
+	int gzfd;   /* Compressed output, until attached to fh or handed to gzpool, else -1. */
 	int type; /* 1 = PCM_AUDIO. */
 
 	uint64_t counter;
@@ -84,20 +263,111 @@ struct fwr_session_s
 
 	pthread_mutex_t listMutex;
 	struct xorg_list list;
-	pthread_cond_t cond;
+	struct xorg_list freeList;  /* Recycled fwr_writer_node_s objects, avoids a malloc per enqueue. */
+	pthread_cond_t cond;        /* Signalled when work is queued, wakes the writer thread. */
+	pthread_cond_t spaceCond;   /* Signalled when the writer thread has released queue space. */
 	pthread_condattr_t condAttr;
 
+	/* Queue limits, see fwr_session_queue_limits_set(). Zero means unlimited. */
+	uint64_t queueMaxBytes;
+	uint32_t queueMaxFrames;
+	int queuePolicy;            /* FWR_QUEUE_POLICY_... */
+	uint64_t shedMaxBytes;      /* Video budget, see fwr_session_shed_set(). Zero when video isn't shed. */
+	uint32_t shedDecimation;
+	uint64_t shedSequence;      /* Video frames offered while over half the budget. */
+	struct fwr_session_queue_stats_s stats; /* Protected by listMutex */
+	uint64_t createdUs;         /* CLOCK_MONOTONIC */
+	uint64_t rateSecond;        /* Writer thread, the second rateBytes is counting, protected by listMutex. */
+	uint64_t rateBytes[FWR_FRAME_TYPE_MAX + 1];
+	struct fwr_header_gap_s *gapPending[FWR_FRAME_TYPE_MAX + 1]; /* Drops not yet queued as a gap record. */
+
+	/* Output staging, records are gathered and flushed in large writes. */
+	struct iovec *iov;          /* Uncompressed output, pending writev() segments. */
+	int iovcnt;
+	uint8_t *stage;             /* Copied record fields (uncompressed) or whole records (gzip). */
+	size_t stageSize;
+	size_t stageUsed;
+	size_t pendingBytes;        /* Record bytes staged but not yet flushed. */
+	int batching;               /* Writer thread defers flushing until the end of a batch. */
+
+	/* Lossless video compression, see fwr_session_video_codec_set(). Also used by
+	 * READ sessions to decode video_v2_header records.
+	 */
+	struct v210codec_s *videoCodec;
+	uint32_t lastHeader;        /* READ session, most recent fwr_session_frame_gettype() result. */
+
+	/* Frame index. WRITE sessions build it, READ sessions load it on first seek. */
+	struct fwr_index_s *index;
+	uint64_t streamOffset;      /* WRITE session, decompressed bytes serialized so far. */
+	char *filename;             /* As opened. READ sessions reopen it at restart points. */
+	int fileMarker;             /* WRITE session, each file starts with FWR_FILE_MARKER. */
+	uint32_t fileStart;         /* READ session, file offset of the record stream, past any marker. */
+
+	/* READ session on an uncompressed file, the whole file mapped read-only. Frames returned
+	 * by the fwr_n_frame_read() calls point into it, remain valid until the session is closed
+	 * and must not be written to. The file size is checked once per readahead window, a
+	 * record past a truncation seen there fails to read. Pages cut off within the window,
+	 * before it's checked again, fault as for any mapping.
+	 */
+	uint8_t *map;
+	int mapFd;
+	size_t mapSize;             /* Length mapped. */
+	size_t mapEnd;              /* Reads stop here, mapSize unless the file shrank. */
+	size_t mapPos;
+	size_t mapAdvised;          /* End of the range last passed to MADV_WILLNEED. */
+	size_t mapReleased;         /* Everything before this has been passed to MADV_DONTNEED. */
+
+	/* READ session on a compressed file, see fwr_session_read_ahead_set(). */
+	struct fwr_readahead_s *readahead;
+
+	/* Segmented output, see fwr_session_segment_set(). */
+	struct fwr_segment_s *segment;
+
+	/* Compact VANC, see fwr_session_vanc_compact_set(). WRITE sessions track the stream
+	 * descriptor last written, READ sessions the one in effect.
+	 */
+	int vancCompact;            /* FWR_VANC_COMPACT_..., 0 for v1 records. */
+	struct fwr_header_vanc_stream_s vancStream;
+	int vancStreamValid;
+	struct fwr_header_vanc_stream_s vancStreamFirst; /* WRITE session, first one in the current file. */
+	int vancStreamFirstValid;
+	uint16_t *vancSamples;      /* Scratch, one line unpacked. */
+	uint8_t *vancPackets;       /* Scratch, WRITE session packets payload. */
+
+	/* In memory ring of recent records, see fwr_session_flight_recorder_set(). */
+	struct fwr_recorder_s *recorder;
+
+	/* Block parallel compression, see fwr_session_gzip_workers_set(). */
+	struct fwr_gzpool_s *gzpool;
+
+	/* O_DIRECT output, see fwr_session_direct_io_set(). */
+	int direct;
+	size_t directAlign;
+	size_t directBufferSize;
+	uint8_t *directBuffer[2];   /* Double buffered, one filling while the other is written. */
+	int directFill;             /* Index of the buffer the writer thread is filling. */
+	size_t directUsed;
+	uint64_t directBytes;       /* Logical file length, excluding any tail padding. */
+	uint64_t directStalls;      /* Times the writer thread waited on the I/O thread. */
+	pthread_t directThreadId;
+	pthread_mutex_t directMutex;
+	pthread_cond_t directCond;
+	uint8_t *directPending;     /* Buffer owned by the I/O thread, NULL when idle. */
+	size_t directPendingLen;
+	int directTerminate;
+	int directError;
+
+	/* Optional preallocated frame buffers, indexed by FWR_FRAME_..., see fwr_session_pool_alloc(). */
+	pthread_mutex_t poolMutex;
+	struct fwr_pool_s *pools[FWR_FRAME_TYPE_MAX + 1];
+	struct fwr_pool_s *poolsRetired; /* Replaced pools with frames still in flight. */
+
 	pthread_t writerThreadId;
 	int thread_running;
 	int thread_terminate;
 	int thread_complete;
 };
 
-#define FWR_FRAME_TIMING 1
-#define FWR_FRAME_VIDEO  2
-#define FWR_FRAME_AUDIO  3
-#define FWR_FRAME_VANC   4
-
 struct fwr_writer_node_s
 {
 	struct xorg_list list;
@@ -105,6 +375,12 @@ struct fwr_writer_node_s
 	/* FWR_FRAME_... */
 	int type;
 	void *ptr;
+	size_t bytes; /* Serialized size of the frame, used for queue accounting. */
+	uint64_t enqueuedUs; /* CLOCK_MONOTONIC, when fwr_writer_enqueue() was called. */
+
+	/* Frames queued by reference, see fwr_writer_enqueue_video_ref(). */
+	fwr_release_callback release;
+	void *opaque;
 };
 
 /**
@@ -229,6 +505,31 @@ int fwr_timing_frame_read(struct fwr_session_s *session, struct fwr_header_timin
  */
 void fwr_timing_frame_free(struct fwr_session_s *session, struct fwr_header_timing_s *frame);
 
+/* Records dropped by a WRITE session, because the writer queue was full or video was shed
+ * (see fwr_session_shed_set()). Queued ahead of the next record accepted after the drops,
+ * so it sits where they would have been in the file, one per record type.
+ */
+#define gap_v1_header 0xCAFEADDE
+#define gap_v1_footer 0xCAFEADDF
+struct fwr_header_gap_s
+{
+	uint32_t       type;        /* FWR_FRAME_... of the records dropped. */
+	uint32_t       count;
+	uint64_t       bytes;       /* As they would have been serialized. */
+	struct timeval first;       /* When the first and last of them were enqueued. */
+	struct timeval last;
+	uint32_t       footer;
+} __attribute__((packed));
+
+/**
+ * @brief       From the READ session, populate a gap structure from the current file pointer.
+ * @param[in]   struct fwr_session_s *session - session object.
+ * @param[out]  struct fwr_header_gap_s *frame - Caller allocated.
+ * @return        0 - Success
+ * @return      < 0 - Error
+ */
+int fwr_gap_frame_read(struct fwr_session_s *session, struct fwr_header_gap_s *frame);
+
 #define video_v1_header 0xDFBEADDE
 #define video_v1_footer 0xDFFEADDE
 struct fwr_header_video_s
@@ -244,6 +545,14 @@ struct fwr_header_video_s
 #define fwr_header_video_size_pre  (sizeof(struct fwr_header_video_s) - sizeof(uint32_t) - sizeof(uint8_t *))
 #define fwr_header_video_size_post (sizeof(uint32_t))
 
+/* Losslessly compressed v210 video, see v210codec.h. Same header layout as v1, with
+ * bufferLengthBytes being the compressed payload length on disk. fwr_video_frame_read()
+ * decodes these transparently, returning height * strideBytes of v210 as for v1.
+ * Files written with the codec start with FWR_FILE_MARKER.
+ */
+#define video_v2_header 0xDFBEADDF
+#define video_v2_footer 0xDFFEADDF
+
 /**
  * @brief       From the READ session, allocate and populate a video structure from the current file pointer.
  *              The caller must release the frame with a call to fwr_video_frame_free().
@@ -379,14 +688,358 @@ __inline__ int fwr_timeval_subtract(struct timeval *result, struct timeval *x, s
  *              The thread will automatically release via fwr_n_frame_free()
  *              when the allocation is no longer required, the caller MUST NOT
  *              release the frame manually.
+ *              If the queue is full and the session uses FWR_QUEUE_POLICY_DROP, the frame
+ *              is released immediately, counted as dropped, and an error is returned.
+ *              With FWR_QUEUE_POLICY_BLOCK the caller waits until the writer thread frees space.
  * @param[in]   struct fwr_session_s *session - session object.
  * @param[in]   void *ptr - Pointer reference to various frame types.
  * @param[in]   int type - The struct type we're passing in the pointer, Eg. FWR_FRAME_VIDEO
  * @return        0 - Success
- * @return      < 0 - Error
+ * @return      < 0 - Error, or frame dropped. In both cases the frame has been released.
  */
 int fwr_writer_enqueue(struct fwr_session_s *session, void *ptr, int type);
 
+/**
+ * @brief       Queue a video frame for writing without copying the payload. The writer thread
+ *              serializes straight from the callers buffer, then calls release(opaque) to
+ *              tell the caller the buffer is no longer needed. The callers buffer must remain
+ *              valid and unmodified until then.
+ *              release() is called exactly once, also when the frame is dropped or an error occurs.
+ * @param[in]   struct fwr_session_s *session - session object.
+ * @param[in]   uint32_t width - Eg. 1280
+ * @param[in]   uint32_t height - Eg. 720
+ * @param[in]   uint32_t stride - Per line, mesaure in bytes.
+ * @param[in]   uint8_t *buffer - a buffer of height * stride bytes.
+ * @param[in]   fwr_release_callback release - Buffer release function, Eg. drop an SDK reference.
+ * @param[in]   void *opaque - Passed to release().
+ * @return        0 - Success
+ * @return      < 0 - Error, or frame dropped.
+ */
+int fwr_writer_enqueue_video_ref(struct fwr_session_s *session,
+	uint32_t width, uint32_t height, uint32_t stride,
+	const uint8_t *buffer,
+	fwr_release_callback release, void *opaque);
+
+/**
+ * @brief       Queue an audio buffer for writing without copying the payload.
+ *              See fwr_writer_enqueue_video_ref() for the buffer lifetime rules.
+ * @param[in]   struct fwr_session_s *session - session object.
+ * @param[in]   uint32_t frameCount - Number of samples (per channel) present in this buffer.
+ * @param[in]   uint32_t sampleDepth - Typically 16 or 32.
+ * @param[in]   uint32_t channelCount - 2 to 16.
+ * @param[in]   uint8_t *buffer - A buffer of data expected to be channels * frameCount * (depth / 8) long.
+ * @param[in]   fwr_release_callback release - Buffer release function, Eg. drop an SDK reference.
+ * @param[in]   void *opaque - Passed to release().
+ * @return        0 - Success
+ * @return      < 0 - Error, or frame dropped.
+ */
+int fwr_writer_enqueue_pcm_ref(struct fwr_session_s *session,
+	uint32_t frameCount, uint32_t sampleDepth, uint32_t channelCount,
+	const uint8_t *buffer,
+	fwr_release_callback release, void *opaque);
+
+/**
+ * @brief       Copy a payload into a new shared buffer, holding a single reference for the caller.
+ * @param[in]   const uint8_t *src - Payload.
+ * @param[in]   size_t len - Payload length in bytes.
+ * @param[out]  struct fwr_buffer_s **buf - Newly allocated buffer.
+ * @return        0 - Success
+ * @return      < 0 - Error
+ */
+int fwr_buffer_alloc(const uint8_t *src, size_t len, struct fwr_buffer_s **buf);
+
+/**
+ * @brief       Share a buffer the caller owns without copying it, Eg. an SDK frame, holding
+ *              a single reference for the caller. release(opaque) is called once the last
+ *              reference is dropped, or straight away if this fails.
+ * @param[in]   const uint8_t *ptr - Payload, valid and unmodified until release() is called.
+ * @param[in]   size_t len - Payload length in bytes.
+ * @param[in]   fwr_release_callback release - Buffer release function, Eg. drop an SDK reference.
+ * @param[in]   void *opaque - Passed to release().
+ * @param[out]  struct fwr_buffer_s **buf - Newly allocated buffer.
+ * @return        0 - Success
+ * @return      < 0 - Error
+ */
+int fwr_buffer_wrap(const uint8_t *ptr, size_t len, fwr_release_callback release, void *opaque, struct fwr_buffer_s **buf);
+
+/**
+ * @brief       Take another reference, for another consumer. Safe from any thread.
+ * @param[in]   struct fwr_buffer_s *buf - Shared buffer.
+ * @return      buf
+ */
+struct fwr_buffer_s *fwr_buffer_ref(struct fwr_buffer_s *buf);
+
+/**
+ * @brief       Drop a reference, freeing the buffer if it was the last. Safe from any thread.
+ * @param[in]   struct fwr_buffer_s *buf - Shared buffer.
+ */
+void fwr_buffer_unref(struct fwr_buffer_s *buf);
+
+/**
+ * @brief       As fwr_writer_enqueue_video_ref(), from a shared buffer. The session takes a
+ *              reference of its own and drops it once the frame is written or dropped, the
+ *              callers reference is unaffected.
+ * @param[in]   struct fwr_session_s *session - session object.
+ * @param[in]   uint32_t width - Eg. 1280
+ * @param[in]   uint32_t height - Eg. 720
+ * @param[in]   uint32_t stride - Per line, mesaure in bytes.
+ * @param[in]   struct fwr_buffer_s *buf - At least height * stride bytes.
+ * @return        0 - Success
+ * @return      < 0 - Error, or frame dropped.
+ */
+int fwr_writer_enqueue_video_buffer(struct fwr_session_s *session,
+	uint32_t width, uint32_t height, uint32_t stride,
+	struct fwr_buffer_s *buf);
+
+/**
+ * @brief       As fwr_writer_enqueue_pcm_ref(), from a shared buffer.
+ *              See fwr_writer_enqueue_video_buffer() for the reference rules.
+ * @param[in]   struct fwr_session_s *session - session object.
+ * @param[in]   uint32_t frameCount - Number of samples (per channel) present in this buffer.
+ * @param[in]   uint32_t sampleDepth - Typically 16 or 32.
+ * @param[in]   uint32_t channelCount - 2 to 16.
+ * @param[in]   struct fwr_buffer_s *buf - At least channels * frameCount * (depth / 8) bytes.
+ * @return        0 - Success
+ * @return      < 0 - Error, or frame dropped.
+ */
+int fwr_writer_enqueue_pcm_buffer(struct fwr_session_s *session,
+	uint32_t frameCount, uint32_t sampleDepth, uint32_t channelCount,
+	struct fwr_buffer_s *buf);
+
+/**
+ * @brief       Bound the amount of memory the deferred writer queue may hold. Frames that
+ *              arrive while either limit is exceeded are handled according to policy.
+ *              A single frame is always accepted into an empty queue, regardless of size.
+ * @param[in]   struct fwr_session_s *session - session object.
+ * @param[in]   uint64_t maxBytes - Maximum number of queued bytes, 0 for unlimited.
+ * @param[in]   uint32_t maxFrames - Maximum number of queued frames (of any type), 0 for unlimited.
+ * @param[in]   int policy - FWR_QUEUE_POLICY_DROP or FWR_QUEUE_POLICY_BLOCK.
+ * @return        0 - Success
+ * @return      < 0 - Error
+ */
+int fwr_session_queue_limits_set(struct fwr_session_s *session, uint64_t maxBytes, uint32_t maxFrames, int policy);
+
+/**
+ * @brief       Give video a writer queue budget of its own, shedding video frames instead of
+ *              losing timing, audio and VANC records when the disk falls behind. Those are
+ *              then never dropped. Under FWR_QUEUE_POLICY_BLOCK they still wait on the limits
+ *              from fwr_session_queue_limits_set(), which no longer count video, under
+ *              FWR_QUEUE_POLICY_DROP they're queued regardless of them.
+ *              Once queued video passes half of maxBytes only every decimation'th frame is
+ *              kept, past maxBytes none are. Every shed frame is counted and recorded in the
+ *              file with a gap record.
+ * @param[in]   struct fwr_session_s *session - session object, opened for write.
+ * @param[in]   uint64_t maxBytes - Video budget, 0 to treat video like any other record again.
+ * @param[in]   uint32_t decimation - Keep 1 in this many frames over half the budget, 0 or 1 to keep all.
+ * @return        0 - Success
+ * @return      < 0 - Error
+ */
+int fwr_session_shed_set(struct fwr_session_s *session, uint64_t maxBytes, uint32_t decimation);
+
+/**
+ * @brief       Preallocate a pool of frame buffers for one frame type, so that the
+ *              fwr_n_frame_create() calls don't touch the heap during steady state capture.
+ *              Buffers return to the pool when the writer thread releases the frame.
+ *              Frames larger than bufferLengthBytes, or created while the pool is exhausted,
+ *              silently fall back to the heap and are counted in the session stats.
+ *              Can be called again to resize the pool, Eg. when the input format changes.
+ *              Frames still holding buffers from the old pool return them to it, and it's
+ *              freed once the last one has. Allocating and populating the pool is slow,
+ *              don't call this from a capture callback while frames are arriving.
+ * @param[in]   struct fwr_session_s *session - session object, opened for write.
+ * @param[in]   int type - FWR_FRAME_TIMING, FWR_FRAME_VIDEO, FWR_FRAME_AUDIO or FWR_FRAME_VANC
+ * @param[in]   size_t bufferLengthBytes - Largest payload expected, Eg. height * stride for video.
+ *              Ignored for timing frames.
+ * @param[in]   uint32_t count - Number of frames in the pool.
+ * @param[in]   int flags - Zero or more FWR_POOL_... flags.
+ * @return        0 - Success
+ * @return      < 0 - Error
+ */
+int fwr_session_pool_alloc(struct fwr_session_s *session, int type, size_t bufferLengthBytes, uint32_t count, int flags);
+
+/**
+ * @brief       Write an uncompressed session with O_DIRECT, bypassing the page cache.
+ *              Records are copied into aligned, double buffered staging buffers and
+ *              written by a dedicated I/O thread. The file is padded to the alignment
+ *              on close and then truncated back, so the on-disk format is unchanged.
+ *              Must be called before any frames are queued. Not supported for .gz sessions.
+ * @param[in]   struct fwr_session_s *session - session object, opened for write.
+ * @param[in]   size_t bufferBytes - Size of each staging buffer, 0 for the default (8MB).
+ * @return        0 - Success
+ * @return      < 0 - Error, Eg. the filesystem doesn't support O_DIRECT. The session remains usable.
+ */
+int fwr_session_direct_io_set(struct fwr_session_s *session, size_t bufferBytes);
+
+/**
+ * @brief       Compress a .gz session on a pool of worker threads. The record stream is
+ *              cut into 1MB blocks, each compressed into an independent gzip member,
+ *              and a single output thread writes the members in order. The result
+ *              remains a valid gzip stream, readable with fwr_session_file_open().
+ *              Must be called before any frames are queued.
+ * @param[in]   struct fwr_session_s *session - session object, opened for write with a .gz filename.
+ * @param[in]   int workers - Number of compression threads.
+ * @return        0 - Success
+ * @return      < 0 - Error, the session remains usable and compresses on the writer thread.
+ */
+int fwr_session_gzip_workers_set(struct fwr_session_s *session, int workers);
+
+/**
+ * @brief       Build a frame index while writing, into a sidecar file.
+ *              Every timing record is indexed by counter and timestamp. Single threaded
+ *              gzip output also gains a restart point at least every 32MB, block parallel
+ *              gzip output has one in every block.
+ *              Entries are appended to the sidecar every 512 frames and on close, so only
+ *              those are held in memory, and a capture that dies early still leaves an index
+ *              covering all but its last few seconds. Block parallel gzip restart points
+ *              are only added on close, an index left behind without them still seeks,
+ *              by decompressing from the start of the file. If the sidecar can't be written,
+ *              Eg. the disk is full, indexing stops for the rest of the session and what was
+ *              already flushed is left as it is.
+ *              Must be called before any frames are queued.
+ * @param[in]   struct fwr_session_s *session - session object, opened for write.
+ * @param[in]   const char *filename - Index filename, by convention the capture filename plus ".idx".
+ * @return        0 - Success
+ * @return      < 0 - Error
+ */
+int fwr_session_index_set(struct fwr_session_s *session, const char *filename);
+
+/**
+ * @brief       Split the output into a sequence of segments, Eg. for round the clock recording.
+ *              The session file becomes the first segment and is renamed to carry a sequence
+ *              number ahead of its extension, capture.mx.gz -> capture.000000.mx.gz.
+ *              The writer moves on to the next segment just before a timing record once
+ *              either limit is reached, so every segment can be analyzed on its own. The
+ *              next file is opened and preallocated ahead of time. An index, if enabled,
+ *              is written per segment as "<segment>.idx".
+ *              Must be called before any frames are queued.
+ * @param[in]   struct fwr_session_s *session - session object, opened for write.
+ * @param[in]   uint32_t seconds - Segment duration in capture time, 0 for no limit.
+ * @param[in]   uint64_t maxBytes - Segment size in record bytes before any compression, 0 for no limit.
+ * @param[in]   uint32_t keepCount - Delete the oldest segments to keep at most this many, 0 to keep all.
+ * @return        0 - Success
+ * @return      < 0 - Error
+ */
+int fwr_session_segment_set(struct fwr_session_s *session, uint32_t seconds, uint64_t maxBytes, uint32_t keepCount);
+
+/**
+ * @brief       Keep the most recent records in a preallocated in-memory ring instead of
+ *              writing them to disk. Each fwr_session_trigger() dumps the ring, then the
+ *              following postSeconds of live records, to a file of its own named like a
+ *              segment, capture.mx -> capture.000000.mx, capture.000001.mx ...
+ *              Triggers during a dump extend it. Dumps start on a timing record and can
+ *              be analyzed like any other capture. The session file itself is removed.
+ *              The ring is written out a slice per frame alongside live capture, which
+ *              keeps recording into it, so the writer never stalls on a whole ring and a
+ *              trigger straight after a dump still has its full window ahead of it.
+ *              Uncompressed sessions only, without an index or segments.
+ *              Must be called before any frames are queued.
+ * @param[in]   struct fwr_session_s *session - session object, opened for write.
+ * @param[in]   uint32_t preSeconds - Capture time to keep ahead of a trigger.
+ * @param[in]   uint32_t postSeconds - Capture time to write after the last trigger.
+ * @param[in]   uint64_t maxBytes - Ring size, 0 for the default (1GB). The oldest frames are
+ *              evicted early if preSeconds of capture doesn't fit.
+ * @return        0 - Success
+ * @return      < 0 - Error
+ */
+int fwr_session_flight_recorder_set(struct fwr_session_s *session, uint32_t preSeconds, uint32_t postSeconds, uint64_t maxBytes);
+
+/**
+ * @brief       Request a flight recorder dump around the current time, acted on once the
+ *              writer reaches the frame captured at this time. Safe to call from any
+ *              thread, Eg. a capture callback.
+ * @param[in]   struct fwr_session_s *session - session object, see fwr_session_flight_recorder_set().
+ * @param[in]   const char *reason - Static string describing the event, Eg. "SCTE-104".
+ * @return        0 - Success
+ * @return      < 0 - Error, the session isn't a flight recorder.
+ */
+int fwr_session_trigger(struct fwr_session_s *session, const char *reason);
+
+/**
+ * @brief       Position a READ session at the first timing record with a counter of at least
+ *              the one given, using the "<filename>.idx" sidecar. The next
+ *              fwr_session_frame_gettype() returns timing_v1_header.
+ * @param[in]   struct fwr_session_s *session - session object, opened for read.
+ * @param[in]   uint64_t counter - fwr_header_timing_s.counter to find.
+ * @return        0 - Success
+ * @return      < 0 - Error, no index or the counter is beyond the end of the file.
+ */
+int fwr_session_seek_frame(struct fwr_session_s *session, uint64_t counter);
+
+/**
+ * @brief       As fwr_session_seek_frame(), finding the first timing record at least
+ *              elapsed time after the first one in the file.
+ * @param[in]   struct fwr_session_s *session - session object, opened for read.
+ * @param[in]   const struct timeval *elapsed - Offset from the start of the capture.
+ * @return        0 - Success
+ * @return      < 0 - Error, no index or the time is beyond the end of the file.
+ */
+int fwr_session_seek_time(struct fwr_session_s *session, const struct timeval *elapsed);
+
+/**
+ * @brief       Decompress a READ session on a background thread, which reads ahead and splits
+ *              the stream into whole records, queued in file order. The fwr_n_frame_read()
+ *              calls then only take the next record, decompression overlaps with whatever
+ *              the caller does with the frames. Uncompressed files are mapped instead, and
+ *              don't support this.
+ * @param[in]   struct fwr_session_s *session - session object, opened for read.
+ * @param[in]   size_t maxBytes - Upper limit on decompressed data queued ahead, 0 for the default (64MB).
+ * @return        0 - Success
+ * @return      < 0 - Error
+ */
+int fwr_session_read_ahead_set(struct fwr_session_s *session, size_t maxBytes);
+
+/**
+ * @brief       Losslessly compress v210 video frames, written as video_v2_header records.
+ *              Frames the codec can't handle, Eg. a stride that isn't a multiple of 16,
+ *              are written uncompressed as before. The output is marked, see FWR_FILE_MARKER.
+ *              Must be called before any frames are queued.
+ * @param[in]   struct fwr_session_s *session - session object, opened for write.
+ * @param[in]   int threads - Number of threads to compress each frame on.
+ * @return        0 - Success
+ * @return      < 0 - Error
+ */
+int fwr_session_video_codec_set(struct fwr_session_s *session, int threads);
+
+/**
+ * @brief       Write VANC as compact v2 records, see vanc_stream_v2_header. Lines without
+ *              ANC are dropped, the others are kept whole or reduced to their packets.
+ *              Lines too wide to scan are written as v1 records. The output is marked,
+ *              see FWR_FILE_MARKER.
+ *              Must be called before any frames are queued.
+ * @param[in]   struct fwr_session_s *session - session object, opened for write.
+ * @param[in]   int mode - FWR_VANC_COMPACT_LINES or FWR_VANC_COMPACT_PACKETS.
+ * @return        0 - Success
+ * @return      < 0 - Error
+ */
+int fwr_session_vanc_compact_set(struct fwr_session_s *session, int mode);
+
+/**
+ * @brief       Take a consistent snapshot of the writer queue statistics.
+ * @param[in]   struct fwr_session_s *session - session object.
+ * @param[out]  struct fwr_session_queue_stats_s *stats - Caller allocated destination.
+ */
+void fwr_session_queue_stats_get(struct fwr_session_s *session, struct fwr_session_queue_stats_s *stats);
+
+/**
+ * @brief       Print the writer queue statistics to a file descriptor, Eg. STDOUT_FILENO.
+ * @param[in]   int fd - Destination file descriptor.
+ * @param[in]   struct fwr_session_s *session - session object.
+ * @param[in]   const char *name - Human readable session name, Eg. the output filename.
+ */
+void fwr_session_queue_stats_print(int fd, struct fwr_session_s *session, const char *name);
+
+/**
+ * @brief       As fwr_session_queue_stats_print(), as a single line JSON object for
+ *              monitoring tools. Latencies are in microseconds, histograms are arrays of
+ *              [lower bound, count] pairs, empty buckets omitted. Bucket n covers [2^n, 2^(n+1)),
+ *              except the first, reported with a lower bound of 0, which covers [0, 2), and
+ *              the last, which is open ended.
+ * @param[in]   int fd - Destination file descriptor.
+ * @param[in]   struct fwr_session_s *session - session object.
+ * @param[in]   const char *name - Human readable session name, Eg. the output filename.
+ */
+void fwr_session_queue_stats_print_json(int fd, struct fwr_session_s *session, const char *name);
+
 #ifdef __cplusplus
 };
 #endif  
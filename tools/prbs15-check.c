@@ -0,0 +1,222 @@
+/* PRBS15 audio validator, see prbs15-check.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "prbs15-check.h"
+
+#define PRBS15_CHECK_VALUES 65536
+#define PRBS15_CHECK_NONE   0xffffffff
+#define PRBS15_CHECK_CHUNK  256
+
+struct prbs15_check_s
+{
+	uint16_t (*next)(uint16_t value);
+
+	/* The cycle containing the first seed, stored twice so any run of up to period
+	 * values starting inside the first copy is contiguous. */
+	uint16_t *seq;
+	uint32_t *pos;              /* Index of each value in seq, or PRBS15_CHECK_NONE */
+	uint32_t period;            /* 0 = not built */
+
+	int synced;
+	uint32_t expect;            /* Index in seq of the next value expected. */
+
+	/* Written by the checking thread only, read by anyone for stats. */
+	uint64_t words;
+	uint64_t wordErrors;
+	uint64_t bitErrors;
+	uint64_t syncs;
+};
+
+int prbs15_check_alloc(struct prbs15_check_s **handle, uint16_t (*next)(uint16_t value))
+{
+	if (!next)
+		return -1;
+
+	struct prbs15_check_s *c = (struct prbs15_check_s *)calloc(1, sizeof(*c));
+	if (!c)
+		return -1;
+
+	c->next = next;
+	c->seq = (uint16_t *)malloc(PRBS15_CHECK_VALUES * 2 * sizeof(*c->seq));
+	c->pos = (uint32_t *)malloc(PRBS15_CHECK_VALUES * sizeof(*c->pos));
+	if (!c->seq || !c->pos) {
+		prbs15_check_free(c);
+		return -1;
+	}
+
+	*handle = c;
+	return 0;
+}
+
+void prbs15_check_free(struct prbs15_check_s *c)
+{
+	if (!c)
+		return;
+
+	free(c->seq);
+	free(c->pos);
+	free(c);
+}
+
+void prbs15_check_reset(struct prbs15_check_s *c)
+{
+	c->synced = 0;
+}
+
+/* Walk the generator from seed until it comes back round. */
+static int prbs15_check_build(struct prbs15_check_s *c, uint16_t seed)
+{
+	memset(c->pos, 0xff, PRBS15_CHECK_VALUES * sizeof(*c->pos));
+	c->period = 0;
+
+	uint16_t v = seed;
+	for (uint32_t n = 0; n < PRBS15_CHECK_VALUES; n++) {
+		if (c->pos[v] != PRBS15_CHECK_NONE)
+			break;
+		c->pos[v] = n;
+		c->seq[n] = v;
+		v = c->next(v);
+		if (v == seed) {
+			c->period = n + 1;
+			break;
+		}
+	}
+
+	if (c->period == 0) {
+		/* The sequence runs into a loop that doesn't include the seed. */
+		memset(c->pos, 0xff, PRBS15_CHECK_VALUES * sizeof(*c->pos));
+		return -1;
+	}
+
+	memcpy(c->seq + c->period, c->seq, c->period * sizeof(*c->seq));
+
+	return 0;
+}
+
+static int prbs15_check_sync(struct prbs15_check_s *c, uint16_t seed)
+{
+	if (c->pos[seed] == PRBS15_CHECK_NONE || c->period == 0) {
+		if (prbs15_check_build(c, seed) < 0)
+			return -1;
+	}
+
+	c->expect = c->pos[seed] + 1;
+	if (c->expect == c->period)
+		c->expect = 0;
+	c->synced = 1;
+	__sync_fetch_and_add(&c->syncs, 1);
+
+	return 0;
+}
+
+static __inline__ uint16_t prbs15_check_sample(const void *samples, int sampleDepth, uint32_t i)
+{
+	if (sampleDepth == 16)
+		return ((const uint16_t *)samples)[i];
+
+	return ((const uint32_t *)samples)[i] >> 16;
+}
+
+/* OR of every difference, cheap enough to run over all samples. */
+static uint16_t prbs15_check_diff16(const uint16_t *s, const uint16_t *e, uint32_t n)
+{
+	uint16_t diff = 0;
+	for (uint32_t i = 0; i < n; i++)
+		diff |= s[i] ^ e[i];
+	return diff;
+}
+
+static uint16_t prbs15_check_diff32(const uint32_t *s, const uint16_t *e, uint32_t n)
+{
+	uint16_t diff = 0;
+	for (uint32_t i = 0; i < n; i++)
+		diff |= (uint16_t)(s[i] >> 16) ^ e[i];
+	return diff;
+}
+
+int prbs15_check_samples(struct prbs15_check_s *c, const void *samples, uint32_t count, int sampleDepth,
+	struct prbs15_check_result_s *r)
+{
+	memset(r, 0, sizeof(*r));
+
+	if (sampleDepth != 16 && sampleDepth != 32)
+		return -1;
+	if (count == 0)
+		return 0;
+
+	if (!c->synced) {
+		r->seed = prbs15_check_sample(samples, sampleDepth, count - 1);
+		if (prbs15_check_sync(c, r->seed) < 0)
+			return -1;
+		r->synced = 1;
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < count; ) {
+		uint32_t n = count - i;
+		if (n > PRBS15_CHECK_CHUNK)
+			n = PRBS15_CHECK_CHUNK;
+		if (n > c->period)
+			n = c->period;
+
+		const uint16_t *e = c->seq + c->expect;
+		uint16_t diff;
+		if (sampleDepth == 16)
+			diff = prbs15_check_diff16((const uint16_t *)samples + i, e, n);
+		else
+			diff = prbs15_check_diff32((const uint32_t *)samples + i, e, n);
+
+		if (diff) {
+			for (uint32_t k = 0; k < n; k++) {
+				uint16_t got = prbs15_check_sample(samples, sampleDepth, i + k);
+				uint16_t x = got ^ e[k];
+				if (!x)
+					continue;
+
+				r->wordErrors++;
+				r->bitErrors += __builtin_popcount(x);
+				if (r->errorCount < PRBS15_CHECK_MAX_ERRORS) {
+					r->errors[r->errorCount].index = i + k;
+					r->errors[r->errorCount].expected = e[k];
+					r->errors[r->errorCount].got = got;
+					r->errorCount++;
+				}
+			}
+		}
+
+		c->expect += n;
+		if (c->expect >= c->period)
+			c->expect -= c->period;
+		i += n;
+	}
+	r->words = count;
+
+	/* A slip or a gap leaves the tail out of step too, lock onto it again. */
+	uint16_t last = prbs15_check_sample(samples, sampleDepth, count - 1);
+	if (r->wordErrors && last != c->seq[c->expect ? c->expect - 1 : c->period - 1]) {
+		r->seed = last;
+		if (prbs15_check_sync(c, r->seed) < 0) {
+			c->synced = 0;
+			return -1;
+		}
+		r->resynced = 1;
+	}
+
+	__sync_fetch_and_add(&c->words, r->words);
+	__sync_fetch_and_add(&c->wordErrors, r->wordErrors);
+	__sync_fetch_and_add(&c->bitErrors, r->bitErrors);
+
+	return 0;
+}
+
+void prbs15_check_stats(struct prbs15_check_s *c, uint64_t *words, uint64_t *wordErrors, uint64_t *bitErrors,
+	uint64_t *syncs)
+{
+	*words = __sync_fetch_and_add(&c->words, 0);
+	*wordErrors = __sync_fetch_and_add(&c->wordErrors, 0);
+	*bitErrors = __sync_fetch_and_add(&c->bitErrors, 0);
+	*syncs = __sync_fetch_and_add(&c->syncs, 0);
+}
@@ -0,0 +1,105 @@
+/**
+ * @file	prbs15-check.h
+ * @brief	Table driven validator for PRBS15 sequences striped across PCM audio channels.
+ *
+ * Rather than stepping the generator once per sample, the whole period of the sequence
+ * is walked once and cached, twice over, so that the values expected for any run of
+ * samples sit in one contiguous slice of the table. A buffer is then checked a chunk
+ * at a time with a plain XOR/OR reduction the compiler vectorizes, and only chunks with
+ * a difference are looked at sample by sample for word and bit error counts.
+ *
+ * The generator itself is supplied by the caller as a successor function, which keeps
+ * the table bit exact with whatever produces the upstream sequence.
+ *
+ *   struct prbs15_check_s *c;
+ *   prbs15_check_alloc(&c, next);
+ *
+ *   struct prbs15_check_result_s r;
+ *   prbs15_check_samples(c, samples, count, 16, &r);
+ *   if (r.wordErrors)
+ *       ... report r.errors[0 .. r.errorCount) ...
+ *
+ *   prbs15_check_free(c);
+ */
+
+#ifndef PRBS15_CHECK_H
+#define PRBS15_CHECK_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PRBS15_CHECK_MAX_ERRORS 16
+
+struct prbs15_check_s;
+
+struct prbs15_check_result_s
+{
+	uint32_t words;             /* Samples checked, 0 when the buffer was only used to sync. */
+	uint32_t wordErrors;        /* Samples that didn't match the prediction. */
+	uint32_t bitErrors;         /* Bits that differed, across every mismatched sample. */
+	int synced;                 /* Locked onto the sequence using the last sample. */
+	int resynced;               /* The last sample was wrong too, lock was lost and taken again. */
+	uint16_t seed;              /* Value locked onto when synced or resynced. */
+
+	/* The first mismatches, by sample index into the buffer. */
+	uint32_t errorCount;
+	struct {
+		uint32_t index;
+		uint16_t expected;
+		uint16_t got;
+	} errors[PRBS15_CHECK_MAX_ERRORS];
+};
+
+/**
+ * @brief	Allocate a validator, not yet synced to the sequence.
+ * @param[out]	struct prbs15_check_s **handle - Newly created validator.
+ * @param[in]	uint16_t (*next)(uint16_t value) - Returns the value the generator produces after value.
+ * @return	0 - Success
+ * @return	< 0 - Error
+ */
+int prbs15_check_alloc(struct prbs15_check_s **handle, uint16_t (*next)(uint16_t value));
+
+void prbs15_check_free(struct prbs15_check_s *c);
+
+/**
+ * @brief	Forget the sequence position, the next buffer is used to sync again.
+ * @param[in]	struct prbs15_check_s *c - Validator.
+ */
+void prbs15_check_reset(struct prbs15_check_s *c);
+
+/**
+ * @brief	Check interleaved samples against the sequence. When not synced, lock onto the
+ *		last sample and check nothing. Mismatches don't stop the check, the prediction
+ *		carries on so isolated bit errors are counted as such, and lock is only taken
+ *		again when the last sample of the buffer is also wrong.
+ * @param[in]	struct prbs15_check_s *c - Validator.
+ * @param[in]	const void *samples - Samples, 16-bit or 32-bit. Only the upper 16 bits of
+ *		32-bit samples are compared.
+ * @param[in]	uint32_t count - Number of samples, frames times channels.
+ * @param[in]	int sampleDepth - 16 or 32.
+ * @param[out]	struct prbs15_check_result_s *r - Result.
+ * @return	0 - Success
+ * @return	< 0 - Error, bad arguments or the generator isn't periodic from the seed.
+ */
+int prbs15_check_samples(struct prbs15_check_s *c, const void *samples, uint32_t count, int sampleDepth,
+	struct prbs15_check_result_s *r);
+
+/**
+ * @brief	Cumulative counts since allocation.
+ * @param[in]	struct prbs15_check_s *c - Validator.
+ * @param[out]	uint64_t *words - Samples checked.
+ * @param[out]	uint64_t *wordErrors - Samples mismatched.
+ * @param[out]	uint64_t *bitErrors - Bits wrong.
+ * @param[out]	uint64_t *syncs - Times lock was taken, including the first.
+ */
+void prbs15_check_stats(struct prbs15_check_s *c, uint64_t *words, uint64_t *wordErrors, uint64_t *bitErrors,
+	uint64_t *syncs);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* PRBS15_CHECK_H */
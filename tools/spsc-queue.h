@@ -0,0 +1,133 @@
+/**
+ * @file	spsc-queue.h
+ * @brief	Bounded lock-free queue of fixed size elements, for exactly one producer
+ *		thread and one consumer thread.
+ *
+ * Elements are copied in and out of a power of two ring. The producer only writes
+ * the head index and the consumer only writes the tail, so neither side ever takes
+ * a lock or waits on the other. A full queue refuses the push, it's up to the
+ * producer what to do with the element. Consumers that want to sleep while the
+ * queue is empty need to pair it with something like a semaphore.
+ *
+ *   struct spsc_queue_s *q;
+ *   spsc_queue_alloc(&q, 16, sizeof(struct item_s));
+ *
+ *   // Producer
+ *   if (spsc_queue_push(q, &item) < 0)
+ *       ... full, drop or retry ...
+ *
+ *   // Consumer
+ *   while (spsc_queue_pop(q, &item) == 0)
+ *       ... process item ...
+ *
+ *   spsc_queue_free(q);
+ */
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPSC_QUEUE_CACHELINE 64
+
+struct spsc_queue_s
+{
+	uint32_t mask;          /* Slot count - 1 */
+	uint32_t elementSize;
+	uint8_t *slots;
+
+	/* Written by the producer only, on its own cache line. */
+	uint32_t head __attribute__((aligned(SPSC_QUEUE_CACHELINE)));
+
+	/* Written by the consumer only. */
+	uint32_t tail __attribute__((aligned(SPSC_QUEUE_CACHELINE)));
+};
+
+/**
+ * @brief	Allocate a queue.
+ * @param[out]	struct spsc_queue_s **handle - Newly created queue.
+ * @param[in]	uint32_t count - Minimum number of elements the queue holds, rounded up to a power of two.
+ * @param[in]	uint32_t elementSize - Size in bytes of each element.
+ * @return	0 - Success
+ * @return	< 0 - Error
+ */
+static __inline__ int spsc_queue_alloc(struct spsc_queue_s **handle, uint32_t count, uint32_t elementSize)
+{
+	if (count == 0 || count > 0x80000000 || elementSize == 0)
+		return -1;
+
+	uint32_t slots = 1;
+	while (slots < count)
+		slots <<= 1;
+
+	struct spsc_queue_s *q;
+	if (posix_memalign((void **)&q, SPSC_QUEUE_CACHELINE, sizeof(*q)))
+		return -1;
+	memset(q, 0, sizeof(*q));
+
+	q->slots = (uint8_t *)calloc(slots, elementSize);
+	if (!q->slots) {
+		free(q);
+		return -1;
+	}
+	q->mask = slots - 1;
+	q->elementSize = elementSize;
+
+	*handle = q;
+	return 0;
+}
+
+static __inline__ void spsc_queue_free(struct spsc_queue_s *q)
+{
+	if (!q)
+		return;
+
+	free(q->slots);
+	free(q);
+}
+
+/**
+ * @brief	Producer only. Copy an element onto the queue.
+ * @return	0 - Success
+ * @return	< 0 - The queue is full.
+ */
+static __inline__ int spsc_queue_push(struct spsc_queue_s *q, const void *element)
+{
+	uint32_t head = q->head;
+	uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	if (head - tail > q->mask)
+		return -1;
+
+	memcpy(q->slots + (head & q->mask) * q->elementSize, element, q->elementSize);
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * @brief	Consumer only. Copy the oldest element off the queue.
+ * @return	0 - Success
+ * @return	< 0 - The queue is empty.
+ */
+static __inline__ int spsc_queue_pop(struct spsc_queue_s *q, void *element)
+{
+	uint32_t tail = q->tail;
+	uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return -1;
+
+	memcpy(element, q->slots + (tail & q->mask) * q->elementSize, q->elementSize);
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* Either side. Number of elements queued, may be stale by the time it returns. */
+static __inline__ uint32_t spsc_queue_depth(struct spsc_queue_s *q)
+{
+	return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+#endif /* SPSC_QUEUE_H */
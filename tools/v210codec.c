@@ -0,0 +1,688 @@
+/* Lossless v210 video codec, see v210codec.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "v210codec.h"
+
+#define V210C_MAGIC        0x31433256 /* "V2C1" */
+#define V210C_MAX_SLICES   64
+#define V210C_SLICE_LINES  32         /* Target lines per slice, frames are cut into at most V210C_MAX_SLICES. */
+#define V210C_UNARY_MAX    24         /* Longer unary prefixes escape to a raw 10 bit sample. */
+#define V210C_ACTIVITY     8          /* Contexts per component, by local gradient. */
+#define V210C_CTX_COUNT    (3 * V210C_ACTIVITY)
+
+#define V210C_SLICE_RAW    0
+#define V210C_SLICE_CODED  1
+
+/* Compressed frame layout, native endian like the rest of the .mx format:
+ *   uint32_t magic
+ *   uint32_t sliceCount
+ *   sliceCount x { uint32_t lineCount, uint32_t byteCount, uint32_t mode }
+ *   slice data, in order
+ */
+struct v210codec_slice_hdr_s
+{
+	uint32_t lineCount;
+	uint32_t byteCount;
+	uint32_t mode;
+};
+
+struct v210codec_slice_s
+{
+	uint32_t firstLine;
+	uint32_t lineCount;
+	uint32_t mode;
+
+	/* Encoder output, or decoder input. */
+	uint8_t *buf;
+	size_t bufSize;
+	size_t len;
+	const uint8_t *in;
+
+	/* Unpacked Y, Cb, Cr for the current and previous line. */
+	int16_t *planes;
+	size_t planesSize;
+
+	int error;
+};
+
+struct v210codec_s
+{
+	int threadCount;
+	pthread_t *threads;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;        /* Work is available, or terminate. */
+	pthread_cond_t doneCond;    /* The last slice of the current job finished. */
+	int terminate;
+
+	/* Current job, protected by mutex. */
+	int decode;
+	const uint8_t *src;
+	uint8_t *dst;
+	uint32_t strideBytes;
+	uint32_t sliceCount;
+	uint32_t nextSlice;
+	uint32_t doneSlices;
+
+	struct v210codec_slice_s slices[V210C_MAX_SLICES];
+
+	uint8_t *out;
+	size_t outSize;
+};
+
+/* -- Bit I/O, MSB first. */
+struct v210codec_bitw_s
+{
+	uint8_t *p;
+	uint8_t *end;
+	uint64_t acc;
+	int n;
+	int overflow;
+};
+
+/* Up to 56 bits at a time. */
+static inline void bitw_put(struct v210codec_bitw_s *w, uint64_t v, int bits)
+{
+	w->acc = (w->acc << bits) | v;
+	w->n += bits;
+	while (w->n >= 8) {
+		w->n -= 8;
+		if (w->p < w->end)
+			*w->p++ = w->acc >> w->n;
+		else
+			w->overflow = 1;
+	}
+}
+
+static inline void bitw_flush(struct v210codec_bitw_s *w)
+{
+	if (w->n)
+		bitw_put(w, 0, 8 - w->n);
+}
+
+struct v210codec_bitr_s
+{
+	const uint8_t *p;
+	const uint8_t *end;
+	uint64_t acc;               /* Valid bits are left aligned. */
+	int n;
+	int overrun;
+};
+
+static inline void bitr_refill(struct v210codec_bitr_s *r)
+{
+	while (r->n <= 56) {
+		uint64_t b = 0;
+		if (r->p < r->end)
+			b = *r->p++;
+		else
+			r->overrun++;
+		r->acc |= b << (56 - r->n);
+		r->n += 8;
+	}
+}
+
+static inline uint32_t bitr_get(struct v210codec_bitr_s *r, int bits)
+{
+	uint32_t v = r->acc >> (64 - bits);
+	r->acc <<= bits;
+	r->n -= bits;
+	return v;
+}
+
+/* -- Modelling */
+struct v210codec_ctx_s
+{
+	uint32_t A;                 /* Accumulated magnitude */
+	uint32_t N;                 /* Occurences */
+};
+
+static void v210codec_ctx_init(struct v210codec_ctx_s *ctx)
+{
+	for (int i = 0; i < V210C_CTX_COUNT; i++) {
+		ctx[i].A = 16;
+		ctx[i].N = 1;
+	}
+}
+
+/* Smallest k with (N << k) >= A, capped at the sample width. */
+static inline int v210codec_rice_k(const struct v210codec_ctx_s *c)
+{
+	if (c->N >= c->A)
+		return 0;
+	int k = __builtin_clz(c->N) - __builtin_clz(c->A);
+	if ((c->N << k) < c->A)
+		k++;
+	return k > 10 ? 10 : k;
+}
+
+static inline void v210codec_ctx_update(struct v210codec_ctx_s *c, uint32_t m)
+{
+	c->A += m;
+	if (++c->N == 64) {
+		c->A >>= 1;
+		c->N >>= 1;
+	}
+}
+
+/* Log2 bucket of the local gradient, 0..V210C_ACTIVITY-1. Written as a sum of
+ * compares so the encoder prepass vectorizes.
+ */
+static inline int v210codec_activity(int a, int b, int c)
+{
+	int act = abs(a - c) + abs(b - c);
+	return (act > 0) + (act > 1) + (act > 3) + (act > 7) + (act > 15) + (act > 31) + (act > 63);
+}
+
+/* Median edge detector, as used by LOCO-I. */
+static inline int v210codec_predict(int a, int b, int c)
+{
+	int mx = a > b ? a : b;
+	int mn = a < b ? a : b;
+	if (c >= mx)
+		return mn;
+	if (c <= mn)
+		return mx;
+	return a + b - c;
+}
+
+/* Neighbours of sample x, in a plane with an optional line above. */
+static inline void v210codec_neighbours(const int16_t *cur, const int16_t *prev, int x, int *a, int *b, int *c)
+{
+	if (prev) {
+		*b = prev[x];
+		*a = x ? cur[x - 1] : *b;
+		*c = x ? prev[x - 1] : *b;
+	} else {
+		*a = x ? cur[x - 1] : 512;
+		*b = *a;
+		*c = *a;
+	}
+}
+
+/* -- v210 packing. Each 16 byte group carries six pixels:
+ *  w0: Cb0 Y0 Cr0   w1: Y1 Cb1 Y2   w2: Cr1 Y3 Cb2   w3: Y4 Cr2 Y5
+ * Returns the OR of the unused top two bits of every word, which must be zero
+ * for the line to be coded.
+ */
+static uint32_t v210codec_unpack(const uint8_t *src, uint32_t groups, int16_t *y, int16_t *cb, int16_t *cr)
+{
+	uint32_t top = 0;
+
+	for (uint32_t g = 0; g < groups; g++) {
+		uint32_t w[4];
+		memcpy(w, src + (g * 16), 16);
+		top |= w[0] | w[1] | w[2] | w[3];
+
+		y[6 * g + 0] = (w[0] >> 10) & 0x3ff;
+		y[6 * g + 1] = (w[1]      ) & 0x3ff;
+		y[6 * g + 2] = (w[1] >> 20) & 0x3ff;
+		y[6 * g + 3] = (w[2] >> 10) & 0x3ff;
+		y[6 * g + 4] = (w[3]      ) & 0x3ff;
+		y[6 * g + 5] = (w[3] >> 20) & 0x3ff;
+		cb[3 * g + 0] = (w[0]      ) & 0x3ff;
+		cb[3 * g + 1] = (w[1] >> 10) & 0x3ff;
+		cb[3 * g + 2] = (w[2] >> 20) & 0x3ff;
+		cr[3 * g + 0] = (w[0] >> 20) & 0x3ff;
+		cr[3 * g + 1] = (w[2]      ) & 0x3ff;
+		cr[3 * g + 2] = (w[3] >> 10) & 0x3ff;
+	}
+
+	return top & 0xc0000000;
+}
+
+static void v210codec_pack(uint8_t *dst, uint32_t groups, const int16_t *y, const int16_t *cb, const int16_t *cr)
+{
+	for (uint32_t g = 0; g < groups; g++) {
+		uint32_t w[4];
+		w[0] = cb[3 * g + 0] | (y[6 * g + 0] << 10) | (cr[3 * g + 0] << 20);
+		w[1] = y[6 * g + 1] | (cb[3 * g + 1] << 10) | (y[6 * g + 2] << 20);
+		w[2] = cr[3 * g + 1] | (y[6 * g + 3] << 10) | (cb[3 * g + 2] << 20);
+		w[3] = y[6 * g + 4] | (cr[3 * g + 2] << 10) | (y[6 * g + 5] << 20);
+		memcpy(dst + (g * 16), w, 16);
+	}
+}
+
+/* -- Slice coding */
+static inline uint16_t v210codec_residual(int x, int a, int b, int c)
+{
+	int e = (x - v210codec_predict(a, b, c)) & 0x3ff;
+	if (e >= 512)
+		e -= 1024;
+	return e >= 0 ? e << 1 : (-e << 1) - 1; /* Zigzag, 0..1023 */
+}
+
+/* Every sample is known up front when encoding, so residuals and contexts for a whole
+ * line are computed in a branch free pass the compiler can vectorize, leaving only the
+ * entropy coder serial.
+ */
+static void v210codec_plane_model(const int16_t *cur, const int16_t *prev, uint32_t count,
+	uint16_t *res, uint8_t *cix)
+{
+	int a, b, c;
+
+	v210codec_neighbours(cur, prev, 0, &a, &b, &c);
+	res[0] = v210codec_residual(cur[0], a, b, c);
+	cix[0] = v210codec_activity(a, b, c);
+
+	if (prev) {
+		for (uint32_t x = 1; x < count; x++) {
+			a = cur[x - 1];
+			b = prev[x];
+			c = prev[x - 1];
+			res[x] = v210codec_residual(cur[x], a, b, c);
+			cix[x] = v210codec_activity(a, b, c);
+		}
+	} else {
+		for (uint32_t x = 1; x < count; x++) {
+			res[x] = v210codec_residual(cur[x], cur[x - 1], cur[x - 1], cur[x - 1]);
+			cix[x] = 0;
+		}
+	}
+}
+
+static void v210codec_plane_encode(struct v210codec_bitw_s *w, struct v210codec_ctx_s *ctx,
+	const int16_t *cur, const int16_t *prev, uint32_t count, uint16_t *res, uint8_t *cix)
+{
+	v210codec_plane_model(cur, prev, count, res, cix);
+
+	for (uint32_t x = 0; x < count; x++) {
+		struct v210codec_ctx_s *cx = &ctx[cix[x]];
+		uint32_t m = res[x];
+
+		int k = v210codec_rice_k(cx);
+		uint32_t q = m >> k;
+		if (q < V210C_UNARY_MAX) {
+			/* q zeros, a one, then the low k bits of m. */
+			bitw_put(w, (1 << k) | (m & ((1 << k) - 1)), q + 1 + k);
+		} else {
+			bitw_put(w, 1, V210C_UNARY_MAX + 1);
+			bitw_put(w, m, 10);
+		}
+		v210codec_ctx_update(cx, m);
+	}
+}
+
+static void v210codec_plane_decode(struct v210codec_bitr_s *r, struct v210codec_ctx_s *ctx,
+	int16_t *cur, const int16_t *prev, uint32_t count)
+{
+	for (uint32_t x = 0; x < count; x++) {
+		int a, b, c;
+		v210codec_neighbours(cur, prev, x, &a, &b, &c);
+
+		struct v210codec_ctx_s *cx = &ctx[v210codec_activity(a, b, c)];
+		int k = v210codec_rice_k(cx);
+
+		bitr_refill(r);
+		int z = r->acc ? __builtin_clzll(r->acc) : 64;
+		uint32_t m;
+		if (z >= V210C_UNARY_MAX) {
+			bitr_get(r, V210C_UNARY_MAX + 1);
+			m = bitr_get(r, 10);
+		} else {
+			bitr_get(r, z + 1);
+			m = z << k;
+			if (k)
+				m |= bitr_get(r, k);
+		}
+		v210codec_ctx_update(cx, m);
+
+		int e = (m >> 1) ^ -(int)(m & 1);
+		cur[x] = (v210codec_predict(a, b, c) + e) & 0x3ff;
+	}
+}
+
+static int v210codec_slice_planes(struct v210codec_slice_s *sl, uint32_t groups)
+{
+	/* Two lines (current and previous) of 6 Y + 3 Cb + 3 Cr samples per group,
+	 * plus the encoders residual and context scratch for the widest plane.
+	 */
+	size_t need = (2 * 12 * groups * sizeof(int16_t)) + (6 * groups * (sizeof(uint16_t) + sizeof(uint8_t)));
+	if (sl->planesSize < need) {
+		free(sl->planes);
+		sl->planes = malloc(need);
+		sl->planesSize = sl->planes ? need : 0;
+	}
+	return sl->planes ? 0 : -1;
+}
+
+static void v210codec_slice_encode(struct v210codec_s *ctx, struct v210codec_slice_s *sl)
+{
+	const uint8_t *src = ctx->src + ((size_t)sl->firstLine * ctx->strideBytes);
+	size_t rawBytes = (size_t)sl->lineCount * ctx->strideBytes;
+	uint32_t groups = ctx->strideBytes / 16;
+
+	if (sl->bufSize < rawBytes) {
+		free(sl->buf);
+		sl->buf = malloc(rawBytes);
+		sl->bufSize = sl->buf ? rawBytes : 0;
+	}
+	if (!sl->buf || v210codec_slice_planes(sl, groups) < 0) {
+		sl->error = 1;
+		return;
+	}
+
+	struct v210codec_ctx_s mctx[3][V210C_CTX_COUNT];
+	for (int i = 0; i < 3; i++)
+		v210codec_ctx_init(mctx[i]);
+
+	struct v210codec_bitw_s w = { sl->buf, sl->buf + rawBytes, 0, 0, 0 };
+	int16_t *line[2] = { sl->planes, sl->planes + (12 * groups) };
+	uint16_t *res = (uint16_t *)(sl->planes + (24 * groups));
+	uint8_t *cix = (uint8_t *)(res + (6 * groups));
+	uint32_t top = 0;
+
+	for (uint32_t i = 0; i < sl->lineCount && !w.overflow && !top; i++) {
+		int16_t *cur = line[i & 1];
+		int16_t *prev = i ? line[(i - 1) & 1] : NULL;
+
+		top = v210codec_unpack(src + ((size_t)i * ctx->strideBytes), groups,
+			cur, cur + (6 * groups), cur + (9 * groups));
+
+		v210codec_plane_encode(&w, mctx[0], cur, prev, 6 * groups, res, cix);
+		v210codec_plane_encode(&w, mctx[1], cur + (6 * groups), prev ? prev + (6 * groups) : NULL, 3 * groups, res, cix);
+		v210codec_plane_encode(&w, mctx[2], cur + (9 * groups), prev ? prev + (9 * groups) : NULL, 3 * groups, res, cix);
+	}
+	bitw_flush(&w);
+
+	if (w.overflow || top) {
+		/* Incompressible, or not strictly v210. Store the lines as is. */
+		memcpy(sl->buf, src, rawBytes);
+		sl->len = rawBytes;
+		sl->mode = V210C_SLICE_RAW;
+	} else {
+		sl->len = w.p - sl->buf;
+		sl->mode = V210C_SLICE_CODED;
+	}
+}
+
+static void v210codec_slice_decode(struct v210codec_s *ctx, struct v210codec_slice_s *sl)
+{
+	uint8_t *dst = ctx->dst + ((size_t)sl->firstLine * ctx->strideBytes);
+	size_t rawBytes = (size_t)sl->lineCount * ctx->strideBytes;
+	uint32_t groups = ctx->strideBytes / 16;
+
+	if (sl->mode == V210C_SLICE_RAW) {
+		if (sl->len != rawBytes)
+			sl->error = 1;
+		else
+			memcpy(dst, sl->in, rawBytes);
+		return;
+	}
+
+	if (v210codec_slice_planes(sl, groups) < 0) {
+		sl->error = 1;
+		return;
+	}
+
+	struct v210codec_ctx_s mctx[3][V210C_CTX_COUNT];
+	for (int i = 0; i < 3; i++)
+		v210codec_ctx_init(mctx[i]);
+
+	struct v210codec_bitr_s r = { sl->in, sl->in + sl->len, 0, 0, 0 };
+	int16_t *line[2] = { sl->planes, sl->planes + (12 * groups) };
+
+	for (uint32_t i = 0; i < sl->lineCount; i++) {
+		int16_t *cur = line[i & 1];
+		int16_t *prev = i ? line[(i - 1) & 1] : NULL;
+
+		v210codec_plane_decode(&r, mctx[0], cur, prev, 6 * groups);
+		v210codec_plane_decode(&r, mctx[1], cur + (6 * groups), prev ? prev + (6 * groups) : NULL, 3 * groups);
+		v210codec_plane_decode(&r, mctx[2], cur + (9 * groups), prev ? prev + (9 * groups) : NULL, 3 * groups);
+
+		v210codec_pack(dst + ((size_t)i * ctx->strideBytes), groups,
+			cur, cur + (6 * groups), cur + (9 * groups));
+	}
+
+	/* The refill reads up to 8 bytes ahead of what it consumes. */
+	if (r.overrun > 8)
+		sl->error = 1;
+}
+
+/* -- Thread pool, the caller and every worker pull slices until the job is exhausted. */
+static int v210codec_job_next(struct v210codec_s *ctx)
+{
+	int more = 0;
+
+	pthread_mutex_lock(&ctx->mutex);
+	while (ctx->nextSlice < ctx->sliceCount) {
+		uint32_t i = ctx->nextSlice++;
+		int decode = ctx->decode;
+		pthread_mutex_unlock(&ctx->mutex);
+
+		if (decode)
+			v210codec_slice_decode(ctx, &ctx->slices[i]);
+		else
+			v210codec_slice_encode(ctx, &ctx->slices[i]);
+		more = 1;
+
+		pthread_mutex_lock(&ctx->mutex);
+		if (++ctx->doneSlices == ctx->sliceCount)
+			pthread_cond_broadcast(&ctx->doneCond);
+	}
+	pthread_mutex_unlock(&ctx->mutex);
+
+	return more;
+}
+
+static void *v210codec_threadfunc(void *p)
+{
+	struct v210codec_s *ctx = (struct v210codec_s *)p;
+
+	while (1) {
+		pthread_mutex_lock(&ctx->mutex);
+		while (!ctx->terminate && ctx->nextSlice >= ctx->sliceCount)
+			pthread_cond_wait(&ctx->cond, &ctx->mutex);
+		int terminate = ctx->terminate;
+		pthread_mutex_unlock(&ctx->mutex);
+		if (terminate)
+			break;
+
+		v210codec_job_next(ctx);
+	}
+
+	return NULL;
+}
+
+static int v210codec_job_run(struct v210codec_s *ctx)
+{
+	pthread_mutex_lock(&ctx->mutex);
+	ctx->nextSlice = 0;
+	ctx->doneSlices = 0;
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->mutex);
+
+	v210codec_job_next(ctx);
+
+	pthread_mutex_lock(&ctx->mutex);
+	while (ctx->doneSlices < ctx->sliceCount)
+		pthread_cond_wait(&ctx->doneCond, &ctx->mutex);
+	pthread_mutex_unlock(&ctx->mutex);
+
+	for (uint32_t i = 0; i < ctx->sliceCount; i++) {
+		if (ctx->slices[i].error)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void v210codec_slices_layout(struct v210codec_s *ctx, uint32_t height)
+{
+	uint32_t count = height / V210C_SLICE_LINES;
+	if (count < 1)
+		count = 1;
+	if (count > V210C_MAX_SLICES)
+		count = V210C_MAX_SLICES;
+
+	uint32_t line = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		struct v210codec_slice_s *sl = &ctx->slices[i];
+		sl->firstLine = line;
+		sl->lineCount = (height - line) / (count - i);
+		sl->error = 0;
+		line += sl->lineCount;
+	}
+	ctx->sliceCount = count;
+}
+
+int v210codec_encode(struct v210codec_s *ctx, const uint8_t *src, uint32_t height, uint32_t strideBytes,
+	const uint8_t **dst, uint32_t *dstLength)
+{
+	if (!src || height == 0 || strideBytes == 0 || (strideBytes % 16))
+		return -1;
+
+	/* Slice layout is written to the stream, so the pool never sees a partial job. */
+	pthread_mutex_lock(&ctx->mutex);
+	ctx->decode = 0;
+	ctx->src = src;
+	ctx->strideBytes = strideBytes;
+	v210codec_slices_layout(ctx, height);
+	ctx->nextSlice = ctx->sliceCount;
+	pthread_mutex_unlock(&ctx->mutex);
+
+	if (v210codec_job_run(ctx) < 0)
+		return -1;
+
+	size_t total = (2 * sizeof(uint32_t)) + (ctx->sliceCount * sizeof(struct v210codec_slice_hdr_s));
+	for (uint32_t i = 0; i < ctx->sliceCount; i++)
+		total += ctx->slices[i].len;
+
+	if (ctx->outSize < total) {
+		free(ctx->out);
+		ctx->out = malloc(total);
+		ctx->outSize = ctx->out ? total : 0;
+		if (!ctx->out)
+			return -1;
+	}
+
+	uint8_t *p = ctx->out;
+	uint32_t v = V210C_MAGIC;
+	memcpy(p, &v, sizeof(v));
+	p += sizeof(v);
+	memcpy(p, &ctx->sliceCount, sizeof(ctx->sliceCount));
+	p += sizeof(ctx->sliceCount);
+	for (uint32_t i = 0; i < ctx->sliceCount; i++) {
+		struct v210codec_slice_hdr_s h = { ctx->slices[i].lineCount, ctx->slices[i].len, ctx->slices[i].mode };
+		memcpy(p, &h, sizeof(h));
+		p += sizeof(h);
+	}
+	for (uint32_t i = 0; i < ctx->sliceCount; i++) {
+		memcpy(p, ctx->slices[i].buf, ctx->slices[i].len);
+		p += ctx->slices[i].len;
+	}
+
+	*dst = ctx->out;
+	*dstLength = total;
+	return 0;
+}
+
+int v210codec_decode(struct v210codec_s *ctx, const uint8_t *src, uint32_t srcLength,
+	uint32_t height, uint32_t strideBytes, uint8_t *dst)
+{
+	uint32_t magic, count;
+
+	if (!src || !dst || (strideBytes % 16) || srcLength < 2 * sizeof(uint32_t))
+		return -1;
+
+	memcpy(&magic, src, sizeof(magic));
+	memcpy(&count, src + sizeof(magic), sizeof(count));
+	if (magic != V210C_MAGIC || count == 0 || count > V210C_MAX_SLICES)
+		return -1;
+
+	size_t offset = (2 * sizeof(uint32_t)) + (count * sizeof(struct v210codec_slice_hdr_s));
+	if (offset > srcLength)
+		return -1;
+
+	pthread_mutex_lock(&ctx->mutex);
+	ctx->decode = 1;
+	ctx->dst = dst;
+	ctx->strideBytes = strideBytes;
+	ctx->sliceCount = count;
+	ctx->nextSlice = count;
+
+	uint32_t line = 0;
+	int ret = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		struct v210codec_slice_hdr_s h;
+		memcpy(&h, src + (2 * sizeof(uint32_t)) + (i * sizeof(h)), sizeof(h));
+
+		struct v210codec_slice_s *sl = &ctx->slices[i];
+		if (h.byteCount > srcLength - offset || h.lineCount > height - line) {
+			ret = -1;
+			break;
+		}
+		sl->firstLine = line;
+		sl->lineCount = h.lineCount;
+		sl->mode = h.mode;
+		sl->in = src + offset;
+		sl->len = h.byteCount;
+		sl->error = 0;
+
+		line += h.lineCount;
+		offset += h.byteCount;
+	}
+	if (line != height)
+		ret = -1;
+	if (ret < 0)
+		ctx->sliceCount = 0;
+	pthread_mutex_unlock(&ctx->mutex);
+
+	if (ret < 0)
+		return -1;
+
+	return v210codec_job_run(ctx);
+}
+
+int v210codec_alloc(struct v210codec_s **ctx, int threads)
+{
+	struct v210codec_s *c = calloc(1, sizeof(*c));
+	if (!c)
+		return -1;
+
+	pthread_mutex_init(&c->mutex, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	pthread_cond_init(&c->doneCond, NULL);
+
+	/* The calling thread codes slices too. */
+	if (threads > 1) {
+		c->threads = calloc(threads - 1, sizeof(pthread_t));
+		for (int i = 0; c->threads && i < threads - 1; i++) {
+			if (pthread_create(&c->threads[i], 0, v210codec_threadfunc, c) != 0)
+				break;
+			c->threadCount++;
+		}
+	}
+
+	*ctx = c;
+	return 0;
+}
+
+void v210codec_free(struct v210codec_s *ctx)
+{
+	if (!ctx)
+		return;
+
+	pthread_mutex_lock(&ctx->mutex);
+	ctx->terminate = 1;
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->mutex);
+	for (int i = 0; i < ctx->threadCount; i++)
+		pthread_join(ctx->threads[i], NULL);
+	free(ctx->threads);
+
+	for (int i = 0; i < V210C_MAX_SLICES; i++) {
+		free(ctx->slices[i].buf);
+		free(ctx->slices[i].planes);
+	}
+	free(ctx->out);
+
+	pthread_cond_destroy(&ctx->doneCond);
+	pthread_cond_destroy(&ctx->cond);
+	pthread_mutex_destroy(&ctx->mutex);
+	free(ctx);
+}
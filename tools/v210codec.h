@@ -0,0 +1,72 @@
+/**
+ * @file	v210codec.h
+ * @brief	Lossless compression of 10-bit v210 video frames, used by the frame-writer
+ *		for compact full video captures.
+ *
+ * Each line is unpacked into Y, Cb and Cr planes, every sample is predicted from its
+ * left, above and above-left neighbours (median edge detector) and the residual is
+ * written with an adaptive Rice code. Frames are cut into independent slices of lines
+ * which are coded in parallel on a small thread pool. The output reproduces the input
+ * buffer bit for bit, including line padding. Slices that don't compress, or contain
+ * data that isn't v210 (non-zero top bits in a word) are stored raw.
+ */
+
+#ifndef V210CODEC_H
+#define V210CODEC_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct v210codec_s;
+
+/**
+ * @brief	Allocate a codec context.
+ * @param[out]	struct v210codec_s **ctx - Newly created context.
+ * @param[in]	int threads - Number of threads to code slices on, including the caller.
+ * @return	0 - Success
+ * @return	< 0 - Error
+ */
+int v210codec_alloc(struct v210codec_s **ctx, int threads);
+
+/**
+ * @brief	Stop any threads and release all resources associated with the context.
+ * @param[in]	struct v210codec_s *ctx - Context.
+ */
+void v210codec_free(struct v210codec_s *ctx);
+
+/**
+ * @brief	Compress a v210 frame.
+ * @param[in]	struct v210codec_s *ctx - Context.
+ * @param[in]	const uint8_t *src - height * strideBytes bytes of v210.
+ * @param[in]	uint32_t height - Lines in the frame.
+ * @param[in]	uint32_t strideBytes - Bytes per line, must be a multiple of 16.
+ * @param[out]	const uint8_t **dst - Compressed frame, owned by the context and valid until the next call.
+ * @param[out]	uint32_t *dstLength - Length of the compressed frame.
+ * @return	0 - Success
+ * @return	< 0 - Error, Eg. unsupported stride.
+ */
+int v210codec_encode(struct v210codec_s *ctx, const uint8_t *src, uint32_t height, uint32_t strideBytes,
+	const uint8_t **dst, uint32_t *dstLength);
+
+/**
+ * @brief	Decompress a frame produced by v210codec_encode().
+ * @param[in]	struct v210codec_s *ctx - Context.
+ * @param[in]	const uint8_t *src - Compressed frame.
+ * @param[in]	uint32_t srcLength - Length of the compressed frame.
+ * @param[in]	uint32_t height - Lines in the frame.
+ * @param[in]	uint32_t strideBytes - Bytes per line.
+ * @param[out]	uint8_t *dst - Caller allocated, height * strideBytes bytes.
+ * @return	0 - Success
+ * @return	< 0 - Error, the compressed frame is malformed.
+ */
+int v210codec_decode(struct v210codec_s *ctx, const uint8_t *src, uint32_t srcLength,
+	uint32_t height, uint32_t strideBytes, uint8_t *dst);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* V210CODEC_H */
@@ -0,0 +1,206 @@
+/* Verification of v210unpack.h, run by make check.
+ *
+ * Every implementation the CPU supports is compared against libklvanc's C converters,
+ * which v210unpack replaces and must match bit for bit, and against its own portable
+ * C implementation for the ADF scan and the line hash. Lines are random words,
+ * including the two bits v210 leaves unused, plus synthetic VANC lines carrying an
+ * ancillary data flag at every position. Uncompressed .raw VANC captures (-V) can be
+ * passed as arguments to check real lines too, where every line that hashes the same
+ * as the previous frame's must also be identical to it, as -d relies on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <libklvanc/vanc.h>
+#include "v210unpack.h"
+
+#define MAX_WIDTH 4096
+#define MAX_WORDS (MAX_WIDTH * 2 / 3)
+
+static long g_lines = 0;
+static long g_failures = 0;
+
+#define MAX_REPORTED 20
+
+static void fail(const char *what, int isa, int width)
+{
+	/* One broken kernel fails nearly every line, the first few say enough. */
+	if (g_failures++ < MAX_REPORTED) {
+		v210unpack_isa_set((enum v210unpack_isa_e)isa);
+		fprintf(stderr, "FAIL: %s, %s, width %d\n", what, v210unpack_isa_name(), width);
+	}
+}
+
+static void check_line(const uint32_t *src, int width)
+{
+	static uint16_t ref[MAX_WIDTH * 2 + 64], out[MAX_WIDTH * 2 + 64];
+	int w6 = width / 6 * 6;
+
+	v210unpack_isa_set(V210UNPACK_ISA_C);
+	int adf = v210unpack_line_may_have_adf(src, w6);
+	uint64_t hash = v210unpack_line_hash(src, w6);
+
+	for (int isa = 0; isa < V210UNPACK_ISA_MAX; isa++) {
+		if (v210unpack_isa_set((enum v210unpack_isa_e)isa) < 0)
+			continue;
+
+		/* Poisoned, so writes past the end show up too. */
+		memset(ref, 0xa5, sizeof(ref));
+		memset(out, 0xa5, sizeof(out));
+		int r1 = klvanc_v210_line_to_nv20_c((uint32_t *)src, ref, sizeof(ref), w6);
+		int r2 = v210unpack_line_to_nv20(src, out, sizeof(out), w6);
+		if (r1 != r2 || memcmp(ref, out, sizeof(ref)) != 0)
+			fail("nv20 differs from libklvanc", isa, w6);
+
+		memset(ref, 0xa5, sizeof(ref));
+		memset(out, 0xa5, sizeof(out));
+		klvanc_v210_line_to_uyvy_c((uint32_t *)src, ref, width);
+		v210unpack_line_to_uyvy(src, out, width);
+		if (memcmp(ref, out, sizeof(ref)) != 0)
+			fail("uyvy differs from libklvanc", isa, width);
+
+		if (v210unpack_line_may_have_adf(src, w6) != adf)
+			fail("adf scan differs from C", isa, w6);
+		if (v210unpack_line_hash(src, w6) != hash)
+			fail("hash differs from C", isa, w6);
+	}
+
+	g_lines++;
+}
+
+/* Sample n of a line, in wire order, as the unpackers number them. */
+static void sample_set(uint32_t *src, int n, uint32_t value)
+{
+	uint32_t *w = &src[n / 3];
+	int shift = (n % 3) * 10;
+	*w = (*w & ~(0x3ffu << shift)) | ((value & 0x3ff) << shift);
+}
+
+static uint32_t rand32(void)
+{
+	return (uint32_t)rand() ^ ((uint32_t)rand() << 16);
+}
+
+static void check_random(void)
+{
+	static uint32_t src[MAX_WORDS];
+	static const int widths[] = { 6, 12, 18, 24, 42, 48, 54, 96, 720, 1280, 1914, 1920, 1926, 2048, 3840 };
+
+	for (int it = 0; it < 200; it++) {
+		for (int i = 0; i < MAX_WORDS; i++)
+			src[i] = rand32();
+		for (size_t k = 0; k < sizeof(widths) / sizeof(widths[0]); k++)
+			check_line(src, widths[k]);
+	}
+}
+
+/* Blanking with a 000 3FF 3FF flag moved through every position, so each kernel's
+ * block boundaries and the C tail see it. Also a one bit change to the line must
+ * change its hash, whatever the implementation.
+ */
+static void check_adf(void)
+{
+	static uint32_t src[MAX_WORDS];
+	static const int widths[] = { 720, 1920 };
+
+	for (size_t k = 0; k < sizeof(widths) / sizeof(widths[0]); k++) {
+		int width = widths[k];
+		int samples = width * 2;
+
+		for (int pos = 0; pos + 3 <= samples; pos++) {
+			for (int n = 0; n < samples; n++)
+				sample_set(src, n, n & 1 ? 0x040 : 0x200);
+			sample_set(src, pos + 0, 0x000);
+			sample_set(src, pos + 1, 0x3ff);
+			sample_set(src, pos + 2, 0x3ff);
+
+			v210unpack_isa_set(V210UNPACK_ISA_C);
+			if (!v210unpack_line_may_have_adf(src, width))
+				fail("adf not found", V210UNPACK_ISA_C, width);
+			uint64_t hash = v210unpack_line_hash(src, width);
+			check_line(src, width);
+
+			src[(pos / 3 + 1) % (width * 2 / 3)] ^= 1 << (pos % 30);
+			for (int isa = 0; isa < V210UNPACK_ISA_MAX; isa++) {
+				if (v210unpack_isa_set((enum v210unpack_isa_e)isa) == 0 &&
+					v210unpack_line_hash(src, width) == hash)
+				{
+					fail("hash unchanged by a modified line", isa, width);
+				}
+			}
+		}
+	}
+}
+
+#define MAX_LINES 2048
+
+/* Lines of a -V capture, each a 5 word header (the 2nd its line number, the 5th its
+ * length in bytes), the v210 words, and an end of line word.
+ */
+static int check_file(const char *fn)
+{
+	static uint32_t src[MAX_WORDS * 2];
+	static uint32_t prev[MAX_LINES][MAX_WORDS * 2];
+	static uint32_t prevBytes[MAX_LINES];
+	static uint64_t prevHash[MAX_LINES];
+	uint32_t hdr[5], eol;
+	long lines = 0, repeats = 0;
+
+	memset(prevBytes, 0, sizeof(prevBytes));
+
+	FILE *fh = fopen(fn, "rb");
+	if (!fh) {
+		fprintf(stderr, "Unable to open %s\n", fn);
+		return -1;
+	}
+	while (fread(hdr, sizeof(hdr), 1, fh) == 1 && hdr[4] <= sizeof(src) && hdr[2] <= MAX_WIDTH &&
+		fread(src, hdr[4], 1, fh) == 1 && fread(&eol, sizeof(eol), 1, fh) == 1)
+	{
+		check_line(src, hdr[2]);
+		lines++;
+
+		int w6 = hdr[2] / 6 * 6;
+		uint32_t bytes = w6 * 2 / 3 * sizeof(uint32_t);
+		uint32_t nr = hdr[1];
+		if (nr >= MAX_LINES || !v210unpack_line_may_have_adf(src, w6))
+			continue;
+
+		/* Every implementation gave the same hash, above. */
+		v210unpack_isa_set(V210UNPACK_ISA_C);
+		uint64_t hash = v210unpack_line_hash(src, w6);
+		if (prevBytes[nr] == bytes && prevHash[nr] == hash) {
+			repeats++;
+			if (memcmp(prev[nr], src, bytes) != 0)
+				fail("hash repeated for a changed line", V210UNPACK_ISA_C, w6);
+		}
+		memcpy(prev[nr], src, bytes);
+		prevBytes[nr] = bytes;
+		prevHash[nr] = hash;
+	}
+	fclose(fh);
+	printf("%s: %ld lines, %ld repeats\n", fn, lines, repeats);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	srand(1);
+
+	for (int isa = 0; isa < V210UNPACK_ISA_MAX; isa++) {
+		if (v210unpack_isa_set((enum v210unpack_isa_e)isa) == 0)
+			printf("Testing %s\n", v210unpack_isa_name());
+	}
+
+	check_random();
+	check_adf();
+	for (int i = 1; i < argc; i++) {
+		if (check_file(argv[i]) < 0)
+			g_failures++;
+	}
+
+	printf("%ld lines, %ld failures\n", g_lines, g_failures);
+	return g_failures ? 1 : 0;
+}
@@ -0,0 +1,634 @@
+/* v210 to 16-bit sample unpacking with runtime CPU dispatch, see v210unpack.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "v210unpack.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define V210UNPACK_X86 1
+#include <immintrin.h>
+#endif
+
+/* Each v210 word carries three 10-bit samples in its low 30 bits. Unpacked in order
+ * a line reads Cb Y Cr Y Cb Y ..., so chroma is every even sample and luma every odd.
+ */
+#define V210_A(w) ((w) & 0x3ff)
+#define V210_B(w) (((w) >> 10) & 0x3ff)
+#define V210_C(w) (((w) >> 20) & 0x3ff)
+
+struct v210unpack_impl_s
+{
+	const char *name;
+
+	/* Convert 'words' words, returning how many were done. The remainder is finished in C. */
+	int (*nv20)(const uint32_t *src, int words, uint16_t *y, uint16_t *c);
+	int (*uyvy)(const uint32_t *src, int words, uint16_t *dst);
+
+	/* Scan up to 'words' words for ADF_SEEN_* samples, stopping once both are found. */
+	int (*adf)(const uint32_t *src, int words, int *done);
+};
+
+#define ADF_SEEN_000 (1 << 0)
+#define ADF_SEEN_3FF (1 << 1)
+#define ADF_SEEN_ALL (ADF_SEEN_000 | ADF_SEEN_3FF)
+
+/* Words is always even, lines are a multiple of 6 pixels. */
+static void c_nv20(const uint32_t *__restrict src, int words, uint16_t *__restrict y, uint16_t *__restrict c)
+{
+	for (int i = 0, j = 0; i < words; i += 2, j += 3) {
+		uint32_t w0 = src[i];
+		uint32_t w1 = src[i + 1];
+		c[j + 0] = V210_A(w0);
+		y[j + 0] = V210_B(w0);
+		c[j + 1] = V210_C(w0);
+		y[j + 1] = V210_A(w1);
+		c[j + 2] = V210_B(w1);
+		y[j + 2] = V210_C(w1);
+	}
+}
+
+static void c_uyvy(const uint32_t *src, int words, uint16_t *dst)
+{
+	for (int i = 0; i < words; i++) {
+		uint32_t w = src[i];
+		*(dst++) = V210_A(w);
+		*(dst++) = V210_B(w);
+		*(dst++) = V210_C(w);
+	}
+}
+
+/* Reflected CRC32C (Castagnoli), the same polynomial as the SSE4.2 crc32 instruction. */
+static uint32_t g_crc32c[256];
+
+static void crc32c_init(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+		g_crc32c[i] = crc;
+	}
+}
+
+static uint32_t crc32c_bytes(uint32_t crc, const uint8_t *p, int len)
+{
+	while (len--)
+		crc = g_crc32c[(crc ^ *(p++)) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+/* Two CRC32C streams over alternate 8 byte blocks, any 4 byte tail goes to the first. */
+static uint64_t c_hash(const uint32_t *src, int words)
+{
+	const uint8_t *p = (const uint8_t *)src;
+	int bytes = words * 4;
+	uint32_t a = 0xffffffff;
+	uint32_t b = 0xffffffff;
+
+	int i;
+	for (i = 0; i + 16 <= bytes; i += 16) {
+		a = crc32c_bytes(a, p + i, 8);
+		b = crc32c_bytes(b, p + i + 8, 8);
+	}
+	for (; i + 4 <= bytes; i += 4)
+		a = crc32c_bytes(a, p + i, 4);
+
+	return ((uint64_t)a << 32) | b;
+}
+
+static int c_adf(const uint32_t *src, int words, int *done)
+{
+	int seen = 0;
+	int i;
+	for (i = 0; i < words && seen != ADF_SEEN_ALL; i++) {
+		uint32_t w = src[i];
+		if (V210_A(w) == 0 || V210_B(w) == 0 || V210_C(w) == 0)
+			seen |= ADF_SEEN_000;
+		if (V210_A(w) == 0x3ff || V210_B(w) == 0x3ff || V210_C(w) == 0x3ff)
+			seen |= ADF_SEEN_3FF;
+	}
+	*done = i;
+
+	return seen;
+}
+
+static int none_nv20(const uint32_t *src, int words, uint16_t *y, uint16_t *c)
+{
+	return 0;
+}
+
+static int none_uyvy(const uint32_t *src, int words, uint16_t *dst)
+{
+	return 0;
+}
+
+static int none_adf(const uint32_t *src, int words, int *done)
+{
+	*done = 0;
+	return 0;
+}
+
+#if V210UNPACK_X86
+
+/* pshufb control selecting 16-bit lane k, or zero. */
+#define W(k) (2 * (k)), (2 * (k) + 1)
+#define Z    -1, -1
+
+/* The SSE and AVX2 kernels work on groups of 8 words, 24 samples. The words are split
+ * into x0 = { a0 b0 a1 b1 a2 b2 a3 b3 }, x1 = { a4 b4 .. a7 b7 } and c = { c0 .. c7 }
+ * as 16-bit lanes, then every output vector is a couple of shuffles of those ORed together.
+ */
+#define SHUF_NV20_CLO_X0  W(0), Z,    W(3), W(4), Z,    W(7), Z,    Z
+#define SHUF_NV20_CLO_C   Z,    W(0), Z,    Z,    W(2), Z,    Z,    W(4)
+#define SHUF_NV20_CLO_X1  Z,    Z,    Z,    Z,    Z,    Z,    W(0), Z
+#define SHUF_NV20_YLO_X0  W(1), W(2), Z,    W(5), W(6), Z,    Z,    Z
+#define SHUF_NV20_YLO_C   Z,    Z,    W(1), Z,    Z,    W(3), Z,    Z
+#define SHUF_NV20_YLO_X1  Z,    Z,    Z,    Z,    Z,    Z,    W(1), W(2)
+/* Last 4 chroma samples in the low half, last 4 luma in the high half. */
+#define SHUF_NV20_HI_X1   W(3), W(4), Z,    W(7), Z,    W(5), W(6), Z
+#define SHUF_NV20_HI_C    Z,    Z,    W(6), Z,    W(5), Z,    Z,    W(7)
+
+#define SHUF_UYVY_R0_X0   W(0), W(1), Z,    W(2), W(3), Z,    W(4), W(5)
+#define SHUF_UYVY_R0_C    Z,    Z,    W(0), Z,    Z,    W(1), Z,    Z
+#define SHUF_UYVY_R1_C    W(2), Z,    Z,    W(3), Z,    Z,    W(4), Z
+#define SHUF_UYVY_R1_X0   Z,    W(6), W(7), Z,    Z,    Z,    Z,    Z
+#define SHUF_UYVY_R1_X1   Z,    Z,    Z,    Z,    W(0), W(1), Z,    W(2)
+#define SHUF_UYVY_R2_X1   W(3), Z,    W(4), W(5), Z,    W(6), W(7), Z
+#define SHUF_UYVY_R2_C    Z,    W(5), Z,    Z,    W(6), Z,    Z,    W(7)
+
+#define SSE_SHUF(v, m) _mm_shuffle_epi8(v, _mm_setr_epi8(m))
+#define AVX2_SHUF(v, m) _mm256_shuffle_epi8(v, _mm256_setr_epi8(m, m))
+
+__attribute__((target("sse4.1")))
+static __inline__ void sse41_split(const uint32_t *src, __m128i *x0, __m128i *x1, __m128i *c)
+{
+	const __m128i mask = _mm_set1_epi32(0x3ff);
+	__m128i v0 = _mm_loadu_si128((const __m128i *)src);
+	__m128i v1 = _mm_loadu_si128((const __m128i *)(src + 4));
+
+	*x0 = _mm_or_si128(_mm_and_si128(v0, mask), _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(v0, 10), mask), 16));
+	*x1 = _mm_or_si128(_mm_and_si128(v1, mask), _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(v1, 10), mask), 16));
+	*c = _mm_packus_epi32(_mm_and_si128(_mm_srli_epi32(v0, 20), mask), _mm_and_si128(_mm_srli_epi32(v1, 20), mask));
+}
+
+__attribute__((target("sse4.1")))
+static int sse41_nv20(const uint32_t *src, int words, uint16_t *y, uint16_t *c)
+{
+	int i;
+	for (i = 0; i + 8 <= words; i += 8) {
+		__m128i x0, x1, cc;
+		sse41_split(src + i, &x0, &x1, &cc);
+
+		__m128i clo = _mm_or_si128(_mm_or_si128(SSE_SHUF(x0, SHUF_NV20_CLO_X0), SSE_SHUF(cc, SHUF_NV20_CLO_C)),
+			SSE_SHUF(x1, SHUF_NV20_CLO_X1));
+		__m128i ylo = _mm_or_si128(_mm_or_si128(SSE_SHUF(x0, SHUF_NV20_YLO_X0), SSE_SHUF(cc, SHUF_NV20_YLO_C)),
+			SSE_SHUF(x1, SHUF_NV20_YLO_X1));
+		__m128i hi = _mm_or_si128(SSE_SHUF(x1, SHUF_NV20_HI_X1), SSE_SHUF(cc, SHUF_NV20_HI_C));
+
+		_mm_storeu_si128((__m128i *)c, clo);
+		_mm_storel_epi64((__m128i *)(c + 8), hi);
+		_mm_storeu_si128((__m128i *)y, ylo);
+		_mm_storel_epi64((__m128i *)(y + 8), _mm_unpackhi_epi64(hi, hi));
+		c += 12;
+		y += 12;
+	}
+
+	return i;
+}
+
+__attribute__((target("sse4.1")))
+static int sse41_uyvy(const uint32_t *src, int words, uint16_t *dst)
+{
+	int i;
+	for (i = 0; i + 8 <= words; i += 8) {
+		__m128i x0, x1, cc;
+		sse41_split(src + i, &x0, &x1, &cc);
+
+		__m128i r0 = _mm_or_si128(SSE_SHUF(x0, SHUF_UYVY_R0_X0), SSE_SHUF(cc, SHUF_UYVY_R0_C));
+		__m128i r1 = _mm_or_si128(_mm_or_si128(SSE_SHUF(cc, SHUF_UYVY_R1_C), SSE_SHUF(x0, SHUF_UYVY_R1_X0)),
+			SSE_SHUF(x1, SHUF_UYVY_R1_X1));
+		__m128i r2 = _mm_or_si128(SSE_SHUF(x1, SHUF_UYVY_R2_X1), SSE_SHUF(cc, SHUF_UYVY_R2_C));
+
+		_mm_storeu_si128((__m128i *)dst, r0);
+		_mm_storeu_si128((__m128i *)(dst + 8), r1);
+		_mm_storeu_si128((__m128i *)(dst + 16), r2);
+		dst += 24;
+	}
+
+	return i;
+}
+
+/* The flag scan tests each 10-bit field in place, a field is 000 when (w & mask) == 0
+ * and 3FF when (w & mask) == mask, so nothing needs shifting.
+ */
+__attribute__((target("sse4.1")))
+static int sse41_adf(const uint32_t *src, int words, int *done)
+{
+	const __m128i ma = _mm_set1_epi32(0x3ff);
+	const __m128i mb = _mm_set1_epi32(0x3ff << 10);
+	const __m128i mc = _mm_set1_epi32(0x3ff << 20);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i z = zero;
+	__m128i o = zero;
+
+	int i;
+	for (i = 0; i + 8 <= words; i += 8) {
+		for (int k = 0; k < 8; k += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(src + i + k));
+			__m128i a = _mm_and_si128(v, ma);
+			__m128i b = _mm_and_si128(v, mb);
+			__m128i c = _mm_and_si128(v, mc);
+			z = _mm_or_si128(z, _mm_or_si128(_mm_cmpeq_epi32(a, zero),
+				_mm_or_si128(_mm_cmpeq_epi32(b, zero), _mm_cmpeq_epi32(c, zero))));
+			o = _mm_or_si128(o, _mm_or_si128(_mm_cmpeq_epi32(a, ma),
+				_mm_or_si128(_mm_cmpeq_epi32(b, mb), _mm_cmpeq_epi32(c, mc))));
+		}
+		if (!_mm_testz_si128(z, z) && !_mm_testz_si128(o, o)) {
+			i += 8;
+			break;
+		}
+	}
+	*done = i;
+
+	return (_mm_testz_si128(z, z) ? 0 : ADF_SEEN_000) | (_mm_testz_si128(o, o) ? 0 : ADF_SEEN_3FF);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint64_t sse42_hash(const uint32_t *src, int words)
+{
+	const uint8_t *p = (const uint8_t *)src;
+	int bytes = words * 4;
+	uint64_t a = 0xffffffff;
+	uint64_t b = 0xffffffff;
+
+	int i;
+	for (i = 0; i + 16 <= bytes; i += 16) {
+		uint64_t q0, q1;
+		memcpy(&q0, p + i, sizeof(q0));
+		memcpy(&q1, p + i + 8, sizeof(q1));
+		a = _mm_crc32_u64(a, q0);
+		b = _mm_crc32_u64(b, q1);
+	}
+	for (; i + 4 <= bytes; i += 4) {
+		uint32_t d;
+		memcpy(&d, p + i, sizeof(d));
+		a = _mm_crc32_u32((uint32_t)a, d);
+	}
+
+	return (a << 32) | (uint32_t)b;
+}
+#endif
+
+/* Same as the SSE split, on 16 words. Lane 0 holds words 0..7 and lane 1 words 8..15,
+ * so the in-lane shuffles produce two independent groups of 24 samples.
+ */
+__attribute__((target("avx2")))
+static __inline__ void avx2_split(const uint32_t *src, __m256i *x0, __m256i *x1, __m256i *c)
+{
+	const __m256i mask = _mm256_set1_epi32(0x3ff);
+	__m256i l0 = _mm256_loadu_si256((const __m256i *)src);
+	__m256i l1 = _mm256_loadu_si256((const __m256i *)(src + 8));
+	__m256i v0 = _mm256_permute2x128_si256(l0, l1, 0x20);
+	__m256i v1 = _mm256_permute2x128_si256(l0, l1, 0x31);
+
+	*x0 = _mm256_or_si256(_mm256_and_si256(v0, mask), _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(v0, 10), mask), 16));
+	*x1 = _mm256_or_si256(_mm256_and_si256(v1, mask), _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(v1, 10), mask), 16));
+	*c = _mm256_packus_epi32(_mm256_and_si256(_mm256_srli_epi32(v0, 20), mask), _mm256_and_si256(_mm256_srli_epi32(v1, 20), mask));
+}
+
+__attribute__((target("avx2")))
+static int avx2_nv20(const uint32_t *src, int words, uint16_t *y, uint16_t *c)
+{
+	int i;
+	for (i = 0; i + 16 <= words; i += 16) {
+		__m256i x0, x1, cc;
+		avx2_split(src + i, &x0, &x1, &cc);
+
+		__m256i clo = _mm256_or_si256(_mm256_or_si256(AVX2_SHUF(x0, SHUF_NV20_CLO_X0), AVX2_SHUF(cc, SHUF_NV20_CLO_C)),
+			AVX2_SHUF(x1, SHUF_NV20_CLO_X1));
+		__m256i ylo = _mm256_or_si256(_mm256_or_si256(AVX2_SHUF(x0, SHUF_NV20_YLO_X0), AVX2_SHUF(cc, SHUF_NV20_YLO_C)),
+			AVX2_SHUF(x1, SHUF_NV20_YLO_X1));
+		__m256i hi = _mm256_or_si256(AVX2_SHUF(x1, SHUF_NV20_HI_X1), AVX2_SHUF(cc, SHUF_NV20_HI_C));
+		__m256i yhi = _mm256_unpackhi_epi64(hi, hi);
+
+		_mm_storeu_si128((__m128i *)c, _mm256_castsi256_si128(clo));
+		_mm_storel_epi64((__m128i *)(c + 8), _mm256_castsi256_si128(hi));
+		_mm_storeu_si128((__m128i *)(c + 12), _mm256_extracti128_si256(clo, 1));
+		_mm_storel_epi64((__m128i *)(c + 20), _mm256_extracti128_si256(hi, 1));
+		_mm_storeu_si128((__m128i *)y, _mm256_castsi256_si128(ylo));
+		_mm_storel_epi64((__m128i *)(y + 8), _mm256_castsi256_si128(yhi));
+		_mm_storeu_si128((__m128i *)(y + 12), _mm256_extracti128_si256(ylo, 1));
+		_mm_storel_epi64((__m128i *)(y + 20), _mm256_extracti128_si256(yhi, 1));
+		c += 24;
+		y += 24;
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static int avx2_uyvy(const uint32_t *src, int words, uint16_t *dst)
+{
+	int i;
+	for (i = 0; i + 16 <= words; i += 16) {
+		__m256i x0, x1, cc;
+		avx2_split(src + i, &x0, &x1, &cc);
+
+		__m256i r0 = _mm256_or_si256(AVX2_SHUF(x0, SHUF_UYVY_R0_X0), AVX2_SHUF(cc, SHUF_UYVY_R0_C));
+		__m256i r1 = _mm256_or_si256(_mm256_or_si256(AVX2_SHUF(cc, SHUF_UYVY_R1_C), AVX2_SHUF(x0, SHUF_UYVY_R1_X0)),
+			AVX2_SHUF(x1, SHUF_UYVY_R1_X1));
+		__m256i r2 = _mm256_or_si256(AVX2_SHUF(x1, SHUF_UYVY_R2_X1), AVX2_SHUF(cc, SHUF_UYVY_R2_C));
+
+		/* Samples 0..23 are in the low lanes, 24..47 in the high lanes. */
+		_mm256_storeu_si256((__m256i *)dst, _mm256_permute2x128_si256(r0, r1, 0x20));
+		_mm256_storeu_si256((__m256i *)(dst + 16), _mm256_permute2x128_si256(r2, r0, 0x30));
+		_mm256_storeu_si256((__m256i *)(dst + 32), _mm256_permute2x128_si256(r1, r2, 0x31));
+		dst += 48;
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static int avx2_adf(const uint32_t *src, int words, int *done)
+{
+	const __m256i ma = _mm256_set1_epi32(0x3ff);
+	const __m256i mb = _mm256_set1_epi32(0x3ff << 10);
+	const __m256i mc = _mm256_set1_epi32(0x3ff << 20);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i z = zero;
+	__m256i o = zero;
+
+	int i;
+	for (i = 0; i + 16 <= words; i += 16) {
+		for (int k = 0; k < 16; k += 8) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(src + i + k));
+			__m256i a = _mm256_and_si256(v, ma);
+			__m256i b = _mm256_and_si256(v, mb);
+			__m256i c = _mm256_and_si256(v, mc);
+			z = _mm256_or_si256(z, _mm256_or_si256(_mm256_cmpeq_epi32(a, zero),
+				_mm256_or_si256(_mm256_cmpeq_epi32(b, zero), _mm256_cmpeq_epi32(c, zero))));
+			o = _mm256_or_si256(o, _mm256_or_si256(_mm256_cmpeq_epi32(a, ma),
+				_mm256_or_si256(_mm256_cmpeq_epi32(b, mb), _mm256_cmpeq_epi32(c, mc))));
+		}
+		if (!_mm256_testz_si256(z, z) && !_mm256_testz_si256(o, o)) {
+			i += 16;
+			break;
+		}
+	}
+	*done = i;
+
+	return (_mm256_testz_si256(z, z) ? 0 : ADF_SEEN_000) | (_mm256_testz_si256(o, o) ? 0 : ADF_SEEN_3FF);
+}
+
+/* AVX-512 gathers samples straight out of two vectors of 16 words with vpermt2w.
+ * The first table holds a and b of word i at 16-bit lanes 2i and 2i + 1, the second
+ * holds c of word i at lane 2i, indexed as 32 + 2i. Built once by v210unpack_init().
+ */
+static uint16_t g_avx512_nv20_c[32] __attribute__((aligned(64)));
+static uint16_t g_avx512_nv20_y[32] __attribute__((aligned(64)));
+static uint16_t g_avx512_uyvy[2][32] __attribute__((aligned(64)));
+
+static uint16_t avx512_sample_index(int k)
+{
+	int word = k / 3;
+	switch (k % 3) {
+	case 0:  return 2 * word;
+	case 1:  return 2 * word + 1;
+	default: return 32 + 2 * word;
+	}
+}
+
+static void avx512_tables_init(void)
+{
+	memset(g_avx512_uyvy, 0, sizeof(g_avx512_uyvy));
+	memset(g_avx512_nv20_c, 0, sizeof(g_avx512_nv20_c));
+	memset(g_avx512_nv20_y, 0, sizeof(g_avx512_nv20_y));
+
+	for (int k = 0; k < 48; k++)
+		g_avx512_uyvy[k / 32][k % 32] = avx512_sample_index(k);
+	for (int j = 0; j < 24; j++) {
+		g_avx512_nv20_c[j] = avx512_sample_index(2 * j);
+		g_avx512_nv20_y[j] = avx512_sample_index(2 * j + 1);
+	}
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static __inline__ void avx512_split(const uint32_t *src, __m512i *ab, __m512i *c)
+{
+	const __m512i mask = _mm512_set1_epi32(0x3ff);
+	__m512i v = _mm512_loadu_si512((const void *)src);
+
+	*ab = _mm512_or_si512(_mm512_and_si512(v, mask), _mm512_slli_epi32(_mm512_and_si512(_mm512_srli_epi32(v, 10), mask), 16));
+	*c = _mm512_and_si512(_mm512_srli_epi32(v, 20), mask);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int avx512_nv20(const uint32_t *src, int words, uint16_t *y, uint16_t *c)
+{
+	const __m512i idxc = _mm512_load_si512((const void *)g_avx512_nv20_c);
+	const __m512i idxy = _mm512_load_si512((const void *)g_avx512_nv20_y);
+
+	int i;
+	for (i = 0; i + 16 <= words; i += 16) {
+		__m512i ab, cc;
+		avx512_split(src + i, &ab, &cc);
+
+		_mm512_mask_storeu_epi16(c, 0x00ffffff, _mm512_permutex2var_epi16(ab, idxc, cc));
+		_mm512_mask_storeu_epi16(y, 0x00ffffff, _mm512_permutex2var_epi16(ab, idxy, cc));
+		c += 24;
+		y += 24;
+	}
+
+	return i;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int avx512_uyvy(const uint32_t *src, int words, uint16_t *dst)
+{
+	const __m512i idx0 = _mm512_load_si512((const void *)g_avx512_uyvy[0]);
+	const __m512i idx1 = _mm512_load_si512((const void *)g_avx512_uyvy[1]);
+
+	int i;
+	for (i = 0; i + 16 <= words; i += 16) {
+		__m512i ab, cc;
+		avx512_split(src + i, &ab, &cc);
+
+		_mm512_storeu_si512((void *)dst, _mm512_permutex2var_epi16(ab, idx0, cc));
+		_mm256_storeu_si256((__m256i *)(dst + 32), _mm512_castsi512_si256(_mm512_permutex2var_epi16(ab, idx1, cc)));
+		dst += 48;
+	}
+
+	return i;
+}
+
+
+__attribute__((target("avx512f,avx512bw")))
+static int avx512_adf(const uint32_t *src, int words, int *done)
+{
+	const __m512i ma = _mm512_set1_epi32(0x3ff);
+	const __m512i mb = _mm512_set1_epi32(0x3ff << 10);
+	const __m512i mc = _mm512_set1_epi32(0x3ff << 20);
+	const __m512i zero = _mm512_setzero_si512();
+	__mmask16 z = 0;
+	__mmask16 o = 0;
+
+	int i;
+	for (i = 0; i + 16 <= words; i += 16) {
+		__m512i v = _mm512_loadu_si512((const void *)(src + i));
+		__m512i a = _mm512_and_si512(v, ma);
+		__m512i b = _mm512_and_si512(v, mb);
+		__m512i c = _mm512_and_si512(v, mc);
+		z |= _mm512_cmpeq_epi32_mask(a, zero) | _mm512_cmpeq_epi32_mask(b, zero) | _mm512_cmpeq_epi32_mask(c, zero);
+		o |= _mm512_cmpeq_epi32_mask(a, ma) | _mm512_cmpeq_epi32_mask(b, mb) | _mm512_cmpeq_epi32_mask(c, mc);
+		if (z && o) {
+			i += 16;
+			break;
+		}
+	}
+	*done = i;
+
+	return (z ? ADF_SEEN_000 : 0) | (o ? ADF_SEEN_3FF : 0);
+}
+
+#endif /* V210UNPACK_X86 */
+
+static const struct v210unpack_impl_s g_impls[V210UNPACK_ISA_MAX] =
+{
+	/* Indexed by enum v210unpack_isa_e */
+	{ "c", none_nv20, none_uyvy, none_adf },
+#if V210UNPACK_X86
+	{ "sse4.1", sse41_nv20, sse41_uyvy, sse41_adf },
+	{ "avx2", avx2_nv20, avx2_uyvy, avx2_adf },
+	{ "avx512", avx512_nv20, avx512_uyvy, avx512_adf },
+#else
+	{ 0 }, { 0 }, { 0 },
+#endif
+};
+
+static pthread_once_t g_init_once = PTHREAD_ONCE_INIT;
+static const struct v210unpack_impl_s *g_impl = &g_impls[V210UNPACK_ISA_C];
+static uint64_t (*g_hash)(const uint32_t *src, int words) = c_hash;
+
+static int v210unpack_isa_supported(enum v210unpack_isa_e isa)
+{
+	switch (isa) {
+	case V210UNPACK_ISA_C:
+		return 1;
+#if V210UNPACK_X86
+	case V210UNPACK_ISA_SSE41:
+		return __builtin_cpu_supports("sse4.1");
+	case V210UNPACK_ISA_AVX2:
+		return __builtin_cpu_supports("avx2");
+	case V210UNPACK_ISA_AVX512:
+		return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+	default:
+		return 0;
+	}
+}
+
+/* The crc32 instruction arrived with SSE4.2, select it alongside any of the SIMD sets. */
+static void v210unpack_hash_select(enum v210unpack_isa_e isa)
+{
+	uint64_t (*hash)(const uint32_t *, int) = c_hash;
+#if defined(__x86_64__)
+	if (isa != V210UNPACK_ISA_C && __builtin_cpu_supports("sse4.2"))
+		hash = sse42_hash;
+#endif
+	__atomic_store_n(&g_hash, hash, __ATOMIC_RELEASE);
+}
+
+static void v210unpack_init(void)
+{
+#if V210UNPACK_X86
+	__builtin_cpu_init();
+	avx512_tables_init();
+#endif
+	crc32c_init();
+
+	for (int isa = V210UNPACK_ISA_MAX - 1; isa >= 0; isa--) {
+		if (v210unpack_isa_supported((enum v210unpack_isa_e)isa)) {
+			__atomic_store_n(&g_impl, &g_impls[isa], __ATOMIC_RELEASE);
+			v210unpack_hash_select((enum v210unpack_isa_e)isa);
+			break;
+		}
+	}
+}
+
+static const struct v210unpack_impl_s *v210unpack_impl(void)
+{
+	pthread_once(&g_init_once, v210unpack_init);
+	return __atomic_load_n(&g_impl, __ATOMIC_ACQUIRE);
+}
+
+int v210unpack_isa_set(enum v210unpack_isa_e isa)
+{
+	pthread_once(&g_init_once, v210unpack_init);
+
+	if ((int)isa < 0 || isa >= V210UNPACK_ISA_MAX || !v210unpack_isa_supported(isa))
+		return -1;
+
+	__atomic_store_n(&g_impl, &g_impls[isa], __ATOMIC_RELEASE);
+	v210unpack_hash_select(isa);
+	return 0;
+}
+
+const char *v210unpack_isa_name(void)
+{
+	return v210unpack_impl()->name;
+}
+
+int v210unpack_line_to_nv20(const uint32_t *src, uint16_t *dst, int dstSize, int width)
+{
+	if (width < 0 || width % 6 || width * 2 * (int)sizeof(uint16_t) > dstSize)
+		return -1;
+
+	const struct v210unpack_impl_s *impl = v210unpack_impl();
+	int words = width * 2 / 3;
+	uint16_t *y = dst;
+	uint16_t *c = dst + width;
+
+	/* Every kernel consumes whole groups of 6 pixels, so the tail stays aligned on pixel pairs. */
+	int done = impl->nv20(src, words, y, c);
+	c_nv20(src + done, words - done, y + done * 3 / 2, c + done * 3 / 2);
+
+	return 0;
+}
+
+void v210unpack_line_to_uyvy(const uint32_t *src, uint16_t *dst, int width)
+{
+	const struct v210unpack_impl_s *impl = v210unpack_impl();
+	int words = width * 2 / 3;
+
+	int done = impl->uyvy(src, words, dst);
+	c_uyvy(src + done, words - done, dst + done * 3);
+}
+
+int v210unpack_line_may_have_adf(const uint32_t *src, int width)
+{
+	const struct v210unpack_impl_s *impl = v210unpack_impl();
+	int words = width * 2 / 3;
+
+	int done;
+	int seen = impl->adf(src, words, &done);
+	if (seen != ADF_SEEN_ALL) {
+		int tail;
+		seen |= c_adf(src + done, words - done, &tail);
+	}
+
+	return seen == ADF_SEEN_ALL;
+}
+
+uint64_t v210unpack_line_hash(const uint32_t *src, int width)
+{
+	pthread_once(&g_init_once, v210unpack_init);
+
+	uint64_t (*hash)(const uint32_t *, int) = __atomic_load_n(&g_hash, __ATOMIC_ACQUIRE);
+	return hash(src, width * 2 / 3);
+}
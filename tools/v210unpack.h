@@ -0,0 +1,92 @@
+/**
+ * @file	v210unpack.h
+ * @brief	Unpack 10-bit v210 lines into 16-bit samples for VANC parsing.
+ *
+ * Drop-in replacements for klvanc_v210_line_to_nv20_c() and klvanc_v210_line_to_uyvy_c()
+ * producing bit identical output. SSE4.1, AVX2 and AVX-512BW kernels are selected at
+ * runtime from what the CPU supports, with a portable C implementation for everything
+ * else and for the tail of each line. A vectorised scan for the ancillary data flag
+ * lets callers skip the many VBI lines that carry nothing, and a line hash lets them
+ * skip lines that repeat from frame to frame.
+ */
+
+#ifndef V210UNPACK_H
+#define V210UNPACK_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum v210unpack_isa_e
+{
+	V210UNPACK_ISA_C = 0,
+	V210UNPACK_ISA_SSE41,
+	V210UNPACK_ISA_AVX2,
+	V210UNPACK_ISA_AVX512,
+	V210UNPACK_ISA_MAX,
+};
+
+/**
+ * @brief	Convert a v210 line into separate luma and chroma planes, as klvanc_v210_line_to_nv20_c().
+ *		Luma lands in dst[0 .. width), chroma in dst[width .. width * 2).
+ * @param[in]	const uint32_t *src - v210 line, at least width * 2 / 3 words.
+ * @param[out]	uint16_t *dst - Destination samples.
+ * @param[in]	int dstSize - Size of dst in bytes.
+ * @param[in]	int width - Pixels to convert, must be a multiple of 6.
+ * @return	0 - Success
+ * @return	< 0 - Error, dst is too small or width isn't a multiple of 6.
+ */
+int v210unpack_line_to_nv20(const uint32_t *src, uint16_t *dst, int dstSize, int width);
+
+/**
+ * @brief	Convert a v210 line into interleaved samples in wire order (Cb Y Cr Y ...),
+ *		as klvanc_v210_line_to_uyvy_c(). Used for SD where VANC spans both channels.
+ * @param[in]	const uint32_t *src - v210 line, at least width * 2 / 3 words.
+ * @param[out]	uint16_t *dst - Destination, (width * 2 / 3) * 3 samples.
+ * @param[in]	int width - Pixels to convert.
+ */
+void v210unpack_line_to_uyvy(const uint32_t *src, uint16_t *dst, int width);
+
+/**
+ * @brief	Cheap test for ancillary data on a v210 line, before paying for conversion and parsing.
+ *		Every ANC packet starts with the 000 3FF 3FF ancillary data flag, so a line with no
+ *		000 sample or no 3FF sample anywhere can't carry one. Both values are reserved in
+ *		video, so blanking and picture lines fail. Lines that pass may still turn out to be empty.
+ * @param[in]	const uint32_t *src - v210 line, at least width * 2 / 3 words.
+ * @param[in]	int width - Pixels to scan, as passed to the conversion.
+ * @return	1 - The line may contain an ancillary data flag.
+ * @return	0 - The line definitely contains no ANC.
+ */
+int v210unpack_line_may_have_adf(const uint32_t *src, int width);
+
+/**
+ * @brief	64-bit hash of the v210 words of a line, for spotting lines that haven't changed
+ *		from one frame to the next. Two CRC32C streams over alternate 8 byte blocks, using
+ *		the SSE4.2 crc32 instruction where available.
+ * @param[in]	const uint32_t *src - v210 line, at least width * 2 / 3 words.
+ * @param[in]	int width - Pixels to hash, as passed to the conversion.
+ * @return	Hash value.
+ */
+uint64_t v210unpack_line_hash(const uint32_t *src, int width);
+
+/**
+ * @brief	Force a specific implementation, for benchmarking and verification.
+ *		By default the fastest one the CPU supports is used.
+ * @param[in]	enum v210unpack_isa_e isa - Implementation to use.
+ * @return	0 - Success
+ * @return	< 0 - Not supported by this CPU or build.
+ */
+int v210unpack_isa_set(enum v210unpack_isa_e isa);
+
+/**
+ * @brief	Name of the implementation currently in use, Eg. "avx2".
+ */
+const char *v210unpack_isa_name(void);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* V210UNPACK_H */
@@ -0,0 +1,223 @@
+/* VANC line and DID/SDID filter, see vanc-filter.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include "vanc-filter.h"
+
+#define VANC_FILTER_ANY_SDID -1
+
+static const struct
+{
+	const char *name;
+	uint8_t did;
+	uint8_t sdid;
+} g_vanc_filter_names[] = {
+	{ "afd",     0x41, 0x05 },
+	{ "scte104", 0x41, 0x07 },
+	{ "hdr",     0x41, 0x0c },  /* SMPTE 2108-1 */
+	{ "sdp",     0x43, 0x02 },  /* OP-47 */
+	{ "atc",     0x60, 0x60 },  /* SMPTE 12-2 */
+	{ "eia708",  0x61, 0x01 },
+	{ "eia608",  0x61, 0x02 },
+};
+
+static void bit_set(uint64_t *map, unsigned int i)
+{
+	map[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static int bit_test(const uint64_t *map, unsigned int i)
+{
+	return (map[i / 64] >> (i % 64)) & 1;
+}
+
+void vanc_filter_init(struct vanc_filter_s *f)
+{
+	memset(f, 0, sizeof(*f));
+	memset(f->lines, 0xff, sizeof(f->lines));
+	memset(f->packets, 0xff, sizeof(f->packets));
+}
+
+static void vanc_filter_add_packet(struct vanc_filter_s *f, int reject, uint8_t did, int sdid)
+{
+	uint64_t *map = f->rejects;
+	if (reject) {
+		f->rejectTerms++;
+	} else {
+		/* The first accept term switches from everything to only what's listed. */
+		if (f->acceptTerms++ == 0)
+			memset(f->packets, 0, sizeof(f->packets));
+		map = f->packets;
+	}
+
+	for (int s = 0; s < 256; s++) {
+		if (sdid == VANC_FILTER_ANY_SDID || sdid == s)
+			bit_set(map, (did << 8) | s);
+	}
+}
+
+static int vanc_filter_add_term(struct vanc_filter_s *f, const char *term)
+{
+	int reject = 0;
+	if (*term == '!') {
+		reject = 1;
+		term++;
+	}
+
+	for (size_t i = 0; i < sizeof(g_vanc_filter_names) / sizeof(g_vanc_filter_names[0]); i++) {
+		if (strcasecmp(term, g_vanc_filter_names[i].name) == 0) {
+			vanc_filter_add_packet(f, reject, g_vanc_filter_names[i].did, g_vanc_filter_names[i].sdid);
+			return 0;
+		}
+	}
+
+	unsigned int did, sdid;
+	char c;
+	if (strchr(term, '/')) {
+		if (sscanf(term, "%x/%x%c", &did, &sdid, &c) == 2 && did < 256 && sdid < 256) {
+			vanc_filter_add_packet(f, reject, did, sdid);
+			return 0;
+		}
+		if (sscanf(term, "%x/x%c", &did, &c) == 2 && (c == 'x' || c == 'X') && did < 256 &&
+			strlen(strchr(term, '/')) == 3) {
+			vanc_filter_add_packet(f, reject, did, VANC_FILTER_ANY_SDID);
+			return 0;
+		}
+		return -1;
+	}
+
+	/* Lines can only be accepted. */
+	unsigned int first, last;
+	int n = sscanf(term, "%u-%u%c", &first, &last, &c);
+	if (reject || n < 1 || n > 2)
+		return -1;
+	if (n == 1) {
+		if (sscanf(term, "%u%c", &first, &c) != 1)
+			return -1;
+		if (first == 0) {
+			f->linesAll = 1;
+			return 0;
+		}
+		last = first;
+	}
+	if (first > last || last >= VANC_FILTER_LINES)
+		return -1;
+
+	if (f->lineTerms++ == 0)
+		memset(f->lines, 0, sizeof(f->lines));
+	for (unsigned int l = first; l <= last; l++)
+		bit_set(f->lines, l);
+
+	return 0;
+}
+
+int vanc_filter_add(struct vanc_filter_s *f, const char *spec)
+{
+	char *s = strdup(spec);
+	if (!s)
+		return -1;
+
+	int ret = 0;
+	char *save = NULL;
+	for (char *term = strtok_r(s, ",", &save); term; term = strtok_r(NULL, ",", &save)) {
+		if (vanc_filter_add_term(f, term) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	free(s);
+
+	return ret;
+}
+
+void vanc_filter_compile(struct vanc_filter_s *f)
+{
+	if (f->linesAll) {
+		f->lineTerms = 0;
+		memset(f->lines, 0xff, sizeof(f->lines));
+	}
+
+	f->packetFiltered = 0;
+	for (unsigned int i = 0; i < sizeof(f->packets) / sizeof(f->packets[0]); i++) {
+		f->packets[i] &= ~f->rejects[i];
+		if (f->packets[i] != ~(uint64_t)0)
+			f->packetFiltered = 1;
+	}
+}
+
+void vanc_filter_describe(const struct vanc_filter_s *f, char *buf, int len)
+{
+	int n = 0;
+	buf[0] = 0;
+
+#define VANC_FILTER_APPEND(...) \
+	do { \
+		if (n < len) \
+			n += snprintf(buf + n, len - n, __VA_ARGS__); \
+	} while (0)
+
+	VANC_FILTER_APPEND("lines");
+	if (!f->lineTerms) {
+		VANC_FILTER_APPEND(" all");
+	} else {
+		for (unsigned int l = 0; l < VANC_FILTER_LINES; l++) {
+			if (!bit_test(f->lines, l))
+				continue;
+			unsigned int last = l;
+			while (last + 1 < VANC_FILTER_LINES && bit_test(f->lines, last + 1))
+				last++;
+			if (last == l)
+				VANC_FILTER_APPEND(" %u", l);
+			else
+				VANC_FILTER_APPEND(" %u-%u", l, last);
+			l = last;
+		}
+	}
+
+	VANC_FILTER_APPEND(", packets");
+	if (!f->packetFiltered) {
+		VANC_FILTER_APPEND(" all");
+	} else {
+		/* List what's accepted, or when that's most of them, what isn't. */
+		int accepted = f->acceptTerms != 0;
+		if (!accepted)
+			VANC_FILTER_APPEND(" all except");
+		int listed = n;
+		for (unsigned int did = 0; did < 256; did++) {
+			int count = 0;
+			for (unsigned int s = 0; s < 256; s++)
+				count += bit_test(f->packets, (did << 8) | s) == accepted;
+			if (count == 256) {
+				VANC_FILTER_APPEND(" %02x/xx", did);
+				continue;
+			}
+			for (unsigned int s = 0; count && s < 256; s++) {
+				if (bit_test(f->packets, (did << 8) | s) == accepted)
+					VANC_FILTER_APPEND(" %02x/%02x", did, s);
+			}
+		}
+		if (n == listed)
+			VANC_FILTER_APPEND(" none");
+	}
+
+#undef VANC_FILTER_APPEND
+}
+
+int vanc_filter_words(const struct vanc_filter_s *f, const uint16_t *words, unsigned int count)
+{
+	if (!f->packetFiltered)
+		return 1;
+
+	/* ADF, DID, SDID or DBN */
+	for (unsigned int i = 0; i + 5 <= count; i++) {
+		if (words[i] != 0x000 || words[i + 1] != 0x3ff || words[i + 2] != 0x3ff)
+			continue;
+		if (vanc_filter_packet(f, words[i + 3] & 0xff, words[i + 4] & 0xff))
+			return 1;
+	}
+
+	return 0;
+}
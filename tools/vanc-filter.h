@@ -0,0 +1,115 @@
+/**
+ * @file	vanc-filter.h
+ * @brief	Line and DID/SDID filter for VANC parsing, compiled once at startup into
+ *		lookup bitmaps so that it costs a bit test per line or packet.
+ *
+ * A filter is built from one or more comma separated specs:
+ *
+ *   9           Accept line 9.
+ *   9-20        Accept lines 9 through 20.
+ *   0           Accept every line, as if there were no line terms. There is no line 0,
+ *               and -l 0 has always meant all lines.
+ *   41/07       Accept packets with DID 0x41 and SDID 0x07 (hex).
+ *   61/xx       Accept packets with DID 0x61, any SDID or DBN.
+ *   scte104     Accept a packet type by name, see vanc_filter_add().
+ *   !41/05      Reject packets with DID 0x41 and SDID 0x05, also by name, Eg. !afd.
+ *
+ * Without any line terms every line is accepted, without any accept terms for packets
+ * every packet is accepted, less the rejected ones.
+ *
+ *   struct vanc_filter_s f;
+ *   vanc_filter_init(&f);
+ *   if (vanc_filter_add(&f, "9-13,scte104") < 0)
+ *       ... bad spec ...
+ *   vanc_filter_compile(&f);
+ *
+ *   if (vanc_filter_line(&f, lineNr))
+ *       ... convert the line ...
+ */
+
+#ifndef VANC_FILTER_H
+#define VANC_FILTER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VANC_FILTER_LINES 2048
+
+struct vanc_filter_s
+{
+	int lineTerms;              /* Line terms added, 0 = all lines. */
+	int linesAll;               /* A bare 0 was added, compiled to all lines. */
+	int acceptTerms;            /* Packet accept terms added, 0 = all packets. */
+	int rejectTerms;
+	int packetFiltered;         /* After compile, some DID/SDID is rejected. */
+
+	uint64_t lines[VANC_FILTER_LINES / 64];
+	uint64_t packets[65536 / 64];   /* Indexed by (DID << 8) | SDID */
+	uint64_t rejects[65536 / 64];
+};
+
+/**
+ * @brief	Reset a filter to accept everything.
+ * @param[in]	struct vanc_filter_s *f - Filter.
+ */
+void vanc_filter_init(struct vanc_filter_s *f);
+
+/**
+ * @brief	Add the terms of a spec to a filter, can be called repeatedly before compiling.
+ *		Packet names are afd, scte104, eia708, eia608, sdp, atc and hdr.
+ * @param[in]	struct vanc_filter_s *f - Filter.
+ * @param[in]	const char *spec - Comma separated terms, Eg. "9-13,41/07,!61/xx".
+ * @return	0 - Success
+ * @return	< 0 - Error, the spec is malformed.
+ */
+int vanc_filter_add(struct vanc_filter_s *f, const char *spec);
+
+/**
+ * @brief	Build the final lookup bitmaps once every spec has been added.
+ * @param[in]	struct vanc_filter_s *f - Filter.
+ */
+void vanc_filter_compile(struct vanc_filter_s *f);
+
+/**
+ * @brief	Describe the compiled filter, Eg. "lines 9-13, packets 41/07".
+ * @param[in]	const struct vanc_filter_s *f - Filter.
+ * @param[out]	char *buf - Destination.
+ * @param[in]	int len - Size of buf.
+ */
+void vanc_filter_describe(const struct vanc_filter_s *f, char *buf, int len);
+
+/**
+ * @brief	Look for an ancillary data flag in converted samples, as klvanc_packet_parse()
+ *		would, and check each packet's DID/SDID against the filter.
+ * @param[in]	const struct vanc_filter_s *f - Filter.
+ * @param[in]	const uint16_t *words - 10-bit samples.
+ * @param[in]	unsigned int count - Number of samples.
+ * @return	1 - At least one packet is accepted, or the filter accepts every packet.
+ * @return	0 - Nothing on the line would pass the filter.
+ */
+int vanc_filter_words(const struct vanc_filter_s *f, const uint16_t *words, unsigned int count);
+
+/* Is the line accepted. */
+static __inline__ int vanc_filter_line(const struct vanc_filter_s *f, unsigned int line)
+{
+	if (line >= VANC_FILTER_LINES)
+		return f->lineTerms == 0;
+
+	return (f->lines[line / 64] >> (line % 64)) & 1;
+}
+
+/* Is a packet with this DID and SDID (or DBN) accepted. */
+static __inline__ int vanc_filter_packet(const struct vanc_filter_s *f, uint8_t did, uint8_t sdid)
+{
+	unsigned int i = (did << 8) | sdid;
+	return (f->packets[i / 64] >> (i % 64)) & 1;
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* VANC_FILTER_H */